@@ -0,0 +1,327 @@
+/*
+ * Play a recording from v120irqd --record back through v120irqd as fake
+ * interrupts, and report how fast and how promptly they were dispatched.
+ *
+ * The daemon must be running with --fakeok (or --novme).  The interrupts are
+ * injected on one connection and received on another, which requests every
+ * crate and IRQ level in the recording that nobody else already has.  The
+ * latency reported for each interrupt runs from just before it was injected
+ * to when it was received, so covers the whole trip through the daemon.
+ * Interrupts for lines that belong to other clients are still injected, but
+ * not timed.
+ *
+ * This software is released under the Modified BSD License, and may be
+ * redistributed according to the terms stated in license.txt, which must
+ * be kept with this file.
+ */
+
+#include <argp.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "v120irqd.h"
+#include "irq_record.h"
+#include "latency_histogram.h"
+#include "config.h"
+
+/* How long to wait for stragglers once everything has been injected, in ns. */
+#define DRAIN_TIMEOUT	(1000ULL * 1000 * 1000)
+
+/**********************************************************************
+ * Command line argument parsing.
+ **********************************************************************/
+
+const char* argp_program_version =
+"V120 Interrupt Replay " VERSION "\n"
+"Copyright (C) 2015 Highland Technology, Inc.\n"
+"Released under the 3-Clause BSD license <http://opensource.org/licenses/BSD-3-Clause>.\n"
+"This is free software: you are free to change and redistribute it.\n"
+"There is NO WARRANTY, to the extent permitted by law. "
+;
+
+static struct {
+	const char *file;
+	const char *socket;
+	double speed;
+	bool max;
+} settings = { .speed = 1.0 };
+
+static int parse_opt(int key, char *arg, struct argp_state *state)
+{
+	char *endptr;
+
+	switch (key) {
+	case ARGP_KEY_ARG:
+		if (settings.file != NULL) {
+			argp_failure(state, 1, 0, "Only one recording can be played.");
+		}
+		settings.file = arg;
+		break;
+
+	case 's':
+		settings.socket = arg;
+		break;
+
+	case 'x':
+		settings.speed = strtod(arg, &endptr);
+		if (*endptr != '\0' || !(settings.speed > 0)) {
+			argp_failure(state, 1, 0, "SPEED must be a positive number.");
+		}
+		break;
+
+	case 'm':
+		settings.max = true;
+		break;
+
+	case ARGP_KEY_END:
+		if (settings.file == NULL) {
+			argp_usage(state);
+		}
+	}
+	return 0;
+}
+
+/**********************************************************************
+ * Replay
+ **********************************************************************/
+
+static struct irq_record *records;
+static size_t nrecords;
+
+/* When each record was injected. */
+static uint64_t *t_sent;
+
+/* The records that are on their way to us, oldest first, and when the last
+ * of them arrived.
+ */
+static size_t *inflight;
+static size_t head, tail;
+static uint64_t t_last;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The lines we're receiving for. */
+static bool mine[16][8];
+
+static int receiver;
+static bool batched;
+
+static latency_histogram hist;
+static uint64_t received, elsewhere, mismatched;
+
+/* Match up what arrived with what was sent. */
+static void arrived(const struct v120irqd_selector *sel, int n, uint64_t now)
+{
+	size_t j;
+
+	pthread_mutex_lock(&lock);
+	for (int i = 0; i < n; i++) {
+		/* Delivery keeps to the order of injection, so anything skipped
+		 * over went to a more specific request of some other client.
+		 */
+		for (j = head; j < tail; j++) {
+			if (records[inflight[j]].vector == sel[i].vector) break;
+		}
+		if (j == tail) {
+			mismatched++;
+			continue;
+		}
+		elsewhere += j - head;
+		latency_record(&hist, now - t_sent[inflight[j]]);
+		head = j + 1;
+		received++;
+	}
+	t_last = now;
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ * receive() - Take in and ACK interrupts until the connection is shut down.
+ *
+ * The server waits on each ACK before it goes on to anything else, injections
+ * included, so this has to run alongside them.
+ */
+static void * receive(void *arg)
+{
+	struct v120irqd_selector sel[V120IRQD_BATCH_MAX];
+	int n, err;
+
+	for (;;) {
+		n = v120irqd_getinterrupts(receiver, sel, V120IRQD_BATCH_MAX);
+		if (n == -EINTR) continue;
+		if (n < 0) break;
+		arrived(sel, n, latency_now());
+		err = batched ? v120irqd_ack_many(receiver, n) : v120irqd_ack(receiver);
+		if (err) break;
+	}
+	return NULL;
+}
+
+/* Request every line in the recording that's free. */
+static void request_lines(void)
+{
+	struct v120irqd_selector sel = { .vector = ANYVECTOR };
+	bool seen[16][8] = {{false}};
+	int err;
+
+	for (size_t i = 0; i < nrecords; i++) {
+		seen[records[i].crate & 15][records[i].irq & 7] = true;
+	}
+	for (int crate = 0; crate < 16; crate++) {
+		for (int irq = 1; irq < 8; irq++) {
+			if (!seen[crate][irq]) continue;
+			sel.crate = 1 << crate;
+			sel.irq = 1 << irq;
+			err = v120irqd_request(receiver, &sel);
+			if (err) {
+				fprintf(stderr, "Crate %d IRQ%d not timed: %s\n", crate, irq, strerror(-err));
+				continue;
+			}
+			mine[crate][irq] = true;
+		}
+	}
+}
+
+static void report(uint64_t elapsed, uint64_t max_lag)
+{
+	double secs = elapsed / 1e9;
+
+	printf("Injected:   %zu in %.3f s (%.0f/s)\n", nrecords, secs,
+		secs > 0 ? nrecords / secs : 0.0);
+	printf("Received:   %llu (%.0f/s)\n", (unsigned long long)received,
+		secs > 0 ? received / secs : 0.0);
+	if (elsewhere) {
+		printf("Elsewhere:  %llu taken by other clients\n", (unsigned long long)elsewhere);
+	}
+	if (mismatched) {
+		printf("Unexpected: %llu\n", (unsigned long long)mismatched);
+	}
+	if (!settings.max) {
+		printf("Max lag:    %.1f us behind the recording\n", max_lag / 1e3);
+	}
+	if (hist.total == 0) return;
+	printf("Latency:    p50 %.1f us, p90 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+		latency_percentile(&hist, 500000) / 1e3,
+		latency_percentile(&hist, 900000) / 1e3,
+		latency_percentile(&hist, 990000) / 1e3,
+		latency_percentile(&hist, 999000) / 1e3,
+		hist.max / 1e3);
+}
+
+int main(int argc, char * argv[])
+{
+	struct v120irqd_selector sel;
+	struct irq_record *rec;
+	unsigned int features = V120IRQD_FEATURE_BATCH;
+	const struct timespec poll_interval = { 0, 1000000 };
+	struct timespec ts;
+	pthread_t thread;
+	uint64_t t0, due, now, max_lag = 0;
+	bool done, stalled;
+	int injector, err;
+
+	/* Parse the command line arguments. */
+	struct argp_option options[] = {
+		{"socket",	's',	"NAME",		0,	"Server socket name, if not the default"},
+		{"speed",	'x',	"SPEED",	0,	"Play back SPEED times faster than recorded"},
+		{"max",		'm',	0,			0,	"Play back as fast as possible"},
+		{0}
+	};
+	struct argp argp = {
+		.options = options,
+		.parser = parse_opt,
+		.args_doc = "FILE",
+		.doc = "Replay a v120irqd --record FILE through v120irqd as fake interrupts."
+	};
+	err = argp_parse(&argp, argc, argv, 0, NULL, NULL);
+	if (err) {
+		fprintf(stderr, "Argument parsing failed: %s", strerror(err));
+		return 1;
+	}
+
+	err = irq_record_load(settings.file, &records, &nrecords);
+	if (err) {
+		fprintf(stderr, "Couldn't load %s: %s\n", settings.file, strerror(-err));
+		return 1;
+	}
+	t_sent = calloc(nrecords + 1, sizeof(*t_sent));
+	inflight = calloc(nrecords + 1, sizeof(*inflight));
+	if (t_sent == NULL || inflight == NULL) {
+		perror("Couldn't allocate");
+		return 1;
+	}
+
+	/* Open the sockets to the server. */
+	injector = v120irqd_client(settings.socket);
+	receiver = v120irqd_client(settings.socket);
+	if (injector < 0 || receiver < 0) {
+		perror("Failed opening client socket");
+		return 1;
+	}
+	err = v120irqd_negotiate(receiver, &features);
+	batched = (err == 0 && (features & V120IRQD_FEATURE_BATCH));
+	request_lines();
+
+	err = pthread_create(&thread, NULL, receive, NULL);
+	if (err) {
+		fprintf(stderr, "Couldn't start receiving: %s\n", strerror(err));
+		return 1;
+	}
+
+	t0 = t_last = latency_now();
+	for (size_t i = 0; i < nrecords; i++) {
+		rec = &records[i];
+
+		/* Wait until it's time. */
+		if (!settings.max) {
+			due = t0 + (uint64_t)(rec->t / settings.speed);
+			now = latency_now();
+			if (now < due) {
+				ts.tv_sec = (due - now) / 1000000000u;
+				ts.tv_nsec = (due - now) % 1000000000u;
+				while (nanosleep(&ts, &ts) && errno == EINTR);
+			} else if (now - due > max_lag) {
+				max_lag = now - due;
+			}
+		}
+
+		sel.crate = 1 << (rec->crate & 15);
+		sel.irq = 1 << (rec->irq & 7);
+		sel.vector = rec->vector;
+		sel.payload = 0;
+		pthread_mutex_lock(&lock);
+		t_sent[i] = latency_now();
+		if (mine[rec->crate & 15][rec->irq & 7]) inflight[tail++] = i;
+		pthread_mutex_unlock(&lock);
+		err = v120irqd_interrupt(injector, &sel);
+		if (err) {
+			fprintf(stderr, "Couldn't inject interrupt %zu: %s%s\n", i, strerror(-err),
+				(err == -EBADMSG) ? " (is the server running with --fakeok?)" : "");
+			return 1;
+		}
+	}
+
+	/* Wait for the stragglers, as long as they keep coming. */
+	for (;;) {
+		pthread_mutex_lock(&lock);
+		done = (head == tail);
+		now = latency_now();
+		stalled = (now - t_last > DRAIN_TIMEOUT);
+		if (!done && stalled) {
+			fprintf(stderr, "%zu interrupts never arrived\n", tail - head);
+		}
+		pthread_mutex_unlock(&lock);
+		if (done || stalled) break;
+		nanosleep(&poll_interval, NULL);
+	}
+	shutdown(receiver, SHUT_RDWR);
+	pthread_join(thread, NULL);
+
+	report(t_last - t0, max_lag);
+	return 0;
+}
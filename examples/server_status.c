@@ -1,14 +1,17 @@
 /*
- * A trivial program to report the v120irqd status.
+ * A trivial program to report the v120irqd status, along with how each
+ * client and each crate's IRQ lines are doing, to find whichever client is
+ * holding a crate up.
  *
  * This software is released under the Modified BSD License, and may be
  * redistributed according to the terms stated in license.txt, which must
  * be kept with this file.
- * 
+ *
  * Rob Gaddi, Highland Technology.  22-Jun-2015
  */
 
 #include <argp.h>
+#include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -16,41 +19,189 @@
 
 #include "v120irqd.h"
 
-int main(void) {
-	int sock; 
-	
+static struct {
+	const char *socket;
+	bool json;
+} settings;
+
+static int parse_opt(int key, char *arg, struct argp_state *state)
+{
+	switch (key) {
+	case 's':
+		settings.socket = arg;
+		break;
+	case 'j':
+		settings.json = true;
+		break;
+	}
+	return 0;
+}
+
+static struct v120irqd_serverstatus status;
+static struct v120irqd_client_stats *clients;
+static int nclients;
+static struct v120irqd_line_stats lines[16][8];
+
+/* Get all the clients, however many there turn out to be. */
+static int get_clients(int sock)
+{
+	unsigned int max = status.clients + 8;
+	int n;
+
+	for (;;) {
+		clients = realloc(clients, max * sizeof(*clients));
+		if (clients == NULL) return -ENOMEM;
+		n = v120irqd_client_stats(sock, clients, max);
+		if (n < 0 || (unsigned int)n <= max) break;
+		max = n + 8;
+	}
+	if (n >= 0) nclients = n;
+	return (n < 0) ? n : 0;
+}
+
+static void print_text(void)
+{
+	const struct v120irqd_client_stats *c;
+	const struct v120irqd_line_stats *l;
+	bool anyyet = false;
+
+	printf("PID:        %u\n", status.pid);
+	printf("Crates:     [");
+	for (int idx=0; idx<16; idx++) {
+		if (status.crates & (1 << idx)) {
+			if (anyyet) printf(", %d", idx);
+			else 		printf("%d", idx);
+			anyyet = true;
+		}
+	}
+	printf("]\n");
+	printf("Clients:    %u\n", status.clients - 1);
+	printf("Interrupts: %u\n", status.irq_requests);
+
+	printf("\n%8s %6s %5s %12s %8s %8s %10s %10s %6s %s\n",
+		"PID", "ID", "REQS", "DELIVERED", "NAKS", "SLOW", "ACK AVG", "ACK MAX", "QUEUE", "");
+	for (int i = 0; i < nclients; i++) {
+		c = &clients[i];
+		printf("%8d %6u %5u %12llu %8llu %8llu %8.1fus %8.1fus %6u %s\n",
+			(int)c->pid, c->id, c->requests,
+			(unsigned long long)c->delivered, (unsigned long long)c->naks,
+			(unsigned long long)c->timeouts, c->ack_avg / 1e3, c->ack_max / 1e3,
+			c->queued, (c->flags & V120IRQD_CLIENT_SLOW) ? "slow" : "");
+	}
+
+	if (status.crates == 0) return;
+	printf("\n%5s %4s %12s %10s %8s %10s %10s %10s %s\n",
+		"CRATE", "IRQ", "SEEN", "NO TARGET", "MASKED", "HELD OFF", "IACK AVG", "IACK MAX", "");
+	for (int crate = 0; crate < 16; crate++) {
+		if (!(status.crates & (1 << crate))) continue;
+		for (int irq = 1; irq <= 7; irq++) {
+			l = &lines[crate][irq];
+			printf("%5d %4d %12llu %10llu %8llu %10llu %8.1fus %8.1fus %s\n",
+				crate, irq, (unsigned long long)l->seen,
+				(unsigned long long)l->targetless, (unsigned long long)l->masked,
+				(unsigned long long)l->suppressed,
+				l->vector_avg / 1e3, l->vector_max / 1e3,
+				(l->flags & V120IRQD_LINE_MASKED) ? "masked" :
+				(l->flags & V120IRQD_LINE_ENABLED) ? "" : "off");
+		}
+	}
+}
+
+static void print_json(void)
+{
+	const struct v120irqd_client_stats *c;
+	const struct v120irqd_line_stats *l;
+	const char *sep = "";
+
+	printf("{\n  \"pid\": %u,\n  \"crates\": [", status.pid);
+	for (int crate = 0; crate < 16; crate++) {
+		if (!(status.crates & (1 << crate))) continue;
+		printf("%s%d", sep, crate);
+		sep = ", ";
+	}
+	printf("],\n  \"irq_requests\": %u,\n  \"clients\": [", status.irq_requests);
+
+	sep = "";
+	for (int i = 0; i < nclients; i++) {
+		c = &clients[i];
+		printf("%s\n    {\"pid\": %d, \"id\": %u, \"requests\": %u, \"delivered\": %llu, "
+			"\"naks\": %llu, \"timeouts\": %llu, \"ack_avg_ns\": %llu, \"ack_max_ns\": %llu, "
+			"\"queued\": %u, \"slow\": %s}",
+			sep, (int)c->pid, c->id, c->requests,
+			(unsigned long long)c->delivered, (unsigned long long)c->naks,
+			(unsigned long long)c->timeouts, (unsigned long long)c->ack_avg,
+			(unsigned long long)c->ack_max, c->queued,
+			(c->flags & V120IRQD_CLIENT_SLOW) ? "true" : "false");
+		sep = ",";
+	}
+	printf("\n  ],\n  \"lines\": [");
+
+	sep = "";
+	for (int crate = 0; crate < 16; crate++) {
+		if (!(status.crates & (1 << crate))) continue;
+		for (int irq = 1; irq <= 7; irq++) {
+			l = &lines[crate][irq];
+			printf("%s\n    {\"crate\": %d, \"irq\": %d, \"seen\": %llu, \"targetless\": %llu, "
+				"\"masked\": %llu, \"suppressed\": %llu, \"vector_avg_ns\": %llu, "
+				"\"vector_max_ns\": %llu, \"enabled\": %s, \"masked_now\": %s}",
+				sep, crate, irq, (unsigned long long)l->seen,
+				(unsigned long long)l->targetless, (unsigned long long)l->masked,
+				(unsigned long long)l->suppressed, (unsigned long long)l->vector_avg,
+				(unsigned long long)l->vector_max,
+				(l->flags & V120IRQD_LINE_ENABLED) ? "true" : "false",
+				(l->flags & V120IRQD_LINE_MASKED) ? "true" : "false");
+			sep = ",";
+		}
+	}
+	printf("\n  ]\n}\n");
+}
+
+int main(int argc, char * argv[]) {
+	int sock, err;
+
+	struct argp_option options[] = {
+		{"socket",	's',	"NAME",		0,	"Server socket name, if not the default"},
+		{"json",	'j',	0,			0,	"Print as JSON rather than text"},
+		{0}
+	};
+	struct argp argp = {
+		.options = options,
+		.parser = parse_opt,
+		.doc = "Report the status of v120irqd, its clients and its crates' IRQ lines."
+	};
+	err = argp_parse(&argp, argc, argv, 0, NULL, NULL);
+	if (err) {
+		fprintf(stderr, "Argument parsing failed: %s", strerror(err));
+		return 1;
+	}
+
 	/* Open a socket to the server. */
-	printf("Opening socket.\n");
-	sock = v120irqd_client(NULL);
+	sock = v120irqd_client(settings.socket);
 	if (sock < 1) {
 		perror("Failed opening client socket");
 		return 1;
 	}
-	
+
 	/* Get the server information. */
-	struct v120irqd_serverstatus status;	
 	if (v120irqd_status(sock, &status)) {
 		perror("Error requesting status.");
 		return 1;
 	}
-
-	printf("PID:        %u\n", status.pid);
-	printf("Crates:     ");
-	if (status.crates == 0) {
-		printf("[]\n");
-	} else {
-		bool anyyet = false;
-		printf("[");
-		for (int idx=0; idx<16; idx++) {
-			if (status.crates & (1 << idx)) {
-				if (anyyet) printf(", %d", idx);
-				else 		printf("%d", idx);
-				anyyet = true;
-			}
+	err = get_clients(sock);
+	if (err) {
+		fprintf(stderr, "Error requesting client statistics: %s\n", strerror(-err));
+		return 1;
+	}
+	for (int crate = 0; crate < 16; crate++) {
+		if (!(status.crates & (1 << crate))) continue;
+		err = v120irqd_line_stats(sock, crate, lines[crate]);
+		if (err) {
+			fprintf(stderr, "Error requesting crate %d statistics: %s\n", crate, strerror(-err));
+			return 1;
 		}
-		printf("]\n");
 	}
-	printf("Clients:    %u\n", status.clients - 1);
-	printf("Interrupts: %u\n", status.irq_requests);
+
+	if (settings.json)	print_json();
+	else				print_text();
 	return 0;
 }
@@ -40,6 +40,14 @@ extern "C"
 #define V120_PAGE_SIZE      (0x4000)
 #define V120_PAGE_COUNT     (8192)
 
+/*
+ * The page descriptors at the top of each crate, from V120_IRQD_FIRST_PAGE
+ * up, are v120irqd's for mapping the registers of clear actions.  Anything
+ * else that may run alongside it has to map its windows below them.
+ */
+#define V120_IRQD_PAGES         (16)
+#define V120_IRQD_FIRST_PAGE    (V120_PAGE_COUNT - V120_IRQD_PAGES)
+
 struct V120_HANDLE;
 typedef struct V120_HANDLE V120_HANDLE;
 
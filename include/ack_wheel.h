@@ -0,0 +1,107 @@
+/**
+ * DOC: Deadlines for the answers v120irqd is owed by its clients.
+ *
+ * Every client with notifications outstanding has a deadline, and the deadlines
+ * are kept on a timer wheel: ACK_WHEEL_SLOTS lists, each covering one tick of
+ * time, with the tick set so that the whole timeout spans half the wheel.
+ * Adding a deadline is just a push onto a list, and nothing is ever taken off
+ * when the answer turns up.  Instead a deadline's @due may be pushed back at
+ * any time, without telling the wheel, and the wheel sorts it out when the
+ * slot comes around: anything not actually due yet just goes back on for
+ * later.  So in the usual case, where clients answer promptly, keeping the
+ * deadlines costs a few stores per notification and no system calls at all.
+ *
+ * Deadlines come due up to one tick late, but never early.
+ *
+ * All times are in nanoseconds, as from latency_now().
+ *
+ * This software is released under the Modified BSD License, and may be
+ * redistributed according to the terms stated in license.txt, which must
+ * be kept with this file.
+ */
+
+#ifndef ACK_WHEEL_H
+#  define ACK_WHEEL_H 1
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define ACK_WHEEL_SLOTS		32
+
+/**
+ * struct ack_deadline - One deadline, kept in whatever it's the deadline for.
+ * @due:	When it's due.  This may be moved later at any time, but never
+ * 			earlier while @queued.
+ * @next:	The next deadline in the same slot.
+ * @queued:	Whether it's on the wheel.
+ */
+struct ack_deadline {
+	uint64_t due;
+	struct ack_deadline *next;
+	bool queued;
+};
+
+/**
+ * struct ack_wheel - A timer wheel of deadlines.
+ * @slot:	The deadlines due in each tick, modulo ACK_WHEEL_SLOTS.
+ * @tick:	The length of a tick.
+ * @done:	The first tick that hasn't been expired yet.
+ * @count:	The number of deadlines on the wheel.
+ */
+struct ack_wheel {
+	struct ack_deadline *slot[ACK_WHEEL_SLOTS];
+	uint64_t tick;
+	uint64_t done;
+	unsigned int count;
+};
+
+/**
+ * ack_wheel_init() - Start an empty wheel.
+ * @w:			The wheel.
+ * @timeout:	The longest a deadline is ever set ahead of the current time.
+ */
+void ack_wheel_init(struct ack_wheel *w, uint64_t timeout);
+
+/**
+ * ack_wheel_add() - Put a deadline on the wheel.
+ * @w:		The wheel.
+ * @d:		The deadline, with @d->due no more than the timeout after @now.
+ * @now:	The current time.
+ *
+ * Adding a deadline that's already on the wheel does nothing.
+ *
+ * Return: true if the wheel was empty, so nothing was waiting on a timer.
+ */
+bool ack_wheel_add(struct ack_wheel *w, struct ack_deadline *d, uint64_t now);
+
+/**
+ * ack_wheel_remove() - Take a deadline off the wheel, if it's on it.
+ * @w:		The wheel.
+ * @d:		The deadline.
+ *
+ * This is for deadlines that are going away entirely; ones that have been
+ * met can just be left for the wheel to drop.
+ */
+void ack_wheel_remove(struct ack_wheel *w, struct ack_deadline *d);
+
+/**
+ * ack_wheel_expire() - Take everything that's come due off the wheel.
+ * @w:		The wheel.
+ * @now:	The current time.
+ *
+ * Return: The deadlines that were due by @now, chained through @next, or NULL
+ * if there weren't any.  Some of these may well have been met by now, which
+ * is for the caller to know.
+ */
+struct ack_deadline * ack_wheel_expire(struct ack_wheel *w, uint64_t now);
+
+/**
+ * ack_wheel_next() - When ack_wheel_expire() next has anything to look at.
+ * @w:		The wheel.
+ *
+ * Return: The end of the first tick with anything in it, or 0 if the wheel is
+ * empty.
+ */
+uint64_t ack_wheel_next(const struct ack_wheel *w);
+
+#endif
@@ -0,0 +1,143 @@
+/**
+ * DOC: Recordings of the interrupt stream through v120irqd.
+ *
+ * With --record, v120irqd writes every interrupt it finds, real or fake, to a
+ * file: a struct irq_record_header, then one struct irq_record after another
+ * until the end of the file.  Records are fixed-size, with the time kept in
+ * nanoseconds from the start of the recording, so a day of heavy traffic is
+ * still only a few hundred megabytes, and the file can be read back even if
+ * the server died before it was closed.  Everything is in host byte order;
+ * recordings are meant for replay on the same kind of machine, with the
+ * irqreplay example.
+ *
+ * Records are buffered, and written out a block at a time, so keeping the
+ * recording costs a copy per interrupt and a write() every
+ * IRQ_RECORD_BUFFER of them.
+ *
+ * This software is released under the Modified BSD License, and may be
+ * redistributed according to the terms stated in license.txt, which must
+ * be kept with this file.
+ */
+
+#ifndef IRQ_RECORD_H
+#  define IRQ_RECORD_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "v120irqd.h"
+
+#define IRQ_RECORD_MAGIC	"V120IRQR"
+#define IRQ_RECORD_VERSION	1
+
+/* Records to buffer before writing them out. */
+#define IRQ_RECORD_BUFFER	256
+
+/* Record flags. */
+#define IRQ_RECORD_FAKE		(1 << 0)	/* Came from a client, not a crate. */
+
+/**
+ * struct irq_record_header - The start of a recording.
+ * @magic:		IRQ_RECORD_MAGIC, without the terminating NUL.
+ * @version:	IRQ_RECORD_VERSION.
+ * @size:		sizeof(struct irq_record), in case it ever grows.
+ * @t_start:	When the recording started, as from latency_now().
+ */
+struct irq_record_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t size;
+	uint64_t t_start;
+};
+
+/**
+ * struct irq_record - One interrupt.
+ * @t:		When it was found, in nanoseconds since the recording started.
+ * @vector:	Its vector.
+ * @crate:	The crate number, 0-15.
+ * @irq:	The VME IRQ level, 1-7.
+ * @flags:	IRQ_RECORD_* flags.
+ * @reserved:	Zero.
+ */
+struct irq_record {
+	uint64_t t;
+	uint32_t vector;
+	uint8_t crate;
+	uint8_t irq;
+	uint8_t flags;
+	uint8_t reserved;
+};
+
+/**
+ * struct irq_recorder - A recording being written.
+ * @fd:		The file, or -1 when not recording.
+ * @t_start:	When the recording started.
+ * @count:	The number of records in @buf.
+ * @written:	The number of records written out so far.
+ * @buf:	Records waiting to be written.
+ *
+ * An irq_recorder with @fd of -1 is valid, and ignores everything.
+ */
+struct irq_recorder {
+	int fd;
+	uint64_t t_start;
+	unsigned int count;
+	uint64_t written;
+	struct irq_record buf[IRQ_RECORD_BUFFER];
+};
+
+/**
+ * irq_record_open() - Start a recording.
+ * @r:		The recorder.
+ * @path:	The file to write, which is truncated if it exists.
+ * @now:	The current time, as from latency_now().
+ *
+ * Return: Standard success.  On failure @r is left not recording.
+ */
+int irq_record_open(struct irq_recorder *r, const char *path, uint64_t now);
+
+/**
+ * irq_record_add() - Record an interrupt.
+ * @r:		The recorder.
+ * @sel:	The concrete interrupt, with one crate and one IRQ bit set.
+ * @flags:	IRQ_RECORD_* flags.
+ * @t:		When it was found, as from latency_now().
+ *
+ * Return: Standard success.  Failing to write the buffer out ends the
+ * recording.
+ */
+int irq_record_add(struct irq_recorder *r, const struct v120irqd_selector *sel,
+	unsigned int flags, uint64_t t);
+
+/**
+ * irq_record_flush() - Write out everything buffered.
+ * @r:		The recorder.
+ *
+ * Return: Standard success.
+ */
+int irq_record_flush(struct irq_recorder *r);
+
+/**
+ * irq_record_close() - Finish a recording.
+ * @r:		The recorder.
+ *
+ * Return: Standard success.
+ */
+int irq_record_close(struct irq_recorder *r);
+
+/**
+ * irq_record_load() - Read a whole recording into memory.
+ * @path:		The file.
+ * @records:	Loaded with a malloc()ed array of the records, for the caller
+ * 				to free().
+ * @count:		Loaded with the number of @records.
+ *
+ * A partial record at the end, from a recording that was never closed, is
+ * ignored.
+ *
+ * Return: Standard success.  Specifically, -EPROTO if @path isn't a recording
+ * this code understands.
+ */
+int irq_record_load(const char *path, struct irq_record **records, size_t *count);
+
+#endif
@@ -31,10 +31,44 @@
 #ifndef IRQ_VECTOR_TABLE_H
 #  define IRQ_VECTOR_TABLE_H 1
 
+#include <stdbool.h>
+
 #include "v120irqd.h"
 
 typedef intptr_t irqdata_t;
 
+/**
+ * struct irq_target - One recipient of an interrupt.
+ * @data:		The server data identifying the client connection.
+ * @payload:	The payload the client requested.
+ * @options:	The options the entry was registered with.  These remain owned
+ * 				by the table.
+ */
+struct irq_target {
+	irqdata_t data;
+	uint32_t payload;
+	void * options;
+};
+
+/* The most entries that can share one request; see register_interrupt_shared(). */
+#define IRQ_TARGETS_MAX		V120IRQD_SUBSCRIBERS_MAX
+
+/**
+ * find_interrupt_fallback() - Find someone else to take an interrupt.
+ * @request:	The concrete interrupt.
+ * @target:		Loaded with the first unshared entry matching @request whose
+ * 				data @skip doesn't pass over.
+ * @skip:		Returns true for the data of clients to pass over.
+ *
+ * This is for when the entry that would normally get the interrupt, the one
+ * find_interrupt() returns, belongs to a client that can't take it right now;
+ * any more general entry registered after it may do instead.
+ *
+ * Return: Standard success.  -EINVAL means there's no such entry.
+ */
+int find_interrupt_fallback(const struct v120irqd_selector * request,
+	struct irq_target * target, bool (*skip)(irqdata_t));
+
 /**
  * count_registered_interrupts() - Count interrupts currently registered.
  * 
@@ -53,6 +87,29 @@ unsigned count_registered_interrupts(void);
  */
 int register_interrupt(irqdata_t sd, const struct v120irqd_selector * request);
 
+/**
+ * register_interrupt_opts() - Register an interrupt, with options.
+ * @options:	malloc()ed information to keep with the entry, or NULL.
+ *
+ * As register_interrupt().  On success the table takes ownership of @options,
+ * and will dispose of it when the entry is released; on failure it remains the
+ * caller's.
+ */
+int register_interrupt_opts(irqdata_t sd, const struct v120irqd_selector * request,
+	void * options);
+
+/**
+ * register_interrupt_shared() - Register an interrupt that others may share.
+ * @options:	As for register_interrupt_opts().
+ *
+ * As register_interrupt_opts(), except that the entry may coexist with up to
+ * IRQ_TARGETS_MAX-1 other shared entries for exactly the same crate, irq and
+ * vector, so long as they each have a different @sd.  -ENOSPC is returned if
+ * there are already that many.
+ */
+int register_interrupt_shared(irqdata_t sd, const struct v120irqd_selector * request,
+	void * options);
+
 /**
  * find_interrupt() - Find the interrupt request record matching the request.
  * @request:	The IRQ request to be searched for.  If a match is found, the
@@ -68,11 +125,42 @@ int register_interrupt(irqdata_t sd, const struct v120irqd_selector * request);
  */
 irqdata_t find_interrupt(struct v120irqd_selector * request);
 
+/**
+ * set_options_destructor() - Choose how entry options are disposed of.
+ * @fn:		Called on an entry's options when the entry goes away, or NULL
+ * 			for the default of free().
+ */
+void set_options_destructor(void (*fn)(void *));
+
+/**
+ * find_interrupt_opts() - Find an interrupt request record, and its options.
+ * @options:	If not NULL, on success set to the options the matching entry
+ * 				was registered with.  These remain owned by the table.
+ *
+ * As find_interrupt().
+ */
+irqdata_t find_interrupt_opts(struct v120irqd_selector * request, void ** options);
+
+/**
+ * find_interrupt_targets() - Find every recipient of an interrupt.
+ * @request:	The IRQ request to be searched for.
+ * @targets:	Filled in with the recipients, in the order they registered.
+ *
+ * The first matching entry is found just as by find_interrupt().  If it was
+ * registered shared, then so are all the others that share it.
+ *
+ * Return: The number of entries in @targets, or a negative error code.
+ * Specifically, -EINVAL is returned if there's no match.
+ */
+int find_interrupt_targets(const struct v120irqd_selector * request,
+	struct irq_target targets[IRQ_TARGETS_MAX]);
+
 /**
  * release_interrupt() - Unregister one interrupt.
  * 
  * @request must have the exact same crate/irq/vector as was provided
- * to register_interrupt().
+ * to register_interrupt().  Only @sd's entry is removed, even if others share
+ * it.
  *
  * Return: Standard success.  Specifically, if the given data/request
  * combination is not found, -EINVAL is returned.
@@ -83,7 +171,9 @@ int release_interrupt(irqdata_t sd, const struct v120irqd_selector * request);
  * release_all_interrupts() - Release all interrupts claimed by a given client.
  * 
  * This is primarily useful when a client closes its connection and we need to
- * clean up after it.
+ * clean up after it.  The table keeps track of each client's entries, so this
+ * costs in proportion to what @sd had registered, not to the size of the
+ * whole table.
  *
  * Return: Standard success.
  */
@@ -96,6 +186,21 @@ int release_all_interrupts(irqdata_t sd);
  */
 void free_all_interrupts(void);
 
+/**
+ * walk_interrupts() - Visit every entry in the table.
+ * @fn:		Called for each entry, in the order they're matched in, with its
+ * 			data, its request, its options, and whether it was registered
+ * 			shared.  A non-zero return stops the walk.
+ * @arg:	Passed through to @fn.
+ *
+ * Registering the entries again in the same order rebuilds the same table.
+ * @fn must not change the table.
+ *
+ * Return: 0, or whatever @fn stopped the walk with.
+ */
+int walk_interrupts(int (*fn)(irqdata_t sd, const struct v120irqd_selector * request,
+	void * options, bool shared, void * arg), void * arg);
+
 /**
  * list_registered_interrupts() - List all crate/IRQ combinations registered.
  * @irqs:	An array of 16 IRQ bitmasks.  irqs[n] will be loaded with the
@@ -107,4 +212,14 @@ void free_all_interrupts(void);
  */
 void list_registered_interrupts(uint8_t irqs[16]);
 
+/**
+ * registered_irqs() - The IRQ levels registered for one crate.
+ * @crate:	The crate number, 0-15.
+ *
+ * This is one element of list_registered_interrupts(), from reference counts
+ * kept up to date as entries come and go, so it's cheap enough to call on
+ * every change.
+ */
+uint8_t registered_irqs(int crate);
+
 #endif
@@ -0,0 +1,96 @@
+/**
+ * DOC: Latency histograms for v120irqd.
+ *
+ * These are HDR-style log-linear histograms of nanosecond intervals.  Each
+ * power of two is split into LATENCY_SUB_COUNT equal buckets, so every
+ * recorded value is known to within 1/LATENCY_SUB_COUNT of itself no matter
+ * how large it is, while the whole histogram stays a fixed, small array that
+ * can be updated without ever allocating.  Values under LATENCY_SUB_COUNT ns
+ * are exact, and anything past 2^(LATENCY_MAX_EXP+1) ns (about a minute) is
+ * lumped into the top bucket.
+ *
+ * This software is released under the Modified BSD License, and may be
+ * redistributed according to the terms stated in license.txt, which must
+ * be kept with this file.
+ */
+
+#ifndef LATENCY_HISTOGRAM_H
+#  define LATENCY_HISTOGRAM_H 1
+
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#  include <x86intrin.h>
+#endif
+
+#define LATENCY_SUB_BITS	4
+#define LATENCY_SUB_COUNT	(1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_EXP		35
+#define LATENCY_BUCKETS		\
+	(LATENCY_SUB_COUNT + (LATENCY_MAX_EXP - LATENCY_SUB_BITS + 1) * LATENCY_SUB_COUNT)
+
+/**
+ * struct latency_histogram - A histogram of nanosecond intervals.
+ * @total:		Number of values recorded.
+ * @max:		Largest value recorded, exactly.
+ * @counts:		Number of values recorded in each bucket.
+ *
+ * An all-zero latency_histogram is a valid empty one.
+ */
+typedef struct latency_histogram {
+	uint64_t total;
+	uint64_t max;
+	uint32_t counts[LATENCY_BUCKETS];
+} latency_histogram;
+
+/**
+ * latency_now() - Current CLOCK_MONOTONIC_RAW time in nanoseconds.
+ *
+ * The raw clock isn't slewed by NTP, so intervals between two readings are
+ * honest even while the system clock is being disciplined.
+ */
+static inline uint64_t latency_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/**
+ * latency_tsc() - Current CPU timestamp counter, or 0 if there isn't one.
+ *
+ * Only for telling clients, who may want to line the server's timing up with
+ * their own; intervals are all kept with latency_now().
+ */
+static inline uint64_t latency_tsc(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+/**
+ * latency_record() - Add one interval of @ns nanoseconds to @h.
+ */
+void latency_record(latency_histogram *h, uint64_t ns);
+
+/**
+ * latency_merge() - Add all the values recorded in @from to @into.
+ */
+void latency_merge(latency_histogram *into, const latency_histogram *from);
+
+/**
+ * latency_percentile() - Value below which a given share of intervals fell.
+ * @h:		The histogram.
+ * @ppm:	The share, in parts per million; 500000 is the median and 999000
+ * 			is p99.9.
+ *
+ * Return: The highest value equivalent to the bucket holding the requested
+ * percentile, never more than the true maximum, or 0 for an empty histogram.
+ */
+uint64_t latency_percentile(const latency_histogram *h, uint32_t ppm);
+
+#endif
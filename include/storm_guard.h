@@ -0,0 +1,84 @@
+/**
+ * DOC: Interrupt storm protection for v120irqd.
+ *
+ * Every crate's IRQ level gets a token bucket, refilled at a steady rate up to
+ * a burst size, and each interrupt handled on the line takes one token.  A line
+ * that runs out is masked for a backoff period, which doubles each time the
+ * line trips again, from STORM_BACKOFF_MIN up to STORM_BACKOFF_MAX.  Once the
+ * line has stayed quiet long enough for its bucket to refill, it's forgiven
+ * and the next trip starts from the minimum again.
+ *
+ * The same masking applies to lines that are stuck on, so that a card that
+ * can't be cleared is retried later rather than being taken offline for good.
+ *
+ * All times are in nanoseconds, as from latency_now().
+ *
+ * This software is released under the Modified BSD License, and may be
+ * redistributed according to the terms stated in license.txt, which must
+ * be kept with this file.
+ */
+
+#ifndef STORM_GUARD_H
+#  define STORM_GUARD_H 1
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define STORM_BACKOFF_MIN	(10ULL * 1000 * 1000)
+#define STORM_BACKOFF_MAX	(5ULL * 1000 * 1000 * 1000)
+
+/**
+ * struct storm_guard - Rate limiting for one IRQ line.
+ * @tokens:		Interrupts still allowed right now, in billionths of a token.
+ * @t_refill:	When @tokens was last topped up.
+ * @backoff:	How long the line was last masked for, or 0 if it's been
+ * 				forgiven.
+ * @t_rearm:	When the masked line is due to be enabled again, or 0 if it
+ * 				isn't masked.
+ * @storms:		Times the line has been masked.
+ * @suppressed:	Interrupts that were held off by masking the line.
+ *
+ * An all-zero storm_guard is a valid one for a line that's never been seen.
+ */
+struct storm_guard {
+	uint64_t tokens;
+	uint64_t t_refill;
+	uint64_t backoff;
+	uint64_t t_rearm;
+	uint64_t storms;
+	uint64_t suppressed;
+};
+
+/**
+ * storm_allow() - Take a token for one interrupt.
+ * @g:		The line.
+ * @rate:	Tokens added per second, or 0 for no limit at all.
+ * @burst:	Most tokens the bucket holds.
+ * @now:	The current time.
+ *
+ * Return: true if the interrupt may be handled, or false if the line is over
+ * its limit, in which case it's counted as suppressed.
+ */
+bool storm_allow(struct storm_guard *g, uint32_t rate, uint32_t burst, uint64_t now);
+
+/**
+ * storm_mask() - Start masking a line.
+ * @g:		The line.
+ * @now:	The current time.
+ *
+ * Return: When the line is due to be enabled again, which is also kept in
+ * @g->t_rearm.
+ */
+uint64_t storm_mask(struct storm_guard *g, uint64_t now);
+
+/**
+ * storm_rearm_due() - Check whether a masked line's time is up.
+ * @g:		The line.
+ * @now:	The current time.
+ *
+ * Return: true, and the line is no longer considered masked, if it was
+ * masked until @now or earlier.
+ */
+bool storm_rearm_due(struct storm_guard *g, uint64_t now);
+
+#endif
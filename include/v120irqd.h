@@ -39,6 +39,11 @@
 #  define DEFAULTSOCKET "@/v120/v120irqd"
 #endif
 
+/* Socket name that asks v120irqd_client() for in-process dispatch instead of
+ * a connection to the server.
+ */
+#define V120IRQD_LOCAL "local:"
+
 /**********************************************************************
  * Types
  **********************************************************************/
@@ -93,6 +98,138 @@ struct v120irqd_selector {
 #define ANYIRQ		(0x00FE)
 #define ANYVECTOR	(0xFFFFFFFF)
 
+/**
+ * struct v120irqd_clear - A register write that releases an RORA interrupt.
+ * @address:	VME address of the register.
+ * @value:		The value to write to it.
+ * @space:		The address space of @address; V120IRQD_A16, V120IRQD_A24 or
+ * 				V120IRQD_A32.
+ * @width:		Size of the access in bytes; 1, 2 or 4.  @address must be
+ * 				aligned to it.
+ * @flags:		V120IRQD_CLEAR_READBACK to read the register back after the
+ * 				write, for cards that need a moment before the line drops.
+ * @reserved:	Must be 0.
+ *
+ * See v120irqd_request_clear().
+ */
+struct v120irqd_clear {
+	uint32_t address;
+	uint32_t value;
+	uint8_t space;
+	uint8_t width;
+	uint8_t flags;
+	uint8_t reserved;
+};
+#define V120IRQD_A16			(1)
+#define V120IRQD_A24			(2)
+#define V120IRQD_A32			(3)
+#define V120IRQD_CLEAR_READBACK	(1 << 0)
+
+/**
+ * struct v120irqd_dma - A DMA read to run whenever an interrupt hits.
+ * @address:	VME address to read from.
+ * @flags:		Transfer flags, exactly as for the flags of a v120_dma_xfr()
+ * 				descriptor: the V120_PD_* address width, data width, endianness
+ * 				and speed, plus V120_DMA_CTL_HOLD to read from the same
+ * 				address throughout, as for a FIFO.  Writes aren't allowed.
+ * @length:		Bytes to read, at most V120IRQD_DMA_MAX.
+ * @reserved:	Must be 0.
+ *
+ * See v120irqd_request_dma().
+ */
+struct v120irqd_dma {
+	uint64_t address;
+	uint64_t flags;
+	uint32_t length;
+	uint32_t reserved;
+};
+#define V120IRQD_DMA_MAX	(1 << 20)
+
+/**
+ * struct v120irqd_subscription - How a client shares an interrupt.
+ * @role:		V120IRQD_CONSUMER for a subscriber that handles the interrupt
+ * 				and acknowledges it, or V120IRQD_OBSERVER for one that only
+ * 				wants to know it happened.
+ * @policy:		When the server considers the interrupt handled: on the first
+ * 				consumer ACK (V120IRQD_ACK_FIRST), once every consumer has
+ * 				ACKed (V120IRQD_ACK_ALL), or as soon as the notifications are
+ * 				sent (V120IRQD_ACK_NONE).  All of the subscriptions to one
+ * 				selector must agree on it.
+ * @reserved:	Must be 0.
+ *
+ * See v120irqd_subscribe().
+ */
+struct v120irqd_subscription {
+	uint8_t role;
+	uint8_t policy;
+	uint16_t reserved;
+};
+#define V120IRQD_CONSUMER		(0)
+#define V120IRQD_OBSERVER		(1)
+#define V120IRQD_ACK_FIRST		(0)
+#define V120IRQD_ACK_ALL		(1)
+#define V120IRQD_ACK_NONE		(2)
+
+/* The most subscriptions that can share one selector. */
+#define V120IRQD_SUBSCRIBERS_MAX	(16)
+
+/**
+ * struct v120irqd_dmaslot - The buffer a DMA request's data is delivered in.
+ * @sequence:	Odd while the server is refilling the buffer, and even again
+ * 				once it's done, so it goes up by two with every refill.
+ * @selector:	The concrete interrupt the contents were read for.
+ * @status:		0 if the transfer succeeded, or -errno if it failed.
+ * @length:		Bytes transferred into @data.
+ * @reserved:	Padding, to align @data to 64 bytes.
+ * @data:		The data read.
+ *
+ * This lives in memory shared with the server.  It's refilled before a
+ * notification only if the client has answered every notification sent to it
+ * before and isn't marked slow; otherwise the notification goes out with the
+ * buffer as it was, and @sequence unchanged.  A client that reads it other
+ * than between a notification and its answer should treat it like a seqlock:
+ * read @sequence, copy what it needs, and start over if @sequence was odd or
+ * has changed since.
+ */
+struct v120irqd_dmaslot {
+	uint64_t sequence;
+	struct v120irqd_selector selector;
+	int32_t status;
+	uint32_t length;
+	uint8_t reserved[36];
+	uint8_t data[];
+};
+
+/**
+ * struct v120irqd_dmabuf - A client's view of a DMA request's buffer.
+ * @slot:		The shared buffer, mapped read-only.
+ * @size:		Size of the mapping.
+ */
+struct v120irqd_dmabuf {
+	const volatile struct v120irqd_dmaslot *slot;
+	size_t size;
+};
+
+/**
+ * typedef v120irqd_handler - Interrupt callback for v120irqd_local_dispatch().
+ * @sel:		The concrete interrupt, with the payload of the request it
+ * 				matched.
+ * @arg:		The argument given to v120irqd_local_dispatch().
+ */
+typedef void (*v120irqd_handler)(const struct v120irqd_selector *sel, void *arg);
+
+/**
+ * typedef v120irqd_completion - Callback for an asynchronous request.
+ * @err:		0 if the server agreed, -EPERM if it refused, or another
+ * 				negative error code if the request failed outright.
+ * @sel:		The selector the request was made for.
+ * @arg:		The argument given with the request.
+ */
+typedef void (*v120irqd_completion)(int err, const struct v120irqd_selector *sel, void *arg);
+
+/* A non-blocking connection; see DOC: Asynchronous clients. */
+struct v120irqd_async;
+
 /**
  * struct v120irqd_serverstatus - Information about the server for clients.
  * @pid:			Process ID of the server.
@@ -107,6 +244,262 @@ struct v120irqd_serverstatus {
 	unsigned int irq_requests;
 };
 
+/* v120irqd_client_stats flags. */
+#define V120IRQD_CLIENT_SLOW	(1 << 0)	/* Not being waited on for now. */
+
+/**
+ * struct v120irqd_client_stats - How one client has kept up, for finding the
+ * one that's holding a crate up.
+ * @pid:		Process ID of the client, or 0 if unknown.
+ * @id:			The server's number for the connection, for telling apart
+ * 				several from the same process.
+ * @flags:		V120IRQD_CLIENT_* flags.
+ * @requests:	Number of its registered IRQ descriptions.
+ * @queued:		Notifications it still owes an answer for, plus requests
+ * 				waiting on the server.
+ * @delivered:	Interrupts sent to it.
+ * @naks:		Interrupts it NAKed.
+ * @timeouts:	Times it was marked slow.
+ * @ack_avg:	Average time from a notification to its answer, in ns.
+ * @ack_max:	Longest time from a notification to its answer, in ns.
+ */
+struct v120irqd_client_stats {
+	pid_t pid;
+	uint32_t id;
+	uint32_t flags;
+	uint32_t requests;
+	uint32_t queued;
+	uint64_t delivered;
+	uint64_t naks;
+	uint64_t timeouts;
+	uint64_t ack_avg;
+	uint64_t ack_max;
+};
+
+/* v120irqd_line_stats flags. */
+#define V120IRQD_LINE_ENABLED	(1 << 0)	/* Someone has registered for it. */
+#define V120IRQD_LINE_MASKED	(1 << 1)	/* Masked by storm protection. */
+
+/**
+ * struct v120irqd_line_stats - The interrupts on one IRQ level of a crate.
+ * @seen:		Interrupts found and handled.
+ * @targetless:	Of those, the ones nobody had registered for.
+ * @masked:		Times the line was masked by storm protection.
+ * @suppressed:	Interrupts held off while it was over its rate limit.
+ * @vector_avg:	Average time to read the IACK vector, in ns.
+ * @vector_max:	Longest time to read the IACK vector, in ns.
+ * @flags:		V120IRQD_LINE_* flags.
+ * @reserved:	Zero.
+ */
+struct v120irqd_line_stats {
+	uint64_t seen;
+	uint64_t targetless;
+	uint64_t masked;
+	uint64_t suppressed;
+	uint64_t vector_avg;
+	uint64_t vector_max;
+	uint32_t flags;
+	uint32_t reserved;
+};
+
+/**
+ * DOC: Latency stages
+ *
+ * The server timestamps every interrupt as it goes through its hands, and
+ * keeps a histogram per crate and IRQ level of the time spent between each
+ * of these points:
+ *
+ * V120IRQD_LAT_WAKE_TO_VECTOR:	From the interrupt endpoint waking the server
+ * 								until the IACK vector has been read back.
+ * V120IRQD_LAT_VECTOR_TO_SEND:	From the vector until the notification starts
+ * 								out to the client.
+ * V120IRQD_LAT_SEND_TO_ACK:	From the notification until the client's ACK.
+ * V120IRQD_LAT_WAKE_TO_ACK:	The whole trip, wakeup to ACK.
+ *
+ * Fake interrupts are timed too, with the arrival of the request standing in
+ * for both the wakeup and the vector.
+ */
+enum v120irqd_latency_stage {
+	V120IRQD_LAT_WAKE_TO_VECTOR,
+	V120IRQD_LAT_VECTOR_TO_SEND,
+	V120IRQD_LAT_SEND_TO_ACK,
+	V120IRQD_LAT_WAKE_TO_ACK,
+	V120IRQD_LAT_STAGES
+};
+
+/**
+ * struct v120irqd_latency - Summary of interrupt latencies, in nanoseconds.
+ * @count:		Number of interrupts timed.
+ * @stage:		Percentiles for each of the enum v120irqd_latency_stage
+ * 				intervals.
+ *
+ * Percentiles come from log-linear histograms, and are accurate to within
+ * about 6%.  The max is exact.
+ */
+struct v120irqd_latency {
+	uint64_t count;
+	struct {
+		uint64_t p50;
+		uint64_t p99;
+		uint64_t p999;
+		uint64_t max;
+	} stage[V120IRQD_LAT_STAGES];
+};
+
+/* Flags for v120irqd_latency(). */
+#define V120IRQD_LATENCY_RESET	(1 << 0)
+
+/**
+ * DOC: Protocol features
+ *
+ * Optional protocol features are agreed on a connection by connection basis
+ * with v120irqd_negotiate().  A connection that never negotiates anything
+ * gets the original protocol, so existing clients keep working unchanged.
+ *
+ * V120IRQD_FEATURE_BATCH:	The server may deliver all of the interrupts it
+ * 							found in one pass over a crate as a single message.
+ * 							These are received with v120irqd_getinterrupts()
+ * 							and acknowledged together with v120irqd_ack_many().
+ * V120IRQD_FEATURE_CLEAR:	The client may attach a clear action to its
+ * 							requests with v120irqd_request_clear().
+ * V120IRQD_FEATURE_DMA:	The client may have the server read data from the
+ * 							card for it with v120irqd_request_dma().
+ * V120IRQD_FEATURE_FANOUT:	The client may share interrupts with other clients
+ * 							through v120irqd_subscribe().
+ * V120IRQD_FEATURE_MUX:	Requests and their replies are tagged, so that the
+ * 							connection can be shared; see DOC: Shared
+ * 							connections.
+ * V120IRQD_FEATURE_TIMESTAMP:	Interrupts are delivered as struct
+ * 							v120irqd_event, received with v120irqd_getevents();
+ * 							see DOC: Timestamped events.
+ */
+#define V120IRQD_FEATURE_BATCH	(1 << 0)
+#define V120IRQD_FEATURE_CLEAR	(1 << 1)
+#define V120IRQD_FEATURE_DMA	(1 << 2)
+#define V120IRQD_FEATURE_FANOUT	(1 << 3)
+#define V120IRQD_FEATURE_MUX	(1 << 4)
+#define V120IRQD_FEATURE_TIMESTAMP	(1 << 5)
+
+/* The most interrupts in one batch; one pass over a crate yields at most one
+ * vector for each of IRQ7* through IRQ1*.
+ */
+#define V120IRQD_BATCH_MAX		(7)
+
+/**
+ * DOC: Timestamped events
+ *
+ * A v120irqd_selector says which interrupt it was, but not when.  A
+ * connection that negotiates V120IRQD_FEATURE_TIMESTAMP has each interrupt
+ * delivered as a struct v120irqd_event instead, which adds when the server
+ * found it and where it falls in the sequence for its crate.  Subtracting
+ * @t_detect from CLOCK_MONOTONIC_RAW on arrival gives the time the interrupt
+ * spent in the server and the socket together, and events from different
+ * crates can be put back in the order they happened.
+ *
+ * The sequence counts every interrupt the server fetches a vector for on a
+ * crate, whoever it was for, and fake interrupts along with the real ones.
+ * So a client that has every line on a crate sees a gap in the sequence only
+ * where it lost an interrupt.  The counters start from 1 when the server
+ * does, and wrap at 2^32.
+ *
+ * Events are received with v120irqd_getevents(), and acknowledged exactly as
+ * the interrupts from v120irqd_getinterrupts() would be.
+ * v120irqd_getinterrupt() and v120irqd_getinterrupts() still work on such a
+ * connection, and simply drop the timing.
+ */
+
+/**
+ * struct v120irqd_event - An interrupt, with when the server found it.
+ * @sel:		The concrete interrupt, as from v120irqd_getinterrupt().
+ * @t_detect:	When the server found it, in nanoseconds of CLOCK_MONOTONIC_RAW.
+ * 				For a real interrupt that's when its crate's status was read,
+ * 				for a fake one when the request for it arrived.
+ * @tsc:		The CPU timestamp counter at the same moment, or 0 where the
+ * 				server has no such counter.
+ * @seq:		Its place in the sequence of interrupts on its crate.
+ * @flags:		V120IRQD_EVENT_* flags.
+ */
+struct v120irqd_event {
+	struct v120irqd_selector sel;
+	uint64_t t_detect;
+	uint64_t tsc;
+	uint32_t seq;
+	uint32_t flags;
+};
+
+/* Flags for v120irqd_event. */
+#define V120IRQD_EVENT_FAKE		(1 << 0)	/* Came from a client, not a crate. */
+
+/**
+ * DOC: Shared connections
+ *
+ * Ordinarily a connection is lock-step: each request reads the very next
+ * message from the server as its reply, so only one thread can use it at a
+ * time, and an interrupt that arrives in between is taken for a bad reply.
+ *
+ * Negotiating V120IRQD_FEATURE_MUX lifts both restrictions.  Every request
+ * then carries a tag that the server puts on its reply, and whichever thread
+ * happens to be reading hands each message to the thread it belongs to:
+ * replies to the request they answer, and interrupt notifications to a queue
+ * for v120irqd_getinterrupt() and v120irqd_getinterrupts().  Any number of
+ * threads can make requests and take interrupts on the one connection at
+ * once, and nothing is lost or mistaken for anything else.
+ *
+ * A notification may already be queued when the socket itself has nothing to
+ * read, so a thread should wait in v120irqd_getinterrupt() rather than in
+ * poll().  Such a connection should be closed with v120irqd_close(), which
+ * frees the demultiplexer.  The feature isn't available without pthreads.
+ */
+
+/**
+ * DOC: Asynchronous clients
+ *
+ * An application built around an event loop can't sit in
+ * v120irqd_getinterrupt(), or wait on the reply to each request.  A
+ * v120irqd_async connection never blocks.  Put v120irqd_async_fd() in the
+ * loop, and whenever it's readable, call v120irqd_dispatch(): every interrupt
+ * waiting goes to the handler registered for its payload with
+ * v120irqd_async_handler(), and is ACKed once that returns, and every reply
+ * goes to the completion callback of the request it answers.
+ * v120irqd_async_request() and v120irqd_async_release() return as soon as the
+ * request is sent.
+ *
+ * This relies on V120IRQD_FEATURE_MUX, so it needs a server, and pthreads,
+ * that provide it.  A context isn't thread-safe, and must not be closed from
+ * inside one of its own callbacks.
+ */
+
+/**
+ * DOC: Multiple servers
+ *
+ * A host with many crates can run a separate v120irqd for each group of them,
+ * each with its own --crates, --socket and --cpu, so that a busy group can't
+ * hold up the others.  Give each one a socket name that starts with
+ * DEFAULTSOCKET, such as "@/v120/v120irqd-a", and clients can find the one
+ * for a given crate with v120irqd_locate() rather than knowing the layout.
+ */
+
+/**
+ * DOC: In-process dispatch
+ *
+ * A single application that owns the VME crates outright can take its
+ * interrupts straight from the hardware, saving the trip through v120irqd and
+ * the two context switches that go with it.  Connect with
+ * v120irqd_client(V120IRQD_LOCAL) and use the connection exactly as though it
+ * went to the server: v120irqd_request(), v120irqd_getinterrupt(),
+ * v120irqd_ack() and so on all work, with the same selector matching rules.
+ * The descriptor is pollable, becoming readable when a crate interrupts.
+ *
+ * Rather than fetching and acknowledging interrupts one at a time, they can
+ * be handed to a callback with v120irqd_local_dispatch().
+ *
+ * The crates' interrupt endpoints belong to the process for as long as the
+ * connection is open, so v120irqd shouldn't be servicing them at the same
+ * time.  Only one local connection can be open in a process, and it isn't
+ * thread-safe.  Fake interrupts are always allowed, and v120irqd_latency()
+ * isn't available.
+ */
+
 /**********************************************************************
  * Declaration of the functions in interrupt.c
  **********************************************************************/
@@ -133,10 +526,38 @@ extern int v120irqd_ilog2f(uint32_t x);
  * 					default; which should be the case anytime other than weird
  * 					testing scenarios.
  *
+ * Passing V120IRQD_LOCAL instead gets a connection that doesn't go through the
+ * server at all; see DOC: In-process dispatch.
+ *
  * Return: A file descriptor for the socket, or -1 for failure and errno is set.
  */
 extern int v120irqd_client(const char *socketname);
 
+/**
+ * v120irqd_locate() - Find the server that serves a crate.
+ * @crate:		The crate number, 0-15.
+ * @name:		Loaded with the name of its socket, for v120irqd_client().
+ * @size:		The size of @name.
+ *
+ * Asks every server listening on DEFAULTSOCKET, or a name that starts with
+ * it, which crates it has; see DOC: Multiple servers.
+ *
+ * Return: Standard success.  Specifically, -ENOENT if no server has @crate.
+ */
+extern int v120irqd_locate(int crate, char *name, size_t size);
+
+/**
+ * v120irqd_close() - Close a connection from v120irqd_client().
+ * @socket:		The open connection.
+ *
+ * Required for V120IRQD_LOCAL connections, and wanted for those that
+ * negotiated V120IRQD_FEATURE_MUX, which have more than a descriptor to tear
+ * down; the same as close() for anything else.
+ *
+ * Return: Standard success.
+ */
+extern int v120irqd_close(int socket);
+
 /**
  * v120irqd_request() - Request interrupt notification from the server.
  * @socket:		The open connection to the server.
@@ -156,6 +577,107 @@ extern int v120irqd_client(const char *socketname);
  */
 extern int v120irqd_request(int socket, struct v120irqd_selector * sel);
 
+/**
+ * v120irqd_request_clear() - Request interrupt notification, and have the
+ * server release the interrupt itself.
+ * @socket:		The open connection to the server, which must have negotiated
+ * 				V120IRQD_FEATURE_CLEAR.
+ * @sel:		A description of the interrupt to be notified on.
+ * @clear:		The register write that releases it.
+ *
+ * This is v120irqd_request() for RORA interrupts.  Right after reading the
+ * vector, the server performs @clear on the crate that interrupted, so the
+ * line is released without waiting for the client at all.  The notification
+ * is then sent without waiting for it to be acknowledged either; the client
+ * should still v120irqd_ack() each one, but the server carries on regardless.
+ *
+ * The server maps the clear registers through page descriptors at the very top
+ * of each crate's VME space, which other applications must leave alone.
+ *
+ * Return: Standard success.  Specifically, -EPERM will be returned for a server
+ * NAK, which will be received for the same reasons as from v120irqd_request(),
+ * or if @clear is invalid or can't be mapped, or the connection hasn't
+ * negotiated V120IRQD_FEATURE_CLEAR.  -EOPNOTSUPP is returned for a
+ * V120IRQD_LOCAL connection, where the application can simply clear the
+ * interrupt itself.
+ */
+extern int v120irqd_request_clear(int socket, struct v120irqd_selector *sel,
+	const struct v120irqd_clear *clear);
+
+/**
+ * v120irqd_request_dma() - Request interrupt notification, with the server
+ * reading data from the card first.
+ * @socket:		The open connection to the server, which must have negotiated
+ * 				V120IRQD_FEATURE_DMA.
+ * @sel:		A description of the interrupt to be notified on.
+ * @dma:		The read to perform.
+ * @buf:		On success, the buffer the data will be delivered in.
+ *
+ * This is v120irqd_request() for interrupts whose handler starts by reading
+ * a buffer or FIFO from the card.  Right after reading the vector, the server
+ * runs @dma on the crate that interrupted, into memory that it shares with
+ * the client, then sends the notification.  By the time the client has it,
+ * @buf->slot holds the data, and stays untouched until the client
+ * acknowledges.  A client still owing answers to earlier notifications gets
+ * the next one without a refill; see struct v120irqd_dmaslot.  The transfer
+ * is also run for fake interrupts on crates that exist; for any others the
+ * slot's status is -ENODEV.
+ *
+ * @sel must name a single crate and IRQ level, since the one buffer can't
+ * hold the data for two interrupts at once.
+ *
+ * Release the request with v120irqd_release() as usual, then the buffer with
+ * v120irqd_unmap_dma().
+ *
+ * Return: Standard success.  Specifically, -EPERM will be returned for a server
+ * NAK, which will be received for the same reasons as from v120irqd_request(),
+ * or if @dma or @sel is invalid, or the connection hasn't negotiated
+ * V120IRQD_FEATURE_DMA.  -EOPNOTSUPP is returned for a V120IRQD_LOCAL
+ * connection.
+ */
+extern int v120irqd_request_dma(int socket, struct v120irqd_selector *sel,
+	const struct v120irqd_dma *dma, struct v120irqd_dmabuf *buf);
+
+/**
+ * v120irqd_subscribe() - Request interrupt notification, shared with other
+ * subscribers.
+ * @socket:		The open connection to the server, which must have negotiated
+ * 				V120IRQD_FEATURE_FANOUT.
+ * @sel:		A description of the interrupt to be notified on.
+ * @sub:		The role this client plays, and the ACK policy.
+ *
+ * This is v120irqd_request() for interrupts that more than one client wants to
+ * see.  Any number of clients, up to V120IRQD_SUBSCRIBERS_MAX, may subscribe
+ * to exactly the same crate, irq and vector, and each one is notified with
+ * its own payload.  A subscription still can't overlap any other request.
+ *
+ * Consumers are notified first, and the server waits on their ACKs as
+ * @sub->policy says.  Observers are notified after that, without the server
+ * ever waiting on them: a notification that an observer's connection has no
+ * room for is dropped.  Observers don't acknowledge their notifications, and
+ * mustn't, as the ACK would be taken for the answer to something else on the
+ * same connection; only consumers do.  With V120IRQD_ACK_NONE, or no
+ * consumers at all, the interrupt must be ROAK or released some other way.
+ *
+ * Release the subscription with v120irqd_release(); the others are unaffected.
+ *
+ * Return: Standard success.  Specifically, -EPERM will be returned for a server
+ * NAK, which will be received for the same reasons as from v120irqd_request(),
+ * or if @sub is invalid or its policy disagrees with the existing subscribers,
+ * or the connection hasn't negotiated V120IRQD_FEATURE_FANOUT.  -EOPNOTSUPP is
+ * returned for a V120IRQD_LOCAL connection.
+ */
+extern int v120irqd_subscribe(int socket, struct v120irqd_selector *sel,
+	const struct v120irqd_subscription *sub);
+
+/**
+ * v120irqd_unmap_dma() - Let go of a buffer from v120irqd_request_dma().
+ * @buf:		The buffer.
+ *
+ * Return: Standard success.
+ */
+extern int v120irqd_unmap_dma(struct v120irqd_dmabuf *buf);
+
 /**
  * v120irqd_release() - Stop getting a given interrupt notification.
  * @socket:		The open connection to the server.
@@ -186,6 +708,46 @@ extern int v120irqd_release(int socket, struct v120irqd_selector * sel);
  */
 extern int v120irqd_getinterrupt(int socket, struct v120irqd_selector *sel);
 
+/**
+ * v120irqd_getinterrupts() - Copy one or more interrupt notifications into @sel.
+ * @socket:		The open connection to the server.
+ * @sel:		On success, the descriptions of the received interrupts.
+ * @max:		Number of elements available in @sel.  Must be at least
+ * 				V120IRQD_BATCH_MAX.
+ *
+ * This is the batched form of v120irqd_getinterrupt(), for connections that
+ * have negotiated V120IRQD_FEATURE_BATCH.  It blocks until a notification is
+ * sent from the server, which will be either a single interrupt or a batch of
+ * interrupts from the same crate, in priority order.
+ *
+ * The client must reply to the entire batch with a single v120irqd_ack_many()
+ * or v120irqd_nak() once every interrupt in it has been serviced.
+ *
+ * Return: The number of interrupts copied into @sel, or a negative error
+ * code.  Specifically, -EBADMSG indicates that while a successful message was
+ * received, it wasn't an interrupt, and -EINVAL that @max is too small.
+ */
+extern int v120irqd_getinterrupts(int socket, struct v120irqd_selector *sel, unsigned int max);
+
+/**
+ * v120irqd_getevents() - Copy one or more timestamped interrupts into @ev.
+ * @socket:		The open connection to the server.
+ * @ev:			On success, the received interrupts.
+ * @max:		Number of elements available in @ev.  Must be at least
+ * 				V120IRQD_BATCH_MAX.
+ *
+ * This is v120irqd_getinterrupts() for connections that have negotiated
+ * V120IRQD_FEATURE_TIMESTAMP, and is answered the same way.  On a connection
+ * that hasn't, the interrupts still arrive, but with @t_detect, @tsc and
+ * @seq all zero.
+ *
+ * Return: The number of interrupts copied into @ev, or a negative error
+ * code.  Specifically, -EBADMSG indicates that while a successful message was
+ * received, it wasn't an interrupt, -EINVAL that @max is too small, and
+ * -EOPNOTSUPP that @socket is a V120IRQD_LOCAL connection.
+ */
+extern int v120irqd_getevents(int socket, struct v120irqd_event *ev, unsigned int max);
+
 /**
  * v120irqd_interrupt() - Signal an IRQ on the socket.
  * @socket:		The open connection to the client/server.
@@ -211,7 +773,16 @@ extern int v120irqd_interrupt(int socket, struct v120irqd_selector *sel);
 extern int v120irqd_ack(int socket);
 
 /**
- * v120irqd_ack() - Send a negative (NAK) response.
+ * v120irqd_ack_many() - Acknowledge a batch of interrupts.
+ * @socket:		The open connection to the server.
+ * @count:		The number of interrupts returned by v120irqd_getinterrupts().
+ *
+ * Return: Standard success.
+ */
+extern int v120irqd_ack_many(int socket, unsigned int count);
+
+/**
+ * v120irqd_nak() - Send a negative (NAK) response.
  * @socket:		The open connection to the client/server.
  *
  * Return: Standard success.
@@ -227,4 +798,163 @@ extern int v120irqd_nak(int socket);
  */
 extern int v120irqd_status(int socket, struct v120irqd_serverstatus *status);
 
+/**
+ * v120irqd_client_stats() - Query how each of the server's clients is doing.
+ * @socket:		The open socket to the server.
+ * @stats:		Buffer to store the returned information.
+ * @max:		Number of @stats.
+ *
+ * The clients are fetched a few at a time, so the list is only a snapshot if
+ * none come or go in the meantime.  The one asking is included.
+ *
+ * Return: The number of clients the server has, of which at most @max are
+ * stored in @stats, or a negative error code.
+ */
+extern int v120irqd_client_stats(int socket, struct v120irqd_client_stats *stats,
+	unsigned int max);
+
+/**
+ * v120irqd_line_stats() - Query the server's statistics for a crate.
+ * @socket:		The open socket to the server.
+ * @crate:		The crate number, 0-15.
+ * @line:		Buffer to store the returned information, indexed by IRQ
+ * 				level; line[0] is unused.
+ *
+ * Return: Standard success.  Specifically, -ENODEV if the server doesn't have
+ * @crate.
+ */
+extern int v120irqd_line_stats(int socket, int crate, struct v120irqd_line_stats line[8]);
+
+/**
+ * v120irqd_latency() - Query the server's interrupt latency statistics.
+ * @socket:		The open socket to the server.
+ * @which:		Multibit selector for the crates and IRQ levels to summarize
+ * 				together, e.g. {.crate = ANYCRATE, .irq = ANYIRQ} for
+ * 				everything.  The vector and payload are ignored.
+ * @flags:		V120IRQD_LATENCY_RESET to clear the selected histograms once
+ * 				they've been read.
+ * @lat:		Buffer to store the returned information.
+ *
+ * Return: Standard success.
+ */
+extern int v120irqd_latency(int socket, const struct v120irqd_selector *which,
+	unsigned int flags, struct v120irqd_latency *lat);
+
+/**
+ * v120irqd_negotiate() - Agree on optional protocol features with the server.
+ * @socket:		The open connection to the server, before any other messages.
+ * @features:	On entry, the V120IRQD_FEATURE_* bits the client would like to
+ * 				use.  On success, the subset of them that the server agreed to.
+ *
+ * Return: Standard success.  Specifically, -EOPNOTSUPP indicates a server too
+ * old to negotiate at all, in which case the original protocol remains in use.
+ */
+extern int v120irqd_negotiate(int socket, unsigned int *features);
+
+/**********************************************************************
+ * Declaration of the functions in local.c
+ **********************************************************************/
+
+/**
+ * v120irqd_local_dispatch() - Hand interrupts to a callback.
+ * @socket:		A V120IRQD_LOCAL connection.
+ * @fn:			Called once for each interrupt.  The interrupt is ACKed as soon
+ * 				as it returns, so for an RORA interrupt it must clear the
+ * 				source before returning.
+ * @arg:		Passed through to @fn.
+ * @timeout:	Milliseconds to wait for the first interrupt, 0 not to wait,
+ * 				or -1 to wait forever.
+ *
+ * Waits for interrupts, then calls @fn for every one that's been found.
+ *
+ * Return: The number of interrupts dispatched, 0 on timeout, or a negative
+ * error code.  Specifically, -EBADF if @socket isn't a local connection.
+ */
+extern int v120irqd_local_dispatch(int socket, v120irqd_handler fn, void *arg, int timeout);
+
+/**********************************************************************
+ * Declaration of the functions in async.c
+ **********************************************************************/
+
+/**
+ * v120irqd_async_open() - Open a non-blocking connection to the server.
+ * @socketname:		As for v120irqd_client().
+ *
+ * Return: The new context, or NULL for failure and errno is set.
+ * Specifically, EOPNOTSUPP if the server won't share the connection; see
+ * DOC: Asynchronous clients.
+ */
+extern struct v120irqd_async *v120irqd_async_open(const char *socketname);
+
+/**
+ * v120irqd_async_fd() - The descriptor to wait on.
+ * @ctx:		The context.
+ *
+ * Return: A descriptor that becomes readable when v120irqd_dispatch() has
+ * something to do.  It belongs to @ctx; don't read or close it.
+ */
+extern int v120irqd_async_fd(const struct v120irqd_async *ctx);
+
+/**
+ * v120irqd_async_handler() - Set the handler for a payload.
+ * @ctx:		The context.
+ * @payload:	The payload, as given in the selectors of requests.
+ * @fn:			Called for every interrupt with that payload, which is ACKed as
+ * 				soon as it returns.  NULL to remove the handler.
+ * @arg:		Passed through to @fn.
+ *
+ * Interrupts with no handler are ACKed all the same, with a warning.
+ *
+ * Return: Standard success.
+ */
+extern int v120irqd_async_handler(struct v120irqd_async *ctx, uint32_t payload,
+	v120irqd_handler fn, void *arg);
+
+/**
+ * v120irqd_async_request() - Request interrupt notification, without waiting.
+ * @ctx:		The context.
+ * @sel:		As for v120irqd_request().
+ * @done:		Called from v120irqd_dispatch() once the server answers, or
+ * 				NULL.
+ * @arg:		Passed through to @done.
+ *
+ * Return: Standard success, for sending the request.  The answer comes later.
+ */
+extern int v120irqd_async_request(struct v120irqd_async *ctx,
+	const struct v120irqd_selector *sel, v120irqd_completion done, void *arg);
+
+/**
+ * v120irqd_async_release() - Release a request, without waiting.
+ * @ctx:		The context.
+ * @sel:		As for v120irqd_release().
+ * @done:		Called from v120irqd_dispatch() once the server answers, or
+ * 				NULL.
+ * @arg:		Passed through to @done.
+ *
+ * Return: Standard success, for sending the release.
+ */
+extern int v120irqd_async_release(struct v120irqd_async *ctx,
+	const struct v120irqd_selector *sel, v120irqd_completion done, void *arg);
+
+/**
+ * v120irqd_dispatch() - Handle everything the server has sent.
+ * @ctx:		The context.
+ *
+ * Never blocks.  If the server has hung up, every request still waiting is
+ * completed with -ECONNRESET, and the context is only good for closing.
+ *
+ * Return: The number of interrupts dispatched, or a negative error code.
+ */
+extern int v120irqd_dispatch(struct v120irqd_async *ctx);
+
+/**
+ * v120irqd_async_close() - Close the connection and free the context.
+ * @ctx:		The context.
+ *
+ * Requests still waiting on answers are dropped without their callbacks.
+ *
+ * Return: Standard success.
+ */
+extern int v120irqd_async_close(struct v120irqd_async *ctx);
+
 #endif
@@ -14,6 +14,8 @@
 #ifndef V120IRQD_INTL_H
 #  define V120IRQD_INTL_H 1
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <syslog.h>
 #include "v120irqd.h"
 
@@ -38,28 +40,312 @@
  * @SERVER_STATUS:	Client->server, this is a request for server information.
  * 					Server->client, this is the response with a
  * 					v120irqd_serverstatus payload.
+ * @HELLO:			Client->server, the V120IRQD_FEATURE_* bits requested.
+ * 					Server->client, the subset of those that were granted.
+ * 					Features payload.
+ * @IRQ_BATCH:		Signal several IRQs from one crate have occurred.
+ * 					Acknowledgement of the whole batch required.
+ * 					Server->client only, and only with V120IRQD_FEATURE_BATCH.
+ * 					Sent as a batch_buffer rather than a response_buffer.
+ * @LATENCY_STATUS:	Client->server, a request for latency statistics, with a
+ * 					multibit v120irqd_selector payload and the
+ * 					v120irqd_latency() flags in its payload member.
+ * 					Server->client, the response as a latency_buffer.
+ * @REQUEST_CLEAR:	Request notification on an IRQ, which the server clears.
+ * 					Acknowledgement required.
+ * 					Client->server only, as a clear_buffer, and only with
+ * 					V120IRQD_FEATURE_CLEAR.
+ * @REQUEST_DMA:	Request notification on an IRQ, with a DMA read first.
+ * 					Acknowledgement required, and an ACK carries the
+ * 					descriptor of the shared buffer.
+ * 					Client->server only, as a dma_buffer, and only with
+ * 					V120IRQD_FEATURE_DMA.
+ * @REQUEST_SHARED:	Subscribe to an IRQ alongside other clients.
+ * 					Acknowledgement required.
+ * 					Client->server only, as a subscribe_buffer, and only with
+ * 					V120IRQD_FEATURE_FANOUT.
+ * @IRQ_EVENTS:		Signal one or more IRQs from one crate, with timestamps.
+ * 					Acknowledgement as for @IRQ_SIGNAL or @IRQ_BATCH.
+ * 					Server->client only, as an event_buffer, and only with
+ * 					V120IRQD_FEATURE_TIMESTAMP.
+ * @TAKEOVER:		Hand the whole server over to a new instance.
+ * 					New server->old server, the HANDOFF_VERSION it speaks, as
+ * 					a features payload.  The old server answers with a NAK,
+ * 					or with a series of handoff_buffers and then goes away.
+ * @CLIENT_STATS:	Client->server, a request for client statistics, with the
+ * 					index of the first client wanted in the payload member of
+ * 					a v120irqd_selector payload.
+ * 					Server->client, the response as a client_stats_buffer.
+ * @LINE_STATS:		Client->server, a request for one crate's line
+ * 					statistics, with a v120irqd_selector payload naming it.
+ * 					Server->client, the response as a line_stats_buffer, or a
+ * 					NAK if the server doesn't have the crate.
+ *
+ * New message types are only ever appended, so that the numbering stays
+ * compatible with existing clients.
+ *
+ * On a connection that negotiated V120IRQD_FEATURE_MUX, the top half of the
+ * client's requests also carries a tag, which the server puts on its reply.
+ * Notifications, and the client's answers to them, are always untagged.  See
+ * msg_tagged().
  */
 typedef enum v120_irq_message_select {
 	NAK, ACK,
 	REQUEST_IRQ, RELEASE_IRQ,
 	IRQ_SIGNAL,
-	SERVER_STATUS
+	SERVER_STATUS,
+	HELLO,
+	IRQ_BATCH,
+	LATENCY_STATUS,
+	REQUEST_CLEAR,
+	REQUEST_DMA,
+	REQUEST_SHARED,
+	IRQ_EVENTS,
+	TAKEOVER,
+	CLIENT_STATS,
+	LINE_STATS
 } v120_irq_message_select;
 
+/* Every feature this version of the server knows how to provide. */
+#define V120IRQD_FEATURES_SUPPORTED	\
+	(V120IRQD_FEATURE_BATCH | V120IRQD_FEATURE_CLEAR | V120IRQD_FEATURE_DMA | \
+	 V120IRQD_FEATURE_FANOUT | V120IRQD_FEATURE_MUX | \
+	 V120IRQD_FEATURE_TIMESTAMP)
+
+/* Tags are 15 bits, so a tagged msg is still a positive int; 0 is untagged. */
+#define MSG_TAG_MAX		0x7FFF
+
+#define msg_type(m)		((v120_irq_message_select)((uint32_t)(m) & 0xFFFF))
+#define msg_tag(m)		((uint16_t)((uint32_t)(m) >> 16))
+#define msg_tagged(m, tag) \
+	((v120_irq_message_select)((uint32_t)msg_type(m) | ((uint32_t)(tag) << 16)))
+
+/* The ones a V120IRQD_LOCAL connection can provide. */
+#define V120IRQD_LOCAL_FEATURES		(V120IRQD_FEATURE_BATCH)
+
 /**
  * struct response_buffer - General purpose communications buffer.
  * @msg:		The message type identifier.
  * @selector:	Payload for REQUEST_IRQ, RELEASE_IRQ, IRQ_SIGNAL.
  * @status:		Payload for SERVER_STATUS.
+ * @count:		Payload for ACK and NAK of an IRQ_BATCH; the number of
+ * 				interrupts being responded to.  0 from older clients.
+ * @features:	Payload for HELLO.
  */
 typedef struct response_buffer {
 	v120_irq_message_select msg;
 	union {
 		struct v120irqd_selector selector;
 		struct v120irqd_serverstatus status;
+		uint32_t count;
+		uint32_t features;
 	};
 } response_buffer;
 
+/**
+ * struct batch_buffer - Communications buffer for IRQ_BATCH.
+ * @msg:		The message type identifier, always IRQ_BATCH.
+ * @count:		The number of valid entries in @selector.
+ * @selector:	Concrete v120irqd_selectors, in the order they were found.
+ *
+ * Only the first @count selectors are actually sent; see batch_buffer_len().
+ */
+typedef struct batch_buffer {
+	v120_irq_message_select msg;
+	uint32_t count;
+	struct v120irqd_selector selector[V120IRQD_BATCH_MAX];
+} batch_buffer;
+
+/**
+ * struct event_buffer - Communications buffer for IRQ_EVENTS.
+ * @msg:		The message type identifier, always IRQ_EVENTS.
+ * @count:		The number of valid entries in @event.
+ * @event:		The interrupts, in the order they were found.
+ *
+ * Only the first @count events are actually sent; see event_buffer_len().
+ */
+typedef struct event_buffer {
+	v120_irq_message_select msg;
+	uint32_t count;
+	struct v120irqd_event event[V120IRQD_BATCH_MAX];
+} event_buffer;
+
+/* The version of the handoff_buffer series; both servers have to agree. */
+#define HANDOFF_VERSION		1
+
+/**
+ * enum handoff_kind - What a handoff_buffer carries.
+ * @HANDOFF_START:		The counts of what follows, with the listening socket.
+ * @HANDOFF_CLIENT:		One client connection, with its socket.
+ * @HANDOFF_ENTRY:		One entry of the vector table, in table order, with the
+ * 						shared buffer of a DMA request.
+ * @HANDOFF_RECORDING:	The --record file, with its descriptor.
+ * @HANDOFF_END:		That's everything.
+ */
+enum handoff_kind {
+	HANDOFF_START,
+	HANDOFF_CLIENT,
+	HANDOFF_ENTRY,
+	HANDOFF_RECORDING,
+	HANDOFF_END
+};
+
+/**
+ * struct handoff_buffer - One piece of a running server, for TAKEOVER.
+ * @msg:		The message type identifier, always TAKEOVER.
+ * @kind:		An enum handoff_kind.
+ * @start:		For HANDOFF_START: the HANDOFF_VERSION, the number of clients
+ * 				and entries to follow, and the last sequence number given out
+ * 				on each crate.
+ * @client:		For HANDOFF_CLIENT: the number the entries know it by, counting
+ * 				from 0, its V120IRQD_FEATURE_* bits, the notifications it
+ * 				still owes answers for, and whether it's been marked slow.
+ * @entry:		For HANDOFF_ENTRY: the client it belongs to, the server's own
+ * 				flags for its options, whether it's shared, the request
+ * 				itself, and whichever of the options go with the flags.
+ * @recording:	For HANDOFF_RECORDING: when the recording started, and how
+ * 				many records are in it.
+ *
+ * Every descriptor goes along with its record as SCM_RIGHTS.
+ */
+typedef struct handoff_buffer {
+	v120_irq_message_select msg;
+	uint32_t kind;
+	union {
+		struct {
+			uint32_t version;
+			uint32_t clients;
+			uint32_t entries;
+			uint32_t seq[16];
+		} start;
+		struct {
+			uint32_t id;
+			uint32_t features;
+			uint32_t unacked;
+			uint32_t slow;
+		} client;
+		struct {
+			uint32_t client;
+			uint32_t flags;
+			uint32_t shared;
+			struct v120irqd_selector selector;
+			struct v120irqd_clear clear;
+			struct v120irqd_dma dma;
+			struct v120irqd_subscription sub;
+		} entry;
+		struct {
+			uint64_t t_start;
+			uint64_t written;
+		} recording;
+	};
+} handoff_buffer;
+
+/**
+ * struct latency_buffer - Communications buffer for LATENCY_STATUS replies.
+ * @msg:		The message type identifier, always LATENCY_STATUS.
+ * @latency:	The summary.
+ */
+typedef struct latency_buffer {
+	v120_irq_message_select msg;
+	struct v120irqd_latency latency;
+} latency_buffer;
+
+/* Clients per CLIENT_STATS reply. */
+#define STATS_PAGE		16
+
+/**
+ * struct client_stats_buffer - Communications buffer for CLIENT_STATS replies.
+ * @msg:		The message type identifier, always CLIENT_STATS.
+ * @total:		The number of clients the server has.
+ * @first:		The index of @client[0] among them.
+ * @count:		Number of @client.
+ * @client:		The statistics.
+ */
+typedef struct client_stats_buffer {
+	v120_irq_message_select msg;
+	uint32_t total;
+	uint32_t first;
+	uint32_t count;
+	struct v120irqd_client_stats client[STATS_PAGE];
+} client_stats_buffer;
+
+/**
+ * struct line_stats_buffer - Communications buffer for LINE_STATS replies.
+ * @msg:		The message type identifier, always LINE_STATS.
+ * @crate:		The crate number.
+ * @line:		The statistics, indexed by IRQ level.
+ */
+typedef struct line_stats_buffer {
+	v120_irq_message_select msg;
+	uint32_t crate;
+	struct v120irqd_line_stats line[8];
+} line_stats_buffer;
+
+/**
+ * struct clear_buffer - Communications buffer for REQUEST_CLEAR.
+ * @msg:		The message type identifier, always REQUEST_CLEAR.
+ * @selector:	Multibit v120irqd_selector, as for REQUEST_IRQ.
+ * @clear:		The clear action.
+ */
+typedef struct clear_buffer {
+	v120_irq_message_select msg;
+	struct v120irqd_selector selector;
+	struct v120irqd_clear clear;
+} clear_buffer;
+
+/**
+ * struct dma_buffer - Communications buffer for REQUEST_DMA.
+ * @msg:		The message type identifier, always REQUEST_DMA.
+ * @selector:	v120irqd_selector as for REQUEST_IRQ, but for a single crate
+ * 				and IRQ level.
+ * @dma:		The transfer.
+ */
+typedef struct dma_buffer {
+	v120_irq_message_select msg;
+	struct v120irqd_selector selector;
+	struct v120irqd_dma dma;
+} dma_buffer;
+
+/**
+ * struct subscribe_buffer - Communications buffer for REQUEST_SHARED.
+ * @msg:		The message type identifier, always REQUEST_SHARED.
+ * @selector:	Multibit v120irqd_selector, as for REQUEST_IRQ.
+ * @sub:		The role and ACK policy.
+ */
+typedef struct subscribe_buffer {
+	v120_irq_message_select msg;
+	struct v120irqd_selector selector;
+	struct v120irqd_subscription sub;
+} subscribe_buffer;
+
+/* The size of the shared buffer for a transfer of len bytes. */
+#define dma_mapping_len(len) \
+	(sizeof(struct v120irqd_dmaslot) + (len))
+
+#define batch_buffer_len(n) \
+	(offsetof(batch_buffer, selector) + (n)*sizeof(struct v120irqd_selector))
+
+#define event_buffer_len(n) \
+	(offsetof(event_buffer, event) + (n)*sizeof(struct v120irqd_event))
+
+/**
+ * v120irqd_selector_covers() - Does a request claim a concrete interrupt?
+ * @entry:		The multibit selector that was requested.
+ * @sel:		The concrete interrupt.
+ *
+ * It does if all bits in the interrupt's crate and irq are set in the
+ * request's, and the request's vector is either ANYVECTOR or identically the
+ * interrupt's.  The server's vector table and the in-process dispatcher both
+ * go by this.
+ */
+static inline bool v120irqd_selector_covers(const struct v120irqd_selector *entry,
+	const struct v120irqd_selector *sel)
+{
+	return ((entry->crate & sel->crate) == sel->crate) &&
+		((entry->irq & sel->irq) == sel->irq) &&
+		((entry->vector == ANYVECTOR) || (entry->vector == sel->vector));
+}
+
 /**
  * v120irqd_msg_send() - Send an arbitrary message to a socket.
  *
@@ -74,6 +360,85 @@ ssize_t v120irqd_msg_send(int socket, const response_buffer *buf);
  */
 ssize_t v120_irqd_msg_recv(int socket, response_buffer* buf);
 
+/**
+ * v120irqd_frame_recv() - Get a message of any kind from a socket.
+ * @buf:	Where to put it.
+ * @size:	The size of @buf; anything longer is cut short.
+ * @fd:		Set to any file descriptor that came with it, or -1.  NULL if
+ * 			none is expected, in which case any that does come is closed.
+ *
+ * Return: The total bytes read, or a negative error code.
+ */
+ssize_t v120irqd_frame_recv(int socket, void *buf, size_t size, int *fd);
+
+/**
+ * v120irqd_frame_send() - Send a message of any kind, perhaps with a descriptor.
+ * @buf:	The message, starting with its v120_irq_message_select.
+ * @size:	The length of @buf.
+ * @fd:		A descriptor to go along, which the receiver gets a duplicate of,
+ * 			or -1 for none.
+ *
+ * Return: The total bytes sent, or a negative error code.
+ */
+ssize_t v120irqd_frame_send(int socket, const void *buf, size_t size, int fd);
+
+/**
+ * v120irqd_msg_send_fd() - Send a message along with a file descriptor.
+ * @fd:		The descriptor, which the receiver gets a duplicate of.
+ *
+ * Return: The total bytes sent, or a negative error code.
+ */
+ssize_t v120irqd_msg_send_fd(int socket, const response_buffer *buf, int fd);
+
+/**
+ * v120irqd_msg_recv_fd() - Get a message, and any file descriptor with it.
+ * @fd:		Set to the descriptor received, or -1 if there wasn't one.
+ *
+ * Return: The total bytes read, or a negative error code.
+ */
+ssize_t v120irqd_msg_recv_fd(int socket, response_buffer *buf, int *fd);
+
+/**
+ * v120irqd_signal() - Signal one or a batch of IRQs, without waiting.
+ * @socket:		The open connection to the client.
+ * @sel:		The interrupt information to be sent.
+ * @count:		Number of entries in @sel, 1 to V120IRQD_BATCH_MAX.
+ *
+ * A @count of 1 is sent as an IRQ_SIGNAL, more as an IRQ_BATCH, which only
+ * V120IRQD_FEATURE_BATCH clients understand.  The response is left for the
+ * caller to collect, or not.
+ *
+ * Return: Standard success.
+ */
+int v120irqd_signal(int socket, const struct v120irqd_selector *sel, unsigned count);
+
+/**
+ * v120irqd_signal_events() - Signal one or a batch of timestamped IRQs.
+ * @socket:		The open connection to a V120IRQD_FEATURE_TIMESTAMP client.
+ * @ev:			The interrupts to be sent.
+ * @count:		Number of entries in @ev, 1 to V120IRQD_BATCH_MAX.
+ *
+ * As v120irqd_signal(), but always sent as an IRQ_EVENTS.
+ *
+ * Return: Standard success.
+ */
+int v120irqd_signal_events(int socket, const struct v120irqd_event *ev, unsigned count);
+
+/**
+ * v120irqd_interrupts() - Signal a batch of IRQs on the socket.
+ * @socket:		The open connection to the client.
+ * @sel:		The interrupt information to be sent.
+ * @count:		Number of entries in @sel, 1 to V120IRQD_BATCH_MAX.
+ *
+ * The server calls this to send several interrupt notifications to a client
+ * that negotiated V120IRQD_FEATURE_BATCH.  A @count of 1 is sent as an ordinary
+ * IRQ_SIGNAL.  Block until the single response for the batch is returned.
+ *
+ * Return: Standard success.  Specifically, -EBADMSG indicates that the client
+ * sent a response other than an ACK.
+ */
+int v120irqd_interrupts(int socket, const struct v120irqd_selector *sel, unsigned count);
+
 /**
  * v120irqd_server() - Create an open socket in listen mode.
  * @socketname		Name of the socket in the filesystem.  Begin it with an
@@ -94,6 +459,63 @@ int v120irqd_server(const char *socketname);
  */
 const char * message_select_str(v120_irq_message_select msg);
 
+/**********************************************************************
+ * In-process dispatch, see local.c.
+ *
+ * These are the V120IRQD_LOCAL halves of the public functions, which call
+ * them once v120irqd_is_local() says the socket is the local connection.
+ * They return standard success, except as noted, but leave errno alone.
+ **********************************************************************/
+
+bool v120irqd_is_local(int socket);
+
+/* Returns the local connection's descriptor, or -1 with errno set. */
+int v120irqd_local_open(void);
+
+int v120irqd_local_request(const struct v120irqd_selector *sel);
+int v120irqd_local_release(const struct v120irqd_selector *sel);
+
+/* Returns the number of interrupts copied into sel, or a negative error. */
+int v120irqd_local_getinterrupts(struct v120irqd_selector *sel,
+	unsigned int max, int timeout);
+
+/* ACK (success) or NAK the oldest count unacknowledged interrupts. */
+int v120irqd_local_respond(unsigned int count, bool success);
+
+int v120irqd_local_interrupt(const struct v120irqd_selector *sel);
+void v120irqd_local_status(struct v120irqd_serverstatus *status);
+
+/**********************************************************************
+ * Connection sharing, see mux.c.
+ *
+ * Once a connection has negotiated V120IRQD_FEATURE_MUX it gets a
+ * demultiplexer, and the public functions go through that rather than
+ * reading the socket themselves.
+ **********************************************************************/
+
+struct v120irqd_mux;
+
+/* The socket's demultiplexer, or NULL if it hasn't got one. */
+struct v120irqd_mux * v120irqd_mux_find(int socket);
+
+/* Give the socket a demultiplexer.  Standard success. */
+int v120irqd_mux_start(int socket);
+
+/* Tear down the socket's demultiplexer, if it has one. */
+void v120irqd_mux_stop(int socket);
+
+/* Send a request and wait for the reply to it, which is copied into resp with
+ * the tag taken back off.  fd is as for v120irqd_frame_recv().  Returns the
+ * length of the reply, or a negative error code.
+ */
+ssize_t v120irqd_mux_call(struct v120irqd_mux *mux, void *req, size_t reqlen,
+	void *resp, size_t resplen, int *fd);
+
+/* Wait for the next notification and copy it into buf.  Returns its length,
+ * or a negative error code.
+ */
+ssize_t v120irqd_mux_next(struct v120irqd_mux *mux, void *buf, size_t size);
+
 /**********************************************************************
  * Error reporting tools.
  **********************************************************************/
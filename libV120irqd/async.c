@@ -0,0 +1,345 @@
+/**
+ * DOC: Non-blocking client connections, for event loops.
+ *
+ * Each context keeps its own list of requests waiting on replies, matched up
+ * by the tags of V120IRQD_FEATURE_MUX, rather than going through mux.c, whose
+ * whole job is waiting.  Everything that comes in is handled in
+ * v120irqd_dispatch(), which reads until the socket runs dry.
+ *
+ * This software is released under the Modified BSD License, and may be
+ * redistributed according to the terms stated in license.txt, which must
+ * be kept with this file.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "v120irqd_intl.h"
+
+/* Handler slots to add to the table at a time. */
+#define ASYNC_HANDLER_INCR	16
+
+/**
+ * struct async_call - A request whose reply hasn't come back yet.
+ * @next:	The next one outstanding.
+ * @tag:	The tag it went out with.
+ * @done:	The completion callback, or NULL.
+ * @arg:	Passed to @done.
+ * @sel:	The selector it was made for.
+ */
+struct async_call {
+	struct async_call *next;
+	uint16_t tag;
+	v120irqd_completion done;
+	void *arg;
+	struct v120irqd_selector sel;
+};
+
+/**
+ * struct async_handler - Where interrupts with one payload go.
+ * @payload:	The payload.
+ * @fn:			The handler.
+ * @arg:		Passed to @fn.
+ */
+struct async_handler {
+	uint32_t payload;
+	v120irqd_handler fn;
+	void *arg;
+};
+
+/**
+ * struct v120irqd_async - A non-blocking connection.
+ * @fd:			The socket, non-blocking.
+ * @tag:		The last tag handed out.
+ * @calls:		The requests still waiting on replies, newest first.
+ * @handlers:	The interrupt handlers, in no particular order.
+ * @nhandlers:	The number of valid entries in @handlers.
+ * @allocated:	The number of entries @handlers has room for.
+ */
+struct v120irqd_async {
+	int fd;
+	uint16_t tag;
+	struct async_call *calls;
+	struct async_handler *handlers;
+	unsigned int nhandlers;
+	unsigned int allocated;
+};
+
+/**********************************************************************
+ * Internal utilities
+ **********************************************************************/
+
+static struct async_handler * find_handler(struct v120irqd_async *ctx, uint32_t payload)
+{
+	for (unsigned int i = 0; i < ctx->nhandlers; i++) {
+		if (ctx->handlers[i].payload == payload) return &ctx->handlers[i];
+	}
+	return NULL;
+}
+
+/* Hand an interrupt to its handler. */
+static void run_handler(struct v120irqd_async *ctx, const struct v120irqd_selector *sel)
+{
+	struct async_handler *h = find_handler(ctx, sel->payload);
+
+	if (h == NULL) {
+		logwarn("No handler for %04X:%02X:%08X payload %u",
+			sel->crate, sel->irq, sel->vector, sel->payload);
+		return;
+	}
+	h->fn(sel, h->arg);
+}
+
+/* Send a tagged request, and remember it until the reply comes back. */
+static int send_call(struct v120irqd_async *ctx, v120_irq_message_select msg,
+	const struct v120irqd_selector *sel, v120irqd_completion done, void *arg)
+{
+	response_buffer req = {0};
+	struct async_call *call;
+	ssize_t len;
+	int err;
+
+	call = malloc(sizeof(*call));
+	if (call == NULL) {
+		errno = ENOMEM;
+		return -ENOMEM;
+	}
+	do {
+		ctx->tag = (ctx->tag + 1) & MSG_TAG_MAX;
+	} while (ctx->tag == 0);
+	call->tag = ctx->tag;
+	call->done = done;
+	call->arg = arg;
+	call->sel = *sel;
+
+	req.msg = msg_tagged(msg, call->tag);
+	req.selector = *sel;
+	len = write(ctx->fd, &req, sizeof(req));
+	if (len < 0) {
+		err = errno;
+		logwarn("Couldn't send message %s: %s", message_select_str(msg), strerror(err));
+		free(call);
+		errno = err;
+		return -err;
+	}
+
+	call->next = ctx->calls;
+	ctx->calls = call;
+	return 0;
+}
+
+/* Hand a reply to the callback of the request it answers. */
+static void complete_call(struct v120irqd_async *ctx, const response_buffer *resp)
+{
+	struct async_call **pp, *call;
+	uint16_t tag = msg_tag(resp->msg);
+	int err;
+
+	for (pp = &ctx->calls; *pp != NULL; pp = &(*pp)->next) {
+		if ((*pp)->tag == tag) break;
+	}
+	call = *pp;
+	if (call == NULL) {
+		logwarn("Reply %s to no request", message_select_str(msg_type(resp->msg)));
+		return;
+	}
+	*pp = call->next;
+
+	switch (msg_type(resp->msg)) {
+	case ACK:	err = 0;		break;
+	case NAK:	err = -EPERM;	break;
+	default:	err = -EBADMSG;	break;
+	}
+	if (call->done != NULL) call->done(err, &call->sel, call->arg);
+	free(call);
+}
+
+/* Fail every outstanding request, for a connection that's gone. */
+static void fail_calls(struct v120irqd_async *ctx, int err)
+{
+	struct async_call *call;
+
+	while ((call = ctx->calls) != NULL) {
+		ctx->calls = call->next;
+		if (call->done != NULL) call->done(err, &call->sel, call->arg);
+		free(call);
+	}
+}
+
+/**********************************************************************
+ * Public API
+ **********************************************************************/
+
+/* Open a non-blocking connection, or NULL with errno set. */
+struct v120irqd_async * v120irqd_async_open(const char *socketname)
+{
+	struct v120irqd_async *ctx;
+	unsigned int features = V120IRQD_FEATURE_MUX | V120IRQD_FEATURE_BATCH;
+	int fd, err;
+
+	fd = v120irqd_client(socketname);
+	if (fd < 0) return NULL;
+
+	/* A V120IRQD_LOCAL connection won't grant V120IRQD_FEATURE_MUX. */
+	err = v120irqd_negotiate(fd, &features);
+	if (err < 0) goto cleanup;
+	if (!(features & V120IRQD_FEATURE_MUX)) {
+		err = -EOPNOTSUPP;
+		goto cleanup;
+	}
+
+	/* Replies get matched up here instead. */
+	v120irqd_mux_stop(fd);
+
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK)) {
+		err = -errno;
+		goto cleanup;
+	}
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (ctx == NULL) {
+		err = -ENOMEM;
+		goto cleanup;
+	}
+	ctx->fd = fd;
+	return ctx;
+
+cleanup:
+	v120irqd_close(fd);
+	errno = -err;
+	return NULL;
+}
+
+/* The descriptor to wait on. */
+int v120irqd_async_fd(const struct v120irqd_async *ctx)
+{
+	return ctx->fd;
+}
+
+/* Register, replace or remove the handler for a payload. */
+int v120irqd_async_handler(struct v120irqd_async *ctx, uint32_t payload,
+	v120irqd_handler fn, void *arg)
+{
+	struct async_handler *h = find_handler(ctx, payload);
+	void *newtable;
+
+	if (fn == NULL) {
+		if (h != NULL) *h = ctx->handlers[--ctx->nhandlers];
+		return 0;
+	}
+
+	if (h == NULL) {
+		if (ctx->nhandlers == ctx->allocated) {
+			newtable = realloc(ctx->handlers,
+				(ctx->allocated + ASYNC_HANDLER_INCR) * sizeof(*ctx->handlers));
+			if (newtable == NULL) {
+				errno = ENOMEM;
+				return -ENOMEM;
+			}
+			ctx->handlers = newtable;
+			ctx->allocated += ASYNC_HANDLER_INCR;
+		}
+		h = &ctx->handlers[ctx->nhandlers++];
+		h->payload = payload;
+	}
+	h->fn = fn;
+	h->arg = arg;
+	return 0;
+}
+
+/* Request interrupt notification, without waiting for the answer. */
+int v120irqd_async_request(struct v120irqd_async *ctx,
+	const struct v120irqd_selector *sel, v120irqd_completion done, void *arg)
+{
+	return send_call(ctx, REQUEST_IRQ, sel, done, arg);
+}
+
+/* Release a request, without waiting for the answer. */
+int v120irqd_async_release(struct v120irqd_async *ctx,
+	const struct v120irqd_selector *sel, v120irqd_completion done, void *arg)
+{
+	return send_call(ctx, RELEASE_IRQ, sel, done, arg);
+}
+
+/* Handle everything the server has sent. */
+int v120irqd_dispatch(struct v120irqd_async *ctx)
+{
+	union {
+		response_buffer resp;
+		batch_buffer batch;
+	} buf;
+	ssize_t len;
+	int err, count = 0;
+	unsigned int n;
+
+	for (;;) {
+		len = recv(ctx->fd, &buf, sizeof(buf), MSG_DONTWAIT);
+		if (len < 0) {
+			err = errno;
+			if (err == EAGAIN || err == EWOULDBLOCK) break;
+			if (err == EINTR) continue;
+			logwarn("Couldn't read message data from socket: %s", strerror(err));
+			errno = err;
+			return -err;
+		}
+		if (len == 0) {
+			fail_calls(ctx, -ECONNRESET);
+			errno = ECONNRESET;
+			return -ECONNRESET;
+		}
+
+		if (msg_tag(buf.resp.msg) != 0) {
+			complete_call(ctx, &buf.resp);
+			continue;
+		}
+
+		switch (buf.resp.msg) {
+		case IRQ_SIGNAL:
+			run_handler(ctx, &buf.resp.selector);
+			count++;
+			err = v120irqd_ack(ctx->fd);
+			break;
+
+		case IRQ_BATCH:
+			n = buf.batch.count;
+			if (n < 1 || n > V120IRQD_BATCH_MAX || len < batch_buffer_len(n)) {
+				logwarn("Bad batch of %u from server", n);
+				err = v120irqd_nak(ctx->fd);
+				break;
+			}
+			for (unsigned int i = 0; i < n; i++) {
+				run_handler(ctx, &buf.batch.selector[i]);
+			}
+			count += n;
+			err = v120irqd_ack_many(ctx->fd, n);
+			break;
+
+		default:
+			logwarn("Unexpected %s from server", message_select_str(buf.resp.msg));
+			err = 0;
+			break;
+		}
+		if (err < 0) return err;
+	}
+	return count;
+}
+
+/* Close the connection, dropping any requests still outstanding. */
+int v120irqd_async_close(struct v120irqd_async *ctx)
+{
+	struct async_call *call;
+	int err = 0;
+
+	while ((call = ctx->calls) != NULL) {
+		ctx->calls = call->next;
+		free(call);
+	}
+	if (close(ctx->fd)) err = -errno;
+	free(ctx->handlers);
+	free(ctx);
+	return err;
+}
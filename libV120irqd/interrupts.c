@@ -9,10 +9,12 @@
  */
 
 #include <errno.h>
+#include <poll.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -47,6 +49,89 @@ ssize_t v120_irqd_msg_recv(int socket, response_buffer* buf)
 	return len;
 }
 
+/* Send a message of any kind, with a file descriptor attached if there is one. */
+ssize_t v120irqd_frame_send(int socket, const void *buf, size_t size, int fd)
+{
+	ssize_t len;
+	char control[CMSG_SPACE(sizeof(int))] = {0};
+	struct iovec iov = {
+		.iov_base = (void *)buf,
+		.iov_len = size
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = (fd >= 0) ? control : NULL,
+		.msg_controllen = (fd >= 0) ? sizeof(control) : 0
+	};
+	struct cmsghdr *cmsg;
+
+	if (fd >= 0) {
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+
+	len = sendmsg(socket, &msg, 0);
+	if (len < 0) {
+		logwarn("Couldn't send message %s: %s",
+			message_select_str(*(const v120_irq_message_select *)buf), strerror(errno));
+		return -errno;
+	}
+	return len;
+}
+
+/* Send a message with a file descriptor attached. */
+ssize_t v120irqd_msg_send_fd(int socket, const response_buffer *buf, int fd)
+{
+	return v120irqd_frame_send(socket, buf, sizeof(response_buffer), fd);
+}
+
+/* Get a message of any kind, and possibly a file descriptor, from a socket. */
+ssize_t v120irqd_frame_recv(int socket, void *buf, size_t size, int *fd)
+{
+	ssize_t len;
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = {
+		.iov_base = buf,
+		.iov_len = size
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control)
+	};
+	struct cmsghdr *cmsg;
+	int got = -1;
+
+	len = recvmsg(socket, &msg, MSG_CMSG_CLOEXEC);
+	if (len < 0) {
+		logwarn("Couldn't read message data from socket: %s", strerror(errno));
+		if (fd != NULL) *fd = -1;
+		return -errno;
+	}
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			memcpy(&got, CMSG_DATA(cmsg), sizeof(int));
+		}
+	}
+	if (fd != NULL) {
+		*fd = got;
+	} else if (got >= 0) {
+		close(got);
+	}
+	return len;
+}
+
+/* Get a message, and possibly a file descriptor, from a socket. */
+ssize_t v120irqd_msg_recv_fd(int socket, response_buffer *buf, int *fd)
+{
+	return v120irqd_frame_recv(socket, buf, sizeof(response_buffer), fd);
+}
+
 /**********************************************************************
  * Utility functions
  **********************************************************************/
@@ -56,8 +141,12 @@ static char message_select_strbuf[16];
 /* msg as a string */
 const char * message_select_str(v120_irq_message_select msg)
 {
-	static const char* strs[] = {"NAK", "ACK", "REQUEST_IRQ", "RELEASE_IRQ", "IRQ_SIGNAL", "SERVER_STATUS"};
-	if (msg >= NAK && msg <= IRQ_SIGNAL) {
+	static const char* strs[] = {
+		"NAK", "ACK", "REQUEST_IRQ", "RELEASE_IRQ", "IRQ_SIGNAL", "SERVER_STATUS",
+		"HELLO", "IRQ_BATCH", "LATENCY_STATUS", "REQUEST_CLEAR", "REQUEST_DMA",
+		"REQUEST_SHARED", "IRQ_EVENTS", "TAKEOVER", "CLIENT_STATS", "LINE_STATS"
+	};
+	if (msg >= NAK && msg <= LINE_STATS) {
 		return strs[msg];
 	} else {
 		snprintf(message_select_strbuf, sizeof(message_select_strbuf), "%d", msg);
@@ -65,6 +154,57 @@ const char * message_select_str(v120_irq_message_select msg)
 	}
 }
 
+/* Standard success from a local.c result, which doesn't set errno. */
+static int local_result(int err)
+{
+	if (err < 0) errno = -err;
+	return err;
+}
+
+/**
+ * transact() - Send a request and get the reply to it.
+ * @req:		The request, of @reqlen bytes.
+ * @resp:		Where the reply goes, of @resplen bytes.
+ * @fd:			As for v120irqd_frame_recv().
+ *
+ * Shared connections go through their demultiplexer; anything else just reads
+ * the next message.
+ *
+ * Return: The length of the reply, or a negative error code.
+ */
+static ssize_t transact(int socket, void *req, size_t reqlen,
+	void *resp, size_t resplen, int *fd)
+{
+	struct v120irqd_mux *mux = v120irqd_mux_find(socket);
+	v120_irq_message_select msg = *(v120_irq_message_select *)req;
+	ssize_t len;
+
+	if (mux != NULL) return v120irqd_mux_call(mux, req, reqlen, resp, resplen, fd);
+
+	len = write(socket, req, reqlen);
+	if (len < 0) {
+		logwarn("Couldn't send message %s: %s", message_select_str(msg), strerror(errno));
+		return -errno;
+	}
+	return v120irqd_frame_recv(socket, resp, resplen, fd);
+}
+
+/* Get the next notification, which on a shared connection may already be in. */
+static ssize_t next_notification(int socket, void *buf, size_t size)
+{
+	struct v120irqd_mux *mux = v120irqd_mux_find(socket);
+	ssize_t len;
+
+	if (mux != NULL) return v120irqd_mux_next(mux, buf, size);
+
+	len = read(socket, buf, size);
+	if (len < 0) {
+		logwarn("Couldn't read message data from socket: %s", strerror(errno));
+		return -errno;
+	}
+	return len;
+}
+
 /* -1 if x == 0 else floor(log2(x)) */
 int v120irqd_ilog2f(uint32_t x)
 {
@@ -89,14 +229,16 @@ int v120irqd_request(int socket, struct v120irqd_selector * sel)
 	response_buffer resp;
 	unsigned err;
 
+	if (v120irqd_is_local(socket)) {
+		return local_result(v120irqd_local_request(sel));
+	}
+
 	/* Alright then, send the data requesting the IRQ. */
 	resp.msg = REQUEST_IRQ;
 	resp.selector = *sel;
-	len = v120irqd_msg_send(socket, &resp);
-	if (len < 0) return len;
 
 	/* Make sure the server liked it, it'll respond with an ACK. */
-	len = v120_irqd_msg_recv(socket, &resp);
+	len = transact(socket, &resp, sizeof(resp), &resp, sizeof(resp), NULL);
 	if (len < 0)					return len;
 	else if (len == 0)				err = ECONNRESET;
 	else if (resp.msg == ACK)		err = 0;
@@ -110,6 +252,121 @@ int v120irqd_request(int socket, struct v120irqd_selector * sel)
 	return 0;
 }
 
+/* Request notification of an interrupt that the server clears itself. */
+int v120irqd_request_clear(int socket, struct v120irqd_selector *sel,
+	const struct v120irqd_clear *clear)
+{
+	ssize_t len;
+	clear_buffer req;
+	response_buffer resp;
+	unsigned err;
+
+	if (v120irqd_is_local(socket)) {
+		return local_result(-EOPNOTSUPP);
+	}
+
+	req.msg = REQUEST_CLEAR;
+	req.selector = *sel;
+	req.clear = *clear;
+	len = transact(socket, &req, sizeof(req), &resp, sizeof(resp), NULL);
+	if (len < 0)					return len;
+	else if (len == 0)				err = ECONNRESET;
+	else if (resp.msg == ACK)		err = 0;
+	else if (resp.msg == NAK)		err = EPERM;
+	else 							err = EBADMSG;
+
+	if (err) {
+		errno = err;
+		return -err;
+	}
+	return 0;
+}
+
+/* Request notification of an interrupt that other clients may share. */
+int v120irqd_subscribe(int socket, struct v120irqd_selector *sel,
+	const struct v120irqd_subscription *sub)
+{
+	ssize_t len;
+	subscribe_buffer req;
+	response_buffer resp;
+	unsigned err;
+
+	if (v120irqd_is_local(socket)) {
+		return local_result(-EOPNOTSUPP);
+	}
+
+	req.msg = REQUEST_SHARED;
+	req.selector = *sel;
+	req.sub = *sub;
+	len = transact(socket, &req, sizeof(req), &resp, sizeof(resp), NULL);
+	if (len < 0)					return len;
+	else if (len == 0)				err = ECONNRESET;
+	else if (resp.msg == ACK)		err = 0;
+	else if (resp.msg == NAK)		err = EPERM;
+	else 							err = EBADMSG;
+
+	if (err) {
+		errno = err;
+		return -err;
+	}
+	return 0;
+}
+
+/* Request notification of an interrupt, with its data read by the server. */
+int v120irqd_request_dma(int socket, struct v120irqd_selector *sel,
+	const struct v120irqd_dma *dma, struct v120irqd_dmabuf *buf)
+{
+	ssize_t len;
+	dma_buffer req;
+	response_buffer resp;
+	unsigned err;
+	int fd;
+	void *ptr;
+
+	if (v120irqd_is_local(socket)) {
+		return local_result(-EOPNOTSUPP);
+	}
+
+	req.msg = REQUEST_DMA;
+	req.selector = *sel;
+	req.dma = *dma;
+	len = transact(socket, &req, sizeof(req), &resp, sizeof(resp), &fd);
+	if (len < 0)					return len;
+	else if (len == 0)				err = ECONNRESET;
+	else if (resp.msg == NAK)		err = EPERM;
+	else if (resp.msg != ACK)		err = EBADMSG;
+	else if (fd < 0)				err = EBADMSG;
+	else							err = 0;
+
+	if (err) {
+		if (fd >= 0) close(fd);
+		errno = err;
+		return -err;
+	}
+
+	/* The descriptor's only needed long enough to map it. */
+	buf->size = dma_mapping_len(dma->length);
+	ptr = mmap(NULL, buf->size, PROT_READ, MAP_SHARED, fd, 0);
+	err = errno;
+	close(fd);
+	if (ptr == MAP_FAILED) {
+		logerror("Couldn't map DMA buffer: %s", strerror(err));
+		errno = err;
+		return -err;
+	}
+	buf->slot = ptr;
+	return 0;
+}
+
+/* Unmap a DMA buffer. */
+int v120irqd_unmap_dma(struct v120irqd_dmabuf *buf)
+{
+	if (munmap((void *)buf->slot, buf->size)) return -errno;
+	buf->slot = NULL;
+	buf->size = 0;
+	return 0;
+}
+
 /* Stop previously requested interrupt notification from the server. */
 int v120irqd_release(int socket, struct v120irqd_selector * sel)
 {
@@ -117,14 +374,16 @@ int v120irqd_release(int socket, struct v120irqd_selector * sel)
 	response_buffer resp;
 	unsigned err;
 
+	if (v120irqd_is_local(socket)) {
+		return local_result(v120irqd_local_release(sel));
+	}
+
 	/* Alright then, send the data requesting the IRQ. */
 	resp.msg = RELEASE_IRQ;
 	resp.selector = *sel;
-	len = v120irqd_msg_send(socket, &resp);
-	if (len < 0) return len;
 
 	/* Make sure the server liked it, it'll respond with an ACK. */
-	len = v120_irqd_msg_recv(socket, &resp);
+	len = transact(socket, &resp, sizeof(resp), &resp, sizeof(resp), NULL);
 	if (len < 0)					return len;
 	else if (len == 0)				err = ECONNRESET;
 	else if (resp.msg == ACK)		err = 0;
@@ -138,34 +397,141 @@ int v120irqd_release(int socket, struct v120irqd_selector * sel)
 	return 0;
 }
 
-/* Retrieve the interrupt information pending on a socket. */
-int v120irqd_getinterrupt(int socket, struct v120irqd_selector * sel)
+/* Anything the server may notify a client with. */
+union notification {
+	response_buffer resp;
+	batch_buffer batch;
+	event_buffer events;
+};
+
+/**
+ * recv_interrupts() - Read the next interrupt notification, of any kind.
+ * @socket:		The open connection to the server.
+ * @buf:		Loaded with the notification.
+ *
+ * Return: The number of interrupts in @buf, or a negative error code.
+ */
+static int recv_interrupts(int socket, union notification *buf)
 {
 	ssize_t len;
-	response_buffer resp;
-	unsigned err;
+	unsigned err = 0;
+	unsigned count = 0;
 
-	len = v120_irqd_msg_recv(socket, &resp);
-	if (len < 0)						return len;
-	else if (len == 0)					err = ECONNRESET;
-	else if (resp.msg == IRQ_SIGNAL)	err = 0;
-	else 								err = EBADMSG;
+	len = next_notification(socket, buf, sizeof(*buf));
+	if (len < 0)								return len;
+	else if (len == 0)							err = ECONNRESET;
+	else if (buf->resp.msg == IRQ_SIGNAL)		count = 1;
+	else if (buf->resp.msg == IRQ_BATCH) {
+		count = buf->batch.count;
+		if (count < 1 || count > V120IRQD_BATCH_MAX || len < batch_buffer_len(count))
+												err = EBADMSG;
+	} else if (buf->resp.msg == IRQ_EVENTS) {
+		count = buf->events.count;
+		if (count < 1 || count > V120IRQD_BATCH_MAX || len < event_buffer_len(count))
+												err = EBADMSG;
+	} else										err = EBADMSG;
 
 	if (err) {
 		errno = err;
 		return -err;
 	}
+	return count;
+}
+
+/* Retrieve the interrupt information pending on a socket. */
+int v120irqd_getinterrupt(int socket, struct v120irqd_selector * sel)
+{
+	ssize_t len;
+	union notification buf;
+
+	if (v120irqd_is_local(socket)) {
+		len = local_result(v120irqd_local_getinterrupts(sel, 1, -1));
+		return (len < 0) ? len : 0;
+	}
 
-	*sel = resp.selector;
+	len = recv_interrupts(socket, &buf);
+	if (len < 0) return len;
+	if (buf.resp.msg == IRQ_BATCH || len != 1) {
+		errno = EBADMSG;
+		return -EBADMSG;
+	}
+
+	*sel = (buf.resp.msg == IRQ_EVENTS) ? buf.events.event[0].sel : buf.resp.selector;
 	return 0;
 }
 
+/* Retrieve one or a batch of interrupts pending on a socket. */
+int v120irqd_getinterrupts(int socket, struct v120irqd_selector *sel, unsigned int max)
+{
+	union notification buf;
+	int count;
+
+	if (max < V120IRQD_BATCH_MAX) {
+		errno = EINVAL;
+		return -EINVAL;
+	}
+	if (v120irqd_is_local(socket)) {
+		return local_result(v120irqd_local_getinterrupts(sel, max, -1));
+	}
+
+	count = recv_interrupts(socket, &buf);
+	if (count < 0) return count;
+
+	if (buf.resp.msg == IRQ_SIGNAL) {
+		sel[0] = buf.resp.selector;
+	} else if (buf.resp.msg == IRQ_BATCH) {
+		memcpy(sel, buf.batch.selector, count*sizeof(*sel));
+	} else {
+		for (int i = 0; i < count; i++) {
+			sel[i] = buf.events.event[i].sel;
+		}
+	}
+	return count;
+}
+
+/* Retrieve one or a batch of timestamped interrupts pending on a socket. */
+int v120irqd_getevents(int socket, struct v120irqd_event *ev, unsigned int max)
+{
+	union notification buf;
+	int count;
+
+	if (max < V120IRQD_BATCH_MAX) {
+		errno = EINVAL;
+		return -EINVAL;
+	}
+	if (v120irqd_is_local(socket)) {
+		errno = EOPNOTSUPP;
+		return -EOPNOTSUPP;
+	}
+
+	count = recv_interrupts(socket, &buf);
+	if (count < 0) return count;
+
+	if (buf.resp.msg == IRQ_EVENTS) {
+		memcpy(ev, buf.events.event, count*sizeof(*ev));
+		return count;
+	}
+	memset(ev, 0, count*sizeof(*ev));
+	if (buf.resp.msg == IRQ_SIGNAL) {
+		ev[0].sel = buf.resp.selector;
+	} else {
+		for (int i = 0; i < count; i++) {
+			ev[i].sel = buf.batch.selector[i];
+		}
+	}
+	return count;
+}
+
 /* Send either an ACK or NAK. */
 static int msg_respond(int socket, v120_irq_message_select response)
 {
 	response_buffer resp;
 	ssize_t len;
 
+	if (v120irqd_is_local(socket)) {
+		return local_result(v120irqd_local_respond(1, response == ACK));
+	}
+
 	resp.msg = response;
 	len = v120irqd_msg_send(socket, &resp);
 	if (len < 0) return len;
@@ -174,6 +540,23 @@ static int msg_respond(int socket, v120_irq_message_select response)
 int v120irqd_ack(int socket) { return msg_respond(socket, ACK); }
 int v120irqd_nak(int socket) { return msg_respond(socket, NAK); }
 
+/* ACK a whole batch at once. */
+int v120irqd_ack_many(int socket, unsigned int count)
+{
+	response_buffer resp;
+	ssize_t len;
+
+	if (v120irqd_is_local(socket)) {
+		return local_result(v120irqd_local_respond(count, true));
+	}
+
+	resp.msg = ACK;
+	resp.count = count;
+	len = v120irqd_msg_send(socket, &resp);
+	if (len < 0) return len;
+	return 0;
+}
+
 /* Send and handshake (if block) an IRQ_SIGNAL on the socket. */
 int v120irqd_interrupt(int socket, struct v120irqd_selector * sel)
 {
@@ -181,9 +564,91 @@ int v120irqd_interrupt(int socket, struct v120irqd_selector * sel)
 	response_buffer resp;
 	unsigned err;
 
+	if (v120irqd_is_local(socket)) {
+		return local_result(v120irqd_local_interrupt(sel));
+	}
+
 	resp.msg = IRQ_SIGNAL;
 	resp.selector = *sel;
-	len = v120irqd_msg_send(socket, &resp);
+
+	len = transact(socket, &resp, sizeof(resp), &resp, sizeof(resp), NULL);
+	if (len < 0)					return len;
+	else if (len == 0)				err = ECONNRESET;
+	else if (resp.msg == ACK)		err = 0;
+	else if (resp.msg == NAK)		err = EPERM;
+	else 							err = EBADMSG;
+
+	if (err) {
+		errno = err;
+		return -err;
+	}
+	return 0;
+}
+
+/* Send a batch of IRQs, or a single IRQ_SIGNAL, and don't wait. */
+int v120irqd_signal(int socket, const struct v120irqd_selector *sel, unsigned count)
+{
+	ssize_t len;
+	batch_buffer batch;
+	response_buffer resp;
+
+	if (count < 1 || count > V120IRQD_BATCH_MAX) {
+		return -EINVAL;
+	}
+	if (count == 1) {
+		resp.msg = IRQ_SIGNAL;
+		resp.selector = *sel;
+		len = v120irqd_msg_send(socket, &resp);
+		return (len < 0) ? len : 0;
+	}
+
+	batch.msg = IRQ_BATCH;
+	batch.count = count;
+	memcpy(batch.selector, sel, count*sizeof(*sel));
+	len = write(socket, &batch, batch_buffer_len(count));
+	if (len < 0) {
+		logwarn("Couldn't send message %s: %s", message_select_str(batch.msg), strerror(errno));
+		return -errno;
+	}
+	return 0;
+}
+
+/* Send one or a batch of timestamped IRQs, without waiting. */
+int v120irqd_signal_events(int socket, const struct v120irqd_event *ev, unsigned count)
+{
+	ssize_t len;
+	event_buffer events;
+
+	if (count < 1 || count > V120IRQD_BATCH_MAX) {
+		return -EINVAL;
+	}
+
+	events.msg = IRQ_EVENTS;
+	events.count = count;
+	memcpy(events.event, ev, count*sizeof(*ev));
+	len = write(socket, &events, event_buffer_len(count));
+	if (len < 0) {
+		logwarn("Couldn't send message %s: %s", message_select_str(events.msg), strerror(errno));
+		return -errno;
+	}
+	return 0;
+}
+
+/* Send and handshake a batch of IRQs; a batch of one is an IRQ_SIGNAL. */
+int v120irqd_interrupts(int socket, const struct v120irqd_selector *sel, unsigned count)
+{
+	ssize_t len;
+	response_buffer resp;
+	unsigned err;
+
+	if (count < 1 || count > V120IRQD_BATCH_MAX) {
+		return -EINVAL;
+	}
+	if (count == 1) {
+		return v120irqd_interrupt(socket, (struct v120irqd_selector *)sel);
+	}
+
+	len = v120irqd_signal(socket, sel, count);
 	if (len < 0) return len;
 
 	len = v120_irqd_msg_recv(socket, &resp);
@@ -197,6 +662,9 @@ int v120irqd_interrupt(int socket, struct v120irqd_selector * sel)
 		errno = err;
 		return -err;
 	}
+	if (resp.count != 0 && resp.count != count) {
+		logwarn("Batch of %u interrupts acknowledged as %u", count, resp.count);
+	}
 	return 0;
 }
 
@@ -207,11 +675,13 @@ int v120irqd_status(int socket, struct v120irqd_serverstatus *status)
 	ssize_t len;
 	int err;
 
-	resp.msg = SERVER_STATUS;
-	len = v120irqd_msg_send(socket, &resp);
-	if (len < 0) return len;
+	if (v120irqd_is_local(socket)) {
+		v120irqd_local_status(status);
+		return 0;
+	}
 
-	len = v120_irqd_msg_recv(socket, &resp);
+	resp.msg = SERVER_STATUS;
+	len = transact(socket, &resp, sizeof(resp), &resp, sizeof(resp), NULL);
 	if (len < 0)						return len;
 	else if (len == 0)					err = ECONNRESET;
 	else if (resp.msg == SERVER_STATUS)	err = 0;
@@ -226,6 +696,168 @@ int v120irqd_status(int socket, struct v120irqd_serverstatus *status)
 	return 0;
 }
 
+/* Request the server latency statistics. */
+int v120irqd_latency(int socket, const struct v120irqd_selector *which,
+	unsigned int flags, struct v120irqd_latency *lat)
+{
+	response_buffer req = {0};
+	latency_buffer resp;
+	ssize_t len;
+	int err;
+
+	/* Nobody's keeping the histograms. */
+	if (v120irqd_is_local(socket)) {
+		return local_result(-EOPNOTSUPP);
+	}
+
+	req.msg = LATENCY_STATUS;
+	req.selector = *which;
+	req.selector.payload = flags;
+	len = transact(socket, &req, sizeof(req), &resp, sizeof(resp), NULL);
+	if (len < 0)						return len;
+	else if (len == 0)					err = ECONNRESET;
+	else if (resp.msg == LATENCY_STATUS && len == sizeof(resp))
+										err = 0;
+	else 								err = EBADMSG;
+
+	if (err) {
+		errno = err;
+		return -err;
+	}
+
+	*lat = resp.latency;
+	return 0;
+}
+
+/* Request the server client statistics. */
+int v120irqd_client_stats(int socket, struct v120irqd_client_stats *stats,
+	unsigned int max)
+{
+	response_buffer req = {0};
+	client_stats_buffer resp;
+	unsigned int first = 0, total = 0;
+	ssize_t len;
+	int err = 0;
+
+	if (v120irqd_is_local(socket)) {
+		return local_result(-EOPNOTSUPP);
+	}
+
+	do {
+		req.msg = CLIENT_STATS;
+		req.selector.payload = first;
+		len = transact(socket, &req, sizeof(req), &resp, sizeof(resp), NULL);
+		if (len < 0)						return len;
+		else if (len == 0)					err = ECONNRESET;
+		else if (resp.msg != CLIENT_STATS || len != sizeof(resp) ||
+				resp.first != first || resp.count > STATS_PAGE)
+											err = EBADMSG;
+		if (err) {
+			errno = err;
+			return -err;
+		}
+
+		total = resp.total;
+		for (unsigned int i = 0; i < resp.count && first < max; i++) {
+			stats[first++] = resp.client[i];
+		}
+		if (resp.count == 0) break;
+	} while (first < total && first < max);
+	return total;
+}
+
+/* Request the server line statistics for a crate. */
+int v120irqd_line_stats(int socket, int crate, struct v120irqd_line_stats line[8])
+{
+	response_buffer req = {0};
+	line_stats_buffer resp;
+	ssize_t len;
+	int err;
+
+	if (v120irqd_is_local(socket)) {
+		return local_result(-EOPNOTSUPP);
+	}
+	if (crate < 0 || crate > 15) {
+		errno = EINVAL;
+		return -EINVAL;
+	}
+
+	req.msg = LINE_STATS;
+	req.selector.crate = 1 << crate;
+	len = transact(socket, &req, sizeof(req), &resp, sizeof(resp), NULL);
+	if (len < 0)						return len;
+	else if (len == 0)					err = ECONNRESET;
+	else if (resp.msg == NAK)			err = ENODEV;
+	else if (resp.msg == LINE_STATS && len == sizeof(resp))
+										err = 0;
+	else 								err = EBADMSG;
+
+	if (err) {
+		errno = err;
+		return -err;
+	}
+
+	memcpy(line, resp.line, sizeof(resp.line));
+	return 0;
+}
+
+/* How long to wait for a HELLO before deciding the server predates it. */
+#ifndef HELLO_TIMEOUT_MS
+#  define HELLO_TIMEOUT_MS 1000
+#endif
+
+/* Agree on protocol features with the server. */
+int v120irqd_negotiate(int socket, unsigned int *features)
+{
+	response_buffer resp = {0};
+	struct pollfd pfd;
+	ssize_t len;
+	int err;
+
+	if (v120irqd_is_local(socket)) {
+		*features &= V120IRQD_LOCAL_FEATURES;
+		return 0;
+	}
+
+	resp.msg = HELLO;
+	resp.features = *features;
+	len = v120irqd_msg_send(socket, &resp);
+	if (len < 0) return len;
+
+	/* Servers that don't know HELLO simply never answer it. */
+	pfd.fd = socket;
+	pfd.events = POLLIN;
+	err = poll(&pfd, 1, HELLO_TIMEOUT_MS);
+	if (err < 0) return -errno;
+	if (err == 0) {
+		errno = EOPNOTSUPP;
+		return -EOPNOTSUPP;
+	}
+
+	len = v120_irqd_msg_recv(socket, &resp);
+	if (len < 0)					return len;
+	else if (len == 0)				err = ECONNRESET;
+	else if (resp.msg == HELLO)		err = 0;
+	else 							err = EBADMSG;
+
+	if (err) {
+		errno = err;
+		return -err;
+	}
+
+	*features &= resp.features;
+
+	/* From here on, everything is read through the demultiplexer. */
+	if (*features & V120IRQD_FEATURE_MUX) {
+		err = v120irqd_mux_start(socket);
+		if (err < 0) {
+			logwarn("Can't share connection: %s", strerror(-err));
+			*features &= ~V120IRQD_FEATURE_MUX;
+		}
+	}
+	return 0;
+}
+
 /**********************************************************************
  * Socket management utilities
  **********************************************************************/
@@ -335,6 +967,7 @@ int v120irqd_client(const char* socketname)
 	server_socket_info.sun_family = AF_UNIX;
 
 	if (socketname == NULL) socketname = DEFAULTSOCKET;
+	if (strcmp(socketname, V120IRQD_LOCAL) == 0) return v120irqd_local_open();
 	strncpy(server_socket_info.sun_path, socketname, UNIX_PATH_MAX);
 	if (*server_socket_info.sun_path == '@') *server_socket_info.sun_path = '\0';
 
@@ -345,9 +978,58 @@ int v120irqd_client(const char* socketname)
 		logerror("connect() failed: %s", strerror(errno));
 		goto cleanup;
 	}
+
+	/* Anything left over from a shared connection that was simply close()d
+	 * belonged to whatever had this descriptor before.
+	 */
+	v120irqd_mux_stop(sock);
 	return sock;
 
 cleanup:
 	close(sock);
 	return -1;
 }
+
+/* The /proc/net/unix flag of a listening socket, __SO_ACCEPTCON. */
+#define UNIX_LISTENING	(1 << 16)
+
+/* Find the server that serves a crate. */
+int v120irqd_locate(int crate, char *name, size_t size)
+{
+	struct v120irqd_serverstatus status;
+	char line[512], path[256];
+	unsigned long flags;
+	unsigned int type;
+	size_t len, prefix = strlen(DEFAULTSOCKET);
+	FILE *f;
+	int sock, err = -ENOENT;
+
+	if (crate < 0 || crate > 15) return -EINVAL;
+
+	/* Every listening socket on the system is in here, with abstract names
+	 * shown with an @ for each NUL.
+	 */
+	f = fopen("/proc/net/unix", "re");
+	if (f == NULL) return -errno;
+	while (err == -ENOENT && fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "%*s %*s %*s %lx %x %*s %*s %255s", &flags, &type, path) != 3) {
+			continue;
+		}
+		if (!(flags & UNIX_LISTENING) || type != SOCK_SEQPACKET) continue;
+		len = strlen(path);
+		if (path[0] == '@') {
+			while (len > 1 && path[len-1] == '@') path[--len] = '\0';
+		}
+		if (strncmp(path, DEFAULTSOCKET, prefix) != 0) continue;
+
+		sock = v120irqd_client(path);
+		if (sock < 0) continue;
+		if (v120irqd_status(sock, &status) == 0 && (status.crates & (1 << crate))) {
+			err = (len < size) ? 0 : -ENAMETOOLONG;
+			if (err == 0) memcpy(name, path, len + 1);
+		}
+		close(sock);
+	}
+	fclose(f);
+	return err;
+}
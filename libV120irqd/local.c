@@ -0,0 +1,542 @@
+/**
+ * DOC: In-process interrupt dispatch, without the v120irqd server.
+ *
+ * Opening V120IRQD_LOCAL with v120irqd_client() gets a connection that is
+ * serviced right here in the calling process rather than by the server.  The
+ * crates' interrupt endpoints are opened directly, and the IRQ status and IACK
+ * vector registers are read by whichever library call is waiting for an
+ * interrupt.  Everything else about the connection behaves as it would with
+ * the server on the other end: the same requests, the same matching rules,
+ * the same ACK/NAK protocol.
+ *
+ * The descriptor handed back is an epoll instance over the interrupt
+ * endpoints, so it can be poll()ed alongside anything else the application
+ * is waiting on.  It must be closed with v120irqd_close().
+ *
+ * Only one local connection may exist in a process, none of this is
+ * thread-safe, and it shouldn't be used on crates that a running v120irqd is
+ * also servicing.
+ *
+ * This software is released under the Modified BSD License, and may be
+ * redistributed according to the terms stated in license.txt, which must
+ * be kept with this file.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "V120.h"
+#include "v120irqd_intl.h"
+
+/* Most interrupts that can be waiting to be fetched, or waiting to be ACKed.
+ * Each crate can only contribute one per IRQ level to either, because a level
+ * isn't looked at again until its last interrupt has been ACKed.  The rest is
+ * headroom for fake interrupts.
+ */
+#define LOCAL_QUEUE_LEN	(16 * 7 + 16)
+
+/* Index in local_event.crate for fake interrupts, which belong to no crate. */
+#define LOCAL_FAKE		(-1)
+
+/**
+ * struct local_crate - One crate being serviced in-process.
+ * @hV120:		The crate handle.
+ * @irqhndl:	The crate's IRQ registers.
+ * @fd:			The crate's interrupt endpoint.
+ * @cratenumber: The crate number, 0-15.
+ * @irqen:		The IRQ levels we have enabled on the crate.
+ * @inflight:	IRQ levels that have been IACKed, and whose interrupt hasn't
+ * 				been ACKed yet.  These are left alone until it has.
+ * @rescan:		The crate needs looking at, either because the endpoint went
+ * 				off or because something changed since it last did.
+ */
+struct local_crate {
+	V120_HANDLE *hV120;
+	V120_IRQ *irqhndl;
+	int fd;
+	int cratenumber;
+	uint32_t irqen;
+	uint32_t inflight;
+	bool rescan;
+};
+
+/**
+ * struct local_event - One interrupt on its way through the dispatcher.
+ * @sel:		The concrete interrupt, with the payload of its request.
+ * @crate:		Index into local_dispatcher.crate, or LOCAL_FAKE.
+ */
+struct local_event {
+	struct v120irqd_selector sel;
+	int crate;
+};
+
+/**
+ * struct local_ring - FIFO of local_events.
+ */
+struct local_ring {
+	struct local_event ev[LOCAL_QUEUE_LEN];
+	unsigned int head;
+	unsigned int count;
+};
+
+/**
+ * struct local_dispatcher - All the state for the local connection.
+ * @epfd:		The descriptor returned to the application.
+ * @ncrates:	The number of valid entries in @crate.
+ * @crate:		The open crates.
+ * @requests:	The registered interrupt requests, in order of registration.
+ * @nrequests:	The number of valid entries in @requests.
+ * @allocated:	The number of entries @requests has room for.
+ * @pending:	Interrupts found, not yet handed to the application.
+ * @unacked:	Interrupts handed to the application, not yet ACKed.
+ */
+static struct local_dispatcher {
+	int epfd;
+	unsigned int ncrates;
+	struct local_crate crate[16];
+	struct v120irqd_selector *requests;
+	unsigned int nrequests;
+	unsigned int allocated;
+	struct local_ring pending;
+	struct local_ring unacked;
+} *local = NULL;
+
+/**********************************************************************
+ * Internal utilities
+ **********************************************************************/
+
+static int ring_push(struct local_ring *r, const struct local_event *ev)
+{
+	if (r->count == LOCAL_QUEUE_LEN) return -ENOBUFS;
+	r->ev[(r->head + r->count) % LOCAL_QUEUE_LEN] = *ev;
+	r->count++;
+	return 0;
+}
+
+static bool ring_pop(struct local_ring *r, struct local_event *ev)
+{
+	if (r->count == 0) return false;
+	*ev = r->ev[r->head];
+	r->head = (r->head + 1) % LOCAL_QUEUE_LEN;
+	r->count--;
+	return true;
+}
+
+/* First request that covers the concrete interrupt sel, or NULL. */
+static const struct v120irqd_selector *local_find(const struct v120irqd_selector *sel)
+{
+	unsigned int i;
+	for (i = 0; i < local->nrequests; i++) {
+		if (v120irqd_selector_covers(&local->requests[i], sel)) {
+			return &local->requests[i];
+		}
+	}
+	return NULL;
+}
+
+/* Bring every crate's irqen in line with the requests. */
+static void local_update_irqen(void)
+{
+	uint32_t irqs[16] = {0};
+	unsigned int i;
+	int crate;
+
+	for (i = 0; i < local->nrequests; i++) {
+		for (crate = 0; crate < 16; crate++) {
+			if (local->requests[i].crate & (1 << crate)) {
+				irqs[crate] |= local->requests[i].irq;
+			}
+		}
+	}
+
+	for (i = 0; i < local->ncrates; i++) {
+		struct local_crate *c = &local->crate[i];
+		uint32_t irqen = irqs[c->cratenumber];
+		if (irqen == c->irqen) continue;
+		c->irqen = irqen;
+		c->irqhndl->irqen = irqen;
+		/* A newly enabled level may already be asserted, and won't
+		 * wake the endpoint again.
+		 */
+		c->rescan = true;
+	}
+}
+
+/* An interrupt handed to the application is done with. */
+static void local_finish(const struct local_event *ev, bool success)
+{
+	struct local_crate *c;
+	uint32_t bit;
+
+	if (ev->crate == LOCAL_FAKE) return;
+
+	c = &local->crate[ev->crate];
+	bit = ev->sel.irq;
+	c->inflight &= ~bit;
+	c->rescan = true;
+
+	/* Just as in the server, a failure that left the line asserted
+	 * would otherwise have us servicing it forever.
+	 */
+	if (!success && (c->irqhndl->irqstatus & bit)) {
+		logwarn("IRQ%d on crate %d still asserted after NAK, disabling",
+			v120irqd_ilog2f(bit), c->cratenumber);
+		c->irqen &= ~bit;
+		c->irqhndl->irqen = c->irqen;
+	}
+}
+
+/* The interrupt at the head of the unacked queue is done with. */
+static int local_retire(bool success)
+{
+	struct local_event ev;
+
+	if (!ring_pop(&local->unacked, &ev)) return -EPROTO;
+	local_finish(&ev, success);
+	return 0;
+}
+
+/* Milliseconds on the monotonic clock. */
+static int64_t local_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * local_scan() - IACK every pending, unclaimed IRQ level on a crate.
+ * @idx:		Index into local->crate.
+ *
+ * Matched interrupts are added to the pending queue, in priority order.
+ * Anything asserted that no request claims is disabled, as the server does,
+ * once the status has been read again after all the levels are done.
+ */
+static void local_scan(int idx)
+{
+	struct local_crate *c = &local->crate[idx];
+	const struct v120irqd_selector *req;
+	struct local_event ev;
+	uint32_t irqstatus, stuck = 0;
+	int irq;
+
+	c->rescan = false;
+	irqstatus = c->irqhndl->irqstatus & c->irqen & ~c->inflight;
+	if (irqstatus == 0) return;
+
+	for (irq = 7; irq > 0; irq--) {
+		if ((irqstatus & (1 << irq)) == 0) continue;
+
+		ev.crate = idx;
+		ev.sel.crate = 1 << c->cratenumber;
+		ev.sel.irq = 1 << irq;
+		ev.sel.vector = c->irqhndl->iack_vector[irq];
+		ev.sel.payload = 0;
+
+		req = local_find(&ev.sel);
+		if (req != NULL) {
+			ev.sel.payload = req->payload;
+			if (ring_push(&local->pending, &ev) == 0) {
+				c->inflight |= ev.sel.irq;
+				continue;
+			}
+			logerror("No room to queue IRQ%d on crate %d", irq, c->cratenumber);
+		} else {
+			logwarn("Targetless interrupt on crate %d IRQ%d vector 0x%08X",
+				c->cratenumber, irq, ev.sel.vector);
+		}
+
+		stuck |= ev.sel.irq;
+	}
+
+	if (stuck == 0) return;
+	stuck &= c->irqhndl->irqstatus;
+	if (stuck == 0) return;
+	for (irq = 7; irq > 0; irq--) {
+		if (stuck & (1 << irq)) {
+			logerror("Unable to clear IRQ%d on crate %d, disabling", irq, c->cratenumber);
+		}
+	}
+	c->irqen &= ~stuck;
+	c->irqhndl->irqen = c->irqen;
+}
+
+/**
+ * local_wait() - Wait until there's at least one pending interrupt.
+ * @timeout:	Milliseconds to wait, or -1 for forever.
+ *
+ * Wakeups that turn up nothing new, such as for levels still in flight,
+ * only get what's left of @timeout to wait again.
+ *
+ * Return: Standard success.  Specifically, -ETIMEDOUT if nothing turned up.
+ */
+static int local_wait(int timeout)
+{
+	struct epoll_event events[16];
+	int64_t deadline = 0, left;
+	unsigned int i;
+	char dummy;
+	int n, wait = timeout;
+
+	if (timeout > 0) deadline = local_now_ms() + timeout;
+
+	for (;;) {
+		for (i = 0; i < local->ncrates; i++) {
+			if (local->crate[i].rescan) local_scan(i);
+		}
+		if (local->pending.count) return 0;
+
+		if (timeout > 0) {
+			left = deadline - local_now_ms();
+			wait = (left > 0) ? (int)left : 0;
+		}
+		n = epoll_wait(local->epfd, events, 16, wait);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return -errno;
+		}
+		if (n == 0) return -ETIMEDOUT;
+
+		while (n--) {
+			struct local_crate *c = events[n].data.ptr;
+			/* Reading the endpoint rearms it. */
+			if (read(c->fd, &dummy, 1) < 0 && errno != EAGAIN) {
+				logwarn("read() of crate %d endpoint failed: %s",
+					c->cratenumber, strerror(errno));
+			}
+			c->rescan = true;
+		}
+	}
+}
+
+/* Tear down whatever part of the dispatcher exists. */
+static void local_free(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < local->ncrates; i++) {
+		local->crate[i].irqhndl->irqen = 0;
+		v120_close(local->crate[i].hV120);
+	}
+	if (local->epfd >= 0) close(local->epfd);
+	free(local->requests);
+	free(local);
+	local = NULL;
+}
+
+/**********************************************************************
+ * Library internal interface
+ **********************************************************************/
+
+bool v120irqd_is_local(int socket)
+{
+	return (local != NULL) && (socket == local->epfd);
+}
+
+/* Open every crate we can find, and return the epoll descriptor or -1. */
+int v120irqd_local_open(void)
+{
+	struct epoll_event ev;
+	V120_HANDLE *hV120;
+	int crate, fd;
+
+	if (local != NULL) {
+		errno = EBUSY;
+		return -1;
+	}
+	local = calloc(1, sizeof(*local));
+	if (local == NULL) return -1;
+
+	local->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (local->epfd < 0) {
+		logerror("epoll_create1() failed: %s", strerror(errno));
+		goto cleanup;
+	}
+
+	/* As with the server, no crates at all is not an error; fake
+	 * interrupts still work.
+	 */
+	for (crate = 0; crate < 16; crate++) {
+		struct local_crate *c = &local->crate[local->ncrates];
+
+		hV120 = v120_open(crate);
+		if (hV120 == NULL) continue;
+		fd = v120_irq_open(hV120);
+		if (fd < 0) {
+			logwarn("Unable to open IRQ endpoint for crate %d", crate);
+			v120_close(hV120);
+			continue;
+		}
+
+		c->hV120 = hV120;
+		c->irqhndl = v120_get_irq(hV120);
+		c->fd = fd;
+		c->cratenumber = crate;
+		c->irqhndl->irqen = 0;
+		local->ncrates++;
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = c;
+		if (epoll_ctl(local->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+			logerror("epoll_ctl() failed: %s", strerror(errno));
+			goto cleanup;
+		}
+	}
+	return local->epfd;
+
+cleanup:
+	fd = errno;
+	local_free();
+	errno = fd;
+	return -1;
+}
+
+int v120irqd_local_request(const struct v120irqd_selector *sel)
+{
+	struct v120irqd_selector *p;
+
+	/* The same validity rules as the server applies. */
+	if ((sel->crate == 0) || (sel->irq == 0) || (sel->irq & ~ANYIRQ)) {
+		return -EPERM;
+	}
+	if (local_find(sel) != NULL) {
+		return -EPERM;
+	}
+
+	if (local->nrequests == local->allocated) {
+		unsigned int n = local->allocated ? 2 * local->allocated : 16;
+		p = realloc(local->requests, n * sizeof(*p));
+		if (p == NULL) return -ENOMEM;
+		local->requests = p;
+		local->allocated = n;
+	}
+	local->requests[local->nrequests++] = *sel;
+	local_update_irqen();
+	return 0;
+}
+
+int v120irqd_local_release(const struct v120irqd_selector *sel)
+{
+	unsigned int i;
+
+	for (i = 0; i < local->nrequests; i++) {
+		struct v120irqd_selector *p = &local->requests[i];
+		if ((p->crate == sel->crate) && (p->irq == sel->irq) &&
+				(p->vector == sel->vector)) {
+			break;
+		}
+	}
+	if (i == local->nrequests) return -EPERM;
+
+	memmove(&local->requests[i], &local->requests[i+1],
+		(local->nrequests - i - 1) * sizeof(*local->requests));
+	local->nrequests--;
+	local_update_irqen();
+	return 0;
+}
+
+int v120irqd_local_getinterrupts(struct v120irqd_selector *sel,
+	unsigned int max, int timeout)
+{
+	struct local_event ev;
+	unsigned int n = 0;
+	int err;
+
+	err = local_wait(timeout);
+	if (err) return err;
+
+	while (n < max && local->unacked.count < LOCAL_QUEUE_LEN &&
+			ring_pop(&local->pending, &ev)) {
+		ring_push(&local->unacked, &ev);
+		sel[n++] = ev.sel;
+	}
+	return n ? (int)n : -ENOBUFS;
+}
+
+int v120irqd_local_respond(unsigned int count, bool success)
+{
+	int err = 0;
+	while (count-- && !err) {
+		err = local_retire(success);
+	}
+	return err;
+}
+
+int v120irqd_local_interrupt(const struct v120irqd_selector *sel)
+{
+	const struct v120irqd_selector *req;
+	struct local_event ev;
+
+	req = local_find(sel);
+	if (req == NULL) {
+		logwarn("Targetless fake interrupt on crate 0x%04X IRQ 0x%02X vector 0x%08X",
+			sel->crate, sel->irq, sel->vector);
+		return 0;
+	}
+	ev.sel = *sel;
+	ev.sel.payload = req->payload;
+	ev.crate = LOCAL_FAKE;
+	return ring_push(&local->pending, &ev);
+}
+
+void v120irqd_local_status(struct v120irqd_serverstatus *status)
+{
+	unsigned int i;
+
+	status->pid = getpid();
+	status->crates = 0;
+	for (i = 0; i < local->ncrates; i++) {
+		status->crates |= 1 << local->crate[i].cratenumber;
+	}
+	status->clients = 1;
+	status->irq_requests = local->nrequests;
+}
+
+/**********************************************************************
+ * Public interface
+ **********************************************************************/
+
+/* Service interrupts through a callback. */
+int v120irqd_local_dispatch(int socket, v120irqd_handler fn, void *arg, int timeout)
+{
+	struct local_event ev;
+	int n = 0;
+	int err;
+
+	if (!v120irqd_is_local(socket)) {
+		errno = EBADF;
+		return -EBADF;
+	}
+
+	err = local_wait(timeout);
+	if (err == -ETIMEDOUT) return 0;
+	if (err) return err;
+
+	/* Only what's already been found, so that a level that's reasserted
+	 * can't keep us in here forever.
+	 */
+	while (ring_pop(&local->pending, &ev)) {
+		fn(&ev.sel, arg);
+		local_finish(&ev, true);
+		n++;
+	}
+	return n;
+}
+
+/* Close either kind of connection. */
+int v120irqd_close(int socket)
+{
+	if (v120irqd_is_local(socket)) {
+		local_free();
+		return 0;
+	}
+	v120irqd_mux_stop(socket);
+	if (close(socket)) return -errno;
+	return 0;
+}
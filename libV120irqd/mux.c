@@ -0,0 +1,395 @@
+/**
+ * DOC: Sharing one server connection between threads.
+ *
+ * A connection that negotiated V120IRQD_FEATURE_MUX gets a v120irqd_mux, and
+ * from then on nobody reads the socket except through it.  Whichever thread
+ * needs a message next and finds nobody else reading becomes the reader: it
+ * drops the lock, reads one message, takes the lock back and files the
+ * message where it belongs, then wakes everyone to see whether it was theirs.
+ * Replies go to the waiter with the matching tag, and notifications onto a
+ * queue.  There's no thread of our own, and a connection used by only one
+ * thread reads exactly as it always did.
+ *
+ * Writes need no lock at all, since a SOCK_SEQPACKET message goes out whole.
+ *
+ * This software is released under the Modified BSD License, and may be
+ * redistributed according to the terms stated in license.txt, which must
+ * be kept with this file.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "v120irqd_intl.h"
+#include "config.h"
+
+#ifndef HAVE_LIBPTHREAD
+# define HAVE_LIBPTHREAD 0
+#endif
+
+#if HAVE_LIBPTHREAD
+
+#include <pthread.h>
+
+/* Anything the server may send. */
+union server_frame {
+	response_buffer resp;
+	batch_buffer batch;
+	event_buffer events;
+	latency_buffer latency;
+	client_stats_buffer clients;
+	line_stats_buffer lines;
+};
+
+/**
+ * struct mux_waiter - A thread waiting on the reply to its request.
+ * @next:	The next waiter on the same connection.
+ * @tag:	The tag its request went out with.
+ * @done:	The reply is in.
+ * @buf:	Where the reply goes.
+ * @size:	The size of @buf.
+ * @len:	The length of the reply.
+ * @fd:		Any descriptor that came with the reply, or -1.
+ */
+struct mux_waiter {
+	struct mux_waiter *next;
+	uint16_t tag;
+	bool done;
+	void *buf;
+	size_t size;
+	ssize_t len;
+	int fd;
+};
+
+/**
+ * struct mux_note - A notification nobody has asked for yet.
+ * @next:	The one after it.
+ * @len:	Its length.
+ * @frame:	The notification, an IRQ_SIGNAL, IRQ_BATCH or IRQ_EVENTS.
+ */
+struct mux_note {
+	struct mux_note *next;
+	ssize_t len;
+	union server_frame frame;
+};
+
+/**
+ * struct v120irqd_mux - The demultiplexer for one connection.
+ * @next:		The next connection's.
+ * @socket:		The connection.
+ * @lock:		Protects everything below.
+ * @cond:		Broadcast whenever a message has been filed, or the reader
+ * 				gives up reading.
+ * @reading:	Some thread is reading the socket.
+ * @dead:		The connection has failed or hung up.
+ * @err:		The negative error code it failed with, or 0 for a hangup.
+ * @tag:		The last tag handed out.
+ * @waiters:	The threads waiting on replies.
+ * @head:		The oldest queued notification.
+ * @tail:		Where the next one goes.
+ */
+struct v120irqd_mux {
+	struct v120irqd_mux *next;
+	int socket;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool reading;
+	bool dead;
+	ssize_t err;
+	uint16_t tag;
+	struct mux_waiter *waiters;
+	struct mux_note *head, **tail;
+};
+
+/* Every connection with a demultiplexer. */
+static struct v120irqd_mux *mux_list = NULL;
+static pthread_mutex_t mux_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**********************************************************************
+ * Internal utilities
+ **********************************************************************/
+
+/* File a reply with its waiter. */
+static void file_reply(struct v120irqd_mux *mux, union server_frame *frame,
+	ssize_t len, int fd)
+{
+	struct mux_waiter *w;
+	uint16_t tag = msg_tag(frame->resp.msg);
+
+	for (w = mux->waiters; w != NULL; w = w->next) {
+		if (w->tag == tag && !w->done) break;
+	}
+	if (w == NULL) {
+		logwarn("Reply %s to no request", message_select_str(msg_type(frame->resp.msg)));
+		if (fd >= 0) close(fd);
+		return;
+	}
+
+	frame->resp.msg = msg_type(frame->resp.msg);
+	if ((size_t)len > w->size) len = w->size;
+	memcpy(w->buf, frame, len);
+	w->len = len;
+	w->fd = fd;
+	w->done = true;
+}
+
+/* Queue a notification. */
+static void file_note(struct v120irqd_mux *mux, union server_frame *frame,
+	ssize_t len)
+{
+	struct mux_note *note = malloc(sizeof(*note));
+
+	if (note == NULL) {
+		logerror("Lost %s: %s", message_select_str(frame->resp.msg), strerror(ENOMEM));
+		return;
+	}
+	note->next = NULL;
+	note->len = len;
+	memcpy(&note->frame, frame, len);
+	*mux->tail = note;
+	mux->tail = &note->next;
+}
+
+/* Put a message where it belongs. */
+static void file_frame(struct v120irqd_mux *mux, union server_frame *frame,
+	ssize_t len, int fd)
+{
+	v120_irq_message_select msg = frame->resp.msg;
+
+	if (msg_tag(msg) != 0) {
+		file_reply(mux, frame, len, fd);
+		return;
+	}
+	if (fd >= 0) close(fd);
+	if (msg == IRQ_SIGNAL || msg == IRQ_BATCH || msg == IRQ_EVENTS) {
+		file_note(mux, frame, len);
+	} else {
+		logwarn("Unexpected %s from server", message_select_str(msg));
+	}
+}
+
+/**
+ * mux_wait() - Wait until something has been filed, reading if need be.
+ * @mux:	The demultiplexer, locked.
+ * @ready:	Whether what we're waiting for has been filed.
+ * @arg:	Passed to @ready.
+ *
+ * Return: 0 once @ready says so, or a negative error code.  0 is also
+ * returned if the server hung up, with @mux->dead set.
+ */
+static int mux_wait(struct v120irqd_mux *mux,
+	bool (*ready)(struct v120irqd_mux *, void *), void *arg)
+{
+	union server_frame frame;
+	ssize_t len;
+	int fd;
+
+	while (!ready(mux, arg)) {
+		if (mux->dead) return mux->err;
+		if (mux->reading) {
+			pthread_cond_wait(&mux->cond, &mux->lock);
+			continue;
+		}
+
+		mux->reading = true;
+		pthread_mutex_unlock(&mux->lock);
+		len = v120irqd_frame_recv(mux->socket, &frame, sizeof(frame), &fd);
+		pthread_mutex_lock(&mux->lock);
+		mux->reading = false;
+		pthread_cond_broadcast(&mux->cond);
+
+		/* Nothing wrong with the connection; let the caller decide. */
+		if (len == -EINTR || len == -EAGAIN) return len;
+
+		if (len <= 0) {
+			mux->dead = true;
+			mux->err = len;
+		} else if ((size_t)len < sizeof(frame.resp.msg)) {
+			logwarn("Runt message from server");
+			if (fd >= 0) close(fd);
+		} else {
+			file_frame(mux, &frame, len, fd);
+		}
+	}
+	return 0;
+}
+
+static bool reply_ready(struct v120irqd_mux *mux, void *arg)
+{
+	return ((struct mux_waiter *)arg)->done;
+}
+
+static bool note_ready(struct v120irqd_mux *mux, void *arg)
+{
+	return mux->head != NULL;
+}
+
+/* Take a waiter off the list. */
+static void unlink_waiter(struct v120irqd_mux *mux, struct mux_waiter *w)
+{
+	struct mux_waiter **pp;
+
+	for (pp = &mux->waiters; *pp != NULL; pp = &(*pp)->next) {
+		if (*pp == w) {
+			*pp = w->next;
+			return;
+		}
+	}
+}
+
+/**********************************************************************
+ * Internal API
+ **********************************************************************/
+
+/* The socket's demultiplexer, or NULL. */
+struct v120irqd_mux * v120irqd_mux_find(int socket)
+{
+	struct v120irqd_mux *mux;
+
+	pthread_mutex_lock(&mux_list_lock);
+	for (mux = mux_list; mux != NULL; mux = mux->next) {
+		if (mux->socket == socket) break;
+	}
+	pthread_mutex_unlock(&mux_list_lock);
+	return mux;
+}
+
+/* Give the socket a demultiplexer. */
+int v120irqd_mux_start(int socket)
+{
+	struct v120irqd_mux *mux;
+
+	/* A leftover from a descriptor that was close()d rather than
+	 * v120irqd_close()d.
+	 */
+	v120irqd_mux_stop(socket);
+
+	mux = calloc(1, sizeof(*mux));
+	if (mux == NULL) return -ENOMEM;
+	mux->socket = socket;
+	pthread_mutex_init(&mux->lock, NULL);
+	pthread_cond_init(&mux->cond, NULL);
+	mux->tail = &mux->head;
+
+	pthread_mutex_lock(&mux_list_lock);
+	mux->next = mux_list;
+	mux_list = mux;
+	pthread_mutex_unlock(&mux_list_lock);
+	return 0;
+}
+
+/* Tear down the socket's demultiplexer. */
+void v120irqd_mux_stop(int socket)
+{
+	struct v120irqd_mux **pp, *mux = NULL;
+	struct mux_note *note;
+
+	pthread_mutex_lock(&mux_list_lock);
+	for (pp = &mux_list; *pp != NULL; pp = &(*pp)->next) {
+		if ((*pp)->socket == socket) {
+			mux = *pp;
+			*pp = mux->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&mux_list_lock);
+	if (mux == NULL) return;
+
+	while ((note = mux->head) != NULL) {
+		mux->head = note->next;
+		free(note);
+	}
+	pthread_cond_destroy(&mux->cond);
+	pthread_mutex_destroy(&mux->lock);
+	free(mux);
+}
+
+/* Send a tagged request, and wait for its reply. */
+ssize_t v120irqd_mux_call(struct v120irqd_mux *mux, void *req, size_t reqlen,
+	void *resp, size_t resplen, int *fd)
+{
+	struct mux_waiter w = { .buf = resp, .size = resplen, .fd = -1 };
+	v120_irq_message_select *msg = req;
+	v120_irq_message_select type = msg_type(*msg);
+	ssize_t len;
+	int err;
+
+	pthread_mutex_lock(&mux->lock);
+	if (mux->dead) {
+		pthread_mutex_unlock(&mux->lock);
+		return mux->err;
+	}
+	do {
+		mux->tag = (mux->tag + 1) & MSG_TAG_MAX;
+	} while (mux->tag == 0);
+	w.tag = mux->tag;
+	w.next = mux->waiters;
+	mux->waiters = &w;
+	pthread_mutex_unlock(&mux->lock);
+
+	/* The reply can land in @resp the moment this is out, and @resp may
+	 * well be @req, so the request is left tagged.
+	 */
+	*msg = msg_tagged(type, w.tag);
+	len = write(mux->socket, req, reqlen);
+	err = errno;
+
+	pthread_mutex_lock(&mux->lock);
+	if (len < 0) {
+		logwarn("Couldn't send message %s: %s", message_select_str(type), strerror(err));
+		len = -err;
+	} else {
+		len = mux_wait(mux, reply_ready, &w);
+		if (len == 0) len = w.done ? w.len : mux->err;
+	}
+	unlink_waiter(mux, &w);
+	pthread_mutex_unlock(&mux->lock);
+
+	if (len <= 0 || fd == NULL) {
+		if (w.fd >= 0) close(w.fd);
+	} else {
+		*fd = w.fd;
+	}
+	return len;
+}
+
+/* Wait for the next notification. */
+ssize_t v120irqd_mux_next(struct v120irqd_mux *mux, void *buf, size_t size)
+{
+	struct mux_note *note;
+	ssize_t len;
+
+	pthread_mutex_lock(&mux->lock);
+	len = mux_wait(mux, note_ready, NULL);
+	if (len == 0 && (note = mux->head) != NULL) {
+		mux->head = note->next;
+		if (mux->head == NULL) mux->tail = &mux->head;
+		len = ((size_t)note->len > size) ? (ssize_t)size : note->len;
+		memcpy(buf, &note->frame, len);
+		free(note);
+	}
+	pthread_mutex_unlock(&mux->lock);
+	return len;
+}
+
+#else /* !HAVE_LIBPTHREAD */
+
+struct v120irqd_mux * v120irqd_mux_find(int socket) { return NULL; }
+int v120irqd_mux_start(int socket) { return -EOPNOTSUPP; }
+void v120irqd_mux_stop(int socket) { }
+
+ssize_t v120irqd_mux_call(struct v120irqd_mux *mux, void *req, size_t reqlen,
+	void *resp, size_t resplen, int *fd)
+{
+	return -EOPNOTSUPP;
+}
+
+ssize_t v120irqd_mux_next(struct v120irqd_mux *mux, void *buf, size_t size)
+{
+	return -EOPNOTSUPP;
+}
+
+#endif
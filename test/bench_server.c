@@ -0,0 +1,578 @@
+/*
+ * Load generator and latency benchmark for v120irqd.
+ *
+ * Starts a fresh server with --novme, just as test_server does, connects
+ * any number of clients with any number of requests each, and then fires
+ * fake interrupts at them at a given rate and distribution.  Reports how fast
+ * requests could be registered and interrupts dispatched, and how long each
+ * interrupt took from being sent to being received, and to being ACKed, as
+ * one JSON object on stdout for scripts to pick up.
+ *
+ * Every request is for an exact vector, spread over all the crates and IRQ
+ * levels, and carries its own index as its payload.  Interrupts are received
+ * and ACKed by a thread of their own, since the server waits on each ACK
+ * before it goes on to the next fake interrupt.
+ *
+ * This isn't run by make check; run it by hand, e.g.
+ *     ./bench_server --clients=200 --subs=4 --count=100000 --dist=zipf
+ *
+ * This software is released under the Modified BSD License, and may be
+ * redistributed according to the terms stated in license.txt, which must
+ * be kept with this file.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "v120irqd.h"
+#include "latency_histogram.h"
+#include "config.h"
+
+#ifndef HAVE_LIBPTHREAD
+#  define HAVE_LIBPTHREAD 0
+#endif
+
+#if HAVE_LIBPTHREAD
+
+#include <pthread.h>
+
+#ifndef DAEMON_LOCAL_NAME
+#  define DAEMON_LOCAL_NAME "v120irqd"
+#endif
+
+/* Interrupts that can be outstanding on one request at once. */
+#define SUB_RING		16
+
+/* How long to wait for stragglers once everything has been sent, in ns. */
+#define DRAIN_TIMEOUT	(1000ULL * 1000 * 1000)
+
+enum bench_dist { DIST_UNIFORM, DIST_ZIPF, DIST_ROUNDROBIN };
+
+static const char *dist_names[] = { "uniform", "zipf", "roundrobin" };
+
+static struct {
+	unsigned int clients;
+	unsigned int subs;
+	unsigned int count;
+	double rate;
+	enum bench_dist dist;
+	bool batch;
+	bool spawn;
+	uint64_t seed;
+} settings = {
+	.clients = 16,
+	.subs = 8,
+	.count = 10000,
+	.dist = DIST_UNIFORM,
+	.spawn = true,
+	.seed = 1
+};
+
+/**
+ * struct bench_sub - One request, and the interrupts sent for it.
+ * @sel:	The request.
+ * @client:	The index of the client that made it.
+ * @t_sent:	When each outstanding interrupt was sent, a ring of SUB_RING.
+ * @sent:	The number of interrupts sent for it.
+ * @got:	The number of them received.
+ */
+struct bench_sub {
+	struct v120irqd_selector sel;
+	unsigned int client;
+	uint64_t t_sent[SUB_RING];
+	unsigned int sent;
+	unsigned int got;
+};
+
+static struct bench_sub *subs;
+static unsigned int nsubs;
+static struct pollfd *clients;
+
+/* Cumulative distribution for DIST_ZIPF. */
+static double *zipf_cdf;
+
+/* Protects @sent and @got of every request, and the counts below. */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t received, unexpected;
+static uint64_t t_last;
+static volatile bool stopping;
+
+/* Only the receiving thread touches these until it's been joined. */
+static latency_histogram lat_receive, lat_ack;
+static latency_histogram lat_register, lat_release;
+
+static void usage(FILE *f)
+{
+	fprintf(f,
+"Usage: bench_server [OPTIONS...]\n"
+"\n"
+"    --clients=N        Connect N clients (16).\n"
+"    --subs=M           Make M requests from each client (8).\n"
+"    --count=K          Send K fake interrupts (10000).\n"
+"    --rate=R           Send R interrupts a second; 0 for flat out (0).\n"
+"    --dist=D           Spread them over the requests uniform, zipf, or\n"
+"                       roundrobin (uniform).\n"
+"    --batch            Have the clients negotiate V120IRQD_FEATURE_BATCH.\n"
+"    --seed=S           Seed for the random distributions (1).\n"
+"    --no-spawn         Use the server that's already running.\n"
+"    -?, --help         Give this help list\n");
+}
+
+static unsigned long parse_number(const char *name, const char *arg, unsigned long max)
+{
+	unsigned long value;
+	char *end;
+
+	errno = 0;
+	value = strtoul(arg, &end, 0);
+	if (errno || *end != '\0' || value > max) {
+		fprintf(stderr, "invalid value '%s' for --%s\n", arg, name);
+		exit(EXIT_FAILURE);
+	}
+	return value;
+}
+
+static void parse_args(int argc, char * argv[])
+{
+	struct option options[] = {
+		{ "clients",    required_argument, NULL, 'c' },
+		{ "subs",       required_argument, NULL, 'm' },
+		{ "count",      required_argument, NULL, 'k' },
+		{ "rate",       required_argument, NULL, 'r' },
+		{ "dist",       required_argument, NULL, 'D' },
+		{ "batch",      no_argument, NULL, 'b' },
+		{ "seed",       required_argument, NULL, 'S' },
+		{ "no-spawn",   no_argument, NULL, 'N' },
+		{ "help",       no_argument, NULL, '?' },
+		{ NULL, 0, NULL, '\0' },
+	};
+	char *end;
+	int opt, i;
+
+	while ((opt = getopt_long(argc, argv, "?", options, NULL)) != -1) {
+		switch (opt) {
+		case 'c':	settings.clients = parse_number("clients", optarg, 4096);	break;
+		case 'm':	settings.subs = parse_number("subs", optarg, 4096);			break;
+		case 'k':	settings.count = parse_number("count", optarg, UINT32_MAX);	break;
+		case 'S':	settings.seed = parse_number("seed", optarg, ULONG_MAX);	break;
+		case 'b':	settings.batch = true;										break;
+		case 'N':	settings.spawn = false;										break;
+		case 'r':
+			settings.rate = strtod(optarg, &end);
+			if (*end != '\0' || settings.rate < 0) {
+				fprintf(stderr, "invalid value '%s' for --rate\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'D':
+			for (i = 0; i < 3; i++) {
+				if (strcmp(optarg, dist_names[i]) == 0) break;
+			}
+			if (i == 3) {
+				fprintf(stderr, "invalid value '%s' for --dist\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			settings.dist = i;
+			break;
+		case '?':
+			usage(stdout);
+			exit(EXIT_SUCCESS);
+		default:
+			usage(stderr);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (settings.clients == 0 || settings.subs == 0) {
+		fprintf(stderr, "need at least one client and one request\n");
+		exit(EXIT_FAILURE);
+	}
+	if (settings.seed == 0) settings.seed = 1;
+}
+
+/**********************************************************************
+ * The server
+ **********************************************************************/
+
+static void kill_server(void)
+{
+	struct v120irqd_serverstatus status;
+	int sock;
+
+	sock = v120irqd_client(NULL);
+	if (sock < 0) return;
+	if (v120irqd_status(sock, &status) == 0) kill(status.pid, SIGTERM);
+	close(sock);
+}
+
+static void start_server(void)
+{
+	int err;
+
+	kill_server();
+
+	/* Give the old one a moment to let go of the socket. */
+	usleep(100 * 1000);
+	err = system(DAEMON_LOCAL_NAME " --novme");
+	if (err) {
+		fprintf(stderr, "Couldn't start server: %d\n", err);
+		exit(EXIT_FAILURE);
+	}
+	atexit(&kill_server);
+}
+
+/**********************************************************************
+ * Load
+ **********************************************************************/
+
+/* xorshift64*, so that runs with the same seed send the same load. */
+static uint64_t random64(void)
+{
+	settings.seed ^= settings.seed >> 12;
+	settings.seed ^= settings.seed << 25;
+	settings.seed ^= settings.seed >> 27;
+	return settings.seed * 0x2545F4914F6CDD1DULL;
+}
+
+/* Request k is the (k+1)th most popular, with weight 1/(k+1). */
+static void build_zipf(void)
+{
+	double total = 0;
+
+	zipf_cdf = malloc(nsubs * sizeof(*zipf_cdf));
+	if (zipf_cdf == NULL) {
+		perror("Couldn't allocate");
+		exit(EXIT_FAILURE);
+	}
+	for (unsigned int k = 0; k < nsubs; k++) {
+		total += 1.0 / (k + 1);
+		zipf_cdf[k] = total;
+	}
+	for (unsigned int k = 0; k < nsubs; k++) {
+		zipf_cdf[k] /= total;
+	}
+}
+
+/* The request to send the @i'th interrupt for. */
+static unsigned int pick(unsigned int i)
+{
+	unsigned int lo, hi, mid;
+	double u;
+
+	switch (settings.dist) {
+	case DIST_ROUNDROBIN:
+		return i % nsubs;
+	case DIST_ZIPF:
+		u = (random64() >> 11) * (1.0 / (1ULL << 53));
+		lo = 0;
+		hi = nsubs - 1;
+		while (lo < hi) {
+			mid = (lo + hi) / 2;
+			if (zipf_cdf[mid] < u)	lo = mid + 1;
+			else					hi = mid;
+		}
+		return lo;
+	default:
+		return random64() % nsubs;
+	}
+}
+
+/* Connect the clients, and describe their requests. */
+static void connect_clients(void)
+{
+	unsigned int features;
+	int err;
+
+	clients = calloc(settings.clients, sizeof(*clients));
+	nsubs = settings.clients * settings.subs;
+	subs = calloc(nsubs, sizeof(*subs));
+	if (clients == NULL || subs == NULL) {
+		perror("Couldn't allocate");
+		exit(EXIT_FAILURE);
+	}
+
+	for (unsigned int c = 0; c < settings.clients; c++) {
+		clients[c].fd = v120irqd_client(NULL);
+		clients[c].events = POLLIN;
+		if (clients[c].fd < 0) {
+			perror("Couldn't connect client");
+			exit(EXIT_FAILURE);
+		}
+		if (settings.batch) {
+			features = V120IRQD_FEATURE_BATCH;
+			err = v120irqd_negotiate(clients[c].fd, &features);
+			if (err || !(features & V120IRQD_FEATURE_BATCH)) {
+				fprintf(stderr, "Couldn't negotiate batching\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	/* Spread over every crate and level, with a vector of their own. */
+	for (unsigned int s = 0; s < nsubs; s++) {
+		subs[s].client = s / settings.subs;
+		subs[s].sel.crate = 1 << (s % 16);
+		subs[s].sel.irq = 1 << (1 + (s / 16) % 7);
+		subs[s].sel.vector = 0x5E000000 | s;
+		subs[s].sel.payload = s;
+	}
+}
+
+/* Make or release every request, timing each into @h. */
+static double register_all(bool release, latency_histogram *h)
+{
+	uint64_t t0, t, now;
+	int fd, err;
+
+	t0 = latency_now();
+	for (unsigned int s = 0; s < nsubs; s++) {
+		fd = clients[subs[s].client].fd;
+		t = latency_now();
+		err = release ? v120irqd_release(fd, &subs[s].sel) : v120irqd_request(fd, &subs[s].sel);
+		now = latency_now();
+		if (err) {
+			fprintf(stderr, "Couldn't %s request %u: %s\n",
+				release ? "release" : "make", s, strerror(-err));
+			exit(EXIT_FAILURE);
+		}
+		latency_record(h, now - t);
+	}
+	return (latency_now() - t0) / 1e9;
+}
+
+/* Take in and ACK one notification on client @c. */
+static int receive_one(unsigned int c)
+{
+	struct v120irqd_selector sel[V120IRQD_BATCH_MAX];
+	struct bench_sub *sub;
+	uint64_t t_sent[V120IRQD_BATCH_MAX];
+	uint64_t t_recv, t_ack;
+	int fd = clients[c].fd;
+	int n, i, err;
+
+	if (settings.batch) {
+		n = v120irqd_getinterrupts(fd, sel, V120IRQD_BATCH_MAX);
+	} else {
+		n = v120irqd_getinterrupt(fd, sel);
+		if (n == 0) n = 1;
+	}
+	if (n < 0) return n;
+	t_recv = latency_now();
+
+	pthread_mutex_lock(&lock);
+	for (i = 0; i < n; i++) {
+		t_sent[i] = 0;
+		if (sel[i].payload >= nsubs) {
+			unexpected++;
+			continue;
+		}
+		sub = &subs[sel[i].payload];
+		if (sub->got == sub->sent) {
+			unexpected++;
+			continue;
+		}
+		t_sent[i] = sub->t_sent[sub->got++ % SUB_RING];
+		received++;
+	}
+	pthread_mutex_unlock(&lock);
+
+	err = settings.batch ? v120irqd_ack_many(fd, n) : v120irqd_ack(fd);
+	t_ack = latency_now();
+	if (err) return err;
+
+	for (i = 0; i < n; i++) {
+		if (t_sent[i] == 0) continue;
+		latency_record(&lat_receive, t_recv - t_sent[i]);
+		latency_record(&lat_ack, t_ack - t_sent[i]);
+	}
+	pthread_mutex_lock(&lock);
+	t_last = t_ack;
+	pthread_mutex_unlock(&lock);
+	return n;
+}
+
+/* Receive on every client until told to stop. */
+static void * receive(void *arg)
+{
+	int n, err;
+
+	while (!stopping) {
+		n = poll(clients, settings.clients, 10);
+		if (n < 0 && errno != EINTR) {
+			perror("poll");
+			break;
+		}
+		for (unsigned int c = 0; c < settings.clients && n > 0; c++) {
+			if (clients[c].revents == 0) continue;
+			n--;
+			err = receive_one(c);
+			if (err < 0 && err != -EINTR) {
+				fprintf(stderr, "Client %u couldn't receive: %s\n", c, strerror(-err));
+				return NULL;
+			}
+		}
+	}
+	return NULL;
+}
+
+/* Send the fake interrupts, at the rate asked for. */
+static double send_all(int injector)
+{
+	struct v120irqd_selector fake;
+	struct bench_sub *sub;
+	struct timespec ts;
+	uint64_t t0, due, now;
+	int err;
+
+	t0 = latency_now();
+	for (unsigned int i = 0; i < settings.count; i++) {
+		if (settings.rate > 0) {
+			due = t0 + (uint64_t)(i * 1e9 / settings.rate);
+			now = latency_now();
+			if (now < due) {
+				ts.tv_sec = (due - now) / 1000000000u;
+				ts.tv_nsec = (due - now) % 1000000000u;
+				while (nanosleep(&ts, &ts) && errno == EINTR);
+			}
+		}
+
+		sub = &subs[pick(i)];
+		fake = sub->sel;
+		fake.payload = 0;
+
+		/* Don't overrun the ring of send times. */
+		pthread_mutex_lock(&lock);
+		while (sub->sent - sub->got >= SUB_RING) {
+			pthread_mutex_unlock(&lock);
+			usleep(100);
+			pthread_mutex_lock(&lock);
+		}
+		sub->t_sent[sub->sent++ % SUB_RING] = latency_now();
+		pthread_mutex_unlock(&lock);
+
+		err = v120irqd_interrupt(injector, &fake);
+		if (err) {
+			fprintf(stderr, "Couldn't send interrupt %u: %s\n", i, strerror(-err));
+			exit(EXIT_FAILURE);
+		}
+	}
+	return (latency_now() - t0) / 1e9;
+}
+
+/* Wait until everything sent has been received, or it stops arriving. */
+static void drain(void)
+{
+	uint64_t want = settings.count;
+	bool done, stalled;
+
+	for (;;) {
+		pthread_mutex_lock(&lock);
+		done = (received >= want);
+		stalled = (latency_now() - t_last > DRAIN_TIMEOUT);
+		pthread_mutex_unlock(&lock);
+		if (done || stalled) return;
+		usleep(1000);
+	}
+}
+
+/**********************************************************************
+ * Results
+ **********************************************************************/
+
+static void print_latency(const char *name, const latency_histogram *h, const char *sep)
+{
+	printf("    \"%s\": {\"count\": %llu, \"p50\": %.3f, \"p90\": %.3f, "
+		"\"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f}%s\n",
+		name, (unsigned long long)h->total,
+		latency_percentile(h, 500000) / 1e3,
+		latency_percentile(h, 900000) / 1e3,
+		latency_percentile(h, 990000) / 1e3,
+		latency_percentile(h, 999000) / 1e3,
+		h->max / 1e3, sep);
+}
+
+static void print_results(double t_register, double t_send, double t_dispatch,
+	double t_release)
+{
+	printf("{\n");
+	printf("  \"clients\": %u,\n", settings.clients);
+	printf("  \"requests\": %u,\n", nsubs);
+	printf("  \"distribution\": \"%s\",\n", dist_names[settings.dist]);
+	printf("  \"batch\": %s,\n", settings.batch ? "true" : "false");
+	printf("  \"rate\": %.1f,\n", settings.rate);
+	printf("  \"register\": {\"seconds\": %.6f, \"per_second\": %.1f},\n",
+		t_register, t_register > 0 ? nsubs / t_register : 0.0);
+	printf("  \"release\": {\"seconds\": %.6f, \"per_second\": %.1f},\n",
+		t_release, t_release > 0 ? nsubs / t_release : 0.0);
+	printf("  \"dispatch\": {\"sent\": %u, \"received\": %llu, \"unexpected\": %llu, "
+		"\"send_seconds\": %.6f, \"seconds\": %.6f, \"per_second\": %.1f},\n",
+		settings.count, (unsigned long long)received, (unsigned long long)unexpected,
+		t_send, t_dispatch, t_dispatch > 0 ? received / t_dispatch : 0.0);
+	printf("  \"latency_us\": {\n");
+	print_latency("register", &lat_register, ",");
+	print_latency("release", &lat_release, ",");
+	print_latency("send_to_receive", &lat_receive, ",");
+	print_latency("send_to_ack", &lat_ack, "");
+	printf("  }\n");
+	printf("}\n");
+}
+
+int main(int argc, char * argv[])
+{
+	double t_register, t_send, t_dispatch, t_release;
+	pthread_t thread;
+	uint64_t t0;
+	int injector, err;
+
+	parse_args(argc, argv);
+	if (settings.spawn) start_server();
+
+	connect_clients();
+	if (settings.dist == DIST_ZIPF) build_zipf();
+	injector = v120irqd_client(NULL);
+	if (injector < 0) {
+		perror("Couldn't connect");
+		return EXIT_FAILURE;
+	}
+
+	t_register = register_all(false, &lat_register);
+
+	err = pthread_create(&thread, NULL, receive, NULL);
+	if (err) {
+		fprintf(stderr, "Couldn't start receiving: %s\n", strerror(err));
+		return EXIT_FAILURE;
+	}
+	t0 = t_last = latency_now();
+	t_send = send_all(injector);
+	drain();
+	t_dispatch = (t_last - t0) / 1e9;
+	stopping = true;
+	pthread_join(thread, NULL);
+
+	if (received < settings.count) {
+		fprintf(stderr, "%llu interrupts never arrived\n",
+			(unsigned long long)(settings.count - received));
+	}
+
+	t_release = register_all(true, &lat_release);
+	print_results(t_register, t_send, t_dispatch, t_release);
+	return (received == settings.count) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#else /* !HAVE_LIBPTHREAD */
+
+int main(void)
+{
+	fprintf(stderr, "bench_server needs pthreads\n");
+	return 1;
+}
+
+#endif
@@ -0,0 +1,135 @@
+/*
+ * Unit tests for the v120irqd ACK deadline timer wheel.
+ *
+ * This software is released under the Modified BSD License, and may be
+ * redistributed according to the terms stated in license.txt, which must
+ * be kept with this file.
+ */
+
+#include <string.h>
+
+#include "ack_wheel.h"
+
+#include "unity/unity.h"
+
+#define MS		(1000ULL * 1000)
+#define SEC		(1000ULL * MS)
+
+/* Start well clear of zero, like the real clock. */
+#define T0		(1000 * SEC)
+
+/* A timeout that makes for 10ms ticks. */
+#define TIMEOUT	(160 * MS)
+
+static struct ack_wheel w;
+static struct ack_deadline d[4];
+
+void setUp(void) {
+	ack_wheel_init(&w, TIMEOUT);
+	memset(d, 0, sizeof(d));
+}
+
+void tearDown(void) {
+}
+
+/* How many deadlines are on a list from ack_wheel_expire(). */
+static int count(const struct ack_deadline *list)
+{
+	int n = 0;
+	for (; list != NULL; list = list->next) n++;
+	return n;
+}
+
+/** Nothing comes due early, or more than a tick late. */
+void test_expiry(void)
+{
+	d[0].due = T0 + TIMEOUT;
+	TEST_ASSERT_TRUE(ack_wheel_add(&w, &d[0], T0));
+	TEST_ASSERT_FALSE(ack_wheel_add(&w, &d[0], T0));
+	TEST_ASSERT_EQUAL(1, w.count);
+
+	TEST_ASSERT_TRUE(ack_wheel_next(&w) >= d[0].due);
+	TEST_ASSERT_TRUE(ack_wheel_next(&w) <= d[0].due + w.tick);
+
+	TEST_ASSERT_NULL(ack_wheel_expire(&w, T0 + TIMEOUT - 1));
+	TEST_ASSERT_NULL(ack_wheel_expire(&w, T0 + TIMEOUT));
+	TEST_ASSERT_EQUAL_PTR(&d[0], ack_wheel_expire(&w, ack_wheel_next(&w)));
+	TEST_ASSERT_FALSE(d[0].queued);
+	TEST_ASSERT_EQUAL(0, w.count);
+	TEST_ASSERT_EQUAL(0, ack_wheel_next(&w));
+}
+
+/** Pushing a deadline back needn't tell the wheel. */
+void test_pushed_back(void)
+{
+	uint64_t now = T0;
+
+	d[0].due = now + TIMEOUT;
+	d[1].due = now + TIMEOUT;
+	ack_wheel_add(&w, &d[0], now);
+	TEST_ASSERT_FALSE(ack_wheel_add(&w, &d[1], now));
+
+	/* d[0] keeps getting answers; d[1] never does. */
+	for (int i = 0; i < 3; i++) {
+		now += 50 * MS;
+		d[0].due = now + TIMEOUT;
+		TEST_ASSERT_NULL(ack_wheel_expire(&w, now));
+	}
+	TEST_ASSERT_EQUAL(2, w.count);
+
+	now = d[1].due + w.tick;
+	TEST_ASSERT_EQUAL_PTR(&d[1], ack_wheel_expire(&w, now));
+	TEST_ASSERT_NULL(d[1].next);
+	TEST_ASSERT_TRUE(d[0].queued);
+	TEST_ASSERT_EQUAL(1, w.count);
+
+	/* And keeps on going around, as long as it keeps being pushed back. */
+	for (int i = 0; i < 100; i++) {
+		now += 50 * MS;
+		d[0].due = now + TIMEOUT;
+		TEST_ASSERT_NULL(ack_wheel_expire(&w, now));
+	}
+	TEST_ASSERT_EQUAL_PTR(&d[0], ack_wheel_expire(&w, d[0].due + w.tick));
+}
+
+/** Everything due is found, however late the wheel is looked at. */
+void test_late(void)
+{
+	for (int i = 0; i < 4; i++) {
+		d[i].due = T0 + (i + 1) * 40 * MS;
+		ack_wheel_add(&w, &d[i], T0);
+	}
+	TEST_ASSERT_EQUAL(2, count(ack_wheel_expire(&w, T0 + 100 * MS)));
+	TEST_ASSERT_EQUAL(2, count(ack_wheel_expire(&w, T0 + 100 * SEC)));
+	TEST_ASSERT_EQUAL(0, w.count);
+
+	/* And the wheel starts over fresh after being idle. */
+	d[0].due = T0 + 200 * SEC + TIMEOUT;
+	TEST_ASSERT_TRUE(ack_wheel_add(&w, &d[0], T0 + 200 * SEC));
+	TEST_ASSERT_TRUE(ack_wheel_next(&w) <= d[0].due + w.tick);
+}
+
+/** Deadlines that are going away can be taken off. */
+void test_remove(void)
+{
+	for (int i = 0; i < 3; i++) {
+		d[i].due = T0 + TIMEOUT;
+		ack_wheel_add(&w, &d[i], T0);
+	}
+	ack_wheel_remove(&w, &d[1]);
+	ack_wheel_remove(&w, &d[1]);
+	ack_wheel_remove(&w, &d[3]);
+	TEST_ASSERT_EQUAL(2, w.count);
+	TEST_ASSERT_FALSE(d[1].queued);
+	TEST_ASSERT_EQUAL(2, count(ack_wheel_expire(&w, T0 + 2 * TIMEOUT)));
+}
+
+int main(void)
+{
+	UnityBegin(__FILE__);
+	RUN_TEST(test_expiry);
+	RUN_TEST(test_pushed_back);
+	RUN_TEST(test_late);
+	RUN_TEST(test_remove);
+	return UnityEnd();
+}
@@ -43,6 +43,13 @@ void test_irq_hashsize(void)
 	TEST_ASSERT_EQUAL(end - start, sizeof(uint64_t));
 }
 
+/* Confirm that DMA data starts on its own cache line. */
+void test_dmaslot_layout(void)
+{
+	TEST_ASSERT_EQUAL(64, offsetof(struct v120irqd_dmaslot, data));
+	TEST_ASSERT_EQUAL(64, sizeof(struct v120irqd_dmaslot));
+}
+
 /* Confirm the v120irqd_ilog2f function on some randomly generated test cases. */
 void test_ilog2f(void)
 {
@@ -73,5 +80,6 @@ int main(void) {
 	UnityBegin(__FILE__);
 	RUN_TEST(test_irq_hashsize);
 	RUN_TEST(test_ilog2f);
+	RUN_TEST(test_dmaslot_layout);
 	return UnityEnd();
 }
@@ -0,0 +1,121 @@
+/*
+ * Unit tests for v120irqd interrupt recordings.
+ *
+ * This software is released under the Modified BSD License, and may be
+ * redistributed according to the terms stated in license.txt, which must
+ * be kept with this file.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "irq_record.h"
+
+#include "unity/unity.h"
+
+#define T0		(1000ULL * 1000 * 1000 * 1000)
+
+static char path[] = "/tmp/test_irq_record.XXXXXX";
+static struct irq_recorder r;
+static struct irq_record *records;
+static size_t count;
+
+void setUp(void) {
+	int fd = mkstemp(path);
+	TEST_ASSERT(fd >= 0);
+	close(fd);
+	records = NULL;
+	count = 0;
+}
+
+void tearDown(void) {
+	free(records);
+	unlink(path);
+	strcpy(path + strlen(path) - 6, "XXXXXX");
+}
+
+/* Record @n interrupts, one a microsecond, cycling through the crates. */
+static void record(unsigned int n)
+{
+	struct v120irqd_selector sel;
+
+	for (unsigned int i = 0; i < n; i++) {
+		sel.crate = 1 << (i % 16);
+		sel.irq = 1 << (i % 7 + 1);
+		sel.vector = 0xFFFF0000 | i;
+		TEST_ASSERT_EQUAL(0, irq_record_add(&r, &sel, i & IRQ_RECORD_FAKE, T0 + i * 1000));
+	}
+}
+
+/** Everything recorded comes back, across several buffers' worth. */
+void test_round_trip(void)
+{
+	const unsigned int n = IRQ_RECORD_BUFFER * 2 + 10;
+
+	TEST_ASSERT_EQUAL(0, irq_record_open(&r, path, T0));
+	record(n);
+	TEST_ASSERT_EQUAL(IRQ_RECORD_BUFFER * 2, r.written);
+	TEST_ASSERT_EQUAL(0, irq_record_close(&r));
+	TEST_ASSERT_EQUAL(n, r.written);
+
+	TEST_ASSERT_EQUAL(0, irq_record_load(path, &records, &count));
+	TEST_ASSERT_EQUAL(n, count);
+	for (unsigned int i = 0; i < n; i++) {
+		TEST_ASSERT_EQUAL(i * 1000, records[i].t);
+		TEST_ASSERT_EQUAL_HEX32(0xFFFF0000 | i, records[i].vector);
+		TEST_ASSERT_EQUAL(i % 16, records[i].crate);
+		TEST_ASSERT_EQUAL(i % 7 + 1, records[i].irq);
+		TEST_ASSERT_EQUAL(i & IRQ_RECORD_FAKE, records[i].flags);
+	}
+}
+
+/** A recording that was never finished is read up to its last whole record. */
+void test_unfinished(void)
+{
+	TEST_ASSERT_EQUAL(0, irq_record_open(&r, path, T0));
+	record(IRQ_RECORD_BUFFER + 1);
+	TEST_ASSERT_EQUAL(0, truncate(path,
+		sizeof(struct irq_record_header) + 3 * sizeof(struct irq_record) + 5));
+	TEST_ASSERT_EQUAL(0, irq_record_load(path, &records, &count));
+	TEST_ASSERT_EQUAL(3, count);
+	TEST_ASSERT_EQUAL(0, irq_record_close(&r));
+}
+
+/** Anything that isn't a recording is refused. */
+void test_not_a_recording(void)
+{
+	TEST_ASSERT_EQUAL(-EPROTO, irq_record_load(path, &records, &count));
+	TEST_ASSERT_EQUAL(0, irq_record_open(&r, path, T0));
+	TEST_ASSERT_EQUAL(0, irq_record_close(&r));
+	TEST_ASSERT_EQUAL(0, irq_record_load(path, &records, &count));
+	TEST_ASSERT_EQUAL(0, count);
+
+	TEST_ASSERT_EQUAL(0, truncate(path, 4));
+	TEST_ASSERT_EQUAL(-EPROTO, irq_record_load(path, &records, &count));
+	TEST_ASSERT_EQUAL(-ENOENT, irq_record_load("/nonexistent/recording", &records, &count));
+}
+
+/** A recorder that isn't recording ignores everything. */
+void test_not_recording(void)
+{
+	r.fd = -1;
+	r.count = 0;
+	record(IRQ_RECORD_BUFFER * 2);
+	TEST_ASSERT_EQUAL(0, r.count);
+	TEST_ASSERT_EQUAL(0, irq_record_flush(&r));
+	TEST_ASSERT_EQUAL(0, irq_record_close(&r));
+	TEST_ASSERT_EQUAL(-ENOENT, irq_record_open(&r, "/nonexistent/recording", T0));
+	TEST_ASSERT_EQUAL(-1, r.fd);
+}
+
+int main(void)
+{
+	UnityBegin(__FILE__);
+	RUN_TEST(test_round_trip);
+	RUN_TEST(test_unfinished);
+	RUN_TEST(test_not_a_recording);
+	RUN_TEST(test_not_recording);
+	return UnityEnd();
+}
@@ -122,6 +122,92 @@ void test_setup(void) {
 	TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, irqs, 16);
 }
 
+/** A level stays registered until the last entry covering it goes. */
+void test_refcounts(void) {
+	struct v120irqd_selector st = {
+		.crate = (1 << 1), .irq = (1 << 3), .vector = 0xFFFFFFDE
+	};
+
+	TEST_ASSERT_EQUAL_HEX8(0x98, registered_irqs(1));
+	TEST_NOFAIL(release_interrupt(1, &st));
+	TEST_ASSERT_EQUAL_HEX8(0x98, registered_irqs(1));
+	st.vector = 0xFFFF0000;
+	TEST_NOFAIL(release_interrupt(1, &st));
+	TEST_ASSERT_EQUAL_HEX8(0x90, registered_irqs(1));
+
+	/* Everything of client 2's, including its ANYIRQ on crate 2. */
+	TEST_NOFAIL(release_all_interrupts(2));
+	TEST_ASSERT_EQUAL_HEX8(0x10, registered_irqs(1));
+	TEST_ASSERT_EQUAL_HEX8(0x90, registered_irqs(2));
+	TEST_ASSERT_EQUAL_HEX8(0x10, registered_irqs(15));
+
+	TEST_NOFAIL(release_all_interrupts(1));
+	for (int crate = 0; crate < 16; crate++) {
+		TEST_ASSERT_EQUAL_HEX8(0, registered_irqs(crate));
+	}
+}
+
+/** A client with lots of entries can come and go without upsetting others. */
+void test_heavy_client(void) {
+	struct v120irqd_selector st = {
+		.crate = (1 << 9), .irq = (1 << 6), .payload = 50
+	};
+	struct v120irqd_selector hit = { .crate = (1 << 9), .irq = (1 << 6) };
+	int i, round;
+
+	for (round = 0; round < 3; round++) {
+		/* Client 3's entries interleaved with client 4's. */
+		for (i = 0; i < 100; i++) {
+			st.vector = 0xFFFF0000 | i;
+			TEST_NOFAIL(register_interrupt(3 + (i % 2), &st));
+		}
+		TEST_ASSERT_EQUAL(108, count_registered_interrupts());
+
+		TEST_NOFAIL(release_all_interrupts(3));
+		TEST_ASSERT_EQUAL(58, count_registered_interrupts());
+		for (i = 0; i < 100; i++) {
+			hit.vector = 0xFFFF0000 | i;
+			TEST_ASSERT_EQUAL((i % 2) ? 4 : 0, find_interrupt(&hit));
+		}
+		run_testsuite(default_suite);
+
+		/* A more general entry added now still matches after the old ones. */
+		st.vector = ANYVECTOR;
+		TEST_NOFAIL(register_interrupt(5, &st));
+		hit.vector = 0xFFFF0001;
+		TEST_ASSERT_EQUAL(4, find_interrupt(&hit));
+		hit.vector = 0xFFFF0000;
+		TEST_ASSERT_EQUAL(5, find_interrupt(&hit));
+
+		TEST_NOFAIL(release_all_interrupts(5));
+		TEST_NOFAIL(release_all_interrupts(4));
+		TEST_ASSERT_EQUAL(8, count_registered_interrupts());
+		TEST_NOFAIL(release_all_interrupts(4));
+	}
+	run_testsuite(default_suite);
+	TEST_ASSERT_EQUAL_HEX8(0x98, registered_irqs(1));
+	TEST_ASSERT_EQUAL_HEX8(0x10, registered_irqs(9));
+}
+
+static bool skip_one(irqdata_t sd) {
+	return sd == 1;
+}
+
+/** The fallback is the next match that isn't passed over. */
+void test_fallback(void) {
+	struct v120irqd_selector hit = {
+		.crate = (1 << 1), .irq = (1 << 3), .vector = 0xFFFFFFDE
+	};
+	struct irq_target target;
+
+	/* Client 1's IRQ3 request, then its ANYCRATE IRQ4; nobody else. */
+	TEST_ASSERT_EQUAL(-EINVAL, find_interrupt_fallback(&hit, &target, skip_one));
+	TEST_NOFAIL(easy_register_interrupt(2, 1, ANYIRQ, ANYVECTOR, 9));
+	TEST_NOFAIL(find_interrupt_fallback(&hit, &target, skip_one));
+	TEST_ASSERT_EQUAL(2, target.data);
+	TEST_ASSERT_EQUAL(9, target.payload);
+}
+
 void test_addchecking(void) {
 	int ret;
 	syslog(LOG_ERR, "Expecting an error on the following line:");
@@ -191,7 +277,151 @@ void test_simpledelete(void) {
 	TEST_ASSERT_EQUAL(7, count_registered_interrupts());
 }
 
+/* Options ride along with their entry, and only their entry. */
+void test_options(void) {
+	struct v120irqd_selector st = {
+		.crate = (1 << 5),
+		.irq = (1 << 2),
+		.vector = ANYVECTOR,
+		.payload = 42
+	};
+	struct v120irqd_selector hit = {
+		.crate = (1 << 5),
+		.irq = (1 << 2),
+		.vector = 0xFFFF1234
+	};
+	void *options = malloc(16);
+	void *found = NULL;
+
+	TEST_NOFAIL(register_interrupt_opts(3, &st, options));
+	TEST_ASSERT_EQUAL(3, find_interrupt_opts(&hit, &found));
+	TEST_ASSERT_EQUAL_PTR(options, found);
+	TEST_ASSERT_EQUAL(42, hit.payload);
+
+	/* An entry registered without any has none. */
+	hit.crate = (1 << 1);
+	hit.irq = (1 << 3);
+	hit.vector = 0xFFFFFFDE;
+	TEST_ASSERT_EQUAL(1, find_interrupt_opts(&hit, &found));
+	TEST_ASSERT_NULL(found);
+
+	/* Releasing the entry frees the options; valgrind will tell. */
+	TEST_NOFAIL(release_interrupt(3, &st));
+	TEST_ASSERT_EQUAL(8, count_registered_interrupts());
+}
+
 /* Confirm that we are looking interrupts up successfully. */
+void test_shared(void) {
+	struct v120irqd_selector st = {
+		.crate = (1 << 6),
+		.irq = (1 << 5),
+		.vector = 0xFFFF5555,
+		.payload = 10
+	};
+	struct v120irqd_selector hit = {
+		.crate = (1 << 6),
+		.irq = (1 << 5),
+		.vector = 0xFFFF5555
+	};
+	struct irq_target targets[IRQ_TARGETS_MAX];
+	int i;
+
+	/* Subscribers stack up on the exact same selector, once apiece. */
+	for (i = 0; i < IRQ_TARGETS_MAX; i++) {
+		st.payload = 10 + i;
+		TEST_NOFAIL(register_interrupt_shared(20 + i, &st, NULL));
+	}
+	syslog(LOG_ERR, "Expecting errors on the following lines:");
+	TEST_ASSERT_EQUAL(-ENOSPC, register_interrupt_shared(99, &st, NULL));
+	TEST_ASSERT_EQUAL(-EADDRINUSE, register_interrupt_shared(20, &st, NULL));
+	TEST_ASSERT_EQUAL(-EADDRINUSE, register_interrupt(99, &st));
+
+	TEST_ASSERT_EQUAL(IRQ_TARGETS_MAX, find_interrupt_targets(&hit, targets));
+	for (i = 0; i < IRQ_TARGETS_MAX; i++) {
+		TEST_ASSERT_EQUAL(20 + i, targets[i].data);
+		TEST_ASSERT_EQUAL(10 + i, targets[i].payload);
+	}
+
+	/* Releasing one leaves the rest, in order. */
+	TEST_NOFAIL(release_interrupt(21, &st));
+	TEST_ASSERT_EQUAL(-EINVAL, release_interrupt(21, &st));
+	TEST_ASSERT_EQUAL(IRQ_TARGETS_MAX - 1, find_interrupt_targets(&hit, targets));
+	TEST_ASSERT_EQUAL(20, targets[0].data);
+	TEST_ASSERT_EQUAL(22, targets[1].data);
+
+	/* Unshared entries are only ever a single target. */
+	hit.crate = (1 << 1);
+	hit.irq = (1 << 3);
+	hit.vector = 0xFFFFFFDE;
+	TEST_ASSERT_EQUAL(1, find_interrupt_targets(&hit, targets));
+	TEST_ASSERT_EQUAL(1, targets[0].data);
+	hit.crate = (1 << 5);
+	hit.irq = (1 << 7);
+	hit.vector = 0x87654321;
+	TEST_ASSERT_EQUAL(-EINVAL, find_interrupt_targets(&hit, targets));
+
+	for (i = 0; i < IRQ_TARGETS_MAX; i++) {
+		if (i != 1) TEST_NOFAIL(release_interrupt(20 + i, &st));
+	}
+	TEST_ASSERT_EQUAL(8, count_registered_interrupts());
+}
+
+/* Collect the entries of the table, as walk_interrupts() sees them. */
+struct walk_t {
+	irqdata_t sd[16];
+	struct v120irqd_selector sel[16];
+	bool shared[16];
+	int n, stop;
+};
+
+static int walk_one(irqdata_t sd, const struct v120irqd_selector * request,
+	void * options, bool shared, void * arg)
+{
+	struct walk_t *w = arg;
+
+	w->sd[w->n] = sd;
+	w->sel[w->n] = *request;
+	w->shared[w->n] = shared;
+	w->n++;
+	return (w->n == w->stop) ? 99 : 0;
+}
+
+/* Walking the table and registering it all again gives the same table. */
+void test_walk(void) {
+	struct v120irqd_selector st = {
+		.crate = (1 << 6), .irq = (1 << 5), .vector = 0xFFFF5555, .payload = 10
+	};
+	struct walk_t w = {.n = 0};
+	int i;
+
+	/* Leave a hole, and a shared entry, for it to cope with. */
+	TEST_NOFAIL(register_interrupt_shared(3, &st, NULL));
+	st.crate = (1 << 1);
+	st.irq = (1 << 3);
+	st.vector = 0xFFFF0000;
+	TEST_NOFAIL(release_interrupt(1, &st));
+
+	TEST_NOFAIL(walk_interrupts(walk_one, &w));
+	TEST_ASSERT_EQUAL(8, w.n);
+	TEST_ASSERT_EQUAL(3, w.sd[7]);
+	TEST_ASSERT_TRUE(w.shared[7]);
+	TEST_ASSERT_FALSE(w.shared[0]);
+
+	free_all_interrupts();
+	for (i = 0; i < w.n; i++) {
+		if (w.shared[i])	TEST_NOFAIL(register_interrupt_shared(w.sd[i], &w.sel[i], NULL));
+		else				TEST_NOFAIL(register_interrupt(w.sd[i], &w.sel[i]));
+	}
+	run_testsuite_n(default_suite, 2);
+	run_testsuite_n(default_suite + 3, 7);
+
+	/* A walk can be cut short. */
+	w.n = 0;
+	w.stop = 2;
+	TEST_ASSERT_EQUAL(99, walk_interrupts(walk_one, &w));
+	TEST_ASSERT_EQUAL(2, w.n);
+}
+
 void test_simplelookup(void) {
 	run_testsuite(default_suite);
 }
@@ -205,6 +435,12 @@ int main(void) {
 	RUN_TEST(test_simpledelete);
 	RUN_TEST(test_simplelookup);
 	RUN_TEST(test_addchecking);
+	RUN_TEST(test_options);
+	RUN_TEST(test_shared);
+	RUN_TEST(test_walk);
+	RUN_TEST(test_refcounts);
+	RUN_TEST(test_heavy_client);
+	RUN_TEST(test_fallback);
 
 	RUN_TEST(test_resize);
 	return UnityEnd();
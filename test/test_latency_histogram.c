@@ -0,0 +1,97 @@
+/*
+ * Unit tests for the v120irqd latency histograms.
+ *
+ * This software is released under the Modified BSD License, and may be
+ * redistributed according to the terms stated in license.txt, which must
+ * be kept with this file.
+ */
+
+#include <string.h>
+
+#include "latency_histogram.h"
+
+#include "unity/unity.h"
+
+static latency_histogram h;
+
+void setUp(void) {
+	memset(&h, 0, sizeof(h));
+}
+
+void tearDown(void) {
+}
+
+/** An empty histogram reports zero for everything. */
+void test_empty(void)
+{
+	TEST_ASSERT_EQUAL(0, latency_percentile(&h, 500000));
+	TEST_ASSERT_EQUAL(0, latency_percentile(&h, 999000));
+	TEST_ASSERT_EQUAL(0, h.max);
+}
+
+/** Small values are recorded exactly. */
+void test_small_exact(void)
+{
+	for (int v = 0; v < LATENCY_SUB_COUNT; v++) {
+		latency_record(&h, v);
+	}
+	TEST_ASSERT_EQUAL(LATENCY_SUB_COUNT, h.total);
+	TEST_ASSERT_EQUAL(LATENCY_SUB_COUNT/2 - 1, latency_percentile(&h, 500000));
+	TEST_ASSERT_EQUAL(LATENCY_SUB_COUNT - 1, latency_percentile(&h, 1000000));
+}
+
+/** Percentiles of a uniform spread land within the bucket resolution. */
+void test_uniform_spread(void)
+{
+	const uint64_t tolerance = 1000000 / LATENCY_SUB_COUNT;
+	uint64_t p50, p99, p999;
+
+	for (uint64_t v = 1; v <= 1000000; v++) {
+		latency_record(&h, v * 1000);
+	}
+
+	p50 = latency_percentile(&h, 500000);
+	p99 = latency_percentile(&h, 990000);
+	p999 = latency_percentile(&h, 999000);
+
+	/* Each result is the top of its bucket, so never low, and never more
+	 * than one bucket width high.
+	 */
+	TEST_ASSERT(p50 >= 500000000 && p50 <= 500000000 + 500 * tolerance);
+	TEST_ASSERT(p99 >= 990000000 && p99 <= 990000000 + 990 * tolerance);
+	TEST_ASSERT(p999 >= 999000000 && p999 <= h.max);
+	TEST_ASSERT(p50 <= p99 && p99 <= p999);
+	TEST_ASSERT(h.max == 1000000000);
+}
+
+/** Enormous values are clamped into the top bucket but keep an exact max. */
+void test_overflow(void)
+{
+	latency_record(&h, UINT64_MAX);
+	TEST_ASSERT_EQUAL(1, h.counts[LATENCY_BUCKETS - 1]);
+	TEST_ASSERT(h.max == UINT64_MAX);
+}
+
+/** Merging is the same as recording everything into one histogram. */
+void test_merge(void)
+{
+	latency_histogram other = {0};
+
+	latency_record(&h, 100);
+	latency_record(&other, 100000);
+	latency_merge(&h, &other);
+	TEST_ASSERT_EQUAL(2, h.total);
+	TEST_ASSERT_EQUAL(100000, h.max);
+	TEST_ASSERT(latency_percentile(&h, 500000) >= 100);
+	TEST_ASSERT(latency_percentile(&h, 500000) < 100 + 100 / LATENCY_SUB_COUNT);
+}
+
+int main(void) {
+	UnityBegin(__FILE__);
+	RUN_TEST(test_empty);
+	RUN_TEST(test_small_exact);
+	RUN_TEST(test_uniform_spread);
+	RUN_TEST(test_overflow);
+	RUN_TEST(test_merge);
+	return UnityEnd();
+}
@@ -0,0 +1,193 @@
+/*
+ * Unit tests for the in-process (V120IRQD_LOCAL) dispatcher.
+ *
+ * These run on fake interrupts, so they don't need any crates attached.
+ *
+ * This software is released under the Modified BSD License, and may be
+ * redistributed according to the terms stated in license.txt, which must
+ * be kept with this file.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "v120irqd.h"
+#include "unity/unity.h"
+
+static int sock;
+
+void setUp(void)
+{
+	sock = v120irqd_client(V120IRQD_LOCAL);
+	TEST_ASSERT_MESSAGE(sock >= 0, "Couldn't open local connection");
+}
+
+void tearDown(void)
+{
+	TEST_ASSERT_EQUAL(0, v120irqd_close(sock));
+}
+
+/* Only the one local connection at a time. */
+void test_single_instance(void)
+{
+	struct v120irqd_serverstatus status;
+
+	TEST_ASSERT_EQUAL(-1, v120irqd_client(V120IRQD_LOCAL));
+	TEST_ASSERT_EQUAL(EBUSY, errno);
+
+	TEST_ASSERT_EQUAL(0, v120irqd_status(sock, &status));
+	TEST_ASSERT_EQUAL(getpid(), status.pid);
+	TEST_ASSERT_EQUAL(1, status.clients);
+	TEST_ASSERT_EQUAL(0, status.irq_requests);
+}
+
+/* The same rules as the server for what can be requested and released. */
+void test_requests(void)
+{
+	struct v120irqd_selector specific = {
+		.crate = 1 << 3, .irq = 1 << 5, .vector = 0xFFFFFF10, .payload = 1
+	};
+	struct v120irqd_selector general = {
+		.crate = ANYCRATE, .irq = ANYIRQ, .vector = ANYVECTOR, .payload = 2
+	};
+	struct v120irqd_selector bad = {
+		.crate = 0, .irq = 1 << 5, .vector = ANYVECTOR
+	};
+	struct v120irqd_serverstatus status;
+
+	TEST_ASSERT_EQUAL(-EPERM, v120irqd_request(sock, &bad));
+	TEST_ASSERT_EQUAL(0, v120irqd_request(sock, &specific));
+	TEST_ASSERT_EQUAL(0, v120irqd_request(sock, &general));
+	TEST_ASSERT_EQUAL(-EPERM, v120irqd_request(sock, &specific));
+
+	TEST_ASSERT_EQUAL(0, v120irqd_status(sock, &status));
+	TEST_ASSERT_EQUAL(2, status.irq_requests);
+
+	specific.vector = ANYVECTOR;
+	TEST_ASSERT_EQUAL(-EPERM, v120irqd_release(sock, &specific));
+	specific.vector = 0xFFFFFF10;
+	TEST_ASSERT_EQUAL(0, v120irqd_release(sock, &specific));
+	TEST_ASSERT_EQUAL(0, v120irqd_release(sock, &general));
+}
+
+/* Fake interrupts go to the first matching request, in order. */
+void test_getinterrupt(void)
+{
+	struct v120irqd_selector specific = {
+		.crate = 1 << 3, .irq = 1 << 5, .vector = 0xFFFFFF10, .payload = 1
+	};
+	struct v120irqd_selector general = {
+		.crate = ANYCRATE, .irq = ANYIRQ, .vector = ANYVECTOR, .payload = 2
+	};
+	struct v120irqd_selector fake = {
+		.crate = 1 << 3, .irq = 1 << 5, .vector = 0xFFFFFF10
+	};
+	struct v120irqd_selector got;
+	struct pollfd pfd = { .fd = sock, .events = POLLIN };
+
+	TEST_ASSERT_EQUAL(0, v120irqd_request(sock, &specific));
+	TEST_ASSERT_EQUAL(0, v120irqd_request(sock, &general));
+
+	/* Nothing's pending on the hardware side. */
+	TEST_ASSERT_EQUAL(0, poll(&pfd, 1, 0));
+
+	TEST_ASSERT_EQUAL(0, v120irqd_interrupt(sock, &fake));
+	fake.vector = 0xFFFFFF11;
+	TEST_ASSERT_EQUAL(0, v120irqd_interrupt(sock, &fake));
+
+	TEST_ASSERT_EQUAL(0, v120irqd_getinterrupt(sock, &got));
+	TEST_ASSERT_EQUAL_HEX32(0xFFFFFF10, got.vector);
+	TEST_ASSERT_EQUAL(1, got.payload);
+	TEST_ASSERT_EQUAL(0, v120irqd_ack(sock));
+
+	TEST_ASSERT_EQUAL(0, v120irqd_getinterrupt(sock, &got));
+	TEST_ASSERT_EQUAL_HEX32(0xFFFFFF11, got.vector);
+	TEST_ASSERT_EQUAL(2, got.payload);
+	TEST_ASSERT_EQUAL(0, v120irqd_nak(sock));
+
+	/* Nothing left to answer for. */
+	TEST_ASSERT_EQUAL(-EPROTO, v120irqd_ack(sock));
+}
+
+static void count_handler(const struct v120irqd_selector *sel, void *arg)
+{
+	unsigned int *total = arg;
+	*total += sel->payload;
+}
+
+/* Callbacks get everything that's been found, and ACK as they go. */
+void test_dispatch(void)
+{
+	struct v120irqd_selector req = {
+		.crate = ANYCRATE, .irq = ANYIRQ, .vector = ANYVECTOR, .payload = 10
+	};
+	struct v120irqd_selector fake = {
+		.crate = 1 << 0, .irq = 1 << 2, .vector = 0xFFFF1234
+	};
+	unsigned int total = 0;
+	int i;
+
+	TEST_ASSERT_EQUAL(-EBADF, v120irqd_local_dispatch(sock + 100, count_handler, &total, 0));
+
+	TEST_ASSERT_EQUAL(0, v120irqd_local_dispatch(sock, count_handler, &total, 0));
+	TEST_ASSERT_EQUAL(0, v120irqd_request(sock, &req));
+	for (i = 0; i < 3; i++) {
+		TEST_ASSERT_EQUAL(0, v120irqd_interrupt(sock, &fake));
+	}
+	TEST_ASSERT_EQUAL(3, v120irqd_local_dispatch(sock, count_handler, &total, -1));
+	TEST_ASSERT_EQUAL(30, total);
+	TEST_ASSERT_EQUAL(-EPROTO, v120irqd_ack(sock));
+}
+
+/* Dispatch leaves what v120irqd_getinterrupt() handed out to be answered. */
+void test_dispatch_outstanding(void)
+{
+	struct v120irqd_selector req = {
+		.crate = ANYCRATE, .irq = ANYIRQ, .vector = ANYVECTOR, .payload = 10
+	};
+	struct v120irqd_selector fake = {
+		.crate = 1 << 0, .irq = 1 << 2, .vector = 0xFFFF1234
+	};
+	struct v120irqd_selector got;
+	unsigned int total = 0;
+
+	TEST_ASSERT_EQUAL(0, v120irqd_request(sock, &req));
+	TEST_ASSERT_EQUAL(0, v120irqd_interrupt(sock, &fake));
+	TEST_ASSERT_EQUAL(0, v120irqd_getinterrupt(sock, &got));
+
+	fake.vector = 0xFFFF1235;
+	TEST_ASSERT_EQUAL(0, v120irqd_interrupt(sock, &fake));
+	TEST_ASSERT_EQUAL(1, v120irqd_local_dispatch(sock, count_handler, &total, 0));
+	TEST_ASSERT_EQUAL(10, total);
+
+	TEST_ASSERT_EQUAL(0, v120irqd_ack(sock));
+	TEST_ASSERT_EQUAL(-EPROTO, v120irqd_ack(sock));
+}
+
+/* A timeout is the whole wait, not each of the waits that make it up. */
+void test_dispatch_timeout(void)
+{
+	struct timespec t0, t1;
+	unsigned int total = 0;
+	long ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	TEST_ASSERT_EQUAL(0, v120irqd_local_dispatch(sock, count_handler, &total, 50));
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	ms = (t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec) / 1000000;
+	TEST_ASSERT(ms >= 40 && ms < 1000);
+}
+
+int main(void)
+{
+	UnityBegin(__FILE__);
+	RUN_TEST(test_single_instance);
+	RUN_TEST(test_requests);
+	RUN_TEST(test_getinterrupt);
+	RUN_TEST(test_dispatch);
+	RUN_TEST(test_dispatch_outstanding);
+	RUN_TEST(test_dispatch_timeout);
+	return UnityEnd();
+}
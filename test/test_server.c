@@ -12,20 +12,34 @@
 
 #include <errno.h>
 #include <poll.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "v120irqd.h"
+#include "config.h"
 
 #include "unity/unity.h"
 
+#ifndef HAVE_LIBPTHREAD
+#  define HAVE_LIBPTHREAD 0
+#endif
+#if HAVE_LIBPTHREAD
+#  include <pthread.h>
+#endif
+
 #define SAFETY_ALARM 2
 #define KILL_EXISTING_SERVER 1
 #define USESOCKET NULL
+/* The SCHED_FIFO priority the server under test is started with */
+#define SERVER_PRIORITY 1
+#define STRINGIFY(x) #x
+#define TOSTRING(x) STRINGIFY(x)
 
 /**********************************************************************
  * Test suite
@@ -343,6 +357,707 @@ void test_irq_receipt(void)
 	}
 }
 
+/** Confirm feature negotiation, and batched receipt on a negotiated client. */
+void test_batch_receipt(void)
+{
+	struct v120irqd_selector req = {
+		.crate = BIT(6), .irq = BIT(2), .vector = ANYVECTOR, .payload = 77
+	};
+	struct v120irqd_selector got[V120IRQD_BATCH_MAX];
+	unsigned int features = ~0u;
+	int sock, n;
+
+	sock = v120irqd_client(USESOCKET);
+	TEST_ASSERT(sock >= 0);
+	TEST_NOFAIL(v120irqd_negotiate(sock, &features));
+	TEST_ASSERT_EQUAL_HEX(V120IRQD_FEATURE_BATCH, features & V120IRQD_FEATURE_BATCH);
+	TEST_NOFAIL(v120irqd_request(sock, &req));
+
+	/* Too small a buffer is refused before anything is read. */
+	TEST_ASSERT_EQUAL(-EINVAL, v120irqd_getinterrupts(sock, got, 1));
+
+	req.vector = 0x0BADCAFE;
+	alarm(SAFETY_ALARM);
+	TEST_NOFAIL(v120irqd_interrupt(fds[0].fd, &req));
+	n = v120irqd_getinterrupts(sock, got, V120IRQD_BATCH_MAX);
+	alarm(0);
+	TEST_ASSERT_EQUAL(1, n);
+	TEST_NOFAIL(v120irqd_ack_many(sock, n));
+
+	TEST_ASSERT_EQUAL_HEX16(BIT(6), got[0].crate);
+	TEST_ASSERT_EQUAL_HEX8(BIT(2), got[0].irq);
+	TEST_ASSERT_EQUAL_HEX32(0x0BADCAFE, got[0].vector);
+	TEST_ASSERT_EQUAL(77, got[0].payload);
+	close(sock);
+}
+
+static uint64_t raw_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/** Confirm that timestamped events carry their detection time and sequence. */
+void test_timestamped_events(void)
+{
+	struct v120irqd_selector req = {
+		.crate = BIT(15), .irq = BIT(6), .vector = ANYVECTOR, .payload = 88
+	};
+	struct v120irqd_event ev[V120IRQD_BATCH_MAX];
+	unsigned int features = V120IRQD_FEATURE_TIMESTAMP;
+	uint64_t t0, t1;
+	uint32_t seq = 0;
+	int sock, n, i;
+
+	sock = v120irqd_client(USESOCKET);
+	TEST_ASSERT(sock >= 0);
+	TEST_NOFAIL(v120irqd_negotiate(sock, &features));
+	TEST_ASSERT_EQUAL_HEX(V120IRQD_FEATURE_TIMESTAMP, features);
+	TEST_NOFAIL(v120irqd_request(sock, &req));
+	TEST_ASSERT_EQUAL(-EINVAL, v120irqd_getevents(sock, ev, 1));
+
+	for (i = 0; i < 2; i++) {
+		req.vector = 0xE0E0E000 + i;
+		t0 = raw_now();
+		alarm(SAFETY_ALARM);
+		TEST_NOFAIL(v120irqd_interrupt(fds[0].fd, &req));
+		n = v120irqd_getevents(sock, ev, V120IRQD_BATCH_MAX);
+		alarm(0);
+		t1 = raw_now();
+		TEST_ASSERT_EQUAL(1, n);
+		TEST_NOFAIL(v120irqd_ack(sock));
+
+		TEST_ASSERT_EQUAL_HEX16(BIT(15), ev[0].sel.crate);
+		TEST_ASSERT_EQUAL_HEX8(BIT(6), ev[0].sel.irq);
+		TEST_ASSERT_EQUAL_HEX32(0xE0E0E000 + i, ev[0].sel.vector);
+		TEST_ASSERT_EQUAL(88, ev[0].sel.payload);
+		TEST_ASSERT_EQUAL_HEX(V120IRQD_EVENT_FAKE, ev[0].flags);
+		TEST_ASSERT(ev[0].t_detect >= t0 && ev[0].t_detect <= t1);
+		if (i > 0) TEST_ASSERT_EQUAL_UINT32(seq + 1, ev[0].seq);
+		seq = ev[0].seq;
+	}
+
+	/* The plain calls still work, without the timing. */
+	req.vector = 0xE0E0E0FF;
+	alarm(SAFETY_ALARM);
+	TEST_NOFAIL(v120irqd_interrupt(fds[0].fd, &req));
+	TEST_NOFAIL(v120irqd_getinterrupt(sock, &req));
+	alarm(0);
+	TEST_NOFAIL(v120irqd_ack(sock));
+	TEST_ASSERT_EQUAL_HEX32(0xE0E0E0FF, req.vector);
+	close(sock);
+}
+
+/** Confirm that requests with a clear action are delivered without waiting. */
+void test_clear_action(void)
+{
+	struct v120irqd_selector req = {
+		.crate = BIT(9), .irq = BIT(6), .vector = ANYVECTOR, .payload = 99
+	};
+	struct v120irqd_clear clear = {
+		.address = 0x1002, .value = 0x80, .space = V120IRQD_A16, .width = 2
+	};
+	struct v120irqd_serverstatus status;
+	unsigned int features = 0;
+	int sock, i;
+
+	sock = v120irqd_client(USESOCKET);
+	TEST_ASSERT(sock >= 0);
+
+	/* Not without negotiating for it. */
+	TEST_ASSERT_EQUAL(-EPERM, v120irqd_request_clear(sock, &req, &clear));
+	features = V120IRQD_FEATURE_CLEAR;
+	TEST_NOFAIL(v120irqd_negotiate(sock, &features));
+	TEST_ASSERT_EQUAL_HEX(V120IRQD_FEATURE_CLEAR, features);
+
+	/* Misaligned and out of range clear registers are refused. */
+	clear.address = 0x1001;
+	TEST_ASSERT_EQUAL(-EPERM, v120irqd_request_clear(sock, &req, &clear));
+	clear.address = 0x11000;
+	TEST_ASSERT_EQUAL(-EPERM, v120irqd_request_clear(sock, &req, &clear));
+	clear.address = 0x1002;
+	TEST_NOFAIL(v120irqd_request_clear(sock, &req, &clear));
+
+	/* Several at once; the server doesn't wait for the ACKs in between. */
+	req.vector = 0xFFFF0042;
+	alarm(SAFETY_ALARM);
+	for (i = 0; i < 3; i++) {
+		TEST_NOFAIL(v120irqd_interrupt(fds[0].fd, &req));
+	}
+	for (i = 0; i < 3; i++) {
+		TEST_NOFAIL(v120irqd_getinterrupt(sock, &req));
+		TEST_ASSERT_EQUAL(99, req.payload);
+		TEST_ASSERT_EQUAL_HEX32(0xFFFF0042, req.vector);
+		TEST_NOFAIL(v120irqd_ack(sock));
+	}
+
+	/* And the ACKs were soaked up rather than taken for anything else. */
+	TEST_NOFAIL(v120irqd_status(sock, &status));
+	alarm(0);
+	TEST_ASSERT_EQUAL(total_requests() + 1, status.irq_requests);
+	close(sock);
+}
+
+/** Confirm that DMA requests share a buffer that's filled before delivery. */
+void test_dma_readout(void)
+{
+	struct v120irqd_selector req = {
+		.crate = BIT(10), .irq = BIT(4), .vector = ANYVECTOR, .payload = 55
+	};
+	struct v120irqd_dma dma = {
+		.address = 0x200000, .flags = 0, .length = 256
+	};
+	struct v120irqd_dmabuf buf;
+	struct v120irqd_serverstatus status;
+	unsigned int features = 0;
+	int sock;
+
+	sock = v120irqd_client(USESOCKET);
+	TEST_ASSERT(sock >= 0);
+
+	/* Not without negotiating for it. */
+	TEST_ASSERT_EQUAL(-EPERM, v120irqd_request_dma(sock, &req, &dma, &buf));
+	features = V120IRQD_FEATURE_DMA;
+	TEST_NOFAIL(v120irqd_negotiate(sock, &features));
+	TEST_ASSERT_EQUAL_HEX(V120IRQD_FEATURE_DMA, features);
+
+	/* Nor with an unreasonable length. */
+	dma.length = 0;
+	TEST_ASSERT_EQUAL(-EPERM, v120irqd_request_dma(sock, &req, &dma, &buf));
+	dma.length = V120IRQD_DMA_MAX + 1;
+	TEST_ASSERT_EQUAL(-EPERM, v120irqd_request_dma(sock, &req, &dma, &buf));
+	dma.length = 256;
+
+	/* Nor for more than one level, which could fill the slot twice at once. */
+	req.irq = BIT(4) | BIT(5);
+	TEST_ASSERT_EQUAL(-EPERM, v120irqd_request_dma(sock, &req, &dma, &buf));
+	req.irq = BIT(4);
+	TEST_NOFAIL(v120irqd_request_dma(sock, &req, &dma, &buf));
+	TEST_ASSERT(buf.size >= 256);
+	TEST_ASSERT_EQUAL(0, buf.slot->sequence);
+
+	/* There's no crate 10, so the slot is updated but reports the failure. */
+	req.vector = 0xFFFF0099;
+	alarm(SAFETY_ALARM);
+	TEST_NOFAIL(v120irqd_interrupt(fds[0].fd, &req));
+	TEST_NOFAIL(v120irqd_getinterrupt(sock, &req));
+	alarm(0);
+	TEST_ASSERT_EQUAL(55, req.payload);
+	TEST_ASSERT_EQUAL(2, buf.slot->sequence);
+	TEST_ASSERT_EQUAL_HEX32(0xFFFF0099, buf.slot->selector.vector);
+	TEST_ASSERT_EQUAL(-ENODEV, buf.slot->status);
+	TEST_ASSERT_EQUAL(0, buf.slot->length);
+
+	/* Until that's answered the slot is left alone, even as the client falls
+	 * behind and is sent more.
+	 */
+	req.vector = 0xFFFF009A;
+	alarm(SAFETY_ALARM);
+	TEST_NOFAIL(v120irqd_interrupt(fds[0].fd, &req));
+	TEST_NOFAIL(v120irqd_getinterrupt(sock, &req));
+	alarm(0);
+	TEST_ASSERT_EQUAL_HEX32(0xFFFF009A, req.vector);
+	TEST_ASSERT_EQUAL(2, buf.slot->sequence);
+	TEST_ASSERT_EQUAL_HEX32(0xFFFF0099, buf.slot->selector.vector);
+	TEST_NOFAIL(v120irqd_ack(sock));
+	TEST_NOFAIL(v120irqd_ack(sock));
+	TEST_NOFAIL(v120irqd_status(sock, &status));
+
+	/* Once it's caught up, it gets fresh data again. */
+	req.vector = 0xFFFF009B;
+	alarm(SAFETY_ALARM);
+	TEST_NOFAIL(v120irqd_interrupt(fds[0].fd, &req));
+	TEST_NOFAIL(v120irqd_getinterrupt(sock, &req));
+	alarm(0);
+	TEST_ASSERT_EQUAL(4, buf.slot->sequence);
+	TEST_ASSERT_EQUAL_HEX32(0xFFFF009B, buf.slot->selector.vector);
+	TEST_NOFAIL(v120irqd_ack(sock));
+
+	req.vector = ANYVECTOR;
+	TEST_NOFAIL(v120irqd_release(sock, &req));
+	TEST_NOFAIL(v120irqd_unmap_dma(&buf));
+	close(sock);
+}
+
+/** Confirm that shared subscriptions all get the interrupt. */
+void test_fanout(void)
+{
+	struct v120irqd_selector req = {
+		.crate = BIT(11), .irq = BIT(2), .vector = 0xFFFF00AA
+	};
+	struct v120irqd_subscription sub = {
+		.role = V120IRQD_CONSUMER, .policy = V120IRQD_ACK_FIRST
+	};
+	struct v120irqd_selector own = {
+		.crate = BIT(11), .irq = BIT(5), .vector = 0xFFFF00AB, .payload = 103
+	};
+	struct v120irqd_selector fallback = {
+		.crate = BIT(11), .irq = BIT(5), .vector = ANYVECTOR, .payload = 104
+	};
+	struct v120irqd_serverstatus status;
+	struct v120irqd_selector got;
+	unsigned int features;
+	int sock[3], i;
+
+	for (i = 0; i < 3; i++) {
+		sock[i] = v120irqd_client(USESOCKET);
+		TEST_ASSERT(sock[i] >= 0);
+	}
+
+	/* Not without negotiating for it. */
+	TEST_ASSERT_EQUAL(-EPERM, v120irqd_subscribe(sock[0], &req, &sub));
+	for (i = 0; i < 3; i++) {
+		features = V120IRQD_FEATURE_FANOUT;
+		TEST_NOFAIL(v120irqd_negotiate(sock[i], &features));
+		TEST_ASSERT_EQUAL_HEX(V120IRQD_FEATURE_FANOUT, features);
+	}
+
+	/* Two consumers and an observer, which must all agree on the policy. */
+	req.payload = 100;
+	TEST_NOFAIL(v120irqd_subscribe(sock[0], &req, &sub));
+	req.payload = 101;
+	TEST_NOFAIL(v120irqd_subscribe(sock[1], &req, &sub));
+	TEST_ASSERT_EQUAL(-EPERM, v120irqd_subscribe(sock[1], &req, &sub));
+	sub.role = V120IRQD_OBSERVER;
+	sub.policy = V120IRQD_ACK_ALL;
+	req.payload = 102;
+	TEST_ASSERT_EQUAL(-EPERM, v120irqd_subscribe(sock[2], &req, &sub));
+	sub.policy = V120IRQD_ACK_FIRST;
+	TEST_NOFAIL(v120irqd_subscribe(sock[2], &req, &sub));
+
+	/* Shared or not, subscriptions can't overlap ordinary requests. */
+	TEST_ASSERT_EQUAL(-EPERM, v120irqd_request(fds[0].fd, &req));
+
+	/* Everyone has it before anyone has ACKed. */
+	alarm(SAFETY_ALARM);
+	TEST_NOFAIL(v120irqd_interrupt(fds[0].fd, &req));
+	for (i = 2; i >= 0; i--) {
+		TEST_NOFAIL(v120irqd_getinterrupt(sock[i], &got));
+		TEST_ASSERT_EQUAL_HEX32(0xFFFF00AA, got.vector);
+		TEST_ASSERT_EQUAL(100 + i, got.payload);
+	}
+	/* Only the consumers answer; observers are never owed anything. */
+	for (i = 0; i < 2; i++) {
+		TEST_NOFAIL(v120irqd_ack(sock[i]));
+	}
+
+	/* The spare ACKs were soaked up rather than taken for anything else. */
+	for (i = 0; i < 3; i++) {
+		TEST_NOFAIL(v120irqd_status(sock[i], &status));
+	}
+	alarm(0);
+	TEST_ASSERT_EQUAL(total_requests() + 3, status.irq_requests);
+
+	/* Releasing one subscription leaves the others. */
+	TEST_NOFAIL(v120irqd_release(sock[1], &req));
+	TEST_NOFAIL(v120irqd_status(sock[0], &status));
+	TEST_ASSERT_EQUAL(total_requests() + 2, status.irq_requests);
+
+	/* Long after the ACK timeout, the observer isn't taken for slow, so its
+	 * own requests still come to it rather than to the fallback.
+	 */
+	TEST_NOFAIL(v120irqd_request(sock[2], &own));
+	TEST_NOFAIL(v120irqd_request(sock[0], &fallback));
+	usleep(600 * 1000);
+	alarm(SAFETY_ALARM);
+	TEST_NOFAIL(v120irqd_interrupt(fds[0].fd, &own));
+	TEST_NOFAIL(v120irqd_getinterrupt(sock[2], &got));
+	TEST_ASSERT_EQUAL(103, got.payload);
+	TEST_NOFAIL(v120irqd_ack(sock[2]));
+	TEST_NOFAIL(v120irqd_status(sock[2], &status));
+	alarm(0);
+
+	for (i = 0; i < 3; i++) {
+		close(sock[i]);
+	}
+}
+
+/** Confirm that a client that stops answering can't hold the server up. */
+void test_slow_client(void)
+{
+	struct v120irqd_selector req = {
+		.crate = BIT(12), .irq = BIT(3), .vector = 0xFFFF00BB, .payload = 1
+	};
+	struct v120irqd_selector fallback = {
+		.crate = BIT(12), .irq = BIT(3), .vector = ANYVECTOR, .payload = 2
+	};
+	struct v120irqd_serverstatus status;
+	struct v120irqd_selector got;
+	int slow, other;
+
+	slow = v120irqd_client(USESOCKET);
+	other = v120irqd_client(USESOCKET);
+	TEST_ASSERT(slow >= 0 && other >= 0);
+	TEST_NOFAIL(v120irqd_request(slow, &req));
+	TEST_NOFAIL(v120irqd_request(other, &fallback));
+
+	/* Nobody reads the first one, and the server gives up on it. */
+	alarm(SAFETY_ALARM);
+	TEST_NOFAIL(v120irqd_interrupt(fds[0].fd, &req));
+	TEST_NOFAIL(v120irqd_status(fds[0].fd, &status));
+
+	/* So the next goes to the fallback instead. */
+	TEST_NOFAIL(v120irqd_interrupt(fds[0].fd, &req));
+	TEST_NOFAIL(v120irqd_getinterrupt(other, &got));
+	TEST_ASSERT_EQUAL(2, got.payload);
+	TEST_NOFAIL(v120irqd_ack(other));
+
+	/* Until the slow client catches up. */
+	TEST_NOFAIL(v120irqd_getinterrupt(slow, &got));
+	TEST_ASSERT_EQUAL(1, got.payload);
+	TEST_NOFAIL(v120irqd_ack(slow));
+	TEST_NOFAIL(v120irqd_status(slow, &status));
+	TEST_NOFAIL(v120irqd_interrupt(fds[0].fd, &req));
+	TEST_NOFAIL(v120irqd_getinterrupt(slow, &got));
+	TEST_ASSERT_EQUAL(1, got.payload);
+	TEST_NOFAIL(v120irqd_ack(slow));
+	alarm(0);
+
+	close(slow);
+	close(other);
+}
+
+#if HAVE_LIBPTHREAD
+
+#define SHARE_THREADS	4
+#define SHARE_ROUNDS	25
+#define SHARE_IRQS		20
+
+/* The connection all the threads share. */
+static int shared;
+
+/**
+ * struct share_job - What one thread on the shared connection is to do.
+ * @n:		Interrupts to take, or the thread number for requests.
+ * @err:	The first thing that went wrong, or 0.
+ */
+struct share_job {
+	int n;
+	int err;
+};
+
+/* Take and ACK @n interrupts, which should all have payload 7. */
+static void * share_irqs(void *arg)
+{
+	struct share_job *job = arg;
+	struct v120irqd_selector got;
+
+	for (int i = 0; i < job->n && job->err == 0; i++) {
+		job->err = v120irqd_getinterrupt(shared, &got);
+		if (job->err == 0 && got.payload != 7) job->err = -EBADMSG;
+		if (job->err == 0) job->err = v120irqd_ack(shared);
+	}
+	return NULL;
+}
+
+/* Request, query and release, over and over. */
+static void * share_requests(void *arg)
+{
+	struct share_job *job = arg;
+	struct v120irqd_serverstatus status;
+	struct v120irqd_selector req = {
+		.crate = BIT(13), .irq = BIT(4), .payload = job->n
+	};
+
+	for (int i = 0; i < SHARE_ROUNDS && job->err == 0; i++) {
+		req.vector = 0xFFFF0000 | (job->n * SHARE_ROUNDS + i);
+		job->err = v120irqd_request(shared, &req);
+		if (job->err == 0) job->err = v120irqd_status(shared, &status);
+		if (job->err == 0) job->err = v120irqd_release(shared, &req);
+	}
+	return NULL;
+}
+
+/** Confirm that threads can share a connection without mixing anything up. */
+void test_shared_connection(void)
+{
+	struct v120irqd_selector req = {
+		.crate = BIT(13), .irq = BIT(2), .vector = ANYVECTOR, .payload = 7
+	};
+	struct v120irqd_selector fake = {
+		.crate = BIT(13), .irq = BIT(2), .vector = 0xFFFF1234
+	};
+	struct v120irqd_serverstatus before, after;
+	struct share_job irqs, jobs[SHARE_THREADS];
+	pthread_t irq_thread, threads[SHARE_THREADS];
+	unsigned int features = V120IRQD_FEATURE_MUX;
+	int i;
+
+	shared = v120irqd_client(USESOCKET);
+	TEST_ASSERT(shared >= 0);
+	TEST_NOFAIL(v120irqd_negotiate(shared, &features));
+	TEST_ASSERT_EQUAL_HEX(V120IRQD_FEATURE_MUX, features);
+	TEST_NOFAIL(v120irqd_request(shared, &req));
+
+	/* An interrupt in the way of a reply is kept for the thread that wants
+	 * it, and the server holds the reply until it's been ACKed.
+	 */
+	alarm(SAFETY_ALARM);
+	irqs.n = 1;
+	irqs.err = 0;
+	TEST_ASSERT_EQUAL(0, pthread_create(&irq_thread, NULL, share_irqs, &irqs));
+	TEST_NOFAIL(v120irqd_interrupt(fds[0].fd, &fake));
+	TEST_NOFAIL(v120irqd_status(shared, &before));
+	pthread_join(irq_thread, NULL);
+	alarm(0);
+	TEST_NOFAIL(irqs.err);
+
+	/* Requests from every thread at once, with interrupts going through. */
+	alarm(SAFETY_ALARM);
+	irqs.n = SHARE_IRQS;
+	TEST_ASSERT_EQUAL(0, pthread_create(&irq_thread, NULL, share_irqs, &irqs));
+	for (i = 0; i < SHARE_THREADS; i++) {
+		jobs[i].n = i;
+		jobs[i].err = 0;
+		TEST_ASSERT_EQUAL(0, pthread_create(&threads[i], NULL, share_requests, &jobs[i]));
+	}
+	for (i = 0; i < SHARE_IRQS; i++) {
+		TEST_NOFAIL(v120irqd_interrupt(fds[0].fd, &fake));
+	}
+	for (i = 0; i < SHARE_THREADS; i++) {
+		pthread_join(threads[i], NULL);
+		TEST_NOFAIL(jobs[i].err);
+	}
+	pthread_join(irq_thread, NULL);
+	alarm(0);
+	TEST_NOFAIL(irqs.err);
+
+	TEST_NOFAIL(v120irqd_status(shared, &after));
+	TEST_ASSERT_EQUAL(before.irq_requests, after.irq_requests);
+	TEST_NOFAIL(v120irqd_release(shared, &req));
+	TEST_NOFAIL(v120irqd_close(shared));
+}
+
+#else
+
+void test_shared_connection(void)
+{
+	TEST_IGNORE_MESSAGE("Shared connections need pthreads");
+}
+
+#endif
+
+/* What the callbacks of test_async_client() have seen. */
+static int async_done, async_err, async_irqs;
+
+static void async_completion(int err, const struct v120irqd_selector *sel, void *arg)
+{
+	async_done++;
+	async_err = err;
+}
+
+static void async_irq(const struct v120irqd_selector *sel, void *arg)
+{
+	if (arg == &async_irqs && sel->payload == 66) async_irqs++;
+}
+
+/* Wait and dispatch until @counter reaches @n. */
+static void async_pump(struct v120irqd_async *ctx, int *counter, int n)
+{
+	struct pollfd pfd = { .fd = v120irqd_async_fd(ctx), .events = POLLIN };
+
+	alarm(SAFETY_ALARM);
+	while (*counter < n) {
+		TEST_ASSERT_EQUAL(1, poll(&pfd, 1, -1));
+		TEST_ASSERT(v120irqd_dispatch(ctx) >= 0);
+	}
+	alarm(0);
+}
+
+/** Confirm that an event loop can drive a connection without blocking. */
+void test_async_client(void)
+{
+	struct v120irqd_selector req = {
+		.crate = BIT(14), .irq = BIT(5), .vector = ANYVECTOR, .payload = 66
+	};
+	struct v120irqd_selector fake = {
+		.crate = BIT(14), .irq = BIT(5), .vector = 0xFFFF0066
+	};
+	struct v120irqd_selector taken = {
+		.crate = BIT(0), .irq = BIT(3), .vector = ANYVECTOR, .payload = 67
+	};
+	struct v120irqd_async *ctx;
+
+	ctx = v120irqd_async_open(USESOCKET);
+	if (ctx == NULL && errno == EOPNOTSUPP) {
+		TEST_IGNORE_MESSAGE("Asynchronous clients need pthreads");
+	}
+	TEST_ASSERT_NOT_NULL(ctx);
+	TEST_NOFAIL(v120irqd_async_handler(ctx, req.payload, async_irq, &async_irqs));
+	async_done = async_irqs = 0;
+
+	/* Nothing to do yet, and nothing blocks. */
+	TEST_ASSERT_EQUAL(0, v120irqd_dispatch(ctx));
+
+	TEST_NOFAIL(v120irqd_async_request(ctx, &req, async_completion, NULL));
+	async_pump(ctx, &async_done, 1);
+	TEST_NOFAIL(async_err);
+
+	/* Interrupts go to the handler for their payload, and are ACKed. */
+	for (int i = 0; i < 3; i++) {
+		TEST_NOFAIL(v120irqd_interrupt(fds[0].fd, &fake));
+	}
+	async_pump(ctx, &async_irqs, 3);
+
+	/* A refusal is a completion like any other. */
+	TEST_NOFAIL(v120irqd_async_request(ctx, &taken, async_completion, NULL));
+	async_pump(ctx, &async_done, 2);
+	TEST_ASSERT_EQUAL(-EPERM, async_err);
+
+	/* Replies and interrupts mixed together are all sorted out. */
+	TEST_NOFAIL(v120irqd_interrupt(fds[0].fd, &fake));
+	TEST_NOFAIL(v120irqd_async_release(ctx, &req, async_completion, NULL));
+	async_pump(ctx, &async_done, 3);
+	TEST_NOFAIL(async_err);
+	async_pump(ctx, &async_irqs, 4);
+
+	TEST_NOFAIL(v120irqd_async_close(ctx));
+}
+
+/** Confirm that delivered interrupts show up in the latency statistics. */
+void test_latency_report(void)
+{
+	struct v120irqd_selector req = {
+		.crate = BIT(5), .irq = BIT(7), .vector = 0xABCDEF10
+	};
+	const struct v120irqd_selector which = {
+		.crate = BIT(5), .irq = BIT(7)
+	};
+	struct v120irqd_latency lat;
+	int s;
+
+	alarm(SAFETY_ALARM);
+	TEST_NOFAIL(v120irqd_interrupt(fds[0].fd, &req));
+	TEST_NOFAIL(v120irqd_getinterrupt(fds[1].fd, &req));
+	alarm(0);
+	TEST_NOFAIL(v120irqd_ack(fds[1].fd));
+
+	TEST_NOFAIL(v120irqd_latency(fds[0].fd, &which, V120IRQD_LATENCY_RESET, &lat));
+	TEST_ASSERT(lat.count >= 1);
+	for (s = 0; s < V120IRQD_LAT_STAGES; s++) {
+		TEST_ASSERT(lat.stage[s].p50 <= lat.stage[s].p99);
+		TEST_ASSERT(lat.stage[s].p99 <= lat.stage[s].p999);
+		TEST_ASSERT(lat.stage[s].p999 <= lat.stage[s].max);
+	}
+	TEST_ASSERT(lat.stage[V120IRQD_LAT_WAKE_TO_ACK].max >=
+		lat.stage[V120IRQD_LAT_SEND_TO_ACK].max);
+
+	/* The reset should have left nothing behind. */
+	TEST_NOFAIL(v120irqd_latency(fds[0].fd, &which, 0, &lat));
+	TEST_ASSERT(lat.count == 0);
+}
+
+/** Confirm that per-client statistics follow deliveries and NAKs. */
+void test_client_stats(void)
+{
+	struct v120irqd_client_stats stats[NCLIENTS + 1];
+	struct v120irqd_line_stats line[8];
+	struct v120irqd_selector req = {
+		.crate = BIT(1), .irq = BIT(4), .vector = 0x4444
+	};
+	int n, nakked = -1;
+
+	alarm(SAFETY_ALARM);
+	TEST_NOFAIL(v120irqd_interrupt(fds[0].fd, &req));
+	TEST_NOFAIL(v120irqd_getinterrupt(fds[2].fd, &req));
+	alarm(0);
+	TEST_NOFAIL(v120irqd_nak(fds[2].fd));
+
+	n = v120irqd_client_stats(fds[0].fd, stats, NCLIENTS + 1);
+	TEST_ASSERT_EQUAL(NCLIENTS, n);
+	for (int i = 0; i < n; i++) {
+		TEST_ASSERT_EQUAL(getpid(), stats[i].pid);
+		if (stats[i].naks) {
+			TEST_ASSERT_EQUAL(-1, nakked);
+			nakked = i;
+		}
+	}
+	TEST_ASSERT(nakked >= 0);
+	TEST_ASSERT_EQUAL(1, stats[nakked].naks);
+	TEST_ASSERT_EQUAL(1, stats[nakked].delivered);
+	TEST_ASSERT_EQUAL(4, stats[nakked].requests);
+	TEST_ASSERT_EQUAL(0, stats[nakked].queued);
+	TEST_ASSERT(stats[nakked].ack_max >= stats[nakked].ack_avg);
+
+	/* Only the first page, when that's all there's room for. */
+	TEST_ASSERT_EQUAL(NCLIENTS, v120irqd_client_stats(fds[0].fd, stats, 1));
+
+	/* The server under test has no crates at all. */
+	TEST_ASSERT_EQUAL(-ENODEV, v120irqd_line_stats(fds[0].fd, 0, line));
+}
+
+/** Confirm that crates nobody serves can't be located. */
+void test_locate(void)
+{
+	struct v120irqd_serverstatus status;
+	char name[108];
+
+	/* The server under test runs --novme, so has no crates at all. */
+	TEST_NOFAIL(v120irqd_status(fds[0].fd, &status));
+	TEST_ASSERT_EQUAL(0, status.crates);
+	TEST_ASSERT_EQUAL(-ENOENT, v120irqd_locate(0, name, sizeof(name)));
+	TEST_ASSERT_EQUAL(-EINVAL, v120irqd_locate(16, name, sizeof(name)));
+}
+
+/**
+ * Confirm that --priority reaches the scheduler, wherever we're allowed
+ * real-time priority at all, and that bad values are refused.
+ */
+void test_priority(void)
+{
+	struct v120irqd_serverstatus status;
+	struct sched_param sp = { .sched_priority = SERVER_PRIORITY };
+	struct sched_param ours = { .sched_priority = 0 };
+	int allowed;
+
+	TEST_ASSERT(system(DAEMON_LOCAL_NAME " --novme --priority=-5") != 0);
+	TEST_ASSERT(system(DAEMON_LOCAL_NAME " --novme --priority=") != 0);
+	TEST_ASSERT(system(DAEMON_LOCAL_NAME " --novme --priority=100") != 0);
+
+	/* Try it on ourselves to see whether the server could have. */
+	allowed = sched_setscheduler(0, SCHED_FIFO, &sp) == 0;
+	if (allowed) sched_setscheduler(0, SCHED_OTHER, &ours);
+	if (!allowed) TEST_IGNORE_MESSAGE("Real-time priority not permitted");
+
+	TEST_NOFAIL(v120irqd_status(fds[0].fd, &status));
+	TEST_ASSERT_EQUAL(SCHED_FIFO, sched_getscheduler(status.pid));
+	TEST_ASSERT_EQUAL(0, sched_getparam(status.pid, &sp));
+	TEST_ASSERT_EQUAL(SERVER_PRIORITY, sp.sched_priority);
+}
+
+/** Confirm that a warm restart keeps every client and request. */
+void test_warm_restart(void)
+{
+	struct v120irqd_serverstatus before, after;
+	struct v120irqd_selector req = {
+		.crate = BIT(1), .irq = BIT(3), .vector = 0x12345678
+	};
+	const struct timespec pause = { 0, 10000000 };
+	int tries;
+
+	TEST_NOFAIL(v120irqd_status(fds[0].fd, &before));
+	TEST_ASSERT_EQUAL(0, kill(before.pid, SIGHUP));
+
+	/* The new server answers on the same connection once it's in charge. */
+	for (tries = 0; tries < 500; tries++) {
+		nanosleep(&pause, NULL);
+		TEST_NOFAIL(v120irqd_status(fds[0].fd, &after));
+		if (after.pid != before.pid) break;
+	}
+	TEST_ASSERT(after.pid != before.pid);
+	TEST_ASSERT_EQUAL(before.clients, after.clients);
+	TEST_ASSERT_EQUAL(before.irq_requests, after.irq_requests);
+
+	alarm(SAFETY_ALARM);
+	TEST_NOFAIL(v120irqd_interrupt(fds[0].fd, &req));
+	TEST_NOFAIL(v120irqd_getinterrupt(fds[2].fd, &req));
+	alarm(0);
+	TEST_NOFAIL(v120irqd_ack(fds[2].fd));
+	TEST_ASSERT_EQUAL_HEX32(0x12345678, req.vector);
+	TEST_ASSERT_EQUAL(7, req.payload);
+}
+
 void test_alarm(void)
 {
 	/* Make sure that a SIGALRM breaks us out of an infinite wait in
@@ -393,7 +1108,8 @@ int main(void)
 		kill_server();
 
 		/* Now start it fresh in a background process. */
-		err = system(DAEMON_LOCAL_NAME " --novme --debug");
+		err = system(DAEMON_LOCAL_NAME " --novme --debug --ack-timeout=500 --fallback"
+				" --priority=" TOSTRING(SERVER_PRIORITY));
 		if (err == -1) {
 			perror("Couldn't start server.");
 			exit(1);
@@ -426,6 +1142,19 @@ int main(void)
 	RUN_TEST(test_illegal_removal);
 	RUN_TEST(test_alarm);
 	RUN_TEST(test_irq_receipt);
+	RUN_TEST(test_batch_receipt);
+	RUN_TEST(test_timestamped_events);
+	RUN_TEST(test_clear_action);
+	RUN_TEST(test_dma_readout);
+	RUN_TEST(test_fanout);
+	RUN_TEST(test_slow_client);
+	RUN_TEST(test_shared_connection);
+	RUN_TEST(test_async_client);
+	RUN_TEST(test_latency_report);
+	RUN_TEST(test_client_stats);
+	RUN_TEST(test_locate);
+	RUN_TEST(test_priority);
+	RUN_TEST(test_warm_restart);
 
 	return UnityEnd();
 }
@@ -0,0 +1,118 @@
+/*
+ * Unit tests for the v120irqd interrupt storm protection.
+ *
+ * This software is released under the Modified BSD License, and may be
+ * redistributed according to the terms stated in license.txt, which must
+ * be kept with this file.
+ */
+
+#include <string.h>
+
+#include "storm_guard.h"
+
+#include "unity/unity.h"
+
+#define MS		(1000ULL * 1000)
+#define SEC		(1000ULL * MS)
+
+/* Start well clear of zero, like the real clock. */
+#define T0		(1000 * SEC)
+
+static struct storm_guard g;
+
+void setUp(void) {
+	memset(&g, 0, sizeof(g));
+}
+
+void tearDown(void) {
+}
+
+/** A rate of zero is no limit at all. */
+void test_unlimited(void)
+{
+	for (int i = 0; i < 100000; i++) {
+		TEST_ASSERT_TRUE(storm_allow(&g, 0, 1, T0));
+	}
+	TEST_ASSERT_EQUAL(0, g.suppressed);
+}
+
+/** A new line gets its whole burst, then has to wait for the rate. */
+void test_burst_then_rate(void)
+{
+	for (int i = 0; i < 10; i++) {
+		TEST_ASSERT_TRUE(storm_allow(&g, 1000, 10, T0));
+	}
+	TEST_ASSERT_FALSE(storm_allow(&g, 1000, 10, T0));
+	TEST_ASSERT_EQUAL(1, g.suppressed);
+
+	/* 1000 a second is one a millisecond. */
+	TEST_ASSERT_FALSE(storm_allow(&g, 1000, 10, T0 + MS/2));
+	TEST_ASSERT_TRUE(storm_allow(&g, 1000, 10, T0 + MS));
+	TEST_ASSERT_FALSE(storm_allow(&g, 1000, 10, T0 + MS));
+
+	/* And never more than the burst, however long it's been. */
+	for (int i = 0; i < 10; i++) {
+		TEST_ASSERT_TRUE(storm_allow(&g, 1000, 10, T0 + SEC));
+	}
+	TEST_ASSERT_FALSE(storm_allow(&g, 1000, 10, T0 + SEC));
+	TEST_ASSERT_EQUAL(4, g.suppressed);
+}
+
+/* Run the line dry at @now, as a storm would. */
+static void trip(uint64_t now)
+{
+	while (storm_allow(&g, 1000, 10, now)) { ; }
+}
+
+/** Each trip in a row masks for twice as long, up to the maximum. */
+void test_backoff(void)
+{
+	uint64_t now = T0, backoff = STORM_BACKOFF_MIN;
+
+	TEST_ASSERT_FALSE(storm_rearm_due(&g, now));
+	trip(now);
+	for (int i = 0; i < 20; i++) {
+		TEST_ASSERT_EQUAL(now + backoff, storm_mask(&g, now));
+		TEST_ASSERT_FALSE(storm_rearm_due(&g, now + backoff - 1));
+		now += backoff;
+		TEST_ASSERT_TRUE(storm_rearm_due(&g, now));
+		TEST_ASSERT_FALSE(storm_rearm_due(&g, now));
+
+		/* Still chattering the moment it's back. */
+		trip(now);
+
+		backoff *= 2;
+		if (backoff > STORM_BACKOFF_MAX) backoff = STORM_BACKOFF_MAX;
+	}
+	TEST_ASSERT_EQUAL(20, g.storms);
+	TEST_ASSERT_EQUAL(STORM_BACKOFF_MAX, g.backoff);
+}
+
+/** A line that's been quiet for a while is forgiven. */
+void test_forgiven(void)
+{
+	uint64_t now = T0;
+
+	trip(now);
+	storm_mask(&g, now);
+	now += STORM_BACKOFF_MIN;
+	TEST_ASSERT_TRUE(storm_rearm_due(&g, now));
+	trip(now);
+	storm_mask(&g, now);
+	TEST_ASSERT_EQUAL(2 * STORM_BACKOFF_MIN, g.backoff);
+
+	now += SEC;
+	TEST_ASSERT_TRUE(storm_rearm_due(&g, now));
+	TEST_ASSERT_TRUE(storm_allow(&g, 1000, 10, now));
+	TEST_ASSERT_EQUAL(now + STORM_BACKOFF_MIN, storm_mask(&g, now));
+}
+
+int main(void)
+{
+	UnityBegin(__FILE__);
+	RUN_TEST(test_unlimited);
+	RUN_TEST(test_burst_then_rate);
+	RUN_TEST(test_backoff);
+	RUN_TEST(test_forgiven);
+	return UnityEnd();
+}
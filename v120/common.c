@@ -4,10 +4,140 @@
 #include <errno.h>
 #include <string.h>
 #include <stdarg.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+/* One crate's share of -m A, run in a child process of its own */
+struct crate_job_t {
+        V120_HANDLE *v120;
+        FILE *out;
+        FILE *err;
+        pid_t pid;
+        int ret;
+};
+
+static void
+start_job(struct crate_job_t *job,
+          int (*fn)(V120_HANDLE *, void *), void *priv)
+{
+        int ret;
+
+        job->ret = EXIT_FAILURE;
+        job->out = tmpfile();
+        job->err = tmpfile();
+        if (job->out == NULL || job->err == NULL) {
+                v120_perror("tmpfile()");
+                job->pid = -1;
+                return;
+        }
+
+        job->pid = fork();
+        if (job->pid == 0) {
+                dup2(fileno(job->out), STDOUT_FILENO);
+                dup2(fileno(job->err), STDERR_FILENO);
+                ret = fn(job->v120, priv);
+                fflush(stdout);
+                fflush(stderr);
+                _exit(ret);
+        }
+        if (job->pid < 0)
+                v120_perror("fork()");
+}
+
+/* Wait for any one job, and return how many are still running */
+static int
+reap_job(struct crate_job_t *jobs, int njobs, int running)
+{
+        int status;
+        pid_t pid;
+        int i;
+
+        do {
+                pid = wait(&status);
+        } while (pid < 0 && errno == EINTR);
+        if (pid < 0)
+                return 0;
+
+        for (i = 0; i < njobs; i++) {
+                if (jobs[i].pid != pid)
+                        continue;
+                jobs[i].ret = WIFEXITED(status) ? WEXITSTATUS(status)
+                                                : EXIT_FAILURE;
+                break;
+        }
+        return running - 1;
+}
+
+static void
+copy_out(FILE *from, FILE *to)
+{
+        char buf[4096];
+        size_t n;
+
+        if (from == NULL)
+                return;
+        rewind(from);
+        while ((n = fread(buf, 1, sizeof(buf), from)) > 0)
+                fwrite(buf, 1, n, to);
+        fclose(from);
+}
+
+/*
+ * Run @fn on every crate at once, at most args->jobs at a time, each in a
+ * child process with its output captured.  The output is printed in crate
+ * order once they're all done, so it reads just as if they had run one by
+ * one.
+ */
+static int
+do_all_crates_parallel(const struct v120_args_t *args,
+                       int (*fn)(V120_HANDLE *, void *),
+                       void *priv, unsigned int flags)
+{
+        struct crate_job_t jobs[16];
+        int njobs = 0;
+        int running = 0;
+        int ret = EXIT_SUCCESS;
+        int i;
+
+        for (i = 0; i < 16; i++) {
+                jobs[njobs].v120 = v120_open(i);
+                if (jobs[njobs].v120 != NULL)
+                        ++njobs;
+        }
+        if (njobs == 0)
+                return -1;
+
+        fflush(stdout);
+        fflush(stderr);
+        for (i = 0; i < njobs; i++) {
+                if (args->jobs > 0 && running >= args->jobs)
+                        running = reap_job(jobs, njobs, running);
+                start_job(&jobs[i], fn, priv);
+                if (jobs[i].pid > 0)
+                        ++running;
+                v120_close(jobs[i].v120);
+        }
+        while (running > 0)
+                running = reap_job(jobs, njobs, running);
+
+        for (i = 0; i < njobs; i++) {
+                if (i > 0 && !(flags & DFEC_INTERM))
+                        printf("---------------------\n");
+                copy_out(jobs[i].out, stdout);
+                fflush(stdout);
+                copy_out(jobs[i].err, stderr);
+                if (jobs[i].ret != EXIT_SUCCESS)
+                        ret = EXIT_FAILURE;
+        }
+        return ret;
+}
 
 /*
  * common to some of our functions using '-m' options
  *
+ * With -m A, each crate is done in parallel unless -j1 says otherwise,
+ * and the result is a failure if any crate failed.
+ *
  * flags:
  *   DFEC_INTERM - Do not delimit with a line a dashes
  *   DFEC_NOTALL - Do not allow -m A
@@ -24,12 +154,20 @@ do_for_each_crate(const struct v120_args_t *args,
                         v120_perror("-m A not allowed for this subcommand");
                         return EXIT_FAILURE;
                 }
+                if (args->jobs != 1) {
+                        ret = do_all_crates_parallel(args, fn, priv, flags);
+                        if (ret < 0)
+                                goto none;
+                        return ret;
+                }
                 int count = 0;
                 V120_HANDLE *v120 = NULL;
+                ret = EXIT_SUCCESS;
                 while ((v120 = v120_next(v120)) != NULL) {
                         if (count > 0 && !(flags & DFEC_INTERM))
                                 printf("---------------------\n");
-                        ret = fn(v120, priv);
+                        if (fn(v120, priv) != EXIT_SUCCESS)
+                                ret = EXIT_FAILURE;
                         ++count;
                 }
                 if (count == 0)
@@ -4,8 +4,9 @@ const char *v120_help_string =
 "v120 - miscellaneous utilities for the V120.\n"
 "\n"
 "SYNOPSIS\n"
-"       v120  [-efFv]  [-a  awidth]  [-d  dwidth]  [-m crate_no] [-s speed] [-S\n"
-"       slot0] subcommand [args]\n"
+"       v120  [-bcDefFv] [-a awidth] [-d dwidth] [-i file] [-j jobs] [-m\n"
+"       crate_no] [-o file] [-p stride] [-s speed] [-S slot0] [-t format]\n"
+"       subcommand [args]\n"
 "\n"
 "       v120 flash-upgrade upgrade_file\n"
 "       v120 reset\n"
@@ -29,6 +30,16 @@ const char *v120_help_string =
 "           to be specified. They do not permit -m A. The report pci subcommand\n"
 "           also does not support -m A.\n"
 "\n"
+"           With -m A, the crates are all done at once, each by a process of\n"
+"           its own, and each crate's output is printed in crate order once\n"
+"           they have all finished.  The exit status is a failure if any crate\n"
+"           failed.\n"
+"\n"
+"       -j jobs, --jobs=jobs\n"
+"           With -m A, do at most jobs crates at once.  0, the default, does\n"
+"           every crate at once, and 1 does them one at a time with their\n"
+"           output printed as it comes.\n"
+"\n"
 "       -a awidth, --awidth=awidth\n"
 "       -d dwidth, --dwidth=dwidth\n"
 "       -s speed, --speed=speed\n"
@@ -39,14 +50,41 @@ const char *v120_help_string =
 "           0 being the slowest and 3 being the fastest.\n"
 "\n"
 "           For v120 scan, if -a24 is used, then the A24 address space will  be\n"
-"           scanned  *in addition to* the A16 address space.  The other address\n"
-"           modifiers, data width and speed options are ignored.\n"
+"           scanned  *in addition to* the A16 address space, and if -a32 is\n"
+"           used, both the A24 and A32 address spaces will be.  The data width\n"
+"           and speed options are ignored.\n"
 "\n"
 "       -b --binary\n"
 "           For v120 read and v120 write,  if using standard in/out instead  of\n"
 "           command-line values, print or accept binary data instead of  string\n"
 "           expressions\n"
 "\n"
+"       -D, --dma\n"
+"           For v120 read and v120 write, transfer the data by DMA rather than\n"
+"           through a mapped VME window.  The data width must be w, s or l.\n"
+"\n"
+"       -i file, --input=file\n"
+"           For v120 write, take the values from file instead of standard\n"
+"           input.\n"
+"\n"
+"       -c, --verify\n"
+"           For v120 write, read everything back once it has been written, and\n"
+"           fail if any word differs.\n"
+"\n"
+"       -o file, --output=file\n"
+"           For v120 read, write the data to file instead of standard output.\n"
+"\n"
+"       -p stride, --stride=stride\n"
+"           For v120 scan, read one word every stride bytes, a multiple of 4,\n"
+"           and bisect between those for the edges of the cards.  By default\n"
+"           A16 and A24 are read a word at a time and A32 every 64 KiB.\n"
+"\n"
+"       -t format, --format=format\n"
+"           For v120 read, how to print the data: words (\"0x\" hexadecimal\n"
+"           delimited by spaces, the default), raw (binary, as -b), hex (bare\n"
+"           hexadecimal, 32 bytes to a line) or columns (16 bytes to a line,\n"
+"           each starting with its VME address).\n"
+"\n"
 "       -e, --vmeprint\n"
 "           For the read and write subcommands, print some debugging info about\n"
 "           the VME transaction to standard error.\n"
@@ -68,7 +106,9 @@ const char *v120_help_string =
 "           a query.\n"
 "\n"
 "       -v, --verbose\n"
-"           Reserved, in case we wish to add a verbose-mode option.\n"
+"           For v120 read and v120 write, print how long the transfer took,\n"
+"           and its throughput, to standard error.  For v120 scan, print how\n"
+"           many words were read for each address space, and how long it took.\n"
 "\n"
 "       -V, --version\n"
 "       -?, --help\n"
@@ -119,6 +119,54 @@ parse_speed(const char *s)
         return 0;
 }
 
+static int
+parse_jobs(const char *s)
+{
+        long v;
+        char *endptr;
+
+        v = strtol(s, &endptr, 0);
+        if (endptr == s || *endptr != '\0' || errno || v < 0 || v > 16) {
+                v120_perror("invalid jobs '%s'", s);
+                exit(EXIT_FAILURE);
+        }
+        return v;
+}
+
+static unsigned long
+parse_stride(const char *s)
+{
+        unsigned long v;
+        char *endptr;
+
+        v = strtoul(s, &endptr, 0);
+        if (endptr == s || *endptr != '\0' || errno || v == 0 || v % 4 != 0) {
+                v120_perror("invalid stride '%s'", s);
+                exit(EXIT_FAILURE);
+        }
+        return v;
+}
+
+static int
+parse_format(const char *s)
+{
+        static const char *names[FMT_NFORMATS] = {
+                [FMT_WORDS]   = "words",
+                [FMT_RAW]     = "raw",
+                [FMT_HEX]     = "hex",
+                [FMT_COLUMNS] = "columns",
+        };
+        int i;
+
+        for (i = 0; i < FMT_NFORMATS; i++) {
+                if (!strcmp(s, names[i]))
+                        return i;
+        }
+        v120_perror("invalid format '%s'", s);
+        exit(EXIT_FAILURE);
+        return 0;
+}
+
 static void
 version(FILE *fp)
 {
@@ -137,13 +185,20 @@ parse(int argc, char **argv, struct v120_args_t *args)
         static struct option opts[] = {
                 { "awidth",   required_argument, NULL, 'a' },
                 { "binary",   no_argument,       NULL, 'b' },
+                { "verify",   no_argument,       NULL, 'c' },
                 { "dwidth",   required_argument, NULL, 'd' },
+                { "dma",      no_argument,       NULL, 'D' },
                 { "vmeprint", no_argument,       NULL, 'e' },
                 { "fpga",     no_argument,       NULL, 'f' },
                 { "fair",     no_argument,       NULL, 'F' },
+                { "input",    required_argument, NULL, 'i' },
+                { "jobs",     required_argument, NULL, 'j' },
                 { "crate_no", required_argument, NULL, 'm' },
+                { "output",   required_argument, NULL, 'o' },
+                { "stride",   required_argument, NULL, 'p' },
                 { "speed",    required_argument, NULL, 's' },
                 { "slot0",    required_argument, NULL, 'S' },
+                { "format",   required_argument, NULL, 't' },
                 { "verbose",  no_argument,       NULL, 'v' },
                 { "version",  no_argument,       NULL, 'V' },
                 { "help",     no_argument,       NULL, '?' },
@@ -164,7 +219,14 @@ parse(int argc, char **argv, struct v120_args_t *args)
         args->speed = V120_SMED;
         args->slot0 = 0;
         args->verbose = 0;
-        while ((opt = getopt_long(argc, argv, "m:Vfeba:d:s:v",
+        args->dma = 0;
+        args->format = -1;
+        args->output = NULL;
+        args->input = NULL;
+        args->verify = 0;
+        args->stride = 0;
+        args->jobs = 0;
+        while ((opt = getopt_long(argc, argv, "m:VfebcDa:d:i:j:o:p:s:t:v",
                                   opts, NULL)) != -1) {
                 switch (opt) {
                 case 'a':
@@ -173,9 +235,15 @@ parse(int argc, char **argv, struct v120_args_t *args)
                 case 'b':
                         args->binary = 1;
                         break;
+                case 'c':
+                        args->verify = 1;
+                        break;
                 case 'd':
                         args->dwidth = parse_dwidth(optarg, &args->split);
                         break;
+                case 'D':
+                        args->dma = 1;
+                        break;
                 case 'e':
                         args->vmeprint = 1;
                         break;
@@ -185,15 +253,30 @@ parse(int argc, char **argv, struct v120_args_t *args)
                 case 'f':
                         args->fpga = 1;
                         break;
+                case 'i':
+                        args->input = optarg;
+                        break;
+                case 'j':
+                        args->jobs = parse_jobs(optarg);
+                        break;
                 case 'm':
                         args->crate = parse_crate(optarg);
                         break;
+                case 'o':
+                        args->output = optarg;
+                        break;
+                case 'p':
+                        args->stride = parse_stride(optarg);
+                        break;
                 case 's':
                         args->speed = parse_speed(optarg);
                         break;
                 case 'S':
                         args->slot0 = parse_slot0(optarg);
                         break;
+                case 't':
+                        args->format = parse_format(optarg);
+                        break;
                 case 'v':
                         args->verbose = 1;
                         break;
@@ -211,6 +294,8 @@ parse(int argc, char **argv, struct v120_args_t *args)
                         break;
                 }
         }
+        if (args->format < 0)
+                args->format = args->binary ? FMT_RAW : FMT_WORDS;
 }
 
 struct v120_subcommand_t {
@@ -1,129 +1,97 @@
 #include "v120_common.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Bytes moved to or from VME at a time, and formatted at a time */
+#define XFER_CHUNK      (64U * 1024U)
+#define OUTBUF_SIZE     (64U * 1024U)
+
+/* Bytes per line for the hex and columns formats */
+#define HEX_LINE        32U
+#define COLUMNS_LINE    16U
+
+/* Growth step for input that can't be mapped, and for parsed values */
+#define INPUT_GROW      (1024U * 1024U)
 
 struct rw_args_t {
         V120_HANDLE *v120;
         unsigned long long address;
         int nunits;
         int size;
-        void (*print)(volatile void *);
-        void (*put)(volatile void *, uint32_t);
-        void (*printb)(volatile void *);
-        uint32_t (*getb)(volatile void *);
+        unsigned long dma_flags;
 };
 
-static uint32_t
-getb_byte(volatile void *src)
-{
-        return *(volatile uint8_t *)src;
-}
-
-static uint32_t
-getb_word(volatile void *src)
-{
-        return *(volatile uint16_t *)src;
-}
-
-static uint32_t
-getb_dword(volatile void *src)
-{
-        return *(volatile uint32_t *)src;
-}
-
-static void
-printb_byte(volatile void *src)
-{
-        uint8_t v = *(volatile uint8_t *)src;
-        fwrite(&v, 1, 1, stdout);
-}
-
-static void
-printb_word(volatile void *src)
-{
-        uint16_t v = *(volatile uint16_t *)src;
-        fwrite(&v, 2, 1, stdout);
-}
-
-static void
-printb_dword(volatile void *src)
-{
-        uint32_t v = *(volatile uint32_t *)src;
-        fwrite(&v, 4, 1, stdout);
-}
-
-static void
-print_byte(volatile void *src)
-{
-        unsigned char v = *(volatile uint8_t *)src;
-        printf("0x%02hhX", v);
-}
-
-static void
-print_word(volatile void *src)
-{
-        unsigned short v = *(volatile uint16_t *)src;
-        printf("0x%04hX", v);
-}
-
-static void
-print_dword(volatile void *src)
-{
-        unsigned int v = *(volatile uint32_t *)src;
-        printf("0x%08X", v);
-}
-
-static void
-put_byte(volatile void *dst, uint32_t v)
-{
-        *(volatile uint8_t *)dst = (uint8_t)v;
-}
-
-static void
-put_word(volatile void *dst, uint32_t v)
-{
-        *(volatile uint16_t *)dst = (uint16_t)v;
-}
+/* Buffered output, so a dump goes out in a few large writes */
+struct outbuf_t {
+        FILE *fp;
+        size_t len;
+        int err;
+        char buf[OUTBUF_SIZE];
+};
 
-static void
-put_dword(volatile void *dst, uint32_t v)
-{
-        *(volatile uint32_t *)dst = v;
-}
+/* The whole input to v120 write, mapped or read into memory */
+struct input_t {
+        uint8_t *data;
+        size_t len;
+        int mapped;
+};
 
-static VME_REGION *
-rw_open_vme(VME_REGION *region,
-            const struct v120_args_t *args,
-            struct rw_args_t *rw)
+static int
+rw_open_crate(const struct v120_args_t *args, struct rw_args_t *rw)
 {
         if (args->crate == 'A') {
                 v120_perror("invalid crate option 'A'");
-                return NULL;
+                return -1;
         }
         rw->v120 = args->crate < 0
                    ? v120_next(NULL)
                    : v120_open(args->crate);
         if (!rw->v120) {
                 v120_perror("v120_open()");
-                goto err_v120_open;
+                return -1;
         }
+        return 0;
+}
+
+static VME_REGION *
+rw_open_vme(VME_REGION *region,
+            const struct v120_args_t *args,
+            struct rw_args_t *rw)
+{
+        unsigned int npages;
+
+        if (rw_open_crate(args, rw) < 0)
+                return NULL;
         region->vme_addr = rw->address;
         region->start_page = 0;
-        region->len = rw->nunits;
+        region->len = (size_t)rw->nunits * rw->size;
         region->config = args->speed | args->awidth;
         region->tag = "vrw";
-        if (args->dwidth == VME_D16) {
-                region->len *= 2;
+        if (args->dwidth == VME_D16)
                 region->config |= V120_D16;
-        } else if (args->dwidth == VME_D32) {
-                region->len *= 4;
+
+        /*
+         * The whole range is mapped at once, just below the top pages,
+         * which belong to v120irqd's clear actions.
+         */
+        npages = (region->vme_addr % V120_PAGE_SIZE + region->len
+                  + V120_PAGE_SIZE - 1) / V120_PAGE_SIZE;
+        if (npages > V120_IRQD_FIRST_PAGE) {
+                v120_perror("range too large to map; use -D");
+                goto err_vme;
         }
         if (v120_add_vme_region(rw->v120, region) == NULL) {
                 v120_perror("v120_add_vme_region()");
                 goto err_vme;
         }
-        if (v120_allocate_vme(rw->v120, 8191) < 0) {
+        if (v120_allocate_vme(rw->v120, V120_IRQD_FIRST_PAGE - npages) < 0) {
                 v120_perror("v120_allocate_vme()");
                 goto err_vme;
         }
@@ -131,7 +99,6 @@ rw_open_vme(VME_REGION *region,
 
 err_vme:
         v120_close(rw->v120);
-err_v120_open:
         return NULL;
 }
 
@@ -160,162 +127,557 @@ set_up_dwidth(struct rw_args_t *rw, const struct v120_args_t *args)
         case VME_D8EO:
         case VME_D8O:
                 rw->size = 1;
-                rw->put = put_byte;
-                rw->print = print_byte;
-                rw->getb = getb_byte;
-                rw->printb = printb_byte;
                 break;
         case VME_D16:
                 if (!args->split) {
                         rw->size = 2;
-                        rw->put = put_word;
-                        rw->print = print_word;
-                        rw->getb = getb_word;
-                        rw->printb = printb_word;
                         break;
                 }
                 /* else, fall through */
         case VME_D32:
                 rw->size = 4;
-                rw->put = put_dword;
-                rw->print = print_dword;
-                rw->getb = getb_dword;
-                rw->printb = printb_dword;
                 break;
         default:
                 BUG();
                 return -1;
         }
+        rw->dma_flags = args->speed | args->awidth
+                        | (args->dwidth == VME_D32 ? V120_D32 : V120_D16);
         return 0;
 }
 
 static int
-check_align(const struct rw_args_t *rw, VME_REGION *region)
+check_align(const struct rw_args_t *rw)
 {
-        if (rw->size > 1 && (region->vme_addr & (rw->size - 1)) != 0) {
+        if (rw->size > 1 && (rw->address & (rw->size - 1)) != 0) {
                 v120_perror("invalid alignment");
                 return -1;
         }
         return 0;
 }
 
+/* Copy from VME by PIO, one access of the transaction's width at a time */
+static void
+fetch_pio(const struct rw_args_t *rw, volatile void *src, void *dst,
+          size_t len)
+{
+        size_t i;
+
+        switch (rw->size) {
+        case 1: {
+                volatile uint8_t *s = src;
+                uint8_t *d = dst;
+                for (i = 0; i < len; i++)
+                        d[i] = s[i];
+                break;
+        }
+        case 2: {
+                volatile uint16_t *s = src;
+                uint16_t *d = dst;
+                for (i = 0; i < len / 2; i++)
+                        d[i] = s[i];
+                break;
+        }
+        default: {
+                volatile uint32_t *s = src;
+                uint32_t *d = dst;
+                for (i = 0; i < len / 4; i++)
+                        d[i] = s[i];
+                break;
+        }
+        }
+}
+
 static int
-gettok(char *buf, size_t len)
+fetch_dma(const struct rw_args_t *rw, unsigned long long address,
+          void *dst, size_t len)
 {
-        char *p;
-        char *end = &buf[len];
-        int c;
+        struct v120_dma_desc_t desc;
+
+        desc.flags = rw->dma_flags;
+        desc.ptr = (uintptr_t)dst;
+        desc.size = len;
+        desc.next = 0;
+        desc.vme_address = address;
+        if (v120_dma_xfr(rw->v120, &desc) < 0) {
+                v120_perror("DMA read at 0x%llX failed", address);
+                return -1;
+        }
+        return 0;
+}
 
-        while ((c = getchar()) != EOF && isspace(c))
-                ;
-        if (c == EOF)
-                return 1;
+static double
+now_seconds(void)
+{
+        struct timespec ts;
 
-        p = buf;
-        do {
-                *p++ = c;
-        } while ((c = getchar()) != EOF && isalnum(c) && p < end);
-        *p = '\0';
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+report_rate(size_t bytes, double t)
+{
+        fprintf(stderr, "%zu bytes in %.3f s (%.2f MB/s)\n",
+                bytes, t, t > 0 ? bytes / t / 1e6 : 0.0);
+}
+
+/* Copy to VME by PIO, one access of the transaction's width at a time */
+static void
+store_pio(const struct rw_args_t *rw, volatile void *dst, const void *src,
+          size_t len)
+{
+        size_t i;
+
+        switch (rw->size) {
+        case 1: {
+                volatile uint8_t *d = dst;
+                const uint8_t *s = src;
+                for (i = 0; i < len; i++)
+                        d[i] = s[i];
+                break;
+        }
+        case 2: {
+                volatile uint16_t *d = dst;
+                const uint16_t *s = src;
+                for (i = 0; i < len / 2; i++)
+                        d[i] = s[i];
+                break;
+        }
+        default: {
+                volatile uint32_t *d = dst;
+                const uint32_t *s = src;
+                for (i = 0; i < len / 4; i++)
+                        d[i] = s[i];
+                break;
+        }
+        }
+}
 
-        if (c != EOF && !isspace(c))
+static int
+store_dma(const struct rw_args_t *rw, unsigned long long address,
+          const void *src, size_t len)
+{
+        struct v120_dma_desc_t desc;
+
+        desc.flags = rw->dma_flags | V120_DMA_CTL_WRITE;
+        desc.ptr = (uintptr_t)src;
+        desc.size = len;
+        desc.next = 0;
+        desc.vme_address = address;
+        if (v120_dma_xfr(rw->v120, &desc) < 0) {
+                v120_perror("DMA write at 0x%llX failed", address);
                 return -1;
+        }
         return 0;
 }
 
-static int
-v120_write_stdin_ascii(const struct rw_args_t *rw, volatile void *dst)
+/* "00" to "FF", so formatting takes a table lookup per byte */
+static char hextab[256][2];
+
+static void
+init_hextab(void)
 {
-        char buffer[512];
-        int count = 0;
-        int tokres;
+        static const char digits[] = "0123456789ABCDEF";
+        int i;
 
-        while ((tokres = gettok(buffer, sizeof(buffer))) == 0) {
-                char *endptr;
-                uint32_t v = strtoul(buffer, &endptr, 0);
-                if (endptr == buffer || errno) {
-                        v120_perror("invalid %dth value '%s'",
-                                    count, buffer);
-                        return -1;
-                }
+        for (i = 0; i < 256; i++) {
+                hextab[i][0] = digits[i >> 4];
+                hextab[i][1] = digits[i & 15];
+        }
+}
 
-                rw->put(dst, v);
-                dst += rw->size;
-                count++;
+static char *
+put_hex(char *p, uint32_t v, int nbytes)
+{
+        while (nbytes-- > 0) {
+                memcpy(p, hextab[(v >> (nbytes * 8)) & 0xFFU], 2);
+                p += 2;
+        }
+        return p;
+}
+
+static void
+out_flush(struct outbuf_t *ob)
+{
+        if (ob->len != 0 && fwrite(ob->buf, 1, ob->len, ob->fp) != ob->len)
+                ob->err = 1;
+        ob->len = 0;
+}
+
+/* Room for at least @n more characters */
+static char *
+out_space(struct outbuf_t *ob, size_t n)
+{
+        if (ob->len + n > OUTBUF_SIZE)
+                out_flush(ob);
+        return &ob->buf[ob->len];
+}
+
+static uint32_t
+get_unit(const uint8_t *src, int size)
+{
+        uint16_t w;
+        uint32_t d;
+
+        switch (size) {
+        case 1:
+                return *src;
+        case 2:
+                memcpy(&w, src, 2);
+                return w;
+        default:
+                memcpy(&d, src, 4);
+                return d;
         }
+}
 
-        if (tokres != 1)
-                v120_perror("Unexpected token after '%s'\n", buffer);
+/*
+ * Format @len bytes of data read from VME, which start @offset bytes into
+ * the whole read.
+ */
+static void
+emit_chunk(struct outbuf_t *ob, const struct rw_args_t *rw, int format,
+           const uint8_t *data, size_t len, size_t offset)
+{
+        size_t i;
+        char *p;
 
-        return count;
+        if (format == FMT_RAW) {
+                out_flush(ob);
+                if (fwrite(data, 1, len, ob->fp) != len)
+                        ob->err = 1;
+                return;
+        }
+
+        for (i = 0; i < len; i += rw->size, offset += rw->size) {
+                /* enough for an address, a unit and the delimiters */
+                p = out_space(ob, 32);
+                switch (format) {
+                case FMT_WORDS:
+                        if (offset != 0)
+                                *p++ = ' ';
+                        *p++ = '0';
+                        *p++ = 'x';
+                        break;
+                case FMT_HEX:
+                        if (offset != 0 && offset % HEX_LINE == 0)
+                                *p++ = '\n';
+                        break;
+                case FMT_COLUMNS:
+                        if (offset % COLUMNS_LINE == 0) {
+                                if (offset != 0)
+                                        *p++ = '\n';
+                                p = put_hex(p, rw->address + offset, 4);
+                                *p++ = ':';
+                        }
+                        *p++ = ' ';
+                        break;
+                }
+                p = put_hex(p, get_unit(&data[i], rw->size), rw->size);
+                ob->len = p - ob->buf;
+        }
 }
 
+/*
+ * Take in the whole of the input, from a file or standard input.  A
+ * regular file is mapped rather than copied.
+ */
 static int
-v120_write_stdin_binary(const struct rw_args_t *rw, volatile void *dst)
+load_input(const char *path, struct input_t *in)
 {
-        char buffer[512];
-        int count = 0;
-        int total = 0;
-        int alen = sizeof(buffer) / rw->size;
-        do {
-                char *pbuf;
-                int i;
-                count = fread(buffer, rw->size, alen, stdin);
-                if (count < 0) {
-                        v120_perror("fread(stdin) fail");
+        struct stat st;
+        size_t cap = 0;
+        ssize_t n;
+        uint8_t *p;
+        int fd = STDIN_FILENO;
+
+        in->data = NULL;
+        in->len = 0;
+        in->mapped = 0;
+
+        if (path != NULL) {
+                fd = open(path, O_RDONLY);
+                if (fd < 0) {
+                        v120_perror("cannot open '%s'", path);
                         return -1;
                 }
-                pbuf = buffer;
-                for (i = 0; i < count; i++) {
-                        uint32_t v = rw->getb(pbuf);
-                        rw->put(dst, v);
-                        pbuf += rw->size;
-                        dst += rw->size;
+        }
+
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+                p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (p != MAP_FAILED) {
+                        in->data = p;
+                        in->len = st.st_size;
+                        in->mapped = 1;
+                        goto done;
+                }
+        }
+
+        for (;;) {
+                if (in->len == cap) {
+                        cap += INPUT_GROW;
+                        p = realloc(in->data, cap);
+                        if (p == NULL) {
+                                v120_perror("out of memory");
+                                goto err;
+                        }
+                        in->data = p;
+                }
+                n = read(fd, in->data + in->len, cap - in->len);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        v120_perror("cannot read input");
+                        goto err;
                 }
-                total += count;
-        } while (count != alen);
+                if (n == 0)
+                        break;
+                in->len += n;
+        }
 
-        return total;
+done:
+        if (fd != STDIN_FILENO)
+                close(fd);
+        return 0;
+
+err:
+        free(in->data);
+        in->data = NULL;
+        if (fd != STDIN_FILENO)
+                close(fd);
+        return -1;
 }
 
-static int
-v120_write_stdin(const struct rw_args_t *rw,
-                 VME_REGION *region, int binary)
+static void
+free_input(struct input_t *in)
 {
-        /* parse from standard input */
-        int res = EXIT_SUCCESS;
-        int count;
-        if (binary)
-                count = v120_write_stdin_binary(rw, region->base);
+        if (in->mapped)
+                munmap(in->data, in->len);
         else
-                count = v120_write_stdin_ascii(rw, region->base);
+                free(in->data);
+}
+
+/* Digit values for any base up to 16, or 0xFF for anything else */
+static uint8_t digval[256];
 
-        if (count <= 0) {
-                res = EXIT_FAILURE;
-                if (count == 0)
-                        v120_perror("expected: at least one value");
+static void
+init_digval(void)
+{
+        int i;
+
+        memset(digval, 0xFF, sizeof(digval));
+        for (i = 0; i < 10; i++)
+                digval['0' + i] = i;
+        for (i = 0; i < 6; i++) {
+                digval['a' + i] = 10 + i;
+                digval['A' + i] = 10 + i;
+        }
+}
+
+/* Store @v into @dst as one unit of @size bytes */
+static void
+put_unit(uint8_t *dst, uint32_t v, int size)
+{
+        uint16_t w = v;
+
+        switch (size) {
+        case 1:
+                *dst = v;
+                break;
+        case 2:
+                memcpy(dst, &w, 2);
+                break;
+        default:
+                memcpy(dst, &v, 4);
+                break;
         }
-        return res;
 }
 
+/*
+ * Parse whitespace-delimited values, in C notation as strtoul() takes
+ * them, straight out of the input buffer.  As with strtoul(), a leading
+ * '-' negates the value, so "-1" is 0xFFFFFFFF.
+ *
+ * Return: the number of values stored in *@out, or -1 on error.
+ */
 static int
-v120_write_args(const struct rw_args_t *rw, VME_REGION *region,
-                char **argv, int binary)
+parse_ascii(const struct rw_args_t *rw, const struct input_t *in,
+            uint8_t **out)
 {
+        const uint8_t *p = in->data;
+        const uint8_t *end = in->data + in->len;
+        const uint8_t *tok, *num;
+        size_t count = 0, cap = 0;
+        unsigned int base, d;
+        int neg;
+        uint64_t v;
+        uint8_t *buf = NULL, *nbuf;
+
+        init_digval();
+        for (;;) {
+                while (p < end && isspace(*p))
+                        p++;
+                if (p == end)
+                        break;
+
+                tok = p;
+                neg = *p == '-';
+                if (*p == '-' || *p == '+')
+                        p++;
+                base = 10;
+                if (p < end && *p == '0') {
+                        base = 8;
+                        if (end - p > 2 && (p[1] | 0x20) == 'x'
+                            && digval[p[2]] < 16) {
+                                base = 16;
+                                p += 2;
+                        }
+                }
+                v = 0;
+                num = p;
+                while (p < end && (d = digval[*p]) < base) {
+                        v = v * base + d;
+                        if (v > 0xFFFFFFFFU)
+                                break;
+                        p++;
+                }
+                if (p == num || (p < end && !isspace(*p))) {
+                        v120_perror("invalid %zuth value '%.*s'", count,
+                                    (int)(p - tok + (p < end)),
+                                    (const char *)tok);
+                        free(buf);
+                        return -1;
+                }
+
+                if ((count + 1) * rw->size > cap) {
+                        cap += INPUT_GROW;
+                        nbuf = realloc(buf, cap);
+                        if (nbuf == NULL) {
+                                v120_perror("out of memory");
+                                free(buf);
+                                return -1;
+                        }
+                        buf = nbuf;
+                }
+                if (neg)
+                        v = -(uint32_t)v;
+                put_unit(&buf[count * rw->size], v, rw->size);
+                count++;
+        }
+        *out = buf;
+        return count;
+}
+
+static int
+parse_args(const struct rw_args_t *rw, char **argv, uint8_t **out)
+{
+        uint8_t *buf;
         int i;
-        volatile void *dst = region->base;
+
+        buf = malloc((size_t)rw->nunits * rw->size);
+        if (buf == NULL) {
+                v120_perror("out of memory");
+                return -1;
+        }
         for (i = 0; i < rw->nunits; i++) {
                 char *endptr;
                 uint32_t v = strtoul(argv[optind], &endptr, 0);
                 if (endptr == argv[optind] || errno) {
                         v120_perror("failed at writing %dth value '%s'",
                                     i, argv[optind]);
-                        return EXIT_FAILURE;
+                        free(buf);
+                        return -1;
                 }
-                rw->put(dst, v);
-                dst += rw->size;
+                put_unit(&buf[(size_t)i * rw->size], v, rw->size);
                 optind++;
         }
-        return EXIT_SUCCESS;
+        *out = buf;
+        return 0;
+}
+
+/*
+ * Write all of @data to VME, a chunk at a time.  @data may be mapped
+ * or realloc'd input, so DMA goes by way of an aligned bounce buffer.
+ */
+static int
+write_bulk(const struct rw_args_t *rw, const struct v120_args_t *args,
+           VME_REGION *region, const uint8_t *data)
+{
+        size_t total = (size_t)rw->nunits * rw->size;
+        size_t done, len;
+        uint8_t *chunk = NULL;
+        int ret = -1;
+
+        if (args->dma && posix_memalign((void **)&chunk, 4096,
+                                        XFER_CHUNK) != 0) {
+                v120_perror("out of memory");
+                return -1;
+        }
+        for (done = 0; done < total; done += len) {
+                len = total - done < XFER_CHUNK ? total - done : XFER_CHUNK;
+                if (args->dma) {
+                        memcpy(chunk, data + done, len);
+                        if (store_dma(rw, rw->address + done,
+                                      chunk, len) < 0)
+                                goto out;
+                } else {
+                        store_pio(rw, region->base + done, data + done, len);
+                }
+        }
+        ret = 0;
+
+out:
+        free(chunk);
+        return ret;
+}
+
+/* Read everything back, and complain about the first word that differs */
+static int
+verify_bulk(const struct rw_args_t *rw, const struct v120_args_t *args,
+            VME_REGION *region, const uint8_t *data)
+{
+        size_t total = (size_t)rw->nunits * rw->size;
+        size_t done, len, i, bad = 0;
+        uint8_t *chunk;
+        int ret = -1;
+
+        if (posix_memalign((void **)&chunk, 4096, XFER_CHUNK) != 0) {
+                v120_perror("out of memory");
+                return -1;
+        }
+        for (done = 0; done < total; done += len) {
+                len = total - done < XFER_CHUNK ? total - done : XFER_CHUNK;
+                if (args->dma) {
+                        if (fetch_dma(rw, rw->address + done, chunk, len) < 0)
+                                goto out;
+                } else {
+                        fetch_pio(rw, region->base + done, chunk, len);
+                }
+                if (memcmp(chunk, data + done, len) == 0)
+                        continue;
+                for (i = 0; i < len; i += rw->size) {
+                        if (memcmp(&chunk[i], &data[done + i], rw->size) == 0)
+                                continue;
+                        if (bad++ == 0) {
+                                fprintf(stderr, "v120: verify failed at 0x%llX:"
+                                        " wrote 0x%X, read 0x%X\n",
+                                        rw->address + done + i,
+                                        get_unit(&data[done + i], rw->size),
+                                        get_unit(&chunk[i], rw->size));
+                        }
+                }
+        }
+        if (bad != 0) {
+                fprintf(stderr, "v120: %zu of %d words differ\n",
+                        bad, rw->nunits);
+                goto out;
+        }
+        ret = 0;
+
+out:
+        free(chunk);
+        return ret;
 }
 
 #define VME_RETRY       (1UL << 2)
@@ -352,45 +714,149 @@ print_trans_data(V120_HANDLE *v120)
 int
 v120_write(int argc, char **argv, const struct v120_args_t *args)
 {
-        VME_REGION region, *pregion;
+        VME_REGION region;
         int ret = EXIT_FAILURE;
         struct rw_args_t rw;
+        struct input_t in;
+        uint8_t *data = NULL;
+        uint8_t *parsed = NULL;
+        double t0;
+        int count;
 
         if (parse_address(argc, argv, &rw) < 0)
                 return EXIT_FAILURE;
         rw.nunits = optind > argc ? 0 : argc - optind;
-        pregion = rw_open_vme(&region, args, &rw);
-        if (!pregion)
-                return EXIT_FAILURE;
 
         if (set_up_dwidth(&rw, args) < 0)
-                goto err_region;
+                return EXIT_FAILURE;
+        if (check_align(&rw))
+                return EXIT_FAILURE;
+        if (args->dma && rw.size == 1) {
+                v120_perror("DMA needs -dw, -ds or -dl");
+                return EXIT_FAILURE;
+        }
 
-        if (check_align(&rw, &region))
-                goto err_region;
+        /* Have all the data in hand before touching the crate */
+        in.data = NULL;
+        in.len = 0;
+        in.mapped = 0;
+        if (rw.nunits != 0) {
+                if (parse_args(&rw, argv, &parsed) < 0)
+                        return EXIT_FAILURE;
+                data = parsed;
+        } else {
+                if (load_input(args->input, &in) < 0)
+                        return EXIT_FAILURE;
+                if (args->binary) {
+                        data = in.data;
+                        count = in.len / rw.size;
+                } else {
+                        count = parse_ascii(&rw, &in, &parsed);
+                        data = parsed;
+                }
+                if (count <= 0) {
+                        if (count == 0)
+                                v120_perror("expected: at least one value");
+                        goto err_input;
+                }
+                rw.nunits = count;
+        }
 
-        if (rw.nunits == 0)
-                ret = v120_write_stdin(&rw, &region, args->binary);
-        else
-                ret = v120_write_args(&rw, &region, argv, args->binary);
+        if (args->dma) {
+                if (rw_open_crate(args, &rw) < 0)
+                        goto err_input;
+        } else if (rw_open_vme(&region, args, &rw) == NULL) {
+                goto err_input;
+        }
+
+        t0 = now_seconds();
+        if (write_bulk(&rw, args, &region, data) < 0)
+                goto err_region;
+        if (args->verbose)
+                report_rate((size_t)rw.nunits * rw.size, now_seconds() - t0);
+        if (args->verify && verify_bulk(&rw, args, &region, data) < 0)
+                goto err_region;
+        ret = EXIT_SUCCESS;
 
-        if (ret == EXIT_SUCCESS && args->vmeprint)
+        if (args->vmeprint)
                 print_trans_data(rw.v120);
 
 err_region:
         v120_close(rw.v120);
+err_input:
+        free(parsed);
+        if (in.data != NULL)
+                free_input(&in);
+        return ret;
+}
+
+/*
+ * Read the whole range a chunk at a time, by DMA or PIO into a host
+ * buffer, and format each chunk in one go rather than a unit at a time.
+ */
+static int
+read_bulk(const struct rw_args_t *rw, const struct v120_args_t *args,
+          VME_REGION *region, FILE *fp)
+{
+        size_t total = (size_t)rw->nunits * rw->size;
+        size_t done, len;
+        struct outbuf_t *ob;
+        void *chunk;
+        double t0;
+        int ret = EXIT_FAILURE;
+
+        ob = malloc(sizeof(*ob));
+        if (ob == NULL || posix_memalign(&chunk, 4096, XFER_CHUNK) != 0) {
+                v120_perror("out of memory");
+                free(ob);
+                return EXIT_FAILURE;
+        }
+        ob->fp = fp;
+        ob->len = 0;
+        ob->err = 0;
+        init_hextab();
+
+        t0 = now_seconds();
+        for (done = 0; done < total; done += len) {
+                len = total - done < XFER_CHUNK ? total - done : XFER_CHUNK;
+                if (args->dma) {
+                        if (fetch_dma(rw, rw->address + done, chunk, len) < 0)
+                                goto out;
+                } else {
+                        fetch_pio(rw, region->base + done, chunk, len);
+                }
+                emit_chunk(ob, rw, args->format, chunk, len, done);
+                if (ob->err)
+                        break;
+        }
+
+        if (args->format != FMT_RAW) {
+                *out_space(ob, 1) = '\n';
+                ob->len++;
+        }
+        out_flush(ob);
+        if (ob->err || fflush(fp) != 0) {
+                v120_perror("write failed");
+                goto out;
+        }
+        if (args->verbose)
+                report_rate(total, now_seconds() - t0);
+        ret = EXIT_SUCCESS;
+
+out:
+        free(chunk);
+        free(ob);
         return ret;
 }
 
 int
 v120_read(int argc, char **argv, const struct v120_args_t *args)
 {
-        VME_REGION region, *pregion;
+        VME_REGION region;
         int ret = EXIT_FAILURE;
         char *endptr;
-        volatile void *src;
         struct rw_args_t rw;
-        int i;
+        FILE *fp = stdout;
 
         if (parse_address(argc, argv, &rw) < 0)
                 return EXIT_FAILURE;
@@ -404,35 +870,41 @@ v120_read(int argc, char **argv, const struct v120_args_t *args)
                         return EXIT_FAILURE;
                 }
         }
-        pregion = rw_open_vme(&region, args, &rw);
-        if (!pregion)
-                return EXIT_FAILURE;
 
         if (set_up_dwidth(&rw, args) < 0)
-                goto err_region;
+                return EXIT_FAILURE;
+        if (check_align(&rw))
+                return EXIT_FAILURE;
+        if (args->dma && rw.size == 1) {
+                v120_perror("DMA needs -dw, -ds or -dl");
+                return EXIT_FAILURE;
+        }
 
-        if (check_align(&rw, &region))
-                goto err_region;
+        /* DMA goes straight to the crate, so needs no VME window */
+        if (args->dma) {
+                if (rw_open_crate(args, &rw) < 0)
+                        return EXIT_FAILURE;
+        } else if (rw_open_vme(&region, args, &rw) == NULL) {
+                return EXIT_FAILURE;
+        }
 
-        src = region.base;
-        for (i = 0; i < rw.nunits; i++) {
-                if (args->binary) {
-                        rw.printb(src);
-                } else {
-                        if (i)
-                                putchar(' ');
-                        rw.print(src);
+        if (args->output != NULL) {
+                fp = fopen(args->output, args->format == FMT_RAW ? "wb" : "w");
+                if (fp == NULL) {
+                        v120_perror("cannot open '%s'", args->output);
+                        goto err_region;
                 }
-                src += rw.size;
         }
 
-        if (!args->binary)
-                putchar('\n');
+        ret = read_bulk(&rw, args, &region, fp);
 
         if (args->vmeprint)
                 print_trans_data(rw.v120);
 
-        ret = EXIT_SUCCESS;
+        if (fp != stdout && fclose(fp) != 0) {
+                v120_perror("cannot close '%s'", args->output);
+                ret = EXIT_FAILURE;
+        }
 
 err_region:
         v120_close(rw.v120);
@@ -3,73 +3,174 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <time.h>
 
-#define PTR_OFFS(P, BASE)  ((unsigned int)((void *)(P) - (void *)(BASE)))
 #define VME_ACC_EMASK      (0x1FU)
 #define VME_ACC_DTACK      (0x01U)
 #define VME_ACKED(LA)   \
         (((LA) & VME_ACC_EMASK) == VME_ACC_DTACK)
 
+/*
+ * The VME window as remapped for each part of A32: every page below the
+ * ones reserved for v120irqd's clear actions, which are left alone.
+ */
+#define SCAN_WINDOW \
+        ((unsigned long long)V120_PAGE_SIZE * V120_IRQD_FIRST_PAGE)
+
+/* Default probe spacing in A32, where reading every word would take hours */
+#define A32_STRIDE         (0x10000UL)
+
+/*
+ * Where a scan of one address space has got to.  The state carries over
+ * from one window to the next, so a card that straddles two A32 windows
+ * is still reported once.
+ */
+struct scan_t {
+        V120_CONFIG *cfg_regs;
+        volatile uint8_t *vme;
+        unsigned long long base;        /* VME address of vme[0] */
+        unsigned long stride;
+        long long last;                 /* offset last probed in window */
+        int found;                      /* whether that probe was acked */
+        unsigned long long start;
+        unsigned long probes;
+        int count;
+};
+
+/* Read one word, and see whether anything answered */
 static int
-run_scan(V120_HANDLE *v120, V120_CONFIG *cfg_regs, void *vme, uint32_t *top)
+probe(struct scan_t *s, long long off)
 {
-        volatile uint32_t *ptr = (volatile uint32_t *)vme;
-        int found = 0;
-        int count = 0;
-        uint32_t start;
-
-        for (ptr = (volatile uint32_t *)vme; ptr < top; ptr++) {
-                uint32_t lastacc;
-                uint32_t x;
-
-                x = *ptr;
-                (void)x;
-                lastacc = cfg_regs->vme_acc;
-
-                if (lastacc == -1) {
-                        v120_perror("Lost PCIe coms!");
-                        fprintf(stderr, "Current offset: 0x%X\n",
-                                PTR_OFFS(ptr, vme));
-                        return -1;
-                }
+        uint32_t lastacc;
+        uint32_t x;
+
+        x = *(volatile uint32_t *)(s->vme + off);
+        (void)x;
+        lastacc = s->cfg_regs->vme_acc;
+        s->probes++;
 
-                if (found && !VME_ACKED(lastacc)) {
-                        printf("\t0x%08X ---> 0x%08X\n",
-                               start, PTR_OFFS(ptr, vme));
-                        found = 0;
-                } else if (!found && VME_ACKED(lastacc)) {
-                        start = PTR_OFFS(ptr, vme);
-                        found = 1;
-                        ++count;
+        if (lastacc == -1) {
+                v120_perror("Lost PCIe coms!");
+                fprintf(stderr, "Current address: 0x%08llX\n", s->base + off);
+                return -1;
+        }
+        return VME_ACKED(lastacc);
+}
+
+static void
+edge(struct scan_t *s, unsigned long long addr, int acked)
+{
+        if (acked) {
+                s->start = addr;
+                ++s->count;
+        } else {
+                printf("\t0x%08llX ---> 0x%08llX\n", s->start, addr);
+        }
+        s->found = acked;
+}
+
+/*
+ * Probe the word at @off.  If it answers differently from the last one
+ * probed, bisect the gap in between for the exact address where that
+ * changed, rather than reading every word of it.
+ */
+static int
+scan_point(struct scan_t *s, long long off)
+{
+        long long lo, hi, mid;
+        int acked, m;
+
+        acked = probe(s, off);
+        if (acked < 0)
+                return -1;
+        if (acked != s->found) {
+                lo = s->last;
+                hi = off;
+                while (hi - lo > 4) {
+                        mid = lo + ((hi - lo) / 2 & ~3LL);
+                        m = probe(s, mid);
+                        if (m < 0)
+                                return -1;
+                        if (m == acked)
+                                hi = mid;
+                        else
+                                lo = mid;
                 }
+                edge(s, s->base + hi, acked);
+        }
+        s->last = off;
+        return 0;
+}
+
+/*
+ * Scan @len bytes of the window at s->stride.  The last word of the window
+ * is always probed too, so no edge is left between two windows.
+ */
+static int
+scan_window(struct scan_t *s, unsigned long long len)
+{
+        long long off;
+
+        s->last = -4;
+        for (off = 0; off < (long long)len; off += s->stride) {
+                if (scan_point(s, off) < 0)
+                        return -1;
         }
+        if (s->last != (long long)len - 4)
+                return scan_point(s, len - 4);
+        return 0;
+}
+
+static double
+now_seconds(void)
+{
+        struct timespec ts;
 
-        return count;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
 static int
 scan_one_helper(V120_HANDLE *v120, V120_CONFIG *cfg_regs,
-                void *vme, int aw)
+                void *vme, int aw, const struct v120_args_t *args)
 {
-        int page;
-        unsigned long top;
+        unsigned long long top, win, len;
         V120_PD amod;
-        int count;
+        struct scan_t s;
+        double t0;
+        int page;
 
-        top = 1 << aw;
-        amod = (aw == 16) ?  V120_A16 : V120_A24;
+        top = 1ULL << aw;
+        amod = (aw == 16) ? V120_A16 : (aw == 24) ? V120_A24 : V120_A32;
 
-        for (page = 0; page < top / V120_PAGE_SIZE; page++) {
-                v120_configure_page(v120, page, V120_PAGE_SIZE * page,
-                                    V120_SFAST | V120_EAUTO | amod);
-        }
+        s.cfg_regs = cfg_regs;
+        s.vme = vme;
+        s.stride = args->stride ? args->stride : (aw == 32) ? A32_STRIDE : 4;
+        s.found = 0;
+        s.probes = 0;
+        s.count = 0;
         printf("Scanning A%d space...\n", aw);
 
-        count = run_scan(v120, cfg_regs, vme, vme + top);
-        if (count < 0)
-                return -1;
+        t0 = now_seconds();
+        for (win = 0; win < top; win += SCAN_WINDOW) {
+                len = top - win < SCAN_WINDOW ? top - win : SCAN_WINDOW;
+                for (page = 0; page < len / V120_PAGE_SIZE; page++) {
+                        v120_configure_page(v120, page,
+                                            win + V120_PAGE_SIZE * page,
+                                            V120_SFAST | V120_EAUTO | amod);
+                }
+                s.base = win;
+                if (scan_window(&s, len) < 0)
+                        return -1;
+        }
+        if (s.found)
+                edge(&s, top, 0);
 
-        printf("\t%d cards found\n", count);
+        printf("\t%d cards found\n", s.count);
+        if (args->verbose) {
+                printf("\t%lu probes in %.2f s\n", s.probes,
+                       now_seconds() - t0);
+        }
         return 0;
 }
 
@@ -87,11 +188,16 @@ scan_one(V120_HANDLE *v120, void *priv)
                 return EXIT_FAILURE;
         }
 
-        if (scan_one_helper(v120, cfg_regs, vme, 16) < 0)
+        if (scan_one_helper(v120, cfg_regs, vme, 16, args) < 0)
                 return EXIT_FAILURE;
 
-        if (args->awidth == V120_A24) {
-                if (scan_one_helper(v120, cfg_regs, vme, 24) < 0)
+        if (args->awidth == V120_A24 || args->awidth == V120_A32) {
+                if (scan_one_helper(v120, cfg_regs, vme, 24, args) < 0)
+                        return EXIT_FAILURE;
+        }
+
+        if (args->awidth == V120_A32) {
+                if (scan_one_helper(v120, cfg_regs, vme, 32, args) < 0)
                         return EXIT_FAILURE;
         }
 
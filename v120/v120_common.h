@@ -34,6 +34,13 @@ struct v120_args_t {
         unsigned long speed;
         int slot0;
         int verbose;
+        int dma;
+        int format;
+        const char *output;
+        const char *input;
+        int verify;
+        unsigned long stride;
+        int jobs;
 };
 
 /* values of .dwidth field in v120_args_t (NOT a V120_PD type) */
@@ -45,6 +52,15 @@ enum vme_dwidth_t {
         VME_NDWIDTHS,
 };
 
+/* values of .format field in v120_args_t */
+enum read_format_t {
+        FMT_WORDS = 0,
+        FMT_RAW,
+        FMT_HEX,
+        FMT_COLUMNS,
+        FMT_NFORMATS,
+};
+
 /* v120_macro_write() values */
 #define MACRO_FLST_CMD          (0x00000081U)
 #define MACRO_RESET_CMD         (0x00000082U)
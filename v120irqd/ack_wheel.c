@@ -0,0 +1,111 @@
+/**
+ * DOC: Implementation of the v120irqd ACK deadline timer wheel.
+ *
+ * Ticks are counted from the start of the clock, so tick k covers the times
+ * from k*tick up to (k+1)*tick, and lives in slot k % ACK_WHEEL_SLOTS.  The
+ * timeout only spans half the wheel, so a deadline added now can't come
+ * around into a slot that's still to be expired for an earlier tick.
+ *
+ * This software is released under the Modified BSD License, and may be
+ * redistributed according to the terms stated in license.txt, which must
+ * be kept with this file.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include "ack_wheel.h"
+
+/* Start an empty wheel. */
+void ack_wheel_init(struct ack_wheel *w, uint64_t timeout)
+{
+	memset(w, 0, sizeof(*w));
+	w->tick = timeout / (ACK_WHEEL_SLOTS / 2);
+	if (w->tick == 0) w->tick = 1;
+}
+
+/* Push onto the slot for @d->due. */
+static void enqueue(struct ack_wheel *w, struct ack_deadline *d)
+{
+	struct ack_deadline **slot = &w->slot[(d->due / w->tick) % ACK_WHEEL_SLOTS];
+
+	d->next = *slot;
+	*slot = d;
+}
+
+/* Put a deadline on the wheel. */
+bool ack_wheel_add(struct ack_wheel *w, struct ack_deadline *d, uint64_t now)
+{
+	bool was_empty = (w->count == 0);
+
+	if (d->queued) return false;
+
+	/* An idle wheel has nothing behind it to catch up on. */
+	if (was_empty) w->done = now / w->tick;
+
+	d->queued = true;
+	enqueue(w, d);
+	w->count++;
+	return was_empty;
+}
+
+/* Take a deadline off the wheel. */
+void ack_wheel_remove(struct ack_wheel *w, struct ack_deadline *d)
+{
+	struct ack_deadline **pp;
+
+	if (!d->queued) return;
+
+	/* It's wherever it was when it was last queued, so search them all. */
+	for (int i = 0; i < ACK_WHEEL_SLOTS; i++) {
+		for (pp = &w->slot[i]; *pp != NULL; pp = &(*pp)->next) {
+			if (*pp == d) {
+				*pp = d->next;
+				d->next = NULL;
+				d->queued = false;
+				w->count--;
+				return;
+			}
+		}
+	}
+}
+
+/* Take everything that's come due off the wheel. */
+struct ack_deadline * ack_wheel_expire(struct ack_wheel *w, uint64_t now)
+{
+	struct ack_deadline *expired = NULL, *d, *next;
+	uint64_t end = now / w->tick;
+	uint64_t k;
+
+	/* Way behind, every slot is up; no need to go round more than once. */
+	if (end - w->done > ACK_WHEEL_SLOTS) w->done = end - ACK_WHEEL_SLOTS;
+
+	for (k = w->done; k < end; k++) {
+		d = w->slot[k % ACK_WHEEL_SLOTS];
+		w->slot[k % ACK_WHEEL_SLOTS] = NULL;
+		for (; d != NULL; d = next) {
+			next = d->next;
+			if (d->due > now) {
+				/* Pushed back since it went on; on to its new slot. */
+				enqueue(w, d);
+				continue;
+			}
+			d->queued = false;
+			d->next = expired;
+			expired = d;
+			w->count--;
+		}
+	}
+	w->done = end;
+	return expired;
+}
+
+/* When the next tick with anything in it ends. */
+uint64_t ack_wheel_next(const struct ack_wheel *w)
+{
+	if (w->count == 0) return 0;
+	for (uint64_t k = w->done; k < w->done + ACK_WHEEL_SLOTS; k++) {
+		if (w->slot[k % ACK_WHEEL_SLOTS] != NULL) return (k + 1) * w->tick;
+	}
+	return 0;
+}
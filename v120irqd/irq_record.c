@@ -0,0 +1,192 @@
+/**
+ * DOC: Implementation of v120irqd interrupt recordings.
+ *
+ * This software is released under the Modified BSD License, and may be
+ * redistributed according to the terms stated in license.txt, which must
+ * be kept with this file.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "irq_record.h"
+
+/* Write all of @len bytes, or fail. */
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return -errno;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Read up to @len bytes, stopping early only at the end of the file. */
+static ssize_t read_all(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		n = read(fd, p + done, len - done);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return -errno;
+		}
+		if (n == 0) break;
+		done += n;
+	}
+	return done;
+}
+
+/* Start a recording. */
+int irq_record_open(struct irq_recorder *r, const char *path, uint64_t now)
+{
+	struct irq_record_header hdr = {
+		.version = IRQ_RECORD_VERSION,
+		.size = sizeof(struct irq_record),
+		.t_start = now
+	};
+	int err;
+
+	r->fd = -1;
+	r->count = 0;
+	r->written = 0;
+	r->t_start = now;
+
+	r->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (r->fd < 0) {
+		err = -errno;
+		r->fd = -1;
+		return err;
+	}
+	memcpy(hdr.magic, IRQ_RECORD_MAGIC, sizeof(hdr.magic));
+	err = write_all(r->fd, &hdr, sizeof(hdr));
+	if (err) {
+		close(r->fd);
+		r->fd = -1;
+	}
+	return err;
+}
+
+/* Record an interrupt. */
+int irq_record_add(struct irq_recorder *r, const struct v120irqd_selector *sel,
+	unsigned int flags, uint64_t t)
+{
+	struct irq_record *rec;
+
+	if (r->fd < 0) return 0;
+
+	rec = &r->buf[r->count++];
+	rec->t = (t > r->t_start) ? t - r->t_start : 0;
+	rec->vector = sel->vector;
+	rec->crate = v120irqd_ilog2f(sel->crate);
+	rec->irq = v120irqd_ilog2f(sel->irq);
+	rec->flags = flags;
+	rec->reserved = 0;
+
+	if (r->count < IRQ_RECORD_BUFFER) return 0;
+	return irq_record_flush(r);
+}
+
+/* Write out everything buffered. */
+int irq_record_flush(struct irq_recorder *r)
+{
+	int err;
+
+	if (r->fd < 0 || r->count == 0) return 0;
+
+	err = write_all(r->fd, r->buf, r->count * sizeof(*r->buf));
+	if (err) {
+		close(r->fd);
+		r->fd = -1;
+		return err;
+	}
+	r->written += r->count;
+	r->count = 0;
+	return 0;
+}
+
+/* Finish a recording. */
+int irq_record_close(struct irq_recorder *r)
+{
+	int err;
+
+	if (r->fd < 0) return 0;
+
+	err = irq_record_flush(r);
+	if (r->fd >= 0) {
+		if (close(r->fd) && err == 0) err = -errno;
+		r->fd = -1;
+	}
+	return err;
+}
+
+/* Read a whole recording into memory. */
+int irq_record_load(const char *path, struct irq_record **records, size_t *count)
+{
+	struct irq_record_header hdr;
+	struct stat st;
+	ssize_t len;
+	size_t n;
+	int fd, err = 0;
+
+	*records = NULL;
+	*count = 0;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return -errno;
+	if (fstat(fd, &st)) {
+		err = -errno;
+		goto cleanup;
+	}
+	if ((size_t)st.st_size < sizeof(hdr)) {
+		err = -EPROTO;
+		goto cleanup;
+	}
+
+	len = read_all(fd, &hdr, sizeof(hdr));
+	if (len < 0) {
+		err = len;
+		goto cleanup;
+	}
+	if (len != sizeof(hdr) || memcmp(hdr.magic, IRQ_RECORD_MAGIC, sizeof(hdr.magic)) ||
+			hdr.version != IRQ_RECORD_VERSION || hdr.size != sizeof(struct irq_record)) {
+		err = -EPROTO;
+		goto cleanup;
+	}
+
+	n = (st.st_size - sizeof(hdr)) / sizeof(struct irq_record);
+	if (n == 0) goto cleanup;
+	*records = malloc(n * sizeof(struct irq_record));
+	if (*records == NULL) {
+		err = -ENOMEM;
+		goto cleanup;
+	}
+
+	len = read_all(fd, *records, n * sizeof(struct irq_record));
+	if (len < 0) {
+		err = len;
+		free(*records);
+		*records = NULL;
+		goto cleanup;
+	}
+	*count = len / sizeof(struct irq_record);
+
+cleanup:
+	close(fd);
+	return err;
+}
@@ -3,10 +3,13 @@
  *
  * The table is currently stored as a single array, malloced in chunks defined
  * as INTERRUPT_VECTOR_INCR.  This keeps the entire table physically adjacent
- * in hopes of improving cache performance, at the expense of causing fairly
- * slow additions and removals to the table.  Since the table is likely to be
- * configured once at startup and never touched again, this seems like a good
- * trade.
+ * in hopes of improving cache performance.  Removals only mark the entry dead,
+ * and the dead are swept out in one pass later on, so a client dropping all
+ * of its entries at once doesn't hold up interrupt lookups for long.
+ *
+ * Alongside the table each client's entries are chained together, so that
+ * finding everything a client has registered doesn't mean a trip through the
+ * whole table.
  *
  * Other implementation options, which may be more or less efficient, include:
  *		* A linked list.  This was rejected because the extra storage
@@ -85,15 +88,16 @@
  * table is of size 0.  vector_table_end points to the next address past the end
  * of the allocated vector table.
  *
- * Entries can be deleted from the table by setting their values to zero.  Since
- * both crate and irq are bitmasks, neither should be zero for a functional
- * entry.  All valid entries are kept contiguous when elements are deleted, so
- * the first entry with a zero is the last entry that actually exists;
+ * Entries in use run from vector_table up to vector_table_top, and keep the
+ * order they were added in, which is the order they're matched in.  Deleting
+ * one leaves a dead entry, a tombstone, in its place.  compact_table() sweeps
+ * the tombstones out, once there are enough of them to be worth it or the
+ * room is needed.
  *
  * Macros foreach_vector and foreach_vector_st are defined to simplify iterating
- * the table.  foreach_vector will set @ptr to each element in the table, from
- * vector_table until reaching vector_table_end.  foreach_vector_st does the
- * same, but begins at an explicit @start rather than vector_table.
+ * the table.  foreach_vector will set @ptr to each live element in the table,
+ * from vector_table until reaching vector_table_top.  foreach_vector_st does
+ * the same, but begins at an explicit @start rather than vector_table.
  **********************************************************************/
 
 /**
@@ -101,15 +105,71 @@
  * @selector:	A single multibit IRQ definition.
  * @data:		Information about the client requesting @selector.  @data will
  * 				never be 0 for a valid element.
+ * @options:	Malloced extra information about the request, or NULL.  Owned
+ * 				by the table, and freed along with the entry.
+ * @shared:		Registered with register_interrupt_shared(), so other shared
+ * 				entries with an identical @selector may follow it.
+ * @dead:		Deleted, and waiting for compact_table().
+ * @prev:		Index of the previous entry with the same @data, or -1.
+ * @next:		Index of the next entry with the same @data, or -1.
  */
 typedef struct table_t {
 	struct v120irqd_selector selector;
 	irqdata_t data;
+	void *options;
+	bool shared;
+	bool dead;
+	int prev;
+	int next;
 } table_t;
 
 static table_t * vector_table = NULL;
+static table_t * vector_table_top = NULL;
 static table_t * vector_table_end = NULL;
 
+/* The number of dead entries below vector_table_top. */
+static unsigned int vector_table_dead = 0;
+
+/**
+ * struct client_t - Where to find one client's entries.
+ * @data:		The client data.
+ * @first:		Index of the client's most recently added entry.
+ * @count:		The number of entries the client has.
+ */
+typedef struct client_t {
+	irqdata_t data;
+	int first;
+	unsigned int count;
+} client_t;
+
+/* Every client with at least one entry, in no particular order. */
+static client_t * client_list = NULL;
+static unsigned int client_count = 0;
+static unsigned int client_allocated = 0;
+
+/* How to dispose of an entry's options. */
+static void (*options_destructor)(void *) = free;
+
+/* The number of entries covering each crate and IRQ level, indexed as
+ * refcount[crate][irq].
+ */
+static unsigned int refcount[16][8];
+
+/**
+ * count_entry() - Add or remove an entry's contribution to the refcounts.
+ * @sel:	The entry's selector.
+ * @delta:	1 for an entry being added, -1 for one going away.
+ */
+static void count_entry(const struct v120irqd_selector * sel, int delta)
+{
+	for (int crate = 0; crate < 16; crate++) {
+		if (!(sel->crate & (1 << crate))) continue;
+		for (int irq = 1; irq <= 7; irq++) {
+			if (sel->irq & (1 << irq)) refcount[crate][irq] += delta;
+		}
+	}
+}
+
 /**
  * vector_table_allocated() - Return the total number of allocated vectors.
  *
@@ -117,8 +177,8 @@ static table_t * vector_table_end = NULL;
  */
 static unsigned vector_table_allocated(void) {return vector_table_end - vector_table;}
 
-/* Iterate over the table, from start until the last valid element. */
-#define foreach_vector_st(ptr, start)	for (ptr=start; (ptr<vector_table_end) && (ptr->data!=0); ptr++)
+/* Iterate over the live entries of the table, from start to the top. */
+#define foreach_vector_st(ptr, start)	for (ptr=start; ptr<vector_table_top; ptr++) if (!ptr->dead)
 
 /* Iterate over the entire vector table. */
 #define foreach_vector(ptr)				foreach_vector_st(ptr, vector_table)
@@ -172,12 +232,12 @@ static unsigned vector_table_allocated(void) {return vector_table_end - vector_t
 static table_t * locate_interrupt(const struct v120irqd_selector * request, table_t * const start)
 {
 	table_t *ptr;
-	uint32_t pvec;
 	foreach_vector_st(ptr, start) {
-		/* All bits in the request are set in the entry if we've got a match. */
+		/* All bits in the request are set in the entry if we've got a match;
+		 * the cheap test weeds out most of the table.
+		 */
 		if (!hashmatch(&ptr->selector, request)) continue;
-		pvec = ptr->selector.vector;
-		if ((pvec == ANYVECTOR) || (pvec == request->vector)) {
+		if (v120irqd_selector_covers(&ptr->selector, request)) {
 			return ptr;
 		}
 	}
@@ -185,33 +245,173 @@ static table_t * locate_interrupt(const struct v120irqd_selector * request, tabl
 }
 
 /**
- * remove_entry() - Move the entire list up one to replace victim.
+ * find_client() - Find a client's place in the client list.
+ * @sd:		The client data.
+ *
+ * Warning: The mutex should already be locked when this function is called.
+ *
+ * Return: The client, or NULL if it has no entries.
+ */
+static client_t * find_client(irqdata_t sd)
+{
+	for (unsigned int i = 0; i < client_count; i++) {
+		if (client_list[i].data == sd) return &client_list[i];
+	}
+	return NULL;
+}
+
+/**
+ * forget_client() - Take a client with no entries left off the client list.
+ * @client:	The client.
+ *
+ * Warning: The mutex should already be locked when this function is called.
+ */
+static void forget_client(client_t * client)
+{
+	*client = client_list[--client_count];
+}
+
+/**
+ * link_entry() - Chain a new entry onto its client's list.
+ * @ptr:	The entry, with its data already set.
+ *
+ * Warning: The mutex should already be locked when this function is called.
+ *
+ * Return: Standard success.
+ */
+static int link_entry(table_t * ptr)
+{
+	client_t *client = find_client(ptr->data);
+	int idx = ptr - vector_table;
+
+	if (client == NULL) {
+		if (client_count == client_allocated) {
+			unsigned int n = client_allocated + INTERRUPT_VECTOR_INCR;
+			client = realloc(client_list, n * sizeof(client_t));
+			if (client == NULL) {
+				logerror("couldn't increase client list: %s", strerror(errno));
+				return -errno;
+			}
+			client_list = client;
+			client_allocated = n;
+		}
+		client = &client_list[client_count++];
+		client->data = ptr->data;
+		client->first = -1;
+		client->count = 0;
+	}
+
+	ptr->prev = -1;
+	ptr->next = client->first;
+	if (client->first >= 0) vector_table[client->first].prev = idx;
+	client->first = idx;
+	client->count++;
+	return 0;
+}
+
+/**
+ * kill_entry() - Turn an entry into a tombstone.
  * @victim		The table entry to be deleted.
  *
- * This is slow, but it's not like this is an operation happening often. The
- * entry where the end of the list had been is zeroed out to mark it invalid.
+ * This leaves the entry on its client's list; the caller has to unlink it.
+ *
+ * Warning: The mutex should already be locked when this function is called.
+ */
+static void kill_entry(table_t * victim)
+{
+	if (victim->options != NULL) options_destructor(victim->options);
+	victim->options = NULL;
+	count_entry(&victim->selector, -1);
+	victim->dead = true;
+	vector_table_dead++;
+}
+
+/**
+ * remove_entry() - Delete one entry from the table.
+ * @victim		The table entry to be deleted.
  *
  * Warning: The mutex should already be locked when this function is called.
  */
 static void remove_entry(table_t * victim)
 {
-	table_t *last;
+	client_t *client = find_client(victim->data);
+
+	assert(client != NULL);
+	if (victim->prev >= 0) {
+		vector_table[victim->prev].next = victim->next;
+	} else {
+		client->first = victim->next;
+	}
+	if (victim->next >= 0) vector_table[victim->next].prev = victim->prev;
+	if (--client->count == 0) forget_client(client);
+
+	kill_entry(victim);
+}
+
+/**
+ * compact_table() - Sweep the dead entries out of the table.
+ *
+ * The live entries are moved down over the dead ones, keeping their order,
+ * and the client chains are fixed up to match.  If there isn't the memory to
+ * do that, the tombstones just stay where they are for now.
+ *
+ * Warning: The mutex should already be locked when this function is called.
+ */
+static void compact_table(void)
+{
+	int *moved, top, n, i;
 
-	/* Find the last entry in the list.  Definitionally it's >= victim. */
-	foreach_vector_st(last, victim) { ; }
-	last--;
+	if (vector_table_dead == 0) return;
 
-	/* Copy everything past the victim down one entry. */
-	if (last != victim) {
-		memmove(victim, victim+1, (last-victim)*sizeof(table_t));
+	top = vector_table_top - vector_table;
+	moved = malloc(top * sizeof(int));
+	if (moved == NULL) {
+		logwarn("couldn't compact table: %s", strerror(errno));
+		return;
 	}
 
-	/* Set the last entry (which has also been copied down one) to zero. */
-	memset(last, 0, sizeof(table_t));
+	/* Where each live entry is going to, then move it there. */
+	for (i = n = 0; i < top; i++) {
+		moved[i] = vector_table[i].dead ? -1 : n++;
+	}
+	for (i = 0; i < top; i++) {
+		table_t *ptr = &vector_table[i];
+		if (ptr->dead) continue;
+		if (ptr->prev >= 0) ptr->prev = moved[ptr->prev];
+		if (ptr->next >= 0) ptr->next = moved[ptr->next];
+		if (moved[i] != i) vector_table[moved[i]] = *ptr;
+	}
+	for (unsigned int c = 0; c < client_count; c++) {
+		client_list[c].first = moved[client_list[c].first];
+	}
+	free(moved);
+
+	memset(vector_table + n, 0, (top - n) * sizeof(table_t));
+	vector_table_top = vector_table + n;
+	vector_table_dead = 0;
+}
+
+/**
+ * tidy_table() - Compact the table if it's more dead than alive.
+ *
+ * Warning: The mutex should already be locked when this function is called.
+ */
+static void tidy_table(void)
+{
+	unsigned int top = vector_table_top - vector_table;
+	if (vector_table_dead >= INTERRUPT_VECTOR_INCR && vector_table_dead * 2 >= top) {
+		compact_table();
+	}
 }
 
 /* Look up an actual interrupt to determine who and how to return it. */
 irqdata_t find_interrupt(struct v120irqd_selector * request)
+{
+	return find_interrupt_opts(request, NULL);
+}
+
+/* As find_interrupt(), and also return the entry's options. */
+irqdata_t find_interrupt_opts(struct v120irqd_selector * request, void ** options)
 {
 	int e;
 	irqdata_t ret;
@@ -230,6 +430,7 @@ irqdata_t find_interrupt(struct v120irqd_selector * request)
 	} else {
 		ret = ptr->data;
 		request->payload = ptr->selector.payload;
+		if (options != NULL) *options = ptr->options;
 	}
 
 	if ((e = pthread_mutex_unlock(&irq_mutex))) {
@@ -240,12 +441,92 @@ irqdata_t find_interrupt(struct v120irqd_selector * request)
 	return ret;
 }
 
-/* Add one entry to the table, allocating more memory for the table if needed. */
-int register_interrupt(irqdata_t sd, const struct v120irqd_selector * request)
+/* Every recipient of an actual interrupt. */
+int find_interrupt_targets(const struct v120irqd_selector * request,
+	struct irq_target targets[IRQ_TARGETS_MAX])
+{
+	int e, ret;
+	const table_t *first, *ptr;
+
+	if ((e = pthread_mutex_lock(&irq_mutex))) {
+		logerror("failed pthread_mutex_lock: %s", strerror(e));
+		return -e;
+	}
+
+	first = locate_interrupt(request, vector_table);
+	if (first == NULL) {
+		ret = -EINVAL;
+		goto freemutex;
+	}
+
+	targets[0].data = first->data;
+	targets[0].payload = first->selector.payload;
+	targets[0].options = first->options;
+	ret = 1;
+	if (first->shared) {
+		foreach_vector_st(ptr, first+1) {
+			if (!ptr->shared || !hasheq(&ptr->selector, &first->selector)) continue;
+			if (ret == IRQ_TARGETS_MAX) break;
+			targets[ret].data = ptr->data;
+			targets[ret].payload = ptr->selector.payload;
+			targets[ret].options = ptr->options;
+			ret++;
+		}
+	}
+
+freemutex:
+	if ((e = pthread_mutex_unlock(&irq_mutex))) {
+		logerror("failed pthread_mutex_unlock: %s", strerror(e));
+		ret = -e;
+	}
+	return ret;
+}
+
+/* The first unshared recipient of an interrupt that isn't passed over. */
+int find_interrupt_fallback(const struct v120irqd_selector * request,
+	struct irq_target * target, bool (*skip)(irqdata_t))
+{
+	int e, ret = -EINVAL;
+	const table_t *ptr;
+
+	if ((e = pthread_mutex_lock(&irq_mutex))) {
+		logerror("failed pthread_mutex_lock: %s", strerror(e));
+		return -e;
+	}
+
+	for (ptr = locate_interrupt(request, vector_table); ptr != NULL;
+			ptr = locate_interrupt(request, (table_t *)ptr+1)) {
+		if (ptr->shared || skip(ptr->data)) continue;
+		target->data = ptr->data;
+		target->payload = ptr->selector.payload;
+		target->options = ptr->options;
+		ret = 0;
+		break;
+	}
+
+	if ((e = pthread_mutex_unlock(&irq_mutex))) {
+		logerror("failed pthread_mutex_unlock: %s", strerror(e));
+		ret = -e;
+	}
+	return ret;
+}
+
+/**
+ * add_entry() - Add one entry to the table, allocating more memory for the
+ * table if needed.
+ * @sd:			The client data.
+ * @request:	The multibit request.
+ * @options:	Options to be owned by the entry on success.
+ * @shared:		Whether the entry may be shared.
+ *
+ * Return: Standard success, as for register_interrupt_shared().
+ */
+static int add_entry(irqdata_t sd, const struct v120irqd_selector * request,
+	void * options, bool shared)
 {
 	int e, ret;
 	table_t *ptr;
-	unsigned int old_count, new_count;
+	unsigned int old_count, new_count, sharers;
 
 	logdebug("request for %04X:%02X:%08X",
 		request->crate, request->irq, request->vector);
@@ -269,9 +550,17 @@ int register_interrupt(irqdata_t sd, const struct v120irqd_selector * request)
 		return -e;
 	}
 
-	/* Make sure that no one has already claimed this interrupt. */
-	ptr = locate_interrupt(request, vector_table);
-	if (ptr != NULL) {
+	/* Make sure that no one has already claimed this interrupt, other than
+	 * other subscribers we can share it with.
+	 */
+	sharers = 0;
+	for (ptr = locate_interrupt(request, vector_table); ptr != NULL;
+			ptr = locate_interrupt(request, ptr+1)) {
+		if (shared && ptr->shared && ptr->data != sd &&
+				hasheq(&ptr->selector, request)) {
+			sharers++;
+			continue;
+		}
 		logerror("%04X:%02X:%08X already registered as %04X:%02X:%08X",
 			request->crate, request->irq, request->vector,
 			ptr->selector.crate, ptr->selector.irq, ptr->selector.vector
@@ -279,14 +568,16 @@ int register_interrupt(irqdata_t sd, const struct v120irqd_selector * request)
 		ret = -EADDRINUSE;
 		goto freemutex;
 	}
-
-	/* Find the first unused entry in the table */
-	if (vector_table == NULL) {
-		assert(vector_table_end == NULL);
-		ptr = NULL;
-	} else {
-		foreach_vector(ptr) { ; }
+	if (sharers >= IRQ_TARGETS_MAX) {
+		logerror("%04X:%02X:%08X already has %u subscribers",
+			request->crate, request->irq, request->vector, sharers);
+		ret = -ENOSPC;
+		goto freemutex;
 	}
+
+	/* Take the first unused entry in the table, making room if need be. */
+	if (vector_table_top == vector_table_end) compact_table();
+	ptr = vector_table_top;
 	if (ptr == vector_table_end) {
 		/* Looks like we're gonna need a bigger table. */
 		old_count = vector_table_allocated();
@@ -306,8 +597,17 @@ int register_interrupt(irqdata_t sd, const struct v120irqd_selector * request)
 
 	/* Push this vector into the first unused entry. */
 	ptr->data = sd;
+	ret = link_entry(ptr);
+	if (ret) {
+		ptr->data = 0;
+		goto freemutex;
+	}
 	ptr->selector = *request;
-	ret = 0;
+	ptr->options = options;
+	ptr->shared = shared;
+	ptr->dead = false;
+	vector_table_top = ptr + 1;
+	count_entry(request, 1);
 
 freemutex:
 	if ((e = pthread_mutex_unlock(&irq_mutex))) {
@@ -317,6 +617,26 @@ freemutex:
 	return ret;
 }
 
+/* Add one unshared entry to the table. */
+int register_interrupt(irqdata_t sd, const struct v120irqd_selector * request)
+{
+	return register_interrupt_opts(sd, request, NULL);
+}
+
+/* As register_interrupt(), with options to be kept alongside. */
+int register_interrupt_opts(irqdata_t sd, const struct v120irqd_selector * request,
+	void * options)
+{
+	return add_entry(sd, request, options, false);
+}
+
+/* As register_interrupt_opts(), letting others subscribe to the same thing. */
+int register_interrupt_shared(irqdata_t sd, const struct v120irqd_selector * request,
+	void * options)
+{
+	return add_entry(sd, request, options, true);
+}
+
 /* Remove one exact entry from the table. */
 int release_interrupt(irqdata_t sd, const struct v120irqd_selector * request)
 {
@@ -332,12 +652,12 @@ int release_interrupt(irqdata_t sd, const struct v120irqd_selector * request)
 		return -e;
 	}
 
-	/* Find this exact request in the table. */
+	/* Find this exact request in the table, which may be shared. */
 	current = NULL;
 	foreach_vector(ptr) {
 		if (hasheq(&ptr->selector, request)) {
 			current = ptr;
-			break;
+			if (ptr->data == sd) break;
 		}
 	}
 	if (current == NULL) {
@@ -354,6 +674,7 @@ int release_interrupt(irqdata_t sd, const struct v120irqd_selector * request)
 	}
 
 	remove_entry(current);
+	tidy_table();
 	ret = 0;
 
 freemutex:
@@ -375,8 +696,8 @@ unsigned count_registered_interrupts() {
 		return -e;
 	}
 
-	foreach_vector(end) { ; }
-	ret = end - vector_table;
+	end = vector_table_top;
+	ret = (end - vector_table) - vector_table_dead;
 
 	if ((e = pthread_mutex_unlock(&irq_mutex))) {
 		logerror("failed pthread_mutex_unlock: %s", strerror(e));
@@ -388,18 +709,22 @@ unsigned count_registered_interrupts() {
 /* Wipe out all entries whose data is sd. */
 int release_all_interrupts(irqdata_t sd)
 {
-	int e;
-	table_t * ptr;
+	int e, idx;
+	client_t * client;
 
 	if ((e = pthread_mutex_lock(&irq_mutex))) {
 		logerror("failed pthread_mutex_lock: %s", strerror(e));
 		return -e;
 	}
 
-	foreach_vector(ptr) {
-		while (ptr->data == sd) {
-			remove_entry(ptr);
+	/* Straight down the client's own chain; nobody else's are touched. */
+	client = find_client(sd);
+	if (client != NULL) {
+		for (idx = client->first; idx >= 0; idx = vector_table[idx].next) {
+			kill_entry(&vector_table[idx]);
 		}
+		forget_client(client);
+		tidy_table();
 	}
 
 	if ((e = pthread_mutex_unlock(&irq_mutex))) {
@@ -412,20 +737,61 @@ int release_all_interrupts(irqdata_t sd)
 /* Clear the entire table. */
 void free_all_interrupts(void)
 {
+	table_t *ptr;
+	foreach_vector(ptr) {
+		if (ptr->options != NULL) options_destructor(ptr->options);
+	}
 	free(vector_table);
-	vector_table = vector_table_end = NULL;
+	vector_table = vector_table_top = vector_table_end = NULL;
+	vector_table_dead = 0;
+	free(client_list);
+	client_list = NULL;
+	client_count = client_allocated = 0;
+	memset(refcount, 0, sizeof(refcount));
 }
 
-/* For each crate return a bitmask of all active IRQs. */
-void list_registered_interrupts(uint8_t irqs[16]) {
+/* Visit every live entry, in table order. */
+int walk_interrupts(int (*fn)(irqdata_t sd, const struct v120irqd_selector * request,
+	void * options, bool shared, void * arg), void * arg)
+{
+	int e, ret = 0;
 	table_t *ptr;
-	int crate;
-	memset(irqs, 0, 16);
+
+	if ((e = pthread_mutex_lock(&irq_mutex))) {
+		logerror("failed pthread_mutex_lock: %s", strerror(e));
+		return -e;
+	}
+
 	foreach_vector(ptr) {
-		for (crate = 0; crate < 16; crate++) {
-			if (ptr->selector.crate & (1 << crate)) {
-				irqs[crate] |= ptr->selector.irq;
-			}
-		}
+		ret = fn(ptr->data, &ptr->selector, ptr->options, ptr->shared, arg);
+		if (ret) break;
+	}
+
+	if ((e = pthread_mutex_unlock(&irq_mutex))) {
+		logerror("failed pthread_mutex_unlock: %s", strerror(e));
+		ret = -e;
+	}
+	return ret;
+}
+
+/* Replace free() as the way to get rid of options. */
+void set_options_destructor(void (*fn)(void *))
+{
+	options_destructor = (fn != NULL) ? fn : free;
+}
+
+/* For each crate return a bitmask of all active IRQs. */
+void list_registered_interrupts(uint8_t irqs[16]) {
+	for (int crate = 0; crate < 16; crate++) {
+		irqs[crate] = registered_irqs(crate);
+	}
+}
+
+/* The active IRQs of one crate, from the refcounts. */
+uint8_t registered_irqs(int crate) {
+	uint8_t irqs = 0;
+	for (int irq = 1; irq <= 7; irq++) {
+		if (refcount[crate][irq]) irqs |= (1 << irq);
 	}
+	return irqs;
 }
@@ -0,0 +1,80 @@
+/**
+ * DOC: Implementation of the v120irqd latency histograms.
+ *
+ * Bucket n, for n below LATENCY_SUB_COUNT, holds exactly the value n.  Past
+ * that, buckets come in rows of LATENCY_SUB_COUNT, one row for each power of
+ * two, and a value lands in its row according to the LATENCY_SUB_BITS bits
+ * right below its leading one.
+ *
+ * This software is released under the Modified BSD License, and may be
+ * redistributed according to the terms stated in license.txt, which must
+ * be kept with this file.
+ */
+
+#include "latency_histogram.h"
+
+/* Which bucket does @v go in? */
+static unsigned int bucket_of(uint64_t v)
+{
+	unsigned int e;
+
+	if (v < LATENCY_SUB_COUNT) return v;
+
+	e = 63 - __builtin_clzll(v);
+	if (e > LATENCY_MAX_EXP) return LATENCY_BUCKETS - 1;
+	return LATENCY_SUB_COUNT +
+		(e - LATENCY_SUB_BITS) * LATENCY_SUB_COUNT +
+		((v >> (e - LATENCY_SUB_BITS)) & (LATENCY_SUB_COUNT - 1));
+}
+
+/* The largest value that would go into bucket @n. */
+static uint64_t bucket_top(unsigned int n)
+{
+	unsigned int row, sub;
+
+	if (n < LATENCY_SUB_COUNT) return n;
+
+	row = (n - LATENCY_SUB_COUNT) / LATENCY_SUB_COUNT;
+	sub = (n - LATENCY_SUB_COUNT) % LATENCY_SUB_COUNT;
+	return (((uint64_t)(LATENCY_SUB_COUNT + sub + 1)) << row) - 1;
+}
+
+void latency_record(latency_histogram *h, uint64_t ns)
+{
+	h->counts[bucket_of(ns)]++;
+	h->total++;
+	if (ns > h->max) h->max = ns;
+}
+
+void latency_merge(latency_histogram *into, const latency_histogram *from)
+{
+	unsigned int n;
+
+	for (n = 0; n < LATENCY_BUCKETS; n++) {
+		into->counts[n] += from->counts[n];
+	}
+	into->total += from->total;
+	if (from->max > into->max) into->max = from->max;
+}
+
+uint64_t latency_percentile(const latency_histogram *h, uint32_t ppm)
+{
+	uint64_t target, seen;
+	unsigned int n;
+
+	if (h->total == 0) return 0;
+
+	/* The rank of the value we're after, rounded up, and at least 1. */
+	target = (h->total * ppm + 999999) / 1000000;
+	if (target == 0) target = 1;
+
+	seen = 0;
+	for (n = 0; n < LATENCY_BUCKETS; n++) {
+		seen += h->counts[n];
+		if (seen >= target) {
+			uint64_t top = bucket_top(n);
+			return (top < h->max) ? top : h->max;
+		}
+	}
+	return h->max;
+}
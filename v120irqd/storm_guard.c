@@ -0,0 +1,66 @@
+/**
+ * DOC: Implementation of the v120irqd interrupt storm protection.
+ *
+ * Tokens are counted in billionths, so that refilling at @rate per second is
+ * just @rate added per nanosecond, with no division in the interrupt path
+ * unless the bucket might have filled all the way back up.
+ *
+ * This software is released under the Modified BSD License, and may be
+ * redistributed according to the terms stated in license.txt, which must
+ * be kept with this file.
+ */
+
+#include "storm_guard.h"
+
+#define TOKEN	1000000000ULL
+
+/* Take a token, refilling the bucket for the time since the last one. */
+bool storm_allow(struct storm_guard *g, uint32_t rate, uint32_t burst, uint64_t now)
+{
+	const uint64_t full = (uint64_t)burst * TOKEN;
+	uint64_t elapsed;
+
+	if (rate == 0) return true;
+
+	elapsed = now - g->t_refill;
+	g->t_refill = now;
+	if (elapsed >= full / rate) {
+		g->tokens = full;
+	} else {
+		g->tokens += elapsed * rate;
+		if (g->tokens > full) g->tokens = full;
+	}
+
+	/* Quiet for twice as long as it was last masked; forgive it. */
+	if (elapsed > 2 * g->backoff) g->backoff = 0;
+
+	if (g->tokens < TOKEN) {
+		g->suppressed++;
+		return false;
+	}
+	g->tokens -= TOKEN;
+	return true;
+}
+
+/* Mask for twice as long as last time. */
+uint64_t storm_mask(struct storm_guard *g, uint64_t now)
+{
+	if (g->backoff == 0) {
+		g->backoff = STORM_BACKOFF_MIN;
+	} else if (g->backoff < STORM_BACKOFF_MAX / 2) {
+		g->backoff *= 2;
+	} else {
+		g->backoff = STORM_BACKOFF_MAX;
+	}
+	g->storms++;
+	g->t_rearm = now + g->backoff;
+	return g->t_rearm;
+}
+
+/* Unmask once the time is up. */
+bool storm_rearm_due(struct storm_guard *g, uint64_t now)
+{
+	if (g->t_rearm == 0 || g->t_rearm > now) return false;
+	g->t_rearm = 0;
+	return true;
+}
@@ -6,7 +6,8 @@
  * better tuned to a customer application.
  *
  * Sending a USR1 signal to the daemon will dump the current server status
- * information to syslog.
+ * information, and the interrupt latency of every active crate and IRQ level,
+ * to syslog.
  *
  * The use of the interrupt dispatcher is an all-or-nothing proposition.  If
  * you're going to use it; then the dispatcher should have sole responsibility
@@ -25,15 +26,22 @@
 
 
 #define _GNU_SOURCE 1
+#include <ctype.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <poll.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 
 #include "config.h"
@@ -42,18 +50,15 @@
 
 #include "v120irqd_intl.h"
 #include "irq_vector_table.h"
+#include "latency_histogram.h"
+#include "storm_guard.h"
+#include "ack_wheel.h"
+#include "irq_record.h"
 
 #ifndef VERSION
 #  error No VERSION defined.
 #endif
 
-#ifdef HAVE_MMAN_H
-#  include <sys/mman.h>
-#  ifdef HAVE_SCHED_H
-#    include <sched.h>
-#  endif
-#endif
-
 /**********************************************************************
  * Global variables
  **********************************************************************/
@@ -62,10 +67,12 @@
  * keep it in the following order:
  * 0 <= n < len_crates				VME endpoints
  * len_crates						UNIX socket accept point
- * len_crates < n < len_pollfds		Open client connections
+ * len_crates+1						Timer for re-enabling masked interrupts
+ * 									and for ACK deadlines
+ * len_crates+1 < n < len_pollfds	Open client connections
  *
  * That's also the appending order: first VME endpoints, then the
- * socket accept, then the dynamically resizing open clients list.
+ * socket accept and timer, then the dynamically resizing open clients list.
  *
  * We'll also have two functions for working with the list.  In the
  * event that something stupid happens to those functions, we'll just
@@ -77,17 +84,292 @@ static struct pollfd* list_pollfds = NULL;
 static unsigned int len_crates = 0;
 static unsigned int len_pollfds = 0;
 
+/**
+ * struct client_stats - What a client has been sent, and how it answered.
+ * @delivered:	Interrupts sent.
+ * @naks:		Of the answers, the NAKs.
+ * @answers:	Answers to notifications.
+ * @ack_total:	Time from notification to answer, over all the @answers.
+ * @ack_max:	Longest time from notification to answer.
+ * @t_signal:	When the last notification went out.  A client answers in
+ * 				order, so for one with several outstanding, the time to an
+ * 				answer is counted from the most recent.
+ */
+struct client_stats {
+	uint64_t delivered;
+	uint64_t naks;
+	uint64_t answers;
+	uint64_t ack_total;
+	uint64_t ack_max;
+	uint64_t t_signal;
+};
+
+/**
+ * struct client_t - Everything the server knows about one client connection.
+ * @fd:			The client socket.
+ * @features:	V120IRQD_FEATURE_* bits agreed on with HELLO.
+ * @unacked:	Notifications sent without waiting, whose ACK hasn't arrived.
+ * @deadline:	When the oldest of the @unacked has to be answered by.
+ * @slow:		The client has missed a deadline, and won't be waited on again
+ * 				until it's answered everything.
+ * @timeouts:	Times the client has been marked slow.
+ * @tag:		The tag of the request being answered, with
+ * 				V120IRQD_FEATURE_MUX; otherwise always 0.
+ * @deferred:	Requests set aside by recv_answer(), oldest first.
+ * @ndeferred:	The number of them.
+ * @pid:		The client's process, or 0 if unknown.
+ * @stats:		What it's been sent, and how it answered.
+ *
+ * The irqdata_t that the vector table associates with a client's interrupt
+ * requests is a pointer to its client_t.
+ */
+struct client_t {
+	int fd;
+	unsigned int features;
+	unsigned int unacked;
+	struct ack_deadline deadline;
+	bool slow;
+	uint64_t timeouts;
+	uint16_t tag;
+	struct deferred_frame *deferred;
+	unsigned int ndeferred;
+	pid_t pid;
+	struct client_stats stats;
+};
+
+/* Anything a client may send. */
+union client_frame {
+	response_buffer resp;
+	clear_buffer clear;
+	dma_buffer dma;
+	subscribe_buffer sub;
+};
+
+/**
+ * struct deferred_frame - A request that arrived ahead of an answer.
+ * @next:	The one that arrived after it.
+ * @t_wake:	When it was read.
+ * @in:		The request.
+ */
+struct deferred_frame {
+	struct deferred_frame *next;
+	uint64_t t_wake;
+	union client_frame in;
+};
+
+/* The most requests set aside for one client before it's taken as broken. */
+#define DEFERRED_MAX	64
+
+/* The number of requests set aside, over all the clients. */
+static unsigned int deferred_total = 0;
+
+/* list_clients[n] is the client_t for list_pollfds[n], or NULL for the VME
+ * endpoints and the accept socket.  It's resized right along with
+ * list_pollfds.
+ */
+static struct client_t ** list_clients = NULL;
+
 static struct {
 	bool allowFakeIrq;
 	int debugMode;
 	int noDaemon;
 	int noVME;
+	uint32_t stormRate;
+	uint32_t stormBurst;
+	uint64_t busyWindow;
+	bool busyAlways;
+	cpu_set_t cpus;
+	uint64_t ackTimeout;
+	bool fallback;
+	const char *recordFile;
+	bool takeover;
+	uint16_t crates;
+	const char *socketName;
+	int priority;
+	int mlock;
 } settings;
 
+/* What --mlock keeps in memory. */
+enum mlock_policy {
+	MLOCK_ALL,
+	MLOCK_CURRENT,
+	MLOCK_NONE
+};
+
+/* Busy polling spins in slices of this many ns, checking the sockets and the
+ * timer in between.
+ */
+#ifndef BUSY_SLICE
+#  define BUSY_SLICE	(50 * 1000)
+#endif
+
+/* How long a client gets to answer a notification, in ns, unless changed with
+ * --ack-timeout.
+ */
+#ifndef ACK_TIMEOUT
+#  define ACK_TIMEOUT	(1000ULL * 1000 * 1000)
+#endif
+
+/* The deadlines of clients with answers outstanding, and when the timer is
+ * set for, or 0 if it isn't.
+ */
+static struct ack_wheel wheel;
+static uint64_t timer_due;
+
+/* The recording of every interrupt found, with --record. */
+static struct irq_recorder recorder = { .fd = -1 };
+
+/* The new server that asked to take over, once it's been let. */
+static struct client_t * successor = NULL;
+
+/**
+ * struct handoff_state - What a new server was handed, until it's restored.
+ * @start:		The HANDOFF_START record, once it's arrived.
+ * @listen:		The listening socket, or -1.
+ * @client:		The HANDOFF_CLIENT records, in order.
+ * @client_fd:	Their sockets.
+ * @nclients:	The number of @client so far.
+ * @entry:		The HANDOFF_ENTRY records, in table order.
+ * @entry_fd:	Their descriptors, or -1.
+ * @nentries:	The number of @entry so far.
+ * @recording:	The HANDOFF_RECORDING record, if @record_fd isn't -1.
+ * @record_fd:	The recording, or -1.
+ */
+static struct handoff_state {
+	handoff_buffer start;
+	int listen;
+	handoff_buffer *client;
+	int *client_fd;
+	unsigned int nclients;
+	handoff_buffer *entry;
+	int *entry_fd;
+	unsigned int nentries;
+	handoff_buffer recording;
+	int record_fd;
+} handoff = { .listen = -1, .record_fd = -1 };
+
+/**
+ * struct ack_stats - How clients have been keeping up.
+ * @timeouts:	Times any client has been marked slow.
+ * @rerouted:	Interrupts given to a fallback because their client was slow.
+ * @held:		Interrupts held back because their client was slow, and the
+ * 				server couldn't clear them itself.
+ * @stale_dma:	DMA reads skipped because their client hadn't answered for
+ * 				what was already in the buffer.
+ */
+static struct ack_stats {
+	uint64_t timeouts;
+	uint64_t rerouted;
+	uint64_t held;
+	uint64_t stale_dma;
+} acks;
+
+/**
+ * struct busy_stats - Where the busy polling time goes.
+ * @until:		Keep spinning until this time, after the last interrupt.
+ * @spin_ns:	Total time spent spinning.
+ * @caught:		Interrupts found by spinning.
+ * @woken:		Interrupts found after the driver woke us up.
+ */
+static struct busy_stats {
+	uint64_t until;
+	uint64_t spin_ns;
+	uint64_t caught;
+	uint64_t woken;
+} busy;
+
+/* The default storm protection limits: each crate's IRQ level may take this
+ * many interrupts a second, with bursts of up to this many at once, before
+ * it's masked for a while.
+ */
+#ifndef STORM_RATE
+#  define STORM_RATE	50000
+#endif
+#ifndef STORM_BURST
+#  define STORM_BURST	1000
+#endif
+
+/* The number of page descriptors, counting down from the top of each crate's
+ * VME space, that may be taken over for mapping clear registers.  These have
+ * to stay within the V120_IRQD_PAGES that the v120 tool keeps clear of.
+ */
+#ifndef CLEAR_WINDOWS
+#  define CLEAR_WINDOWS V120_IRQD_PAGES
+#endif
+#if CLEAR_WINDOWS > V120_IRQD_PAGES
+#  error "CLEAR_WINDOWS reaches below the pages reserved for v120irqd"
+#endif
+
+/**
+ * struct clear_window - One page mapped for performing clear actions.
+ * @base:		VME address of the page.
+ * @config:		Page descriptor flags it was mapped with.
+ * @ptr:		Where it's mapped.
+ */
+struct clear_window {
+	uint32_t base;
+	V120_PD config;
+	volatile uint8_t * ptr;
+};
+
+/* An interrupt that waits longer than this many ns, from its crate's status
+ * being read to its own vector being read, counts as starved.
+ */
+#ifndef SCHED_STARVE
+#  define SCHED_STARVE	(1000 * 1000)
+#endif
+
+/**
+ * struct sched_stats - How one crate has fared in the scheduling.
+ * @events:		Interrupts scheduled.
+ * @max_wait:	The longest any of them waited, in ns.
+ * @starved:	How many waited longer than SCHED_STARVE.
+ */
+struct sched_stats {
+	uint64_t events;
+	uint64_t max_wait;
+	uint64_t starved;
+};
+
+/**
+ * struct line_stats - What's been seen on one IRQ level of a crate.
+ * @seen:		Interrupts whose vectors were read.
+ * @targetless:	Of those, the ones nobody had registered for.
+ * @vector_total: Time spent reading their vectors.
+ * @vector_max:	Longest time spent reading a vector.
+ */
+struct line_stats {
+	uint64_t seen;
+	uint64_t targetless;
+	uint64_t vector_total;
+	uint64_t vector_max;
+};
+
+/**
+ * struct v120_info_t - One open crate.
+ * @handle:		The crate handle.
+ * @irqhndl:	The crate's IRQ registers.
+ * @cratenumber: The crate number, 0-15.
+ * @window:		The pages mapped for clear actions so far.  window[n] uses
+ * 				page descriptor V120_PAGE_COUNT-1-n.
+ * @nwindows:	Number of valid entries in @window.
+ * @storm:		Storm protection for each IRQ level, indexed by level.
+ * @sched:		How long the crate's interrupts have waited their turn.
+ * @line:		What's been seen on each IRQ level, indexed by level.
+ * @irqen:		What we last wrote to the crate's irqen register.  Nobody else
+ * 				writes it, so this saves reading it back over PCIe, and lets
+ * 				us skip writes that wouldn't change anything.
+ */
 struct v120_info_t {
 	V120_HANDLE * handle;
 	V120_IRQ * irqhndl;
 	int cratenumber;
+	struct clear_window window[CLEAR_WINDOWS];
+	unsigned int nwindows;
+	struct storm_guard storm[8];
+	uint32_t irqen;
+	struct sched_stats sched;
+	struct line_stats line[8];
 };
 
 /* We'll just statically allocate an array of 16 v120_info members and
@@ -99,6 +381,62 @@ struct v120_info_t {
  */
 static struct v120_info_t v120_info[16];
 
+/**
+ * struct request_options - Extras attached to one interrupt request.
+ * @flags:		Which of the extras are present; OPT_CLEAR and/or OPT_DMA.
+ * @clear:		The clear action, from REQUEST_CLEAR.
+ * @reg:		Where @clear's register is mapped, indexed by crate number.
+ * 				Mapped for every crate in the request when it's registered.
+ * @dma:		The DMA read, from REQUEST_DMA.
+ * @slot:		The buffer shared with the client that @dma reads into.
+ * @fd:			The memfd behind @slot.  It's sent to the client with the ACK,
+ * 				and kept for handing over on a warm restart.
+ * @sub:		The role and ACK policy, from REQUEST_SHARED.
+ *
+ * These are kept as the vector table entry's options, and disposed of with
+ * free_request_options().  Requests without any extras don't have one at all.
+ */
+struct request_options {
+	unsigned int flags;
+	struct v120irqd_clear clear;
+	volatile void * reg[16];
+	struct v120irqd_dma dma;
+	struct v120irqd_dmaslot * slot;
+	int fd;
+	struct v120irqd_subscription sub;
+};
+#define OPT_CLEAR	(1 << 0)
+#define OPT_DMA		(1 << 1)
+#define OPT_SHARED	(1 << 2)
+
+/* Latency histograms, one set for each crate number and IRQ level, indexed as
+ * latency[crate][irq].  Each set is only allocated when that crate and level
+ * first sees an interrupt, since most of them never will.
+ */
+struct irq_latency {
+	latency_histogram stage[V120IRQD_LAT_STAGES];
+};
+static struct irq_latency * latency[16][8];
+
+/**
+ * struct irq_stamp - When and in what order the server found an interrupt.
+ * @t_detect:	When it was found, as from latency_now().
+ * @tsc:		latency_tsc() at about the same moment.
+ * @seq:		Its place in the sequence for its crate, from crate_seq.
+ * @flags:		V120IRQD_EVENT_* flags.
+ *
+ * These go out with the interrupt to V120IRQD_FEATURE_TIMESTAMP clients.
+ */
+struct irq_stamp {
+	uint64_t t_detect;
+	uint64_t tsc;
+	uint32_t seq;
+	uint32_t flags;
+};
+
+/* The last sequence number handed out on each crate number. */
+static uint32_t crate_seq[16];
+
 /* A global variable for the signal caught by the mainloop signal handler.
  * This is set by signalhandler and cleared by mainloop.
  */
@@ -113,22 +451,34 @@ void signalhandler(int sig);
  * append_fd() - Enlarge list_pollfds and add the new fd to it.
  * @fd:		The file descriptor to add.
  * @events:	The poll events to register this fd for.
+ * @client:	The client_t for a client socket, otherwise NULL.
  *
  * Return: The new entry or NULL on failure.
  */
-static struct pollfd* append_fd(int fd, short events)
+static struct pollfd* append_fd(int fd, short events, struct client_t *client)
 {
 	struct pollfd* newmem;
-	len_pollfds++;
-	newmem = realloc(list_pollfds, sizeof(*list_pollfds)*len_pollfds);
+	struct client_t ** newclients;
+
+	newclients = realloc(list_clients, sizeof(*list_clients)*(len_pollfds+1));
+	if (newclients == NULL) {
+		logcrit("realloc failed: %s", strerror(errno));
+		return NULL;
+	}
+	list_clients = newclients;
+
+	newmem = realloc(list_pollfds, sizeof(*list_pollfds)*(len_pollfds+1));
 	if (newmem == NULL) {
 		logcrit("realloc failed: %s", strerror(errno));
 		return NULL;
 	}
 	list_pollfds = newmem;
-	newmem = list_pollfds + (len_pollfds - 1);
+	list_clients[len_pollfds] = client;
+	newmem = list_pollfds + len_pollfds;
 	newmem->fd = fd;
 	newmem->events = events;
+	newmem->revents = 0;
+	len_pollfds++;
 	return newmem;
 }
 
@@ -140,13 +490,14 @@ static struct pollfd* append_fd(int fd, short events)
  */
 static void remove_fd(int idx)
 {
-	if (idx <= len_crates || idx >= len_pollfds) {
-		logcrit("Removal index %d outside valid range %d-%d.", idx, len_crates+1, len_pollfds-1);
+	if (idx <= len_crates+1 || idx >= len_pollfds) {
+		logcrit("Removal index %d outside valid range %d-%d.", idx, len_crates+2, len_pollfds-1);
 		exit(1);
 	}
 
-	/* Collapse the list overtop of the deleted fd. */
-	memmove(list_pollfds+idx, list_pollfds+idx+1, sizeof(*list_pollfds)*(len_pollfds-idx));
+	/* Collapse the lists overtop of the deleted fd. */
+	memmove(list_pollfds+idx, list_pollfds+idx+1, sizeof(*list_pollfds)*(len_pollfds-idx-1));
+	memmove(list_clients+idx, list_clients+idx+1, sizeof(*list_clients)*(len_pollfds-idx-1));
 	len_pollfds--;
 
 	/* We won't bother to realloc over the missing space  This isn't
@@ -162,7 +513,7 @@ static void remove_fd(int idx)
  */
 static unsigned int count_clients(void)
 {
-	return len_pollfds-len_crates-1;
+	return len_pollfds-len_crates-2;
 }
 
 /**
@@ -188,6 +539,7 @@ static int configureVmeEndpoints(void)
 	 * those crates in v120_info, and their interrupt endpoints in list_pollfds.
 	 */
 	for (crate = 0; crate < 16; crate++) {
+		if (!(settings.crates & (1 << crate))) continue;
 		hCrate = v120_open(crate);
 		if (hCrate == NULL) continue;
 
@@ -200,7 +552,8 @@ static int configureVmeEndpoints(void)
 		v120_info[len_crates].handle = hCrate;
 		v120_info[len_crates].irqhndl = v120_get_irq(hCrate);
 		v120_info[len_crates].cratenumber = crate;
-		if (append_fd(fd, POLLIN) == NULL) {
+		v120_info[len_crates].irqen = v120_info[len_crates].irqhndl->irqen;
+		if (append_fd(fd, POLLIN, NULL) == NULL) {
 			logcrit("Failed adding VME interrupt endpoint to list: %s", strerror(errno));
 			exit(1);
 		}
@@ -227,36 +580,109 @@ static int configureServerSocket(void)
 		exit(1);
 	}
 
-	serversocket = v120irqd_server(NULL);
+	if (handoff.listen >= 0) {
+		serversocket = handoff.listen;
+	} else {
+		serversocket = v120irqd_server(settings.socketName);
+	}
 	if (serversocket < 0) {
 		logcrit("Failed opening server socket: %s", strerror(errno));
 		exit(1);
 	}
-	if (append_fd(serversocket, POLLIN) == NULL) {
+	if (append_fd(serversocket, POLLIN, NULL) == NULL) {
 		logcrit("Failed adding server socket to list: %s", strerror(errno));
 		exit(1);
 	}
 	return 0;
 }
 
+/**
+ * configureTimer() - Add the timer to list_pollfds.
+ *
+ * Must be called right after adding the server socket.
+ *
+ * Return: 0 for success, nonzero for failure, though practically most errors
+ * will be fatal and cause immediate exit.
+ */
+static int configureTimer(void)
+{
+	int fd;
+
+	/* Sanity check the call. */
+	if (len_crates + 1 != len_pollfds) {
+		logcrit("Timer must be added right after the server socket.");
+		exit(1);
+	}
+
+	/* The raw clock can't drive a timerfd, but only intervals are set. */
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0) {
+		logcrit("Failed creating timer: %s", strerror(errno));
+		exit(1);
+	}
+	if (append_fd(fd, POLLIN, NULL) == NULL) {
+		logcrit("Failed adding timer to list: %s", strerror(errno));
+		exit(1);
+	}
+	return 0;
+}
+
+/**
+ * peer_pid() - The process at the other end of a client socket.
+ * @fd:		The client socket.
+ *
+ * Return: The process ID, or 0 if it can't be found.
+ */
+static pid_t peer_pid(int fd)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len)) return 0;
+	return cred.pid;
+}
+
 /**
  * configureClientSocket() - Add a single client socket to list_pollfds.
  *
- * Must be called after both VME and server socket fds are added.
+ * Must be called after the VME, server socket and timer fds are added.
  *
  * Return: 0 for success, nonzero for failure, though practically most errors
  * will be fatal and cause exit.
  */
 static int configureClientSocket(int fd)
 {
+	struct client_t *client;
+
 	/* Sanity check the call. */
-	if (len_crates >= len_pollfds) {
-		logcrit("VME and server socket fds must be created before clients.\n");
+	if (len_crates + 1 >= len_pollfds) {
+		logcrit("VME, server socket and timer fds must be created before clients.\n");
 		exit(1);
 	}
 
-	if (append_fd(fd, POLLIN) == NULL) {
+	client = calloc(1, sizeof(*client));
+	if (client == NULL) {
+		logcrit("Couldn't allocate client: %s", strerror(errno));
+		return 1;
+	}
+	client->fd = fd;
+	client->pid = peer_pid(fd);
+
+	/* Bound every wait on the client, with nothing to do per message. */
+	if (settings.ackTimeout) {
+		struct timeval tv = {
+			.tv_sec = settings.ackTimeout / 1000000000u,
+			.tv_usec = (settings.ackTimeout % 1000000000u) / 1000
+		};
+		if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) ||
+				setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv))) {
+			logwarn("Couldn't set client timeouts: %s", strerror(errno));
+		}
+	}
+
+	if (append_fd(fd, POLLIN, client) == NULL) {
 		logcrit("Couldn't add client fd: %s", strerror(errno));
+		free(client);
 		return 1;
 	}
 	return 0;
@@ -267,299 +693,2655 @@ static int configureClientSocket(int fd)
  **********************************************************************/
 
 /**
- * notify_irq() - Find the registered listener and notify it about an IRQ.
- * @sel: A concrete v120irqd_selector describing the interrupt.
+ * storm_masked() - The IRQ levels of a crate that are masked for now.
+ * @idx:	The v120_info index of the crate.
+ */
+static uint8_t storm_masked(int idx)
+{
+	uint8_t masked = 0;
+	for (int irq = 1; irq <= 7; irq++) {
+		if (v120_info[idx].storm[irq].t_rearm) masked |= (1 << irq);
+	}
+	return masked;
+}
+
+/**
+ * sync_irqen() - Bring a crate's interrupt enables up to date.
+ * @idx:	The v120_info index of the crate.
  *
- * Return: 0, or a negative error code to indicate a problem.
+ * Enable the levels that anyone has registered for on the crate, less any
+ * masked by storm protection, and write the register only if that's changed.
+ */
+static void sync_irqen(int idx)
+{
+	uint32_t irqen = registered_irqs(v120_info[idx].cratenumber) & ~storm_masked(idx);
+
+	if (irqen != v120_info[idx].irqen) {
+		v120_info[idx].irqhndl->irqen = irqen;
+		v120_info[idx].irqen = irqen;
+	}
+}
+
+/**
+ * arm_timer() - Set the timer for the next masked line that's due back, or
+ * the next ACK deadline, whichever is sooner.
+ * @now:	The current time.
  */
-static int notify_irq(struct v120irqd_selector * sel)
+static void arm_timer(uint64_t now)
 {
-	int sock, err;
-	sock = find_interrupt(sel);
-	if (sock == 0) {
-		if (errno == EINVAL) {
-			logwarn("No target for %04X:%02X:%08X", sel->crate, sel->irq, sel->vector);
+	struct itimerspec its = {{0}};
+	uint64_t next = ack_wheel_next(&wheel), t;
+
+	for (int idx = 0; idx < len_crates; idx++) {
+		for (int irq = 1; irq <= 7; irq++) {
+			t = v120_info[idx].storm[irq].t_rearm;
+			if (t && (next == 0 || t < next)) next = t;
 		}
-		return -errno;
 	}
+	timer_due = next;
 
-	/* TODO: There should probably be some kind of timeout here, just to
-	 * make sure that a poorly written client doesn't hang the system
-	 * indefinitely.
-	 */
-	logdebug("Sending IRQ %04X:%02X:%08X", sel->crate, sel->irq, sel->vector);
-	err = v120irqd_interrupt(sock, sel);
-	return err;
+	if (next) {
+		/* Zero would disarm it; anything overdue is due right away. */
+		t = (next > now) ? next - now : 1;
+		its.it_value.tv_sec = t / 1000000000u;
+		its.it_value.tv_nsec = t % 1000000000u;
+	}
+	if (timerfd_settime(list_pollfds[len_crates+1].fd, 0, &its, NULL)) {
+		logerror("Couldn't set timer: %s", strerror(errno));
+	}
 }
 
 /**
- * process_vme() -	Process all interrupts on a given crate.
- * @idx:	The list_pollfds index to the VME endpoint.
+ * mark_slow() - Note that a client has missed a deadline.
+ * @client:	The client.
+ * @why:	What it didn't do in time, for the log.
  *
- * process_vme() will keep iterating over the active IRQ list, fetching the
- * interrupt vector of the highest priority interrupt and dispatching it to
- * the registered target, until the all interrupts on the crate have been
- * cleared.
+ * Until a slow client has caught up with everything it owes, it isn't waited
+ * on for anything, and nothing sent to it is allowed to block.
  */
-static void process_vme(int idx)
+static void mark_slow(struct client_t * client, const char * why)
 {
-	uint32_t irqen, irqstatus;
-	unsigned int irq;
-	int err;
-	struct v120irqd_selector selector;
+	if (client->slow) return;
 
-	/* If nothing else, we need to read the flag to reset the socket. */
-	int fd = list_pollfds[idx].fd;
-	err = read(fd, NULL, 1);
+	client->slow = true;
+	client->timeouts++;
+	acks.timeouts++;
+	if (fcntl(client->fd, F_SETFL, fcntl(client->fd, F_GETFL) | O_NONBLOCK)) {
+		logerror("Couldn't stop blocking on client: %s", strerror(errno));
+	}
+	logwarn("Client %d %s; not waiting on it until it catches up.", client->fd, why);
+}
 
-	V120_IRQ * irqhndl = v120_info[idx].irqhndl;
+/**
+ * caught_up() - Start waiting on a slow client again.
+ * @client:	The client, which doesn't owe anything any more.
+ */
+static void caught_up(struct client_t * client)
+{
+	client->slow = false;
+	if (fcntl(client->fd, F_SETFL, fcntl(client->fd, F_GETFL) & ~O_NONBLOCK)) {
+		logerror("Couldn't block on client: %s", strerror(errno));
+	}
+	loginfo("Client %d caught up.", client->fd);
+}
 
-	/* The interrupt mask can't legally change while we do this, so cache it
-	 * to avoid lots of long slow pulls.  We'll do the same thing with the
-	 * irqstatus once per loop.
-	 */
-	irqen = irqhndl->irqen;
+/**
+ * expect_ack() - Note a notification sent to a client without waiting.
+ * @client:	The client.
+ *
+ * Its deadline starts running with the first of these, and the wheel only
+ * needs the timer set if nothing else was waiting on it.
+ */
+static void expect_ack(struct client_t * client)
+{
+	uint64_t now;
 
-irqsearch:
-	irqstatus = irqhndl->irqstatus & irqen;
-	if (irqstatus == 0) return;
+	if (client->unacked++ != 0 || settings.ackTimeout == 0) return;
 
-	for (irq = 7; irq >= 1; irq--) {
-		/* If this bit isn't set then move on. */
-		if ((irqstatus & (1 << irq)) == 0) continue;
+	now = latency_now();
+	client->deadline.due = now + settings.ackTimeout;
+	if (ack_wheel_add(&wheel, &client->deadline, now) ||
+			timer_due == 0 || ack_wheel_next(&wheel) < timer_due) {
+		arm_timer(now);
+	}
+}
 
-		/* Retrieve the vector from VME, then kick it over to the client. */
-		selector.vector = irqhndl->iack_vector[irq];
-		selector.crate = (1 << v120_info[idx].cratenumber);
-		selector.irq = (1 << irq);
-		err = notify_irq(&selector);
+/**
+ * got_ack() - Note an answer to a notification that wasn't waited on.
+ * @client:	The client.
+ *
+ * Each answer gives the client another full timeout for the next.
+ */
+static void got_ack(struct client_t * client)
+{
+	if (--client->unacked == 0) {
+		if (client->slow) caught_up(client);
+	} else {
+		client->deadline.due = latency_now() + settings.ackTimeout;
+	}
+}
 
-		switch (err) {
-			case 0: {
-				goto irqsearch;
-			}
+/**
+ * expire_acks() - Catch the clients that have missed their deadlines.
+ * @now:	The current time.
+ */
+static void expire_acks(uint64_t now)
+{
+	struct ack_deadline *d;
+	struct client_t *client;
 
-			case -EINVAL: {
-				/* We had no registered client for the interrupt.
-				 * If we're lucky and the interrupt was obviously ROAK
-				 * then we just keep going, otherwise we need to disable
-				 * this interrupt.
-				 */
+	for (d = ack_wheel_expire(&wheel, now); d != NULL; d = d->next) {
+		client = (struct client_t *)((char *)d - offsetof(struct client_t, deadline));
+		if (client->unacked != 0 && !client->slow) {
+			mark_slow(client, "didn't answer in time");
+		}
+	}
+}
 
-				logwarn(
-					"Targetless interrupt: Crate %d IRQ%d @0x%08X",
-					v120_info[idx].cratenumber, irq, selector.vector
-				);
-			}
+/* Whether the server should pass over a client, for find_interrupt_fallback(). */
+static bool client_is_slow(irqdata_t data)
+{
+	return ((struct client_t *)data)->slow;
+}
 
-			case -EBADMSG: {
-				/* The client NAKed the message.  Ummm, okay? */
+/* Whether there's anyone for find_targets() to fall back on for @sel. */
+static bool has_fallback(const struct v120irqd_selector * sel)
+{
+	struct irq_target target;
+	return settings.fallback && find_interrupt_fallback(sel, &target, client_is_slow) == 0;
+}
 
-				logwarn(
-					"Client NAK: Crate %d IRQ%d @0x%08X",
-					v120_info[idx].cratenumber, irq, selector.vector
-				);
-			}
+/**
+ * mask_line() - Mask an IRQ line until its backoff runs out.
+ * @idx:	The v120_info index of the crate.
+ * @irq:	The IRQ level.
+ * @why:	What's wrong with it, for the log.
+ * @now:	The current time.
+ *
+ * The caller has to take the line out of its cached irqen, if any.
+ */
+static void mask_line(int idx, int irq, const char * why, uint64_t now)
+{
+	struct storm_guard *g = &v120_info[idx].storm[irq];
+
+	storm_mask(g, now);
+	sync_irqen(idx);
+	logwarn("Crate %d IRQ%d %s; masked for %llu ms.",
+		v120_info[idx].cratenumber, irq, why,
+		(unsigned long long)(g->backoff / 1000000));
+	arm_timer(now);
+}
 
-			case -EPIPE: {
-				/* The client connection closed unexpectedly; we'll
-				 * notice this later when we get back to the poll loop.
-				 *
-				 * There's really no special handling for this versus
-				 * any other error, but at least we understand it.
-				 *
-				 * Disable the interrupt for now; the reanalysis when the
-				 * client is dropped may turn it back on later.
-				 */
-				break;
-			}
+/**
+ * process_timer() - Re-enable the masked lines that are due back, and catch
+ * clients that have missed their ACK deadlines.
+ */
+static void process_timer(void)
+{
+	uint64_t expirations, now;
+	int idx, irq, crate;
 
-			default: {
-				/* We're stumped. */
-				logerror("Error processing interrupt: %s", strerror(-err));
+	if (read(list_pollfds[len_crates+1].fd, &expirations, sizeof(expirations)) < 0 &&
+			errno != EAGAIN) {
+		logerror("Couldn't read timer: %s", strerror(errno));
+	}
+
+	now = latency_now();
+	for (idx = 0; idx < len_crates; idx++) {
+		crate = v120_info[idx].cratenumber;
+		for (irq = 1; irq <= 7; irq++) {
+			if (!storm_rearm_due(&v120_info[idx].storm[irq], now)) continue;
+
+			/* Unless everyone gave up on it in the meantime. */
+			sync_irqen(idx);
+			if (v120_info[idx].irqen & (1 << irq)) {
+				loginfo("Crate %d IRQ%d re-enabled.", crate, irq);
 			}
 		}
+	}
+	expire_acks(now);
+	arm_timer(now);
+}
+
+/**
+ * record_latency() - Add the timestamps of one delivered interrupt to the
+ * latency histograms.
+ * @sel:		The concrete interrupt that was delivered.
+ * @t_wake:		When the server woke up to find it.
+ * @t_vector:	When its vector had been read.
+ * @t_send:		When the notification started out to the client.
+ * @t_ack:		When the client acknowledged it.
+ */
+static void record_latency(const struct v120irqd_selector * sel,
+	uint64_t t_wake, uint64_t t_vector, uint64_t t_send, uint64_t t_ack)
+{
+	int crate = v120irqd_ilog2f(sel->crate);
+	int irq = v120irqd_ilog2f(sel->irq);
+	struct irq_latency *lat;
+
+	if (crate < 0 || crate > 15 || irq < 1 || irq > 7) return;
+
+	lat = latency[crate][irq];
+	if (lat == NULL) {
+		lat = calloc(1, sizeof(*lat));
+		if (lat == NULL) {
+			logerror("Couldn't allocate latency histograms: %s", strerror(errno));
+			return;
+		}
+		latency[crate][irq] = lat;
+	}
+
+	latency_record(&lat->stage[V120IRQD_LAT_WAKE_TO_VECTOR], t_vector - t_wake);
+	latency_record(&lat->stage[V120IRQD_LAT_VECTOR_TO_SEND], t_send - t_vector);
+	latency_record(&lat->stage[V120IRQD_LAT_SEND_TO_ACK], t_ack - t_send);
+	latency_record(&lat->stage[V120IRQD_LAT_WAKE_TO_ACK], t_ack - t_wake);
+}
+
+/**
+ * record_irq() - Add an interrupt to the recording, if there is one.
+ * @sel:	The concrete interrupt.
+ * @flags:	IRQ_RECORD_* flags.
+ * @t:		When it was found.
+ */
+static void record_irq(const struct v120irqd_selector * sel, unsigned int flags, uint64_t t)
+{
+	int err = irq_record_add(&recorder, sel, flags, t);
+	if (err) {
+		logerror("Recording stopped: %s", strerror(-err));
+	}
+}
+
+/**
+ * stamp_irq() - Give an interrupt its timestamp and sequence number.
+ * @stamp:	Loaded with the stamp.
+ * @sel:	The concrete interrupt.
+ * @flags:	V120IRQD_EVENT_* flags.
+ * @t:		When it was found.
+ * @tsc:	latency_tsc() at about the same moment.
+ */
+static void stamp_irq(struct irq_stamp * stamp, const struct v120irqd_selector * sel,
+	unsigned int flags, uint64_t t, uint64_t tsc)
+{
+	int crate = v120irqd_ilog2f(sel->crate);
+
+	stamp->t_detect = t;
+	stamp->tsc = tsc;
+	stamp->seq = (crate >= 0 && crate < 16) ? ++crate_seq[crate] : 0;
+	stamp->flags = flags;
+}
+
+/**
+ * find_targets() - Find the registered listeners for an IRQ.
+ * @sel:		A concrete v120irqd_selector describing the interrupt.  The
+ * 				payload is filled in from the first matching request.
+ * @targets:	Filled in with every matching request; more than one only if
+ * 				they're shared subscriptions.
+ *
+ * With --fallback, an unshared interrupt whose client is slow goes to the
+ * next request that matches it instead, if there is one.
+ *
+ * Return: The number of @targets, or a negative error code.  -EINVAL means
+ * there simply isn't any client registered for @sel.
+ */
+static int find_targets(struct v120irqd_selector * sel,
+	struct irq_target targets[IRQ_TARGETS_MAX])
+{
+	int n = find_interrupt_targets(sel, targets);
+	if (n == -EINVAL) {
+		logwarn("No target for %04X:%02X:%08X", sel->crate, sel->irq, sel->vector);
+	} else if (n == 1 && settings.fallback && client_is_slow(targets[0].data) &&
+			find_interrupt_fallback(sel, &targets[0], client_is_slow) == 0) {
+		logdebug("Rerouted %04X:%02X:%08X from slow client",
+			sel->crate, sel->irq, sel->vector);
+		acks.rerouted++;
+	}
+	if (n > 0) sel->payload = targets[0].payload;
+	return n;
+}
+
+/* Whether an interrupt's targets are shared subscriptions. */
+static inline bool targets_shared(const struct irq_target * targets, int n)
+{
+	const struct request_options *opts = (n > 0) ? targets[0].options : NULL;
+	return (opts != NULL) && (opts->flags & OPT_SHARED);
+}
+
+/**
+ * clear_config() - Page descriptor flags for performing a clear action.
+ */
+static V120_PD clear_config(const struct v120irqd_clear * clear)
+{
+	V120_PD config = V120_RW | V120_SMAX;
+
+	switch (clear->space) {
+		case V120IRQD_A16: config |= V120_A16; break;
+		case V120IRQD_A24: config |= V120_A24; break;
+		default:           config |= V120_A32; break;
+	}
+	switch (clear->width) {
+		case 1:  config |= V120_D16 | V120_EBYTE; break;
+		case 2:  config |= V120_D16 | V120_ESHORT; break;
+		default: config |= V120_D32 | V120_ELONG; break;
+	}
+	return config;
+}
+
+/**
+ * map_clear_register() - Get a clear action's register mapped on a crate.
+ * @idx:	The v120_info index of the crate.
+ * @clear:	The clear action.
+ *
+ * Clear actions that land in the same page share its mapping.  Pages are
+ * never unmapped, so the first CLEAR_WINDOWS distinct ones are all a crate
+ * will ever get.
+ *
+ * Return: The register, or NULL if it can't be mapped.
+ */
+static volatile void * map_clear_register(int idx, const struct v120irqd_clear * clear)
+{
+	struct v120_info_t *info = &v120_info[idx];
+	uint32_t base = clear->address & ~(uint32_t)(V120_PAGE_SIZE - 1);
+	V120_PD config = clear_config(clear);
+	struct clear_window *w;
+	void *ptr;
+
+	for (w = info->window; w < info->window + info->nwindows; w++) {
+		if (w->base == base && w->config == config) {
+			return w->ptr + (clear->address - base);
+		}
+	}
+
+	if (info->nwindows == CLEAR_WINDOWS) {
+		logerror("Crate %d is out of clear windows", info->cratenumber);
+		return NULL;
+	}
+	ptr = v120_configure_page(info->handle, V120_PAGE_COUNT - 1 - info->nwindows,
+		base, config);
+	if (ptr == NULL) {
+		logerror("Couldn't map clear window on crate %d: %s",
+			info->cratenumber, strerror(errno));
+		return NULL;
+	}
+	w->base = base;
+	w->config = config;
+	w->ptr = ptr;
+	info->nwindows++;
+	return w->ptr + (clear->address - base);
+}
+
+/**
+ * free_request_options() - Dispose of a request_options.
+ * @ptr:	The options, as void * so that the vector table can call this.
+ */
+static void free_request_options(void * ptr)
+{
+	struct request_options *opts = ptr;
+	if (opts == NULL) return;
+	if (opts->slot != NULL) {
+		munmap(opts->slot, dma_mapping_len(opts->dma.length));
+	}
+	if (opts->fd >= 0) close(opts->fd);
+	free(opts);
+}
+
+/**
+ * make_request_options() - Validate a REQUEST_CLEAR and build its options.
+ * @req:	The request.
+ *
+ * Return: The malloced options, or NULL with errno set.
+ */
+static struct request_options * make_request_options(const clear_buffer * req)
+{
+	const struct v120irqd_clear *clear = &req->clear;
+	struct request_options *opts;
+	uint32_t limit;
+	int idx;
+
+	switch (clear->space) {
+		case V120IRQD_A16: limit = 0xFFFF; break;
+		case V120IRQD_A24: limit = 0xFFFFFF; break;
+		case V120IRQD_A32: limit = 0xFFFFFFFF; break;
+		default: limit = 0; break;
+	}
+	if (limit == 0 || (clear->address > limit) ||
+			(clear->width != 1 && clear->width != 2 && clear->width != 4) ||
+			(clear->address % clear->width) ||
+			(clear->flags & ~V120IRQD_CLEAR_READBACK) || clear->reserved) {
+		logwarn("rejected illegal clear action");
+		errno = EINVAL;
+		return NULL;
+	}
+
+	opts = calloc(1, sizeof(*opts));
+	if (opts == NULL) return NULL;
+	opts->flags = OPT_CLEAR;
+	opts->fd = -1;
+	opts->clear = *clear;
+
+	for (idx = 0; idx < len_crates; idx++) {
+		int crate = v120_info[idx].cratenumber;
+		if (!(req->selector.crate & (1 << crate))) continue;
+		opts->reg[crate] = map_clear_register(idx, clear);
+		if (opts->reg[crate] == NULL) {
+			free(opts);
+			errno = ENOMEM;
+			return NULL;
+		}
+	}
+	return opts;
+}
+
+/**
+ * adopt_dma_options() - Build the options for a DMA read into an existing buffer.
+ * @dma:	The transfer, already validated.
+ * @fd:		The memfd of the buffer, which the options take over, even on
+ * 			failure.
+ *
+ * Return: The malloced options, or NULL with errno set.
+ */
+static struct request_options * adopt_dma_options(const struct v120irqd_dma * dma, int fd)
+{
+	struct request_options *opts;
+	void *ptr;
+	int err;
+
+	opts = calloc(1, sizeof(*opts));
+	if (opts == NULL) {
+		err = errno;
+		close(fd);
+		errno = err;
+		return NULL;
+	}
+	opts->flags = OPT_DMA;
+	opts->dma = *dma;
+	opts->fd = fd;
+
+	ptr = mmap(NULL, dma_mapping_len(dma->length), PROT_READ | PROT_WRITE,
+		MAP_SHARED, opts->fd, 0);
+	if (ptr == MAP_FAILED) {
+		err = errno;
+		logerror("Couldn't map DMA buffer: %s", strerror(err));
+		free_request_options(opts);
+		errno = err;
+		return NULL;
+	}
+	opts->slot = ptr;
+	return opts;
+}
+
+/**
+ * make_dma_options() - Validate a REQUEST_DMA and build its options.
+ * @req:	The request.
+ *
+ * This includes the buffer to be shared with the client, a memfd left in the
+ * options' fd to be sent along with the ACK.
+ *
+ * Return: The malloced options, or NULL with errno set.
+ */
+static struct request_options * make_dma_options(const dma_buffer * req)
+{
+	const struct v120irqd_dma *dma = &req->dma;
+	const struct v120irqd_selector *sel = &req->selector;
+	int fd, err;
+
+	if (dma->length == 0 || dma->length > V120IRQD_DMA_MAX ||
+			(dma->flags & V120_DMA_CTL_WRITE) || dma->reserved) {
+		logwarn("rejected illegal DMA request");
+		errno = EINVAL;
+		return NULL;
+	}
+
+	/* One slot can only hold one interrupt's data at a time, so the request
+	 * mustn't be able to fire twice in one pass.
+	 */
+	if (sel->crate == 0 || (sel->crate & (sel->crate - 1)) ||
+			sel->irq == 0 || (sel->irq & (sel->irq - 1))) {
+		logwarn("rejected DMA request for more than one crate or level");
+		errno = EINVAL;
+		return NULL;
+	}
+
+#ifdef HAVE_MEMFD_CREATE
+	fd = memfd_create("v120irqd-dma", MFD_CLOEXEC);
+#else
+	{
+		char name[] = "/dev/shm/v120irqd-dmaXXXXXX";
+		fd = mkostemp(name, O_CLOEXEC);
+		if (fd >= 0) unlink(name);
+	}
+#endif
+	if (fd < 0 || ftruncate(fd, dma_mapping_len(dma->length))) {
+		err = errno;
+		logerror("Couldn't create DMA buffer: %s", strerror(err));
+		if (fd >= 0) close(fd);
+		errno = err;
+		return NULL;
+	}
+	return adopt_dma_options(dma, fd);
+}
+
+/**
+ * make_shared_options() - Validate a REQUEST_SHARED and build its options.
+ * @req:	The request.
+ *
+ * Return: The malloced options, or NULL with errno set.
+ */
+static struct request_options * make_shared_options(const subscribe_buffer * req)
+{
+	const struct v120irqd_subscription *sub = &req->sub;
+	struct irq_target targets[IRQ_TARGETS_MAX];
+	const struct request_options *other;
+	struct request_options *opts;
+
+	if (sub->role > V120IRQD_OBSERVER || sub->policy > V120IRQD_ACK_NONE ||
+			sub->reserved) {
+		logwarn("rejected illegal subscription");
+		errno = EINVAL;
+		return NULL;
+	}
+
+	/* Everyone sharing an interrupt has to agree on when it's handled. */
+	if (find_interrupt_targets(&req->selector, targets) > 0) {
+		other = targets[0].options;
+		if (other != NULL && (other->flags & OPT_SHARED) &&
+				other->sub.policy != sub->policy) {
+			logwarn("rejected subscription with a conflicting ACK policy");
+			errno = EINVAL;
+			return NULL;
+		}
+	}
+
+	opts = calloc(1, sizeof(*opts));
+	if (opts == NULL) return NULL;
+	opts->flags = OPT_SHARED;
+	opts->fd = -1;
+	opts->sub = *sub;
+	return opts;
+}
+
+/**
+ * perform_dma() - Carry out a DMA read into its shared buffer.
+ * @opts:	The options holding the transfer and buffer.
+ * @client:	The client the buffer is shared with.
+ * @sel:	The concrete interrupt it's for.
+ * @hV120:	The crate that interrupted, or NULL if it doesn't exist.
+ *
+ * The client may still be reading the buffer until it has answered every
+ * notification sent to it, so a client that's behind, or slow, keeps what it
+ * had and the notification goes out without fresh data.  The sequence is odd
+ * for as long as the buffer is being written.
+ */
+static void perform_dma(const struct request_options * opts,
+	const struct client_t * client, const struct v120irqd_selector * sel,
+	V120_HANDLE * hV120)
+{
+	struct v120irqd_dmaslot *slot = opts->slot;
+	struct v120_dma_desc_t desc = {
+		.flags = opts->dma.flags,
+		.ptr = (uintptr_t)slot->data,
+		.size = opts->dma.length,
+		.next = 0,
+		.vme_address = opts->dma.address
+	};
+
+	if (client->slow || client->unacked != 0) {
+		acks.stale_dma++;
+		return;
+	}
+
+	slot->sequence++;
+	__sync_synchronize();
+	slot->selector = *sel;
+	if (hV120 == NULL) {
+		slot->status = -ENODEV;
+		slot->length = 0;
+	} else if (v120_dma_xfr(hV120, &desc) < 0) {
+		slot->status = -errno;
+		slot->length = 0;
+		logwarn("DMA for %04X:%02X:%08X failed: %s",
+			sel->crate, sel->irq, sel->vector, strerror(errno));
+	} else {
+		slot->status = 0;
+		slot->length = opts->dma.length;
+	}
+	__sync_synchronize();
+	slot->sequence++;
+}
+
+/**
+ * crate_handle() - The handle of an open crate.
+ * @crate:	Crate bitmask, with a single bit set.
+ *
+ * Return: The handle, or NULL if that crate isn't open.
+ */
+static V120_HANDLE * crate_handle(uint16_t crate)
+{
+	for (int idx = 0; idx < len_crates; idx++) {
+		if (crate == (1 << v120_info[idx].cratenumber)) return v120_info[idx].handle;
+	}
+	return NULL;
+}
+
+/**
+ * perform_clear() - Carry out a clear action.
+ * @opts:	The options holding the action.
+ * @crate:	The crate number to perform it on.
+ */
+static void perform_clear(const struct request_options * opts, int crate)
+{
+	const struct v120irqd_clear *clear = &opts->clear;
+	volatile void *reg = opts->reg[crate];
+
+	/* Fake interrupts on crates that don't exist land here. */
+	if (reg == NULL) return;
+
+	switch (clear->width) {
+	case 1:
+		*(volatile uint8_t *)reg = clear->value;
+		if (clear->flags & V120IRQD_CLEAR_READBACK) (void)*(volatile uint8_t *)reg;
+		break;
+	case 2:
+		*(volatile uint16_t *)reg = clear->value;
+		if (clear->flags & V120IRQD_CLEAR_READBACK) (void)*(volatile uint16_t *)reg;
+		break;
+	default:
+		*(volatile uint32_t *)reg = clear->value;
+		if (clear->flags & V120IRQD_CLEAR_READBACK) (void)*(volatile uint32_t *)reg;
+		break;
+	}
+}
+
+/**
+ * defer_frame() - Set a request aside for process_client().
+ * @client:	The client it came from.
+ * @in:		The request.
+ *
+ * Return: Standard success.
+ */
+static int defer_frame(struct client_t * client, const union client_frame * in)
+{
+	struct deferred_frame *df, **pp;
+
+	if (client->ndeferred >= DEFERRED_MAX) {
+		logerror("Client %d has too many requests waiting", client->fd);
+		return -ENOBUFS;
+	}
+	df = malloc(sizeof(*df));
+	if (df == NULL) return -ENOMEM;
+	df->next = NULL;
+	df->t_wake = latency_now();
+	df->in = *in;
+
+	for (pp = &client->deferred; *pp != NULL; pp = &(*pp)->next) { ; }
+	*pp = df;
+	client->ndeferred++;
+	deferred_total++;
+	return 0;
+}
+
+/**
+ * count_answer() - Add a client's answer to its statistics.
+ * @client:	The client.
+ * @msg:	ACK or NAK.
+ */
+static void count_answer(struct client_t * client, v120_irq_message_select msg)
+{
+	struct client_stats *st = &client->stats;
+	uint64_t t = latency_now() - st->t_signal;
+
+	if (msg == NAK) st->naks++;
+	st->answers++;
+	st->ack_total += t;
+	if (t > st->ack_max) st->ack_max = t;
+}
+
+/**
+ * recv_answer() - Read a client's answer to a notification.
+ * @client:	The client.
+ * @resp:	The answer.
+ * @wait:	Keep reading past any requests, rather than returning -EAGAIN
+ * 			once one has been set aside.
+ *
+ * On a V120IRQD_FEATURE_MUX connection other threads may be making requests
+ * while one handles the notification, and those can turn up first.  They're
+ * set aside with defer_frame() and handled after.  From anyone else, whatever
+ * comes next is the answer, good or bad.
+ *
+ * Return: As for v120_irqd_msg_recv().
+ */
+static ssize_t recv_answer(struct client_t * client, response_buffer * resp, bool wait)
+{
+	union client_frame in;
+	ssize_t len;
+
+	for (;;) {
+		len = read(client->fd, &in, sizeof(in));
+		if (len < 0) {
+			len = -errno;
+			if (len != -EAGAIN) {
+				logwarn("Couldn't read message data from socket: %s", strerror(-len));
+			}
+			return len;
+		}
+		if (len == 0 || !(client->features & V120IRQD_FEATURE_MUX) ||
+				in.resp.msg == ACK || in.resp.msg == NAK) {
+			break;
+		}
+		if (defer_frame(client, &in) < 0) break;
+		if (!wait) return -EAGAIN;
+	}
+	if (len > 0 && (in.resp.msg == ACK || in.resp.msg == NAK)) {
+		count_answer(client, in.resp.msg);
+	}
+	*resp = in.resp;
+	return len;
+}
+
+/**
+ * drain_acks() - Collect the responses owed for notifications not waited on.
+ * @client:	The client about to be sent a notification that will be.
+ *
+ * Clients answer in order, so once these are out of the way the next
+ * response really is to the next notification.
+ *
+ * Return: Standard success.
+ */
+static int drain_acks(struct client_t * client)
+{
+	response_buffer resp;
+	ssize_t len;
+
+	while (client->unacked) {
+		len = recv_answer(client, &resp, true);
+		if (len == -EAGAIN) {
+			mark_slow(client, "didn't answer in time");
+			return -ETIMEDOUT;
+		}
+		if (len < 0) return len;
+		if (len == 0) return -EPIPE;
+		if (resp.msg != ACK && resp.msg != NAK) {
+			logerror("Expected a response, got %s", message_select_str(resp.msg));
+			client->unacked = 0;
+			return -EBADMSG;
+		}
+		got_ack(client);
+	}
+	return 0;
+}
+
+/**
+ * await_ack() - Wait for the answer to a notification just sent.
+ * @client:	The client.
+ * @count:	How many interrupts the notification carried.
+ *
+ * The wait only lasts as long as --ack-timeout.  A client that runs out of
+ * time is marked slow, and its answer is collected whenever it does turn up,
+ * as for notifications that weren't waited on.
+ *
+ * Return: 0 for an ACK, -EPERM for a NAK, -ETIMEDOUT if the client ran out of
+ * time, or another negative error code.
+ */
+static int await_ack(struct client_t * client, unsigned int count)
+{
+	response_buffer resp;
+	ssize_t len;
+
+	len = recv_answer(client, &resp, true);
+	if (len == -EAGAIN) {
+		client->unacked++;
+		mark_slow(client, "didn't answer in time");
+		return -ETIMEDOUT;
+	}
+	if (len < 0) return len;
+	if (len == 0) return -ECONNRESET;
+	if (resp.msg == NAK) return -EPERM;
+	if (resp.msg != ACK) return -EBADMSG;
+	if (count > 1 && resp.count != 0 && resp.count != count) {
+		logwarn("Batch of %u interrupts acknowledged as %u", count, resp.count);
+	}
+	return 0;
+}
+
+/**
+ * signal_client() - Send interrupts to a client in whichever form it takes.
+ * @client:	The client.
+ * @sel:	The interrupts.
+ * @stamp:	Their stamps, for V120IRQD_FEATURE_TIMESTAMP clients.
+ * @count:	Number of @sel and @stamp.
+ *
+ * Return: Standard success.
+ */
+static int signal_client(struct client_t * client, const struct v120irqd_selector * sel,
+	const struct irq_stamp * stamp, unsigned int count)
+{
+	struct v120irqd_event ev[V120IRQD_BATCH_MAX];
+	unsigned int i;
+	int err;
+
+	if (!(client->features & V120IRQD_FEATURE_TIMESTAMP)) {
+		err = v120irqd_signal(client->fd, sel, count);
+	} else if (count < 1 || count > V120IRQD_BATCH_MAX) {
+		return -EINVAL;
+	} else {
+		for (i = 0; i < count; i++) {
+			ev[i].sel = sel[i];
+			ev[i].t_detect = stamp[i].t_detect;
+			ev[i].tsc = stamp[i].tsc;
+			ev[i].seq = stamp[i].seq;
+			ev[i].flags = stamp[i].flags;
+		}
+		err = v120irqd_signal_events(client->fd, ev, count);
+	}
+	if (err == 0) {
+		client->stats.delivered += count;
+		client->stats.t_signal = latency_now();
+	}
+	return err;
+}
+
+/**
+ * signal_irqs() - Send interrupts to a client without waiting for its answer.
+ * @client:	The client.
+ * @sel:	The interrupts.
+ * @stamp:	Their stamps.
+ * @count:	Number of @sel.
+ *
+ * Return: Standard success.
+ */
+static int signal_irqs(struct client_t * client, const struct v120irqd_selector * sel,
+	const struct irq_stamp * stamp, unsigned int count)
+{
+	int err = signal_client(client, sel, stamp, count);
+
+	if (err == -EAGAIN) mark_slow(client, "stopped reading");
+	if (err == 0) expect_ack(client);
+	return err;
+}
+
+/**
+ * send_irqs() - Send interrupts to a client and wait for its answer.
+ * @client:	The client.
+ * @sel:	The interrupts.
+ * @stamp:	Their stamps.
+ * @count:	Number of @sel.
+ *
+ * This is v120irqd_interrupts(), but only waiting so long.
+ *
+ * Return: As for await_ack().
+ */
+static int send_irqs(struct client_t * client, const struct v120irqd_selector * sel,
+	const struct irq_stamp * stamp, unsigned int count)
+{
+	int err = signal_client(client, sel, stamp, count);
+
+	if (err == -EAGAIN) {
+		mark_slow(client, "stopped reading");
+		return -ETIMEDOUT;
+	}
+	if (err) return err;
+	return await_ack(client, count);
+}
+
+/**
+ * notify_observer() - Send an observer its notification, if it has room.
+ * @client:	The observer.
+ * @sel:	The interrupt, with the observer's payload.
+ * @stamp:	Its stamp.
+ *
+ * The server never waits on an observer, so if its connection is backed up
+ * the notification is simply dropped.  Nor does it expect an answer: an
+ * observer that only watches must never be taken for slow, and have its own
+ * requests go to the fallback.
+ */
+static void notify_observer(struct client_t * client, const struct v120irqd_selector * sel,
+	const struct irq_stamp * stamp)
+{
+	response_buffer resp = { .msg = IRQ_SIGNAL, .selector = *sel };
+	event_buffer events = {
+		.msg = IRQ_EVENTS,
+		.count = 1,
+		.event = {{
+			.sel = *sel,
+			.t_detect = stamp->t_detect,
+			.tsc = stamp->tsc,
+			.seq = stamp->seq,
+			.flags = stamp->flags
+		}}
+	};
+	ssize_t len;
+
+	if (client->features & V120IRQD_FEATURE_TIMESTAMP) {
+		len = send(client->fd, &events, event_buffer_len(1), MSG_DONTWAIT | MSG_NOSIGNAL);
+	} else {
+		len = send(client->fd, &resp, sizeof(resp), MSG_DONTWAIT | MSG_NOSIGNAL);
+	}
+	if (len < 0) {
+		logdebug("Dropped IRQ %04X:%02X:%08X for observer: %s",
+			sel->crate, sel->irq, sel->vector, strerror(errno));
+		return;
+	}
+	client->stats.delivered++;
+	client->stats.t_signal = latency_now();
+}
+
+/**
+ * deliver_shared() - Notify every subscriber to a shared interrupt.
+ * @sel:		The concrete interrupt.
+ * @stamp:		Its stamp.
+ * @targets:	Its subscribers, as from find_targets().
+ * @ntargets:	Number of @targets.
+ * @t_send:		Set to when the notifications started out.
+ *
+ * The consumers are all notified first, then the observers, and only then
+ * does the server wait on the consumers as their ACK policy says.  Any ACKs
+ * it didn't need to wait for are collected later, as for cleared interrupts.
+ *
+ * Slow consumers are notified but not waited on, leaving it to the others.
+ * Consumers that don't answer within --ack-timeout are marked slow.
+ *
+ * Return: 0 once the interrupt is handled, or a negative error code.  -EBADMSG
+ * means that it was NAKed, and -ETIMEDOUT that nobody answered in time.
+ */
+static int deliver_shared(struct v120irqd_selector * sel, const struct irq_stamp * stamp,
+	const struct irq_target * targets, int ntargets, uint64_t * t_send)
+{
+	const struct request_options *opts = targets[0].options;
+	unsigned int policy = opts->sub.policy;
+	struct pollfd waiting[IRQ_TARGETS_MAX];
+	struct client_t *consumer[IRQ_TARGETS_MAX];
+	struct client_t *client;
+	response_buffer resp;
+	unsigned int needed, nacks = 0, nnaks = 0;
+	int i, nwait = 0, err, ret = 0, timeout;
+	uint64_t deadline, now;
+	ssize_t len;
+
+	*t_send = latency_now();
+	deadline = *t_send + settings.ackTimeout;
+	for (i = 0; i < ntargets; i++) {
+		opts = targets[i].options;
+		if (opts->sub.role != V120IRQD_CONSUMER) continue;
+		client = (struct client_t *)targets[i].data;
+		sel->payload = targets[i].payload;
+
+		err = (policy == V120IRQD_ACK_NONE || client->slow) ? 0 : drain_acks(client);
+		if (err == 0) err = signal_client(client, sel, stamp, 1);
+		if (err == -EAGAIN) mark_slow(client, "stopped reading");
+		if (err) {
+			ret = err;
+			continue;
+		}
+		if (policy == V120IRQD_ACK_NONE || client->slow) {
+			expect_ack(client);
+		} else {
+			consumer[nwait] = client;
+			waiting[nwait].fd = client->fd;
+			waiting[nwait].events = POLLIN;
+			nwait++;
+		}
+	}
+	for (i = 0; i < ntargets; i++) {
+		opts = targets[i].options;
+		if (opts->sub.role != V120IRQD_OBSERVER) continue;
+		sel->payload = targets[i].payload;
+		notify_observer((struct client_t *)targets[i].data, sel, stamp);
+	}
+	if (nwait == 0) return ret;
+
+	needed = (policy == V120IRQD_ACK_ALL) ? nwait : 1;
+	while (nacks < needed && nwait > 0) {
+		timeout = -1;
+		if (settings.ackTimeout) {
+			now = latency_now();
+			timeout = (deadline > now) ? (deadline - now + 999999) / 1000000 : 0;
+		}
+		err = poll(waiting, nwait, timeout);
+		if (err < 0) {
+			if (errno == EINTR) continue;
+			ret = -errno;
+			break;
+		}
+		if (err == 0) {
+			for (i = 0; i < nwait; i++) {
+				mark_slow(consumer[i], "didn't answer in time");
+			}
+			ret = -ETIMEDOUT;
+			break;
+		}
+
+		/* Back to front, so that answered consumers can be swapped out. */
+		for (i = nwait - 1; i >= 0; i--) {
+			if (waiting[i].revents == 0) continue;
+			len = recv_answer(consumer[i], &resp, false);
+			if (len == -EAGAIN) {
+				/* Only a request, the answer's still to come. */
+				continue;
+			} else if (len > 0 && resp.msg == ACK) {
+				nacks++;
+			} else if (len > 0 && resp.msg == NAK) {
+				nnaks++;
+			} else {
+				ret = (len > 0) ? -EBADMSG : -EPIPE;
+			}
+			nwait--;
+			waiting[i] = waiting[nwait];
+			consumer[i] = consumer[nwait];
+		}
+	}
+
+	/* Whoever we didn't need to hear from, we'll hear from later. */
+	for (i = 0; i < nwait; i++) {
+		expect_ack(consumer[i]);
+	}
+
+	if (nacks >= needed) return 0;
+	if (nnaks > 0) return -EBADMSG;
+	return (ret != 0) ? ret : -EPIPE;
+}
+
+/**
+ * notify_irq() - Find the registered listener and notify it about an IRQ.
+ * @sel:	A concrete v120irqd_selector describing the interrupt.
+ * @stamp:	Its stamp, whose @t_detect is also the start of its latency.
+ *
+ * Return: 0, or a negative error code to indicate a problem.
+ */
+static int notify_irq(struct v120irqd_selector * sel, const struct irq_stamp * stamp)
+{
+	struct irq_target targets[IRQ_TARGETS_MAX];
+	struct client_t *client;
+	struct request_options *opts;
+	uint64_t t_wake = stamp->t_detect;
+	uint64_t t_send;
+	int err, n;
+
+	n = find_targets(sel, targets);
+	if (n < 0) return n;
+	if (targets_shared(targets, n)) {
+		err = deliver_shared(sel, stamp, targets, n, &t_send);
+		if (err == 0) {
+			record_latency(sel, t_wake, t_wake, t_send, latency_now());
+		}
+		return err;
+	}
+	client = (struct client_t *)targets[0].data;
+	opts = targets[0].options;
+
+	/* Fake interrupts have nothing to clear, but are delivered just as the
+	 * real thing would be.
+	 */
+	if (opts != NULL && (opts->flags & OPT_DMA)) {
+		perform_dma(opts, client, sel, crate_handle(sel->crate));
+	}
+	if ((opts != NULL && (opts->flags & OPT_CLEAR)) || client->slow) {
+		t_send = latency_now();
+		err = signal_irqs(client, sel, stamp, 1);
+		if (err == 0) {
+			record_latency(sel, t_wake, t_wake, t_send, latency_now());
+		}
+		return err;
+	}
+	err = drain_acks(client);
+	if (err) return err;
+
+	/* Only ever waiting so long for the answer. */
+	logdebug("Sending IRQ %04X:%02X:%08X", sel->crate, sel->irq, sel->vector);
+	t_send = latency_now();
+	err = send_irqs(client, sel, stamp, 1);
+	if (err == 0) {
+		record_latency(sel, t_wake, t_wake, t_send, latency_now());
+	}
+	return err;
+}
+
+/**
+ * struct pending_irq - One interrupt found during a pass over a crate.
+ * @selector:	The concrete interrupt, with the payload of its target.
+ * @stamp:		When and in what order it was found.
+ * @client:		The registered target, or NULL if there isn't one.
+ * @target:		Every registered target, as from find_targets().
+ * @ntargets:	Number of entries in @target.
+ * @shared:		@target are shared subscriptions, for deliver_shared().
+ * @err:		The outcome of notifying @client, as from notify_irq().
+ * @async:		The server already cleared it, so delivery needn't be
+ * 				waited on.
+ * @sent:		Whether delivery has been attempted yet.
+ * @t_vector:	When the vector was read.
+ * @t_send:		When the notification started out to @client.
+ * @t_ack:		When @client acknowledged it.
+ */
+struct pending_irq {
+	struct v120irqd_selector selector;
+	struct irq_stamp stamp;
+	struct client_t *client;
+	struct irq_target target[IRQ_TARGETS_MAX];
+	int ntargets;
+	bool shared;
+	int err;
+	bool async;
+	bool sent;
+	uint64_t t_vector, t_send, t_ack;
+};
+
+/**
+ * deliver_pending() - Notify the targets of everything found in one pass.
+ * @pending:	The interrupts, highest priority first.
+ * @npending:	Number of entries in @pending.
+ *
+ * Clients that negotiated V120IRQD_FEATURE_BATCH get everything bound for
+ * them as a single message with a single acknowledgement.  Everyone else gets
+ * one message per interrupt, exactly as from notify_irq().  Targets are served
+ * in the priority order of the first interrupt bound for them.
+ *
+ * Interrupts that were already cleared are sent without waiting for the ACK,
+ * which turns up in process_client() later; for these @t_ack is just the time
+ * the send finished.  They're never batched with ones that weren't.  Shared
+ * interrupts are never batched at all, but go through deliver_shared().
+ *
+ * Slow clients aren't sent anything that would have to be waited on; that
+ * fails with -ETIMEDOUT, just as if they'd been sent it and not answered.
+ */
+static void deliver_pending(struct pending_irq *pending, unsigned int npending)
+{
+	struct v120irqd_selector batch[V120IRQD_BATCH_MAX];
+	struct irq_stamp stamps[V120IRQD_BATCH_MAX];
+	struct client_t *client;
+	unsigned int i, j, n;
+	uint64_t t_send, t_ack;
+	int err;
+
+	for (i = 0; i < npending; i++) {
+		client = pending[i].client;
+		if (pending[i].sent || client == NULL) continue;
+
+		if (pending[i].shared) {
+			pending[i].err = deliver_shared(&pending[i].selector, &pending[i].stamp,
+				pending[i].target, pending[i].ntargets, &pending[i].t_send);
+			pending[i].t_ack = latency_now();
+			pending[i].sent = true;
+			continue;
+		}
+
+		if (!pending[i].async && client->slow) {
+			pending[i].err = -ETIMEDOUT;
+			pending[i].sent = true;
+			acks.held++;
+			continue;
+		}
+
+		if (!pending[i].async) {
+			pending[i].err = drain_acks(client);
+			if (pending[i].err) {
+				pending[i].sent = true;
+				continue;
+			}
+		}
+
+		if (!(client->features & V120IRQD_FEATURE_BATCH)) {
+			logdebug("Sending IRQ %04X:%02X:%08X", pending[i].selector.crate,
+				pending[i].selector.irq, pending[i].selector.vector);
+			pending[i].t_send = latency_now();
+			if (pending[i].async) {
+				pending[i].err = signal_irqs(client, &pending[i].selector,
+					&pending[i].stamp, 1);
+			} else {
+				pending[i].err = send_irqs(client, &pending[i].selector,
+					&pending[i].stamp, 1);
+			}
+			pending[i].t_ack = latency_now();
+			pending[i].sent = true;
+			continue;
+		}
+
+		n = 0;
+		for (j = i; j < npending; j++) {
+			if (pending[j].client == client && !pending[j].shared &&
+					pending[j].async == pending[i].async) {
+				stamps[n] = pending[j].stamp;
+				batch[n++] = pending[j].selector;
+			}
+		}
+		logdebug("Sending %u IRQs to batch client", n);
+		t_send = latency_now();
+		if (pending[i].async) {
+			err = signal_irqs(client, batch, stamps, n);
+		} else {
+			err = send_irqs(client, batch, stamps, n);
+		}
+		t_ack = latency_now();
+		for (j = i; j < npending; j++) {
+			if (pending[j].client == client && !pending[j].shared &&
+					pending[j].async == pending[i].async) {
+				pending[j].err = err;
+				pending[j].sent = true;
+				pending[j].t_send = t_send;
+				pending[j].t_ack = t_ack;
+			}
+		}
+	}
+}
+
+/**
+ * struct sched_event - One IRQ line found asserted, waiting its turn.
+ * @t_seen:	When its crate's status was read.
+ * @tsc:	latency_tsc() at the same moment.
+ * @t_vector:	When its vector had been read.
+ * @vector:	The vector, from the IACK cycle.
+ * @idx:	The v120_info index of the crate.
+ * @irq:	The IRQ level.
+ */
+struct sched_event {
+	uint64_t t_seen;
+	uint64_t tsc;
+	uint64_t t_vector;
+	uint32_t vector;
+	uint8_t idx;
+	uint8_t irq;
+};
+
+/* Crates start their turn at reading status one later each round, so that
+ * nobody always wins the ties.
+ */
+static unsigned int sched_first;
+
+/**
+ * sched_insert() - Queue an event in priority order.
+ * @ev:		The queue, highest priority first.
+ * @n:		The number of events already in @ev.
+ * @e:		The new event.
+ *
+ * The higher VME level goes first, and then whichever was seen first.
+ */
+static void sched_insert(struct sched_event * ev, unsigned int n, struct sched_event e)
+{
+	while (n > 0 && (ev[n-1].irq < e.irq ||
+			(ev[n-1].irq == e.irq && ev[n-1].t_seen > e.t_seen))) {
+		ev[n] = ev[n-1];
+		n--;
+	}
+	ev[n] = e;
+}
+
+/**
+ * gather_events() - Read what's asserted on a set of crates.
+ * @active:	The v120_info indices of the crates to look at, as a bitmask.
+ * 			Crates with nothing asserted are taken out.
+ * @ev:		Loaded with the asserted lines, highest priority first.
+ *
+ * Each crate's status is read once, and then the vectors of every level it
+ * has asserted straight after, highest level first, so that the whole round
+ * can be dispatched from this one snapshot without going back to the crate.
+ * Only the asserted levels are read: each vector read is a VME IACK cycle, so
+ * reading the whole V120_IRQ block in one go would acknowledge levels that
+ * nobody has asserted.
+ *
+ * A line that goes over its rate limit is masked before its vector is even
+ * read, so the interrupt is still pending when the timer enables it again.
+ *
+ * Return: The number of @ev.
+ */
+static unsigned int gather_events(unsigned int * active, struct sched_event * ev)
+{
+	struct sched_event e;
+	struct v120_info_t *info;
+	struct line_stats *line;
+	uint64_t t_iack;
+	uint32_t irqstatus;
+	unsigned int i, n = 0;
+	int idx, irq;
+
+	for (i = 0; i < len_crates; i++) {
+		idx = (sched_first + i) % len_crates;
+		if (!(*active & (1 << idx))) continue;
+
+		/* The enables only ever change through the shadow copy, so only
+		 * the status has to come over PCIe.
+		 */
+		info = &v120_info[idx];
+		irqstatus = info->irqhndl->irqstatus & info->irqen;
+		if (irqstatus == 0) {
+			*active &= ~(1 << idx);
+			continue;
+		}
+
+		e.t_seen = latency_now();
+		e.tsc = latency_tsc();
+		e.idx = idx;
+		for (irq = 7; irq >= 1; irq--) {
+			if ((irqstatus & (1 << irq)) == 0) continue;
+			if (!storm_allow(&info->storm[irq],
+					settings.stormRate, settings.stormBurst, e.t_seen)) {
+				mask_line(idx, irq, "over its rate limit", e.t_seen);
+				continue;
+			}
+
+			t_iack = latency_now();
+			e.vector = info->irqhndl->iack_vector[irq];
+			e.t_vector = latency_now();
+			e.irq = irq;
+
+			line = &info->line[irq];
+			line->seen++;
+			line->vector_total += e.t_vector - t_iack;
+			if (e.t_vector - t_iack > line->vector_max) {
+				line->vector_max = e.t_vector - t_iack;
+			}
+			sched_insert(ev, n++, e);
+		}
+	}
+	sched_first++;
+	return n;
+}
+
+/**
+ * service_events() - Deliver a batch of scheduled events.
+ * @ev:		The events, highest priority first.
+ * @n:		Number of @ev, at most V120IRQD_BATCH_MAX.
+ * @t_wake:	When the events were first seen.
+ *
+ * Lines that turn out to be stuck are found with one status read per crate
+ * for the whole batch, however many of its lines failed.
+ */
+static void service_events(const struct sched_event * ev, unsigned int n, uint64_t t_wake)
+{
+	struct pending_irq pending[V120IRQD_BATCH_MAX];
+	struct pending_irq *p;
+	struct request_options *opts;
+	struct v120_info_t *info;
+	uint32_t stuck[16] = {0};
+	uint64_t wait, t_turn;
+	unsigned int i;
+	int idx, irq, err;
+
+	/* Everything in the batch goes out to its clients together. */
+	t_turn = latency_now();
+	for (i = 0; i < n; i++) {
+		idx = ev[i].idx;
+		irq = ev[i].irq;
+		info = &v120_info[idx];
+		p = &pending[i];
+
+		p->selector.vector = ev[i].vector;
+		p->t_vector = ev[i].t_vector;
+		p->selector.crate = (1 << info->cratenumber);
+		p->selector.irq = (1 << irq);
+		record_irq(&p->selector, 0, ev[i].t_seen);
+		stamp_irq(&p->stamp, &p->selector, 0, ev[i].t_seen, ev[i].tsc);
+		p->ntargets = find_targets(&p->selector, p->target);
+		p->err = (p->ntargets < 0) ? p->ntargets : 0;
+		p->client = (p->ntargets > 0) ? (struct client_t *)p->target[0].data : NULL;
+		opts = (p->ntargets > 0) ? p->target[0].options : NULL;
+		p->shared = targets_shared(p->target, p->ntargets);
+		p->sent = false;
+
+		/* How long it waited its turn. */
+		wait = t_turn - ev[i].t_seen;
+		info->sched.events++;
+		if (wait > info->sched.max_wait) info->sched.max_wait = wait;
+		if (wait > SCHED_STARVE) info->sched.starved++;
+
+		/* Fetch the data, then release the line right away if we know how. */
+		p->async = false;
+		if (opts != NULL && (opts->flags & OPT_DMA)) {
+			perform_dma(opts, p->client, &p->selector, info->handle);
+		}
+		if (opts != NULL && (opts->flags & OPT_CLEAR)) {
+			perform_clear(opts, info->cratenumber);
+			p->async = true;
+		}
+	}
+
+	deliver_pending(pending, n);
+
+	for (i = 0; i < n; i++) {
+		p = &pending[i];
+		idx = ev[i].idx;
+		irq = ev[i].irq;
+		info = &v120_info[idx];
+		err = p->err;
+
+		switch (err) {
+			case 0: {
+				record_latency(&p->selector, t_wake, p->t_vector, p->t_send, p->t_ack);
+				continue;
+			}
+
+			case -EINVAL: {
+				/* We had no registered client for the interrupt.
+				 * If we're lucky and the interrupt was obviously ROAK
+				 * then we just keep going, otherwise we need to disable
+				 * this interrupt.
+				 */
+				info->line[irq].targetless++;
+				logwarn(
+					"Targetless interrupt: Crate %d IRQ%d @0x%08X",
+					info->cratenumber, irq, p->selector.vector
+				);
+			}
+
+			case -EBADMSG: {
+				/* The client NAKed the message.  Ummm, okay? */
+
+				logwarn(
+					"Client NAK: Crate %d IRQ%d @0x%08X",
+					info->cratenumber, irq, p->selector.vector
+				);
+			}
+
+			case -EPIPE: {
+				/* The client connection closed unexpectedly; we'll
+				 * notice this later when we get back to the poll loop.
+				 *
+				 * There's really no special handling for this versus
+				 * any other error, but at least we understand it.
+				 *
+				 * Disable the interrupt for now; the reanalysis when the
+				 * client is dropped may turn it back on later.
+				 */
+				break;
+			}
+
+			case -ETIMEDOUT:
+			case -EAGAIN: {
+				/* The client is slow, and didn't get or didn't answer the
+				 * interrupt.  If there's someone to fall back on, the next
+				 * pass will find it for them; otherwise anything still on is
+				 * masked below, like any other line nobody is clearing.
+				 */
+				if (has_fallback(&p->selector)) continue;
+				break;
+			}
+
+			default: {
+				/* We're stumped. */
+				logerror("Error processing interrupt: %s", strerror(-err));
+			}
+		}
+
+		stuck[idx] |= (1 << irq);
+	}
+
+	/* Whichever of those lines is still on is a bust; we can't do a thing
+	 * with it and it's stuck on.  All we can do is keep from nuking the
+	 * entire system, and try again later.
+	 */
+	for (idx = 0; idx < len_crates; idx++) {
+		if (stuck[idx] == 0) continue;
+		stuck[idx] &= v120_info[idx].irqhndl->irqstatus;
+		for (irq = 7; irq >= 1; irq--) {
+			if (stuck[idx] & (1 << irq)) {
+				mask_line(idx, irq, "can't be cleared", latency_now());
+			}
+		}
+	}
+}
+
+/**
+ * service_crates() - Handle all interrupts pending on a set of crates.
+ * @ready:	The v120_info indices of the crates, as a bitmask.
+ * @t_wake:	When the interrupts were first seen.
+ *
+ * The crates are serviced together in rounds.  Each round reads what's
+ * asserted on every crate that still had something on last time, and then
+ * fetches and dispatches the lot in priority order: highest VME level first,
+ * then whichever was seen first, across all the crates.  Nothing seen in a
+ * round waits for the next one, so no crate waits longer than one round
+ * however busy the others are: a stream of IRQ7s on one crate gets one turn
+ * per round like everything else, rather than starving IRQ1 everywhere.
+ *
+ * Rounds continue until every crate has been cleared.
+ *
+ * Return: The number of interrupts found.
+ */
+static unsigned int service_crates(unsigned int ready, uint64_t t_wake)
+{
+	struct sched_event ev[16 * 7];
+	unsigned int i, n, found = 0;
+
+	while (ready) {
+		n = gather_events(&ready, ev);
+		for (i = 0; i < n; i += V120IRQD_BATCH_MAX) {
+			service_events(ev + i, (n - i < V120IRQD_BATCH_MAX) ? n - i : V120IRQD_BATCH_MAX,
+				t_wake);
+		}
+		found += n;
+
+		/* Anything found on the next round was first seen from here. */
+		t_wake = latency_now();
+	}
+
+	/* Keep the crates hot for a while, if we're busy polling. */
+	if (found) busy.until = latency_now() + settings.busyWindow;
+	return found;
+}
+
+/**
+ * process_vme() -	Reset the flag of a crate that's woken us up.
+ * @idx:	The list_pollfds index to the VME endpoint.
+ *
+ * The interrupts themselves are left for service_crates(), once all the
+ * crates that are ready have been found.
+ */
+static void process_vme(int idx)
+{
+	/* If nothing else, we need to read the flag to reset the socket. */
+	int fd = list_pollfds[idx].fd;
+	if (read(fd, NULL, 1) < 0) {
+		logdebug("Reading IRQ flag: %s", strerror(errno));
+	}
+}
+
+/**
+ * busy_poll() - Spin on the crates' interrupt registers for a while.
+ *
+ * This is only done for the busy polling window after an interrupt, or all
+ * the time with --busy-poll=always, and only for one BUSY_SLICE at a time.
+ * Interrupts found this way are handled on the spot, without waiting for the
+ * driver to wake us; the driver's flag is reset the next time we poll.
+ *
+ * Return: true if it spun, and the sockets should only be polled without
+ * blocking before it spins again.
+ */
+static bool busy_poll(void)
+{
+	uint64_t start, end, now;
+	unsigned int ready;
+	int idx;
+
+	if (settings.busyWindow == 0 || len_crates == 0) return false;
+	start = now = latency_now();
+	if (!settings.busyAlways && now >= busy.until) return false;
+
+	end = start + BUSY_SLICE;
+	while (now < end && (settings.busyAlways || now < busy.until)) {
+		ready = 0;
+		for (idx = 0; idx < len_crates; idx++) {
+			if (v120_info[idx].irqhndl->irqstatus & v120_info[idx].irqen) {
+				ready |= (1 << idx);
+			}
+		}
+		if (ready) busy.caught += service_crates(ready, latency_now());
+		now = latency_now();
+	}
+	busy.spin_ns += now - start;
+	return true;
+}
+
+/**
+ * process_newclient() - Accept a new client connection, add it to list_pollfds.
+ */
+static void process_newclient(void)
+{
+	int client = accept(list_pollfds[len_crates].fd, NULL, NULL);
+	if (client < 0) {
+		logerror("accept() failed: %s", strerror(errno));
+		return;
+	}
+	if (configureClientSocket(client)) {
+		close(client);
+		return;
+	}
+
+	loginfo("Accepted client connection (%d)", count_clients());
+	return;
+}
+
+/**
+ * enable_interrupts() - Turn on all appropriate interrupt enables.
+ *
+ * For every crate set in @st->crate ensure that all the interrupts set in
+ * @st->irq are enabled.  This is called when adding a new interrupt request
+ * to the list, after it's been counted in the table, and leaves the other
+ * crates alone.
+ */
+static void enable_interrupts(struct v120irqd_selector * st)
+{
+	for (int idx = 0; idx < len_crates; idx++) {
+		if (st->crate & (1 << v120_info[idx].cratenumber)) sync_irqen(idx);
+	}
+}
+
+/**
+ * disable_unused_interrupts() - Set interrupt enables to reflect the table.
+ *
+ * Set the interrupt enable masks of every crate to only those interrupts
+ * that are still registered.  This is called when removing interrupt
+ * requests.  The table keeps count as entries come and go, so this is cheap,
+ * and only the crates whose mask actually changed get written.  Lines masked
+ * by storm protection stay masked either way.
+ */
+static void disable_unused_interrupts(void)
+{
+	for (int idx = 0; idx < len_crates; idx++) sync_irqen(idx);
+}
+
+/**
+ * build_status_report() - Get all the server status information.
+ * @status: A buffer to hold the status information.
+ */
+static void build_status_report(struct v120irqd_serverstatus * status)
+{
+	status->pid = getpid();
+	status->crates = 0;
+	for (int idx=0; idx < len_crates; idx++) {
+		status->crates |= (1 << v120_info[idx].cratenumber);
+	}
+	status->clients = count_clients();
+	status->irq_requests = count_registered_interrupts();
+}
+
+/* walk_interrupts() callback to count the requests of a page of clients. */
+static int count_requests(irqdata_t sd, const struct v120irqd_selector * request,
+	void * options, bool shared, void * arg)
+{
+	client_stats_buffer *buf = arg;
+
+	for (unsigned int i = 0; i < buf->count; i++) {
+		if (list_clients[len_crates+2 + buf->first + i] == (struct client_t *)sd) {
+			buf->client[i].requests++;
+		}
+	}
+	return 0;
+}
+
+/**
+ * build_client_stats() - Get the statistics of a page of clients.
+ * @first:	The index of the first client wanted, in list_clients order.
+ * @buf:	A buffer to hold the statistics.
+ */
+static void build_client_stats(unsigned int first, client_stats_buffer * buf)
+{
+	struct v120irqd_client_stats *out;
+	const struct client_t *client;
+	unsigned int i;
+
+	memset(buf, 0, sizeof(*buf));
+	buf->total = count_clients();
+	buf->first = first;
+	for (i = 0; i < STATS_PAGE && first + i < buf->total; i++) {
+		client = list_clients[len_crates+2 + first + i];
+		out = &buf->client[i];
+		out->pid = client->pid;
+		out->id = client->fd;
+		out->flags = client->slow ? V120IRQD_CLIENT_SLOW : 0;
+		out->queued = client->unacked + client->ndeferred;
+		out->delivered = client->stats.delivered;
+		out->naks = client->stats.naks;
+		out->timeouts = client->timeouts;
+		if (client->stats.answers) {
+			out->ack_avg = client->stats.ack_total / client->stats.answers;
+		}
+		out->ack_max = client->stats.ack_max;
+	}
+	buf->count = i;
+	if (buf->count) walk_interrupts(count_requests, buf);
+}
+
+/**
+ * build_line_stats() - Get the statistics of each IRQ level of a crate.
+ * @crate:	The crate number.
+ * @buf:	A buffer to hold the statistics.
+ *
+ * Return: Standard success; -ENODEV if we don't have @crate.
+ */
+static int build_line_stats(int crate, line_stats_buffer * buf)
+{
+	const struct v120_info_t *info = NULL;
+	const struct line_stats *line;
+	struct v120irqd_line_stats *out;
+
+	for (int idx = 0; idx < len_crates; idx++) {
+		if (v120_info[idx].cratenumber == crate) info = &v120_info[idx];
+	}
+	if (info == NULL) return -ENODEV;
+
+	memset(buf, 0, sizeof(*buf));
+	buf->crate = crate;
+	for (int irq = 1; irq <= 7; irq++) {
+		line = &info->line[irq];
+		out = &buf->line[irq];
+		out->seen = line->seen;
+		out->targetless = line->targetless;
+		out->masked = info->storm[irq].storms;
+		out->suppressed = info->storm[irq].suppressed;
+		if (line->seen) out->vector_avg = line->vector_total / line->seen;
+		out->vector_max = line->vector_max;
+		if (info->irqen & (1 << irq))		out->flags |= V120IRQD_LINE_ENABLED;
+		if (info->storm[irq].t_rearm)		out->flags |= V120IRQD_LINE_MASKED;
+	}
+	return 0;
+}
+
+/**
+ * build_latency_report() - Summarize the latency histograms.
+ * @which:	Multibit selector of the crates and IRQ levels to summarize.
+ * @reset:	If true, clear the selected histograms afterwards.
+ * @report:	A buffer to hold the summary.
+ */
+static void build_latency_report(const struct v120irqd_selector * which, bool reset,
+	struct v120irqd_latency * report)
+{
+	static latency_histogram merged[V120IRQD_LAT_STAGES];
+	int crate, irq, stage;
+
+	memset(merged, 0, sizeof(merged));
+	for (crate = 0; crate < 16; crate++) {
+		if (!(which->crate & (1 << crate))) continue;
+		for (irq = 1; irq <= 7; irq++) {
+			if (!(which->irq & (1 << irq)) || latency[crate][irq] == NULL) continue;
+			for (stage = 0; stage < V120IRQD_LAT_STAGES; stage++) {
+				latency_merge(&merged[stage], &latency[crate][irq]->stage[stage]);
+			}
+			if (reset) {
+				memset(latency[crate][irq], 0, sizeof(struct irq_latency));
+			}
+		}
+	}
+
+	report->count = merged[V120IRQD_LAT_WAKE_TO_ACK].total;
+	for (stage = 0; stage < V120IRQD_LAT_STAGES; stage++) {
+		report->stage[stage].p50 = latency_percentile(&merged[stage], 500000);
+		report->stage[stage].p99 = latency_percentile(&merged[stage], 990000);
+		report->stage[stage].p999 = latency_percentile(&merged[stage], 999000);
+		report->stage[stage].max = merged[stage].max;
+	}
+}
+
+/**
+ * log_storm_report() - Log the storm protection counts of every line that's
+ * ever been masked.
+ */
+static void log_storm_report(void)
+{
+	const struct storm_guard *g;
+
+	for (int idx = 0; idx < len_crates; idx++) {
+		for (int irq = 1; irq <= 7; irq++) {
+			g = &v120_info[idx].storm[irq];
+			if (g->storms == 0) continue;
+			syslog(
+				LOG_ERR, "Crate %d IRQ%d: masked %llu times%s, %llu IRQs held off",
+				v120_info[idx].cratenumber, irq, (unsigned long long)g->storms,
+				g->t_rearm ? " (masked now)" : "",
+				(unsigned long long)g->suppressed
+			);
+		}
+	}
+}
+
+/**
+ * log_sched_report() - Log how long each crate's interrupts have waited
+ * their turn.
+ */
+static void log_sched_report(void)
+{
+	const struct sched_stats *st;
+
+	for (int idx = 0; idx < len_crates; idx++) {
+		st = &v120_info[idx].sched;
+		if (st->events == 0) continue;
+		syslog(
+			LOG_ERR, "Crate %d: %llu IRQs scheduled, longest wait %llu us, %llu waited over %llu us",
+			v120_info[idx].cratenumber, (unsigned long long)st->events,
+			(unsigned long long)(st->max_wait / 1000),
+			(unsigned long long)st->starved,
+			(unsigned long long)(SCHED_STARVE / 1000)
+		);
+	}
+}
+
+/**
+ * log_busy_report() - Log the time spent busy polling, and what it caught.
+ */
+static void log_busy_report(void)
+{
+	if (settings.busyWindow == 0) return;
+	syslog(
+		LOG_ERR, "Busy poll: %llu ms spinning, %llu IRQs caught spinning (%llu us each), %llu woken by the driver",
+		(unsigned long long)(busy.spin_ns / 1000000),
+		(unsigned long long)busy.caught,
+		(unsigned long long)(busy.caught ? busy.spin_ns / busy.caught / 1000 : 0),
+		(unsigned long long)busy.woken
+	);
+}
+
+/**
+ * log_ack_report() - Log how the clients have been keeping up.
+ */
+static void log_ack_report(void)
+{
+	int n = 0;
+
+	for (int idx = len_crates+2; idx < len_pollfds; idx++) {
+		if (list_clients[idx]->slow) n++;
+	}
+	if (acks.timeouts == 0 && acks.stale_dma == 0) return;
+	syslog(
+		LOG_ERR, "Slow clients: %llu times, %d now, %llu IRQs rerouted, %llu held back, "
+		"%llu DMA reads skipped",
+		(unsigned long long)acks.timeouts, n,
+		(unsigned long long)acks.rerouted,
+		(unsigned long long)acks.held,
+		(unsigned long long)acks.stale_dma
+	);
+}
+
+/**
+ * log_latency_report() - Put the wake to ACK latency of every crate and IRQ
+ * level that has seen interrupts into the syslog.
+ */
+static void log_latency_report(void)
+{
+	struct v120irqd_latency report;
+	struct v120irqd_selector which;
+	int crate, irq;
+
+	for (crate = 0; crate < 16; crate++) {
+		for (irq = 1; irq <= 7; irq++) {
+			if (latency[crate][irq] == NULL) continue;
+			which.crate = (1 << crate);
+			which.irq = (1 << irq);
+			build_latency_report(&which, false, &report);
+			syslog(
+				LOG_ERR, "Crate %d IRQ%d: %llu IRQs, wake->ACK ns p50 %llu p99 %llu p99.9 %llu max %llu",
+				crate, irq, (unsigned long long)report.count,
+				(unsigned long long)report.stage[V120IRQD_LAT_WAKE_TO_ACK].p50,
+				(unsigned long long)report.stage[V120IRQD_LAT_WAKE_TO_ACK].p99,
+				(unsigned long long)report.stage[V120IRQD_LAT_WAKE_TO_ACK].p999,
+				(unsigned long long)report.stage[V120IRQD_LAT_WAKE_TO_ACK].max
+			);
+		}
+	}
+}
+
+/**
+ * reply() - ACK or NAK a client's request.
+ * @client:	The client.
+ * @msg:	ACK or NAK.
+ *
+ * The reply carries the request's tag, if it had one.
+ *
+ * Return: Standard success.
+ */
+static int reply(struct client_t * client, v120_irq_message_select msg)
+{
+	response_buffer resp = { .msg = msg_tagged(msg, client->tag) };
+	ssize_t len = v120irqd_msg_send(client->fd, &resp);
+	return (len < 0) ? len : 0;
+}
+
+/**
+ * register_with_options() - Register a request that came with extras, and
+ * answer the client.
+ * @client:	The client.
+ * @sel:	The request.
+ * @opts:	Its options, or NULL if they couldn't be made, which NAKs it.
+ *
+ * The ACK carries the options' descriptor along, if there is one.
+ */
+static void register_with_options(struct client_t * client,
+	struct v120irqd_selector * sel, struct request_options * opts)
+{
+	response_buffer resp = { .msg = msg_tagged(ACK, client->tag) };
+	int e;
+
+	if (opts == NULL) {
+		e = -EPERM;
+	} else if (opts->flags & OPT_SHARED) {
+		e = register_interrupt_shared((irqdata_t)client, sel, opts);
+	} else {
+		e = register_interrupt_opts((irqdata_t)client, sel, opts);
+	}
+	if (e < 0) {
+		logerror("Failed to register interrupt: %s", strerror(-e));
+		free_request_options(opts);
+		e = reply(client, NAK);
+		if (e < 0) {
+			logerror("Error NAKing: %s", strerror(-e));
+		}
+		return;
+	}
+
+	e = (opts->fd < 0) ? reply(client, ACK) : v120irqd_msg_send_fd(client->fd, &resp, opts->fd);
+	if (e < 0) {
+		logerror("Error ACKing: %s", strerror(-e));
+	} else {
+		enable_interrupts(sel);
+	}
+}
+
+/**
+ * trusted_peer() - Is a client allowed to take the server over?
+ * @client:	The client.
+ *
+ * Only root, or whoever the server is running as.
+ */
+static bool trusted_peer(struct client_t * client)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(client->fd, SOL_SOCKET, SO_PEERCRED, &cred, &len)) {
+		logerror("Couldn't identify client: %s", strerror(errno));
+		return false;
+	}
+	return (cred.uid == 0 || cred.uid == geteuid());
+}
+
+/**
+ * handle_frame() - Act on a (non-response) message from a client.
+ * @client:	The client.
+ * @in:		The message.
+ * @t_wake:	When it was read.
+ */
+static void handle_frame(struct client_t * client, union client_frame * in,
+	uint64_t t_wake)
+{
+	int sock = client->fd;
+	int e;
+	latency_buffer latbuf;
+	client_stats_buffer clientbuf;
+	line_stats_buffer linebuf;
+	struct request_options *opts;
+	struct irq_stamp stamp;
+
+	if (client->features & V120IRQD_FEATURE_MUX) {
+		client->tag = msg_tag(in->resp.msg);
+		in->resp.msg = msg_type(in->resp.msg);
+	}
+
+	switch (in->resp.msg) {
+	case REQUEST_IRQ:
+		e = register_interrupt((irqdata_t)client, &in->resp.selector);
+		if (e < 0) {
+			logerror("Failed to register interrupt: %s", strerror(-e));
+			e = reply(client, NAK);
+			if (e < 0) {
+				logerror("Error NAKing: %s", strerror(-e));
+			}
+
+		} else {
+			e = reply(client, ACK);
+			if (e < 0) {
+				logerror("Error ACKing: %s", strerror(-e));
+			} else {
+				enable_interrupts(&in->resp.selector);
+			}
+		}
+		break;
+
+	case REQUEST_CLEAR:
+		opts = NULL;
+		if (!(client->features & V120IRQD_FEATURE_CLEAR)) {
+			logwarn("Clear action from client that didn't negotiate it");
+		} else {
+			opts = make_request_options(&in->clear);
+		}
+		register_with_options(client, &in->clear.selector, opts);
+		break;
+
+	case REQUEST_DMA:
+		opts = NULL;
+		if (!(client->features & V120IRQD_FEATURE_DMA)) {
+			logwarn("DMA request from client that didn't negotiate it");
+		} else {
+			opts = make_dma_options(&in->dma);
+		}
+		register_with_options(client, &in->dma.selector, opts);
+		break;
+
+	case REQUEST_SHARED:
+		opts = NULL;
+		if (!(client->features & V120IRQD_FEATURE_FANOUT)) {
+			logwarn("Subscription from client that didn't negotiate it");
+		} else {
+			opts = make_shared_options(&in->sub);
+		}
+		register_with_options(client, &in->sub.selector, opts);
+		break;
+
+	case ACK:
+	case NAK:
+		/* The response to a notification we didn't wait for. */
+		if (client->unacked == 0) {
+			logerror("Unexpected %s from client", message_select_str(in->resp.msg));
+			break;
+		}
+		got_ack(client);
+		count_answer(client, in->resp.msg);
+		if (in->resp.msg == NAK) {
+			logwarn("Client NAK of interrupt that wasn't waited on");
+		}
+		break;
+
+	case RELEASE_IRQ:
+		e = release_interrupt((irqdata_t)client, &in->resp.selector);
+		if (e < 0) {
+			logerror("Failed to release interrupt: %s", strerror(-e));
+			e = reply(client, NAK);
+		} else {
+			e = reply(client, ACK);
+		}
+
+		if (e < 0) {
+			logerror("Error acknowledging interrupt release: %s", strerror(-e));
+		}
+
+		disable_unused_interrupts();
+		break;
+
+	case IRQ_SIGNAL:
+		/* Getting an IRQ_SIGNAL from a client is a request to fake an
+		 * interrupt for debugging purposes.
+		 */
+		if (settings.allowFakeIrq) {
+			record_irq(&in->resp.selector, IRQ_RECORD_FAKE, t_wake);
+			stamp_irq(&stamp, &in->resp.selector, V120IRQD_EVENT_FAKE, t_wake, latency_tsc());
+			e = reply(client, ACK) || notify_irq(&in->resp.selector, &stamp);
+			if (e < 0 && e != -EINVAL) {
+				logerror("Couldn't signal fake interrupt: %s", strerror(-e));
+			}
+		} else {
+			e = reply(client, NAK);
+			if (e < 0 && e != -EINVAL) {
+				logerror("Couldn't NAK fake interrupt: %s", strerror(-e));
+			}
+
+		}
+		break;
+
+	case SERVER_STATUS:
+		build_status_report(&in->resp.status);
+		in->resp.msg = msg_tagged(SERVER_STATUS, client->tag);
+		v120irqd_msg_send(sock, &in->resp);
+		break;
+
+	case LATENCY_STATUS:
+		latbuf.msg = msg_tagged(LATENCY_STATUS, client->tag);
+		build_latency_report(&in->resp.selector,
+			in->resp.selector.payload & V120IRQD_LATENCY_RESET, &latbuf.latency);
+		e = write(sock, &latbuf, sizeof(latbuf));
+		if (e < 0) {
+			logerror("Couldn't send latency report: %s", strerror(errno));
+		}
+		break;
+
+	case CLIENT_STATS:
+		build_client_stats(in->resp.selector.payload, &clientbuf);
+		clientbuf.msg = msg_tagged(CLIENT_STATS, client->tag);
+		e = write(sock, &clientbuf, sizeof(clientbuf));
+		if (e < 0) {
+			logerror("Couldn't send client statistics: %s", strerror(errno));
+		}
+		break;
+
+	case LINE_STATS:
+		e = build_line_stats(v120irqd_ilog2f(in->resp.selector.crate), &linebuf);
+		if (e < 0) {
+			e = reply(client, NAK);
+		} else {
+			linebuf.msg = msg_tagged(LINE_STATS, client->tag);
+			e = write(sock, &linebuf, sizeof(linebuf));
+			if (e < 0) e = -errno;
+		}
+		if (e < 0) {
+			logerror("Couldn't send line statistics: %s", strerror(-e));
+		}
+		break;
+
+	case TAKEOVER:
+		if (in->resp.features != HANDOFF_VERSION) {
+			logerror("New server speaks handoff version %u, not %u",
+				in->resp.features, HANDOFF_VERSION);
+			e = reply(client, NAK);
+		} else if (!trusted_peer(client)) {
+			logerror("Refusing to hand over to another user's server");
+			e = reply(client, NAK);
+		} else {
+			/* Once everything else in this pass is done. */
+			successor = client;
+			e = 0;
+		}
+		if (e < 0) {
+			logerror("Error answering takeover: %s", strerror(-e));
+		}
+		break;
+
+	case HELLO:
+		client->features = in->resp.features & V120IRQD_FEATURES_SUPPORTED;
+		in->resp.msg = msg_tagged(HELLO, client->tag);
+		in->resp.features = client->features;
+		v120irqd_msg_send(sock, &in->resp);
+		logdebug("Client negotiated features 0x%X", client->features);
+		break;
+
+	default:
+		logerror("Bad message received: %s.\n", message_select_str(in->resp.msg));
+		break;
+	}
+}
+
+/**
+ * run_deferred() - Act on the requests a client had set aside, oldest first.
+ * @client:	The client.
+ */
+static void run_deferred(struct client_t * client)
+{
+	struct deferred_frame *df;
+
+	while ((df = client->deferred) != NULL) {
+		client->deferred = df->next;
+		client->ndeferred--;
+		deferred_total--;
+		handle_frame(client, &df->in, df->t_wake);
+		free(df);
+	}
+}
+
+/**
+ * process_client() - Handle a (non-response) message from a client socket.
+ * @idx:		The list_pollfds index to the client socket.
+ * @revents:	The received socket events from the poll() call.
+ *
+ * Return: true if the client hung up and was removed from list_pollfds.
+ */
+static bool process_client(int idx, int revents)
+{
+	int sock;
+	ssize_t len;
+	union client_frame in;
+	struct client_t *client = list_clients[idx];
+	uint64_t t_wake;
+
+	/* Anything set aside from before goes first. */
+	run_deferred(client);
+
+	/* Read the incoming message. */
+	sock = client->fd;
+	len = read(sock, &in, sizeof(in));
+	if (len < 0) len = -errno;
+	t_wake = latency_now();
+	if (len < 0) {
+		logerror("failed to get message: %s", strerror(-len));
+		return false;
+	} else if (len == 0) {
+		/* The client hung up. */
+		if (client == successor) successor = NULL;
+		remove_fd(idx);
+		ack_wheel_remove(&wheel, &client->deadline);
+		release_all_interrupts((irqdata_t)client);
+		disable_unused_interrupts();
+		close(sock);
+		free(client);
+		loginfo("Disconnected client (%d left)", count_clients());
+		return true;
+	}
+
+	handle_frame(client, &in, t_wake);
+	return false;
+}
+
+/**********************************************************************
+ * Warm restart
+ *
+ * On SIGHUP the server starts a new copy of itself with --takeover, which
+ * could just as well be a newer version started by hand.  The new server
+ * connects as a client and asks to TAKEOVER.  Once the old server has
+ * finished whatever it was doing, it sends over its listening socket, every
+ * client socket, the vector table and the recording as a series of
+ * handoff_buffers with the descriptors attached, then lets go of the crates
+ * and exits.  The new server opens the crates only once the old one has
+ * hung up, then carries on exactly where it left off.  The clients never
+ * notice, beyond a pause in service; an interrupt raised in the meantime
+ * stays asserted until the new server gets to it.
+ *
+ * The statistics and latency histograms start over.
+ **********************************************************************/
+
+/* How long the new server waits for the old one to let go, in ms. */
+#ifndef HANDOFF_TIMEOUT
+#  define HANDOFF_TIMEOUT	5000
+#endif
 
-		if ((irqhndl->irqstatus & (1 << irq)) == 0) goto irqsearch;
+/* The command line that a new server is started with; our own, plus
+ * --takeover.
+ */
+static char ** successor_argv = NULL;
 
-		/* Well, this IRQ line is a bust; we can't do a thing with it
-		 * and it's stuck on.  All we can do is keep from nuking the
-		 * entire system.
-		 */
-		logwarn("Disabling unclearable interrupt %d.", irq);
-		irqen &= ~(1 << irq);
-		irqhndl->irqen = irqen;
-		goto irqsearch;
-	}
+/**
+ * configureSuccessor() - Work out the command line for a successor.
+ * @argc:	As for main().
+ * @argv:	As for main().
+ *
+ * Return: 0 for success, nonzero for failure.
+ */
+static int configureSuccessor(int argc, char * argv[])
+{
+	int n = 0;
 
-	/* This code should be absolutely unreachable.  Get here and it's fatal. */
-	logcrit("IRQSTATUS 0x%X is rampantly illegal at %s:%d.",
-		irqstatus, __FILE__, __LINE__
-	);
-	exit(1);
+	successor_argv = calloc(argc + 2, sizeof(*successor_argv));
+	if (successor_argv == NULL) {
+		logcrit("Couldn't allocate: %s", strerror(errno));
+		return 1;
+	}
+	for (int i = 0; i < argc; i++) {
+		if (strcmp(argv[i], "--takeover") != 0) successor_argv[n++] = argv[i];
+	}
+	successor_argv[n] = "--takeover";
+	return 0;
 }
 
+
 /**
- * process_newclient() - Accept a new client connection, add it to list_pollfds.
+ * spawn_successor() - Start a new server to take over from this one.
+ *
+ * The new server inherits nothing but the standard descriptors; everything
+ * else it's given over the socket.
  */
-static void process_newclient(void)
+static void spawn_successor(void)
 {
-	int client = accept(list_pollfds[len_crates].fd, NULL, NULL);
-	if (client < 0) {
-		logerror("accept() failed: %s", strerror(errno));
+	sigset_t none;
+	pid_t pid;
+	int fd, maxfd;
+
+	pid = fork();
+	if (pid < 0) {
+		logerror("Couldn't start a new server: %s", strerror(errno));
 		return;
 	}
-	if (configureClientSocket(client)) {
-		close(client);
+	if (pid > 0) {
+		loginfo("Started new server (%d) to take over", (int)pid);
 		return;
 	}
 
-	loginfo("Accepted client connection (%d)", count_clients());
-	return;
+	sigemptyset(&none);
+	sigprocmask(SIG_SETMASK, &none, NULL);
+	maxfd = sysconf(_SC_OPEN_MAX);
+	for (fd = 3; fd < maxfd; fd++) close(fd);
+	execv("/proc/self/exe", successor_argv);
+	_exit(127);
 }
 
 /**
- * enable_interrupts() - Turn on all appropriate interrupt enables.
+ * client_id() - The number a client goes by in the handoff.
+ * @client:	The client.
  *
- * For every crate set in @st->crate ensure that all the interrupts set in
- * @st->irq are enabled.  This is called when adding a new interrupt request
- * to the list.
+ * That's its place among the clients, not counting the successor.
+ *
+ * Return: The number, or -1 for the successor itself.
  */
-static void enable_interrupts(struct v120irqd_selector * st)
+static int client_id(const struct client_t * client)
 {
-	/* Enable the correct IRQs on all the appropriate crates. */
-	for (int idx = 0; idx < len_crates; idx++) {
-		if (st->crate && (1 << v120_info[idx].cratenumber)) {
-			uint32_t irq = v120_info[idx].irqhndl->irqen;
-			v120_info[idx].irqhndl->irqen = irq | st->irq;
-		}
+	int id = 0;
+
+	for (unsigned int idx = len_crates+2; idx < len_pollfds; idx++) {
+		if (list_clients[idx] == successor) continue;
+		if (list_clients[idx] == client) return id;
+		id++;
+	}
+	return -1;
+}
+
+/* Send one handoff_buffer, and any descriptor, to the successor. */
+static int send_handoff(handoff_buffer * rec, int fd)
+{
+	ssize_t len;
+
+	rec->msg = TAKEOVER;
+	len = v120irqd_frame_send(successor->fd, rec, sizeof(*rec), fd);
+	return (len < 0) ? len : 0;
+}
+
+/* walk_interrupts() callback to send one entry to the successor. */
+static int send_entry(irqdata_t sd, const struct v120irqd_selector * request,
+	void * options, bool shared, void * arg)
+{
+	const struct request_options *opts = options;
+	handoff_buffer rec = { .kind = HANDOFF_ENTRY };
+	int id = client_id((struct client_t *)sd);
+
+	if (id < 0) return 0;
+	rec.entry.client = id;
+	rec.entry.shared = shared;
+	rec.entry.selector = *request;
+	if (opts != NULL) {
+		rec.entry.flags = opts->flags;
+		rec.entry.clear = opts->clear;
+		rec.entry.dma = opts->dma;
+		rec.entry.sub = opts->sub;
 	}
+	return send_handoff(&rec, (opts != NULL) ? opts->fd : -1);
 }
 
 /**
- * disable_unused_interrupts() - Set interrupt enables to reflect the table.
+ * hand_off() - Send everything over to the successor.
+ *
+ * Nothing here changes any state, so if it fails the server can carry on.
  *
- * Go through all interrupts currently registered in the vector table, then
- * go through the crates setting the interrupt enable masks to only those
- * interrupts that are enabled.  This is called when removing interrupt
- * requests.
+ * Return: Standard success.
  */
-static void disable_unused_interrupts(void)
+static int hand_off(void)
 {
-	uint8_t irqs[16];
-	list_registered_interrupts(irqs);
-	for (int idx = 0; idx < len_crates; idx++) {
-		int crate = v120_info[idx].cratenumber;
-		v120_info[idx].irqhndl->irqen = irqs[crate];
+	handoff_buffer rec = { .kind = HANDOFF_START };
+	struct client_t *client;
+	unsigned int idx;
+	int err;
+
+	rec.start.version = HANDOFF_VERSION;
+	rec.start.clients = count_clients() - 1;
+	rec.start.entries = count_registered_interrupts();
+	memcpy(rec.start.seq, crate_seq, sizeof(rec.start.seq));
+	err = send_handoff(&rec, list_pollfds[len_crates].fd);
+	if (err) return err;
+
+	for (idx = len_crates+2; idx < len_pollfds; idx++) {
+		client = list_clients[idx];
+		if (client == successor) continue;
+		memset(&rec, 0, sizeof(rec));
+		rec.kind = HANDOFF_CLIENT;
+		rec.client.id = client_id(client);
+		rec.client.features = client->features;
+		rec.client.unacked = client->unacked;
+		rec.client.slow = client->slow;
+		err = send_handoff(&rec, client->fd);
+		if (err) return err;
+	}
+
+	err = walk_interrupts(send_entry, NULL);
+	if (err) return err;
+
+	if (recorder.fd >= 0) {
+		err = irq_record_flush(&recorder);
+		if (err) return err;
+		memset(&rec, 0, sizeof(rec));
+		rec.kind = HANDOFF_RECORDING;
+		rec.recording.t_start = recorder.t_start;
+		rec.recording.written = recorder.written;
+		err = send_handoff(&rec, recorder.fd);
+		if (err) return err;
 	}
+
+	memset(&rec, 0, sizeof(rec));
+	rec.kind = HANDOFF_END;
+	return send_handoff(&rec, -1);
 }
 
 /**
- * build_status_report() - Get all the server status information.
- * @status: A buffer to hold the status information.
+ * finish_handoff() - Hand over to the successor and go, if there is one.
+ *
+ * The crates are let go before the successor's connection is, since that's
+ * its cue to open them.
  */
-static void build_status_report(struct v120irqd_serverstatus * status)
+static void finish_handoff(void)
 {
-	status->pid = getpid();
-	status->crates = 0;
-	for (int idx=0; idx < len_crates; idx++) {
-		status->crates |= (1 << v120_info[idx].cratenumber);
+	int err;
+
+	/* Not with requests still set aside; they'd be lost. */
+	if (successor == NULL || deferred_total) return;
+
+	err = hand_off();
+	if (err) {
+		logerror("Couldn't hand over to the new server: %s", strerror(-err));
+		reply(successor, NAK);
+		successor = NULL;
+		return;
 	}
-	status->clients = count_clients();
-	status->irq_requests = count_registered_interrupts();
+	for (unsigned int idx = 0; idx < len_crates; idx++) {
+		v120_close(v120_info[idx].handle);
+	}
+	loginfo("Handed over to the new server.");
+
+	/* Without the atexit() handlers, which would unlink a filesystem socket
+	 * out from under it.
+	 */
+	_exit(EXIT_SUCCESS);
+}
+
+/* Throw away whatever a new server was handed. */
+static void discard_handoff(void)
+{
+	unsigned int i;
+
+	if (handoff.listen >= 0) close(handoff.listen);
+	for (i = 0; i < handoff.nclients; i++) close(handoff.client_fd[i]);
+	for (i = 0; i < handoff.nentries; i++) {
+		if (handoff.entry_fd[i] >= 0) close(handoff.entry_fd[i]);
+	}
+	if (handoff.record_fd >= 0) close(handoff.record_fd);
+	free(handoff.client);
+	free(handoff.client_fd);
+	free(handoff.entry);
+	free(handoff.entry_fd);
+	memset(&handoff, 0, sizeof(handoff));
+	handoff.listen = handoff.record_fd = -1;
 }
 
 /**
- * process_client() - Handle a (non-response) message from a client socket.
- * @idx:		The list_pollfds index to the client socket.
- * @revents:	The received socket events from the poll() call.
+ * accept_handoff() - File one handoff_buffer away.
+ * @rec:	The record.
+ * @fd:		The descriptor that came with it, or -1.  Taken over, or closed.
+ *
+ * Return: 1 at HANDOFF_END, 0 to keep going, or a negative error code.
  */
-static void process_client(int idx, int revents)
+static int accept_handoff(const handoff_buffer * rec, int fd)
 {
-	int sock;
-	int e;
-	ssize_t len;
-	response_buffer buffer;
+	bool started = (handoff.listen >= 0);
 
-	/* Read the incoming message. */
-	sock = list_pollfds[idx].fd;
-	len = v120_irqd_msg_recv(sock, &buffer);
-	if (len < 0) {
-		logerror("failed to get message: %s", strerror(-len));
-		return;
-	} else if (len == 0) {
-		/* The client hung up. */
-		remove_fd(idx);
-		release_all_interrupts(sock);
-		disable_unused_interrupts();
-		close(sock);
-		loginfo("Disconnected client (%d left)", count_clients());
-		return;
+	switch (started ? rec->kind : HANDOFF_START) {
+	case HANDOFF_START:
+		if (started || rec->kind != HANDOFF_START || fd < 0 ||
+				rec->start.version != HANDOFF_VERSION) {
+			break;
+		}
+		handoff.start = *rec;
+		handoff.listen = fd;
+		handoff.client = calloc(rec->start.clients + 1, sizeof(*handoff.client));
+		handoff.client_fd = calloc(rec->start.clients + 1, sizeof(*handoff.client_fd));
+		handoff.entry = calloc(rec->start.entries + 1, sizeof(*handoff.entry));
+		handoff.entry_fd = calloc(rec->start.entries + 1, sizeof(*handoff.entry_fd));
+		if (handoff.client == NULL || handoff.client_fd == NULL ||
+				handoff.entry == NULL || handoff.entry_fd == NULL) {
+			return -ENOMEM;
+		}
+		return 0;
+
+	case HANDOFF_CLIENT:
+		if (fd < 0 || handoff.nclients >= handoff.start.start.clients) break;
+		handoff.client[handoff.nclients] = *rec;
+		handoff.client_fd[handoff.nclients++] = fd;
+		return 0;
+
+	case HANDOFF_ENTRY:
+		if (handoff.nentries >= handoff.start.start.entries) break;
+		handoff.entry[handoff.nentries] = *rec;
+		handoff.entry_fd[handoff.nentries++] = fd;
+		return 0;
+
+	case HANDOFF_RECORDING:
+		if (fd < 0 || handoff.record_fd >= 0) break;
+		handoff.recording = *rec;
+		handoff.record_fd = fd;
+		return 0;
+
+	case HANDOFF_END:
+		if (fd >= 0) close(fd);
+		return 1;
 	}
 
-	switch (buffer.msg) {
-	case REQUEST_IRQ:
-		e = register_interrupt(sock, &buffer.selector);
-		if (e < 0) {
-			logerror("Failed to register interrupt: %s", strerror(-e));
-			e = v120irqd_nak(sock);
-			if (e < 0) {
-				logerror("Error NAKing: %s", strerror(-e));
-			}
+	if (fd >= 0) close(fd);
+	logerror("Unexpected handoff record %u", rec->kind);
+	return -EPROTO;
+}
 
-		} else {
-			e = v120irqd_ack(sock);
-			if (e < 0) {
-				logerror("Error ACKing: %s", strerror(-e));
-			} else {
-				enable_interrupts(&buffer.selector);
-			}
-		}
-		break;
+/**
+ * take_over() - Take everything over from the running server.
+ *
+ * This only collects what the old server hands over, and waits for it to
+ * let go of the crates; restore_handoff() puts it all back together.  With
+ * no server running there's nothing to take over, and that's fine too.
+ *
+ * Return: Standard success.
+ */
+static int take_over(void)
+{
+	response_buffer req = { .msg = TAKEOVER, .features = HANDOFF_VERSION };
+	struct pollfd pfd;
+	handoff_buffer rec;
+	ssize_t len;
+	int sock, fd, err = 0;
 
-	case RELEASE_IRQ:
-		e = release_interrupt(sock, &buffer.selector);
-		if (e < 0) {
-			logerror("Failed to release interrupt: %s", strerror(-e));
-			e = v120irqd_nak(sock);
+	sock = v120irqd_client(settings.socketName);
+	if (sock < 0) {
+		loginfo("No server to take over from; starting fresh.");
+		return 0;
+	}
+	len = v120irqd_msg_send(sock, &req);
+	if (len < 0) {
+		err = len;
+		goto cleanup;
+	}
+
+	do {
+		len = v120irqd_frame_recv(sock, &rec, sizeof(rec), &fd);
+		if (len <= 0) {
+			err = (len < 0) ? len : -ECONNRESET;
+		} else if (rec.msg != TAKEOVER) {
+			logerror("The running server wouldn't hand over");
+			if (fd >= 0) close(fd);
+			err = -EPERM;
 		} else {
-			e = v120irqd_ack(sock);
+			err = accept_handoff(&rec, fd);
 		}
+	} while (err == 0);
+	if (err < 0) goto cleanup;
+	err = 0;
+
+	/* Its hanging up says that the crates are free. */
+	pfd.fd = sock;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, HANDOFF_TIMEOUT) <= 0 || read(sock, &rec, sizeof(rec)) != 0) {
+		logwarn("The old server hasn't gone away; carrying on regardless.");
+	}
 
-		if (e < 0) {
-			logerror("Error acknowledging interrupt release: %s", strerror(-e));
-		}
+cleanup:
+	close(sock);
+	if (err) {
+		logerror("Couldn't take over: %s", strerror(-err));
+		discard_handoff();
+	}
+	return err;
+}
 
-		disable_unused_interrupts();
-		break;
+/**
+ * restore_entry() - Put one handed over entry back in the vector table.
+ * @rec:	Its HANDOFF_ENTRY record.
+ * @fd:		Its descriptor, or -1.  Taken over, or closed.
+ * @client:	The client it belongs to, or NULL if it couldn't be restored.
+ *
+ * Return: Standard success.
+ */
+static int restore_entry(const handoff_buffer * rec, int fd, struct client_t * client)
+{
+	struct v120irqd_selector sel = rec->entry.selector;
+	struct request_options *opts = NULL;
+	clear_buffer clear = { .selector = sel, .clear = rec->entry.clear };
+	subscribe_buffer sub = { .selector = sel, .sub = rec->entry.sub };
+	int err;
 
-	case IRQ_SIGNAL:
-		/* Getting an IRQ_SIGNAL from a client is a request to fake an
-		 * interrupt for debugging purposes.
-		 */
-		if (settings.allowFakeIrq) {
-			e = v120irqd_ack(sock) || notify_irq(&buffer.selector);
-			if (e < 0 && e != -EINVAL) {
-				logerror("Couldn't signal fake interrupt: %s", strerror(-e));
-			}
-		} else {
-			e = v120irqd_nak(sock);
-			if (e < 0 && e != -EINVAL) {
-				logerror("Couldn't NAK fake interrupt: %s", strerror(-e));
-			}
+	if (client == NULL) {
+		if (fd >= 0) close(fd);
+		return -ENOENT;
+	}
 
+	switch (rec->entry.flags) {
+	case 0:
+		break;
+	case OPT_CLEAR:
+		opts = make_request_options(&clear);
+		break;
+	case OPT_DMA:
+		if (fd < 0) {
+			errno = EPROTO;
+			break;
 		}
+		opts = adopt_dma_options(&rec->entry.dma, fd);
+		fd = -1;
 		break;
-
-	case SERVER_STATUS:
-		build_status_report(&buffer.status);
-		v120irqd_msg_send(sock, &buffer);
+	case OPT_SHARED:
+		opts = make_shared_options(&sub);
 		break;
-
 	default:
-		logerror("Bad message received: %s.\n", message_select_str(buffer.msg));
+		errno = EPROTO;
 		break;
 	}
+	if (fd >= 0) close(fd);
+	if (rec->entry.flags != 0 && opts == NULL) return -errno;
+
+	if (rec->entry.shared) {
+		err = register_interrupt_shared((irqdata_t)client, &sel, opts);
+	} else {
+		err = register_interrupt_opts((irqdata_t)client, &sel, opts);
+	}
+	if (err) free_request_options(opts);
+	return err;
+}
+
+/**
+ * restore_handoff() - Carry on from where the old server left off.
+ *
+ * Called once the crates, listening socket and timer are set up.  Anything
+ * that can't be restored is logged and left out.
+ */
+static void restore_handoff(void)
+{
+	struct client_t **clients;
+	struct client_t *client;
+	unsigned int i, n, failed = 0;
+	int err;
+
+	clients = calloc(handoff.nclients + 1, sizeof(*clients));
+	if (clients == NULL) {
+		logcrit("Couldn't restore clients: %s", strerror(errno));
+		exit(1);
+	}
+
+	for (i = 0; i < handoff.nclients; i++) {
+		n = handoff.client[i].client.id;
+		if (n >= handoff.nclients || clients[n] != NULL ||
+				configureClientSocket(handoff.client_fd[i])) {
+			close(handoff.client_fd[i]);
+			failed++;
+			continue;
+		}
+		client = list_clients[len_pollfds-1];
+		client->features = handoff.client[i].client.features & V120IRQD_FEATURES_SUPPORTED;
+		client->slow = handoff.client[i].client.slow;
+		for (n = handoff.client[i].client.unacked; n > 0; n--) expect_ack(client);
+		clients[handoff.client[i].client.id] = client;
+	}
+	handoff.nclients = 0;
+
+	for (i = 0; i < handoff.nentries; i++) {
+		n = handoff.entry[i].entry.client;
+		client = (n < handoff.start.start.clients) ? clients[n] : NULL;
+		err = restore_entry(&handoff.entry[i], handoff.entry_fd[i], client);
+		if (err) {
+			logerror("Couldn't restore %04X:%02X:%08X: %s",
+				handoff.entry[i].entry.selector.crate,
+				handoff.entry[i].entry.selector.irq,
+				handoff.entry[i].entry.selector.vector, strerror(-err));
+			failed++;
+		}
+	}
+	handoff.nentries = 0;
+	free(clients);
+
+	memcpy(crate_seq, handoff.start.start.seq, sizeof(crate_seq));
+	disable_unused_interrupts();
+	loginfo("Took over %d clients and %u requests%s", count_clients(),
+		count_registered_interrupts(), failed ? ", with losses" : "");
+	handoff.listen = -1;
+	discard_handoff();
 }
 
 /**********************************************************************
@@ -581,14 +3363,155 @@ const char *program_usage =
 "    -n, --novme        No MVE interrupts. Implies --fakeok.\n"
 "    -k, --foreground   Run in foreground. Default is to fork to \n"
 "                       background.\n"
+"    --storm-rate=N     Mask any IRQ line taking over N interrupts a\n"
+"                       second, for a while.  0 for no limit.\n"
+"    --storm-burst=N    Allow bursts of up to N interrupts over the rate.\n"
+"    --busy-poll=USEC   Spin on the interrupt registers for USEC after each\n"
+"                       interrupt, rather than waiting to be woken.\n"
+"                       'always' to spin all the time.\n"
+"    --cpu=LIST         Run only on the CPUs in LIST, such as 3 or 2,4-5;\n"
+"                       ideally isolated ones.\n"
+"    --ack-timeout=MS   Give clients MS to answer each interrupt before\n"
+"                       marking them slow.  0 to wait forever.\n"
+"    --fallback         Give the interrupts of slow clients to the next\n"
+"                       matching request, if there is one.\n"
+"    --record=FILE      Record every interrupt found to FILE, for replay\n"
+"                       with irqreplay.\n"
+"    --takeover         Take over from the running server without dropping\n"
+"                       its clients.  SIGHUP starts one of these.\n"
+"    --crates=LIST      Serve only the crates in LIST, such as 0-2 or 3,5.\n"
+"    --socket=NAME      Listen on socket NAME rather than the default.\n"
+"    --priority=N       Run at SCHED_FIFO priority N; 0 to leave the\n"
+"                       scheduling alone.  The default is the maximum.\n"
+"    --mlock=POLICY     Lock 'all' pages in memory, the 'current' ones\n"
+"                       only, or 'none'.\n"
+"    --config=FILE      Read options from FILE, one per line, without\n"
+"                       their leading dashes.\n"
 "    -?, --help         Give this help list\n"
 "    -V, --version      Print program version\n";
 
+static void parse_opt(int key);
+
+static const struct option long_options[] = {
+	{ "debug",      no_argument, NULL, 'd' },
+	{ "fakeok",     no_argument, NULL, 'f' },
+	{ "novme",      no_argument, NULL, 'n' },
+	{ "no-vme",     no_argument, NULL, '0' },
+	{ "foreground", no_argument, NULL, 'k' },
+	{ "storm-rate", required_argument, NULL, 'R' },
+	{ "storm-burst", required_argument, NULL, 'B' },
+	{ "busy-poll",  required_argument, NULL, 'P' },
+	{ "cpu",        required_argument, NULL, 'C' },
+	{ "ack-timeout", required_argument, NULL, 'A' },
+	{ "fallback",   no_argument, NULL, 'F' },
+	{ "record",     required_argument, NULL, 'W' },
+	{ "takeover",   no_argument, NULL, 'T' },
+	{ "crates",     required_argument, NULL, 'c' },
+	{ "socket",     required_argument, NULL, 'S' },
+	{ "priority",   required_argument, NULL, 'p' },
+	{ "mlock",      required_argument, NULL, 'M' },
+	{ "config",     required_argument, NULL, 'G' },
+	{ "help",       no_argument, NULL, '?' },
+	{ "version",    no_argument, NULL, 'V' },
+	{ NULL, 0, NULL, '\0' },
+};
+
+/**
+ * parse_list() - Parse a list of numbers and ranges, like "0,2,4-7".
+ * @arg:	The list.
+ * @limit:	One more than the largest number allowed.
+ * @set:	Loaded with whether each number up to @limit is in the list.
+ *
+ * Return: 0 for success, or -1 if the list is malformed or empty.
+ */
+static int parse_list(const char * arg, unsigned int limit, bool * set)
+{
+	unsigned long first, last;
+	char *end;
+	bool any = false;
+
+	memset(set, 0, limit * sizeof(*set));
+	do {
+		errno = 0;
+		first = last = strtoul(arg, &end, 10);
+		if (end == arg || errno) return -1;
+		if (*end == '-') {
+			arg = end + 1;
+			last = strtoul(arg, &end, 10);
+			if (end == arg || errno) return -1;
+		}
+		if (first > last || last >= limit) return -1;
+		while (first <= last) set[first++] = true;
+		any = true;
+		arg = end + 1;
+	} while (*end == ',');
+	return (*end == '\0' && any) ? 0 : -1;
+}
+
+/**
+ * parse_config() - Read options from a file.
+ * @path:	The file.
+ *
+ * Each line holds one long option without its leading dashes, such as
+ * "crates=0-2" or "fallback".  Blank lines, and anything after a #, are
+ * ignored.  The options take effect just as if they'd been given on the
+ * command line in place of --config.
+ */
+static void parse_config(const char * path)
+{
+	const struct option *opt;
+	char line[256], *p, *value;
+	unsigned int lineno = 0;
+	FILE *f;
+
+	f = fopen(path, "re");
+	if (f == NULL) {
+		fprintf(stderr, "couldn't read %s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		lineno++;
+		p = line + strcspn(line, "#\n");
+		while (p > line && isspace((unsigned char)p[-1])) p--;
+		*p = '\0';
+		p = line + strspn(line, " \t");
+		if (*p == '\0') continue;
+
+		value = strchr(p, '=');
+		if (value != NULL) *value++ = '\0';
+		for (opt = long_options; opt->name != NULL; opt++) {
+			if (strcmp(opt->name, p) == 0) break;
+		}
+		if (opt->name == NULL || opt->val == 'G' ||
+				(opt->has_arg == required_argument) != (value != NULL)) {
+			fprintf(stderr, "%s:%u: invalid option '%s'\n", path, lineno, p);
+			exit(EXIT_FAILURE);
+		}
+
+		/* The settings keep pointers to some of these. */
+		if (value != NULL) {
+			optarg = strdup(value);
+			if (optarg == NULL) {
+				fprintf(stderr, "%s\n", strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+		}
+		parse_opt(opt->val);
+	}
+	fclose(f);
+}
+
 /**
  * parse_opt() - Command line option parser
  */
 static void parse_opt(int key)
 {
+	static bool set[CPU_SETSIZE];
+	unsigned long value;
+	long prio;
+	char *end;
+	int n;
+
 	switch (key) {
 	case 'f':
 		settings.allowFakeIrq = true;
@@ -604,6 +3527,96 @@ static void parse_opt(int key)
 		settings.noVME = true;
 		parse_opt('f');
 		break;
+	case 'R':
+	case 'B':
+		errno = 0;
+		value = strtoul(optarg, &end, 0);
+		if (errno || *end != '\0' || value > UINT32_MAX || (key == 'B' && value == 0)) {
+			fprintf(stderr, "invalid value '%s' for --storm-%s\n", optarg,
+				(key == 'R') ? "rate" : "burst");
+			exit(EXIT_FAILURE);
+		}
+		if (key == 'R')		settings.stormRate = value;
+		else				settings.stormBurst = value;
+		break;
+	case 'P':
+		if (strcmp(optarg, "always") == 0) {
+			settings.busyAlways = true;
+			settings.busyWindow = BUSY_SLICE;
+			break;
+		}
+		errno = 0;
+		value = strtoul(optarg, &end, 0);
+		if (errno || *end != '\0' || value > 60000000) {
+			fprintf(stderr, "invalid value '%s' for --busy-poll\n", optarg);
+			exit(EXIT_FAILURE);
+		}
+		settings.busyWindow = value * 1000;
+		break;
+	case 'C':
+		CPU_ZERO(&settings.cpus);
+		if (parse_list(optarg, CPU_SETSIZE, set)) {
+			fprintf(stderr, "invalid value '%s' for --cpu\n", optarg);
+			exit(EXIT_FAILURE);
+		}
+		for (n = 0; n < CPU_SETSIZE; n++) {
+			if (set[n]) CPU_SET(n, &settings.cpus);
+		}
+		break;
+	case 'c':
+		if (parse_list(optarg, 16, set)) {
+			fprintf(stderr, "invalid value '%s' for --crates\n", optarg);
+			exit(EXIT_FAILURE);
+		}
+		settings.crates = 0;
+		for (n = 0; n < 16; n++) {
+			if (set[n]) settings.crates |= (1 << n);
+		}
+		break;
+	case 'S':
+		settings.socketName = optarg;
+		break;
+	case 'p':
+		errno = 0;
+		prio = strtol(optarg, &end, 0);
+		if (errno || end == optarg || *end != '\0' || (prio != 0 &&
+				(prio < sched_get_priority_min(SCHED_FIFO) ||
+				 prio > sched_get_priority_max(SCHED_FIFO)))) {
+			fprintf(stderr, "invalid value '%s' for --priority\n", optarg);
+			exit(EXIT_FAILURE);
+		}
+		settings.priority = prio;
+		break;
+	case 'M':
+		if (strcmp(optarg, "all") == 0)				settings.mlock = MLOCK_ALL;
+		else if (strcmp(optarg, "current") == 0)	settings.mlock = MLOCK_CURRENT;
+		else if (strcmp(optarg, "none") == 0)		settings.mlock = MLOCK_NONE;
+		else {
+			fprintf(stderr, "invalid value '%s' for --mlock\n", optarg);
+			exit(EXIT_FAILURE);
+		}
+		break;
+	case 'G':
+		parse_config(optarg);
+		break;
+	case 'A':
+		errno = 0;
+		value = strtoul(optarg, &end, 0);
+		if (errno || *end != '\0' || value > 3600000) {
+			fprintf(stderr, "invalid value '%s' for --ack-timeout\n", optarg);
+			exit(EXIT_FAILURE);
+		}
+		settings.ackTimeout = value * 1000000ULL;
+		break;
+	case 'F':
+		settings.fallback = true;
+		break;
+	case 'W':
+		settings.recordFile = optarg;
+		break;
+	case 'T':
+		settings.takeover = true;
+		break;
 	case '?':
 		printf("%s", program_usage);
 		exit(EXIT_SUCCESS);
@@ -621,19 +3634,16 @@ static void parse_opt(int key)
 
 static void parseArgs(int argc, char * argv[])
 {
-	struct option options[] = {
-		{ "debug",      no_argument, NULL, 'd' },
-		{ "fakeok",     no_argument, NULL, 'f' },
-		{ "novme",      no_argument, NULL, 'n' },
-		{ "no-vme",     no_argument, NULL, '0' },
-		{ "foreground", no_argument, NULL, 'k' },
-		{ "help",       no_argument, NULL, '?' },
-		{ "version",    no_argument, NULL, 'V' },
-		{ NULL, 0, NULL, '\0' },
-	};
 	int opt;
+
+	settings.stormRate = STORM_RATE;
+	settings.stormBurst = STORM_BURST;
+	settings.ackTimeout = ACK_TIMEOUT;
+	settings.crates = 0xFFFF;
+	settings.priority = -1;
+	settings.mlock = MLOCK_ALL;
 	while ((opt = getopt_long(argc, argv, "dfn0k?V",
-				  options, NULL)) != -1) {
+				  long_options, NULL)) != -1) {
 		parse_opt(opt);
 	}
 }
@@ -645,7 +3655,8 @@ static int configureSyslog(void)
 	if (settings.debugMode)		setlogmask(LOG_UPTO(LOG_DEBUG));
 	else						setlogmask(LOG_UPTO(LOG_NOTICE));
 
-	syslog(LOG_NOTICE, "Starting v120irqd " VERSION " %s ...",
+	syslog(LOG_NOTICE, "Starting v120irqd " VERSION " on %s %s ...",
+		settings.socketName ? settings.socketName : DEFAULTSOCKET,
 		settings.allowFakeIrq ? "with --fakeok" : ""
 	);
 	return 0;
@@ -658,30 +3669,49 @@ static int configureSyslog(void)
  */
 static void termination(void)
 {
+	int err;
+
+	if (recorder.fd >= 0) {
+		err = irq_record_close(&recorder);
+		if (err) {
+			logerror("Couldn't finish the recording: %s", strerror(-err));
+		} else {
+			loginfo("Recorded %llu interrupts.", (unsigned long long)recorder.written);
+		}
+	}
 	syslog(LOG_NOTICE, "Shutting down.");
 }
 
 /**
- * set_rtpriority() - Set maximum priority and lock all our pages in memory.
+ * set_rtpriority() - Set real-time priority and lock our pages in memory.
+ *
+ * As far as --priority and --mlock ask for; by default, the maximum priority
+ * and every page, now and in the future.
  *
  * Return: 0 on success or a negative error value.
  */
 static int set_rtpriority(void)
 {
-#ifdef HAVE_MMAN_H
-#  ifdef HAVE_SCHED_H
 	const int policy = SCHED_FIFO;
 	struct sched_param sp;
-	sp.sched_priority = sched_get_priority_max(policy);
-	if (sched_setscheduler(0, policy, &sp)) {
-		return -errno;
+	if (settings.priority != 0) {
+		sp.sched_priority = (settings.priority < 0) ?
+			sched_get_priority_max(policy) : settings.priority;
+		if (sched_setscheduler(0, policy, &sp)) {
+			return -errno;
+		}
 	}
-#  endif
 
-	if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
-		return -errno;
+	switch (settings.mlock) {
+	case MLOCK_ALL:
+		if (mlockall(MCL_CURRENT | MCL_FUTURE)) return -errno;
+		break;
+	case MLOCK_CURRENT:
+		if (mlockall(MCL_CURRENT)) return -errno;
+		break;
+	case MLOCK_NONE:
+		break;
 	}
-#endif
 	return 0;
 }
 
@@ -696,11 +3726,18 @@ static int initialize(int argc, char * argv[])
 	int ret;
 	parseArgs(argc, argv);
 	if ((ret = configureSyslog()) != 0)			return ret;
+	if ((ret = configureSuccessor(argc, argv)) != 0)	return ret;
+
+	/* Before touching the crates, which the old server has to let go of. */
+	if (settings.takeover) {
+		if ((ret = take_over()) != 0) return ret;
+	}
 
 	/* Build up a list of all the available file descriptors.  This
 	 * list should contain (in this order):
 	 * 	* All the VME interrupt endpoints
 	 * 	* The base socket, used for accepting new connections.
+ * 	* The timer, for re-enabling masked interrupts and ACK deadlines.
 	 * 	* The communications sockets.
 	 */
 
@@ -708,8 +3745,27 @@ static int initialize(int argc, char * argv[])
 		if ((ret = configureVmeEndpoints()) != 0) return ret;
 	}
 	if ((ret = configureServerSocket()) != 0) return ret;
+	if ((ret = configureTimer()) != 0) return ret;
+	ack_wheel_init(&wheel, settings.ackTimeout);
+
+	/* Before daemon() changes directory out from under a relative path. */
+	if (handoff.record_fd >= 0) {
+		recorder.fd = handoff.record_fd;
+		recorder.t_start = handoff.recording.recording.t_start;
+		recorder.written = handoff.recording.recording.written;
+		recorder.count = 0;
+		handoff.record_fd = -1;
+	} else if (settings.recordFile) {
+		ret = irq_record_open(&recorder, settings.recordFile, latency_now());
+		if (ret) {
+			logerror("Couldn't record to %s: %s", settings.recordFile, strerror(-ret));
+			return ret;
+		}
+	}
 
-	/* Now the Linuxy stuff.  Set up a handler for SIGTERM and SIGUSR1, and
+	if (handoff.listen >= 0) restore_handoff();
+
+	/* Now the Linuxy stuff.  Set up a handler for SIGTERM, SIGUSR1 and SIGHUP, and
 	 * block them whenever we're not waiting for our poll, then daemonize
 	 * the process.
 	 */
@@ -717,6 +3773,9 @@ static int initialize(int argc, char * argv[])
 	if (ret == -EPERM) {
 		logwarn("Permission denied setting real-time priority: must run as root.");
 		logwarn("Falling back to running at default priority.");
+	} else if (ret == -ENOMEM) {
+		logwarn("Can't lock pages in memory: RLIMIT_MEMLOCK is too low.");
+		logwarn("Falling back to running with pages unlocked.");
 	} else if (ret != 0) {
 		logerror("Failed to set real-time priority: %s", strerror(-ret));
 		return 1;
@@ -724,10 +3783,21 @@ static int initialize(int argc, char * argv[])
 		logdebug("Successfully set real-time priority.");
 	}
 
+	if (CPU_COUNT(&settings.cpus)) {
+		if (sched_setaffinity(0, sizeof(settings.cpus), &settings.cpus)) {
+			logerror("Couldn't run on the given CPUs: %s", strerror(errno));
+			return 1;
+		}
+	}
+	if (settings.busyWindow && CPU_COUNT(&settings.cpus) == 0) {
+		logwarn("Busy polling without --cpu will compete with everything else.");
+	}
+
 	sigset_t blockset;
 	sigemptyset(&blockset);
 	sigaddset(&blockset, SIGTERM);
 	sigaddset(&blockset, SIGUSR1);
+	sigaddset(&blockset, SIGHUP);
 	sigprocmask(SIG_BLOCK, &blockset, NULL);
 
 	struct sigaction sa = {
@@ -736,7 +3806,12 @@ static int initialize(int argc, char * argv[])
 	};
 	sigaction(SIGTERM, &sa, NULL);
 	sigaction(SIGUSR1, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
 
+	/* Nobody waits on a successor that didn't make it. */
+	signal(SIGCHLD, SIG_IGN);
+
+	set_options_destructor(&free_request_options);
 	atexit(&termination);
 
 	if (!settings.noDaemon) {
@@ -751,7 +3826,7 @@ static int initialize(int argc, char * argv[])
 /**
  * signalhandler() - Flag the main loop when we get a signal.
  *
- * Only SIGTERM or SIGUSR1 should ever come in the door here, and the act of
+ * Only SIGTERM, SIGUSR1 or SIGHUP should ever come in the door here, and the act of
  * getting this signal will break out of the ppoll loop, so the signals will
  * be blocked until we process them and call ppoll again.
  */
@@ -770,12 +3845,17 @@ static int mainloop(void)
 	int nevents;
 	short revents;
 	int idx;
+	unsigned int ready;
+	uint64_t t_wake;
+	const struct timespec nowait = {0, 0};
 
 	sigset_t emptyset;
 	sigemptyset(&emptyset);
 
-	/* Block until we get activity on any socket or a signal. */
-	nevents = ppoll(list_pollfds, len_pollfds, NULL, &emptyset);
+	/* Block until we get activity on any socket or a signal, unless we're
+	 * busy polling, in which case just check in between spins.
+	 */
+	nevents = ppoll(list_pollfds, len_pollfds, busy_poll() ? &nowait : NULL, &emptyset);
 
 	if (nevents < 0) {
 		if (errno == EINTR) {
@@ -792,6 +3872,16 @@ static int mainloop(void)
 						LOG_ERR, "Crates: %d Clients %d Interrupts Registered %d",
 						status.crates, status.clients, status.irq_requests
 					);
+					log_latency_report();
+					log_storm_report();
+					log_sched_report();
+					log_busy_report();
+					log_ack_report();
+					irq_record_flush(&recorder);
+					break;
+				}
+				case SIGHUP: {
+					spawn_successor();
 					break;
 				}
 				default:{
@@ -807,18 +3897,41 @@ static int mainloop(void)
 		}
 	}
 
-	for (idx = 0; idx<len_pollfds && nevents; idx++) {
+	/* All the crates that are ready get serviced together, by priority. */
+	t_wake = latency_now();
+	ready = 0;
+	for (idx = 0; idx < len_crates && nevents; idx++) {
+		if (list_pollfds[idx].revents) {
+			process_vme(idx);
+			ready |= (1 << idx);
+			nevents--;
+		}
+	}
+	if (ready) busy.woken += service_crates(ready, t_wake);
+
+	for (idx = len_crates; idx<len_pollfds && nevents; idx++) {
 		revents = list_pollfds[idx].revents;
 		if (revents) {
 			/* Decode the pointer location. */
-			if (idx < len_crates)			process_vme(idx);
-			else if (idx == len_crates)		process_newclient();
-			else							process_client(idx, revents);
+			if (idx == len_crates)			process_newclient();
+			else if (idx == len_crates+1)	process_timer();
+			else if (process_client(idx, revents)) {
+				/* The next client just moved down into this slot. */
+				idx--;
+			}
 
 			/* No matter what we did, we handled one event. */
 			nevents--;
 		}
 	}
+
+	/* Requests that turned up while an answer was being waited on. */
+	for (idx = len_crates+2; idx < len_pollfds && deferred_total; idx++) {
+		run_deferred(list_clients[idx]);
+	}
+
+	/* Only between passes is everything in a state to hand over. */
+	finish_handoff();
 	return 0;
 }
 